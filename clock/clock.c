@@ -9,9 +9,18 @@
  * return a value that is either the same as the previous call or
  * greater.
  *
+ * In virtual-time mode, now() instead reads a simulated timeline that
+ * advances only when somebody calls clock_advance() or usleep(), so
+ * waiting for the device costs no real time and every run sees
+ * exactly the same sequence of times.  This module replaces the C
+ * library's usleep() so that drivers, which call usleep() between
+ * polls, see virtual time without any change to their code.
+ *
  */
 
+#include <sys/mman.h>
 #include <time.h>
+#include <unistd.h>
 #include <assert.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -22,6 +31,18 @@
 #define  S_TO_US(s)   ((s) * (timeus_t)1000000)
 #define NS_TO_US(ns) ((ns) / (timeus_t)1000)
 
+/* Virtual time begins at this many microseconds since the epoch.  It
+ * must be far enough from zero that drivers' deadlines computed
+ * relative to small constants behave as they would on a real clock.
+ */
+#define VIRTUAL_EPOCH_US S_TO_US(3600)
+
+/* The virtual timeline, or NULL when now() reads the real clock.  It
+ * lives in shared memory so that a tracer and the tracee it forks
+ * observe and advance the same timeline.
+ */
+static volatile timeus_t *virtual_now;
+
 
 /* now()
  *
@@ -40,6 +61,9 @@ now(void) {
 	
 	struct timespec ts;  /* C library's representation of now */
 
+	if (virtual_now)
+		return *virtual_now;
+
 	if (clock_gettime(CLOCK_MONOTONIC, &ts)) {
 		perror("Failed to get current time");
 		exit(-1);
@@ -50,3 +74,77 @@ now(void) {
 } /* now() */
 
 
+/* clock_init_virtual()
+ *
+ * in:     nothing
+ * out:    virtual_now set via side effect
+ * return: nothing
+ *
+ * Switches now() from the real clock to virtual time beginning at
+ * VIRTUAL_EPOCH_US.  Call this before fork() so that parent and child
+ * share the timeline.
+ *
+ */
+
+void
+clock_init_virtual(void) {
+
+	virtual_now = mmap(NULL, sizeof(*virtual_now), PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (virtual_now == MAP_FAILED) {
+		perror("Failed to map virtual clock");
+		exit(-1);
+	}
+	*virtual_now = VIRTUAL_EPOCH_US;
+
+} /* clock_init_virtual() */
+
+
+/* clock_advance()
+ *
+ * in:     duration - microseconds to move the virtual timeline forward
+ * out:    virtual timeline advanced via side effect
+ * return: nothing
+ *
+ * Moves virtual time forward by duration.  Does nothing on the real
+ * clock, which advances on its own.
+ *
+ */
+
+void
+clock_advance(timeus_t duration) {
+
+	if (virtual_now)
+		*virtual_now += duration;
+
+} /* clock_advance() */
+
+
+/* usleep()
+ *
+ * in:     duration - microseconds to sleep
+ * out:    virtual timeline may be advanced via side effect
+ * return: 0 on success, -1 if a signal interrupted the sleep
+ *
+ * Takes the place of the C library's usleep() in every program that
+ * links this module.  Sleeps for duration microseconds: really, with
+ * nanosleep(), on the real clock, and instantly, by advancing the
+ * timeline, in virtual time.
+ *
+ */
+
+int
+usleep(useconds_t duration) {
+
+	struct timespec ts;  /* duration as nanosleep() wants it */
+
+	if (virtual_now) {
+		*virtual_now += duration;
+		return 0;
+	}
+
+	ts.tv_sec = duration / S_TO_US(1);
+	ts.tv_nsec = (duration % S_TO_US(1)) * 1000;
+	return nanosleep(&ts, NULL);
+
+} /* usleep() */
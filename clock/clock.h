@@ -10,5 +10,7 @@
 typedef unsigned long timeus_t;
 
 timeus_t now(void);
+void clock_init_virtual(void);
+void clock_advance(timeus_t);
 
 #endif
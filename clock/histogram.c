@@ -0,0 +1,170 @@
+/* 
+ * Latency histogram module.
+ *
+ * Copyright (c) 2023 Timothy Jon Fraser Consulting LLC.
+ *
+ * This module records nanosecond latencies in fixed-size log-linear
+ * histograms cheaply enough to leave on for a whole test run, and
+ * reports their percentiles at the end.  Unlike now(), hist_now()
+ * always reads the real clock, even in virtual-time mode, because
+ * the point is to see where real time goes.
+ *
+ */
+
+#include <time.h>
+#include <stdio.h>
+
+#include "histogram.h"
+
+#define NS_PER_S  1000000000UL
+#define NS_PER_US 1000.0
+
+
+/* bucket_index()
+ *
+ * in:     value - a latency in nanoseconds
+ * out:    nothing
+ * return: index of the bucket holding value.
+ *
+ * Values below HIST_SUB_BUCKETS get a bucket each.  Above that, the
+ * index is the position of value's leading one bit followed by the
+ * HIST_SUB_BITS bits below it.
+ *
+ */
+
+static unsigned int
+bucket_index(unsigned long value) {
+
+	unsigned int msb;  /* position of value's leading one bit */
+
+	if (value < HIST_SUB_BUCKETS)
+		return value;
+	msb = 63 - __builtin_clzl(value);
+	return ((msb - HIST_SUB_BITS + 1) << HIST_SUB_BITS) +
+		((value >> (msb - HIST_SUB_BITS)) & (HIST_SUB_BUCKETS - 1));
+
+} /* bucket_index() */
+
+
+/* bucket_top()
+ *
+ * in:     index - a bucket index
+ * out:    nothing
+ * return: the largest value bucket index holds.
+ *
+ */
+
+static unsigned long
+bucket_top(unsigned int index) {
+
+	unsigned int shift;  /* log2 of the bucket's width */
+	unsigned long low;   /* smallest value the bucket holds */
+
+	if (index < HIST_SUB_BUCKETS)
+		return index;
+	shift = (index >> HIST_SUB_BITS) - 1;
+	low = (unsigned long)(HIST_SUB_BUCKETS +
+		(index & (HIST_SUB_BUCKETS - 1))) << shift;
+	return low + (1UL << shift) - 1;
+
+} /* bucket_top() */
+
+
+/* hist_now()
+ *
+ * in:     nothing
+ * out:    nothing
+ * return: the real CLOCK_MONOTONIC time in nanoseconds.
+ *
+ */
+
+unsigned long
+hist_now(void) {
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * NS_PER_S + ts.tv_nsec;
+
+} /* hist_now() */
+
+
+/* hist_record()
+ *
+ * in:     p_h   - histogram
+ *         value - latency in nanoseconds
+ * out:    value counted in p_h
+ * return: nothing
+ *
+ */
+
+void
+hist_record(struct histogram *p_h, unsigned long value) {
+
+	p_h->buckets[ bucket_index(value) ]++;
+	p_h->count++;
+	if (value > p_h->max)
+		p_h->max = value;
+
+} /* hist_record() */
+
+
+/* hist_percentile()
+ *
+ * in:     p_h     - histogram
+ *         percent - percentile to find, 0.0 to 100.0
+ * out:    nothing
+ * return: the latency in nanoseconds that percent of the recorded
+ *         values are at or below, or 0 if p_h is empty.
+ *
+ * Like HdrHistogram, reports the top of the bucket the percentile
+ * falls in, so the result is never less than the true percentile.
+ *
+ */
+
+unsigned long
+hist_percentile(const struct histogram *p_h, double percent) {
+
+	unsigned long rank;      /* how many values to count up to */
+	unsigned long seen = 0;  /* values in buckets so far */
+	unsigned int b;          /* indexes buckets */
+
+	if (!p_h->count)
+		return 0;
+	rank = (unsigned long)(percent / 100.0 * p_h->count + 0.5);
+	if (rank < 1)
+		rank = 1;
+	for (b = 0; b < HIST_BUCKETS; b++) {
+		seen += p_h->buckets[ b ];
+		if (seen >= rank)
+			break;
+	}
+	return ((bucket_top(b) < p_h->max) ? bucket_top(b) : p_h->max);
+
+} /* hist_percentile() */
+
+
+/* hist_print()
+ *
+ * in:     p_h - histogram
+ * out:    p_h's count and percentiles to stderr, in microseconds
+ * return: nothing
+ *
+ * Prints nothing for an empty histogram.
+ *
+ */
+
+void
+hist_print(const struct histogram *p_h) {
+
+	if (!p_h->count)
+		return;
+	fprintf(stderr, "%-38s %9lu samples, us: p50 %9.3f p90 %9.3f "
+		"p99 %9.3f p99.9 %9.3f max %9.3f\n", p_h->name, p_h->count,
+		hist_percentile(p_h, 50.0) / NS_PER_US,
+		hist_percentile(p_h, 90.0) / NS_PER_US,
+		hist_percentile(p_h, 99.0) / NS_PER_US,
+		hist_percentile(p_h, 99.9) / NS_PER_US,
+		p_h->max / NS_PER_US);
+
+} /* hist_print() */
@@ -0,0 +1,28 @@
+#ifndef _HISTOGRAM_H_
+#define _HISTOGRAM_H_
+
+/* Log-linear latency histograms in the style of HdrHistogram.  Each
+ * power-of-two range of nanoseconds is split into HIST_SUB_BUCKETS
+ * equal buckets, so a recorded value is off by at most 1 part in
+ * HIST_SUB_BUCKETS, whatever its magnitude, and recording one is a
+ * couple of shifts and an increment.
+ */
+#define HIST_SUB_BITS    4
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS     ((64 - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS)
+
+struct histogram {
+	const char *name;                      /* what it measures */
+	unsigned long count;                   /* values recorded */
+	unsigned long max;                     /* largest value recorded */
+	unsigned long buckets[ HIST_BUCKETS ]; /* values in each bucket */
+};
+
+#define HISTOGRAM_INIT(n) { .name = (n) }
+
+unsigned long hist_now(void);
+void hist_record(struct histogram *, unsigned long);
+unsigned long hist_percentile(const struct histogram *, double);
+void hist_print(const struct histogram *);
+
+#endif
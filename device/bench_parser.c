@@ -0,0 +1,153 @@
+/* Benchmark for the device emulator's parser state machine.
+ *
+ * Copyright (c) 2023 Timothy Jon Fraser Consulting LLC.
+ *
+ * This program measures how long the parser takes to handle each IO
+ * register event, apart from the cost of the trap or mailbox that
+ * delivers it.  It drives handle_ioregs_event() directly with the
+ * events a correct driver would produce while programming, reading,
+ * and erasing pages, as if separate watchpoints reported each
+ * register access so that the parser never needs to touch a tracee.
+ * The timed intervals cover only the calls into the parser; the time
+ * spent waiting for the device to become ready between operations
+ * is excluded.
+ *
+ */
+
+#include <sys/types.h>
+#include <sys/user.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "clock.h"
+#include "device_emu.h"
+#include "de_deadline.h"
+#include "de_parser.h"
+
+#define DEFAULT_ROUNDS 2000  /* program, read, erase this many times */
+#define NS_PER_S 1000000000UL
+
+/* Nanoseconds spent in the parser and the events it handled. */
+static unsigned long elapsed_ns;
+static unsigned long events;
+
+
+/* stamp()
+ *
+ * in:     nothing
+ * out:    nothing
+ * return: CLOCK_MONOTONIC time in nanoseconds.
+ *
+ */
+
+static unsigned long
+stamp(void) {
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * NS_PER_S + ts.tv_nsec;
+
+} /* stamp() */
+
+
+/* send_address()
+ *
+ * in:     command - the setup command that begins the operation
+ *         block   - block address
+ *         page    - page address, or -1 for an erase
+ * out:    parser state updated
+ * return: nothing
+ *
+ * Sends a setup command followed by as many address cycles as the
+ * geometry requires, LSB first.
+ *
+ */
+
+static void
+send_address(unsigned char command, unsigned long block, long page) {
+
+	unsigned int c;  /* counts address cycles */
+
+	handle_ioregs_event(0, NULL, EV_COMMAND, command);
+	events++;
+	for (c = 0; c < geometry.block_cycles; c++, events++)
+		handle_ioregs_event(0, NULL, EV_ADDRESS, block >> (8 * c));
+	if (page < 0)
+		return;
+	for (c = 0; c < geometry.page_cycles; c++, events++)
+		handle_ioregs_event(0, NULL, EV_ADDRESS, page >> (8 * c));
+	for (c = 0; c < geometry.byte_cycles; c++, events++)
+		handle_ioregs_event(0, NULL, EV_ADDRESS, 0);
+
+} /* send_address() */
+
+
+/* round_trip()
+ *
+ * in:     block - block to program, read, and erase
+ * out:    elapsed_ns and events updated, plus parser side effects
+ * return: nothing
+ *
+ * Programs a page of block, reads it back, and erases block, waiting
+ * untimed for the device to become ready after each execute command.
+ *
+ */
+
+static void
+round_trip(unsigned long block) {
+
+	unsigned long start;  /* beginning of each timed interval */
+	unsigned int b;       /* counts data bytes */
+
+	start = stamp();
+	send_address(C_PROGRAM_SETUP, block, 0);
+	for (b = 0; b < NUM_BYTES; b++, events++)
+		handle_ioregs_event(0, NULL, EV_DATA_WRITE, b);
+	handle_ioregs_event(0, NULL, EV_COMMAND, C_PROGRAM_EXECUTE);
+	events++;
+	elapsed_ns += stamp() - start;
+	while (before_deadline())
+		;
+
+	start = stamp();
+	send_address(C_READ_SETUP, block, 0);
+	handle_ioregs_event(0, NULL, EV_COMMAND, C_READ_EXECUTE);
+	events++;
+	elapsed_ns += stamp() - start;
+	while (before_deadline())
+		;
+
+	start = stamp();
+	for (b = 0; b < NUM_BYTES; b++, events++)
+		handle_ioregs_event(0, NULL, EV_DATA_READ, 0);
+	send_address(C_ERASE_SETUP, block, -1);
+	handle_ioregs_event(0, NULL, EV_COMMAND, C_ERASE_EXECUTE);
+	events++;
+	elapsed_ns += stamp() - start;
+	while (before_deadline())
+		;
+
+} /* round_trip() */
+
+
+int
+main(int argc, char *argv[]) {
+
+	unsigned long rounds = DEFAULT_ROUNDS;  /* round trips to time */
+	unsigned long r;                        /* counts round trips */
+
+	if (argc > 1)
+		rounds = strtoul(argv[ 1 ], NULL, 0);
+
+	parser_init(true);
+	for (r = 0; r < rounds; r++)
+		round_trip(r % NUM_BLOCKS);
+
+	printf("%lu events in %lu ns: %.1f ns per event.\n", events,
+		elapsed_ns, (double)elapsed_ns / (double)events);
+	return 0;
+
+} /* main() */
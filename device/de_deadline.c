@@ -6,105 +6,387 @@
  *
  */
 
+#include <sys/types.h>
 #include <sys/time.h>
+#include <sys/timerfd.h>
 #include <stddef.h>
 #include <stdbool.h>
+#include <string.h>
 
 #if defined(DIAGNOSTICS_GET) || defined(DIAGNOSTICS_SET)
 #include <stdio.h>
 #endif
 
 #include "clock.h"
+#include "histogram.h"
+#include "device_emu.h"
 #include "de_deadline.h"
 
 #define MICROSECONDS_IN_SECOND 1000000
+#define NS_PER_US 1000
 
-static timeus_t deadline;  /* deadline (in microseconds since epoch) */
+/* Each chip-enable target has its own deadline (in microseconds
+ * since epoch).  The functions below operate on the selected target's.
+ */
+static timeus_t deadlines[ NUM_TARGETS ];
+static unsigned int target;  /* selected target */
+
+/* Snapshots of how long each target had left to be busy. */
+static timeus_t snapshots[ NUM_SNAPSHOTS ][ NUM_TARGETS ];
+
+/* Shared status page to publish deadline in, or NULL if none. */
+static struct gpio_status *status;
+
+/* Timerfd to arm so that it expires at the deadline, or -1 if none. */
+static int irq_fd = -1;
+
+/* The time this module last read the clock, until
+ * deadline_last_read() collects it, otherwise 0.
+ */
+static timeus_t last_read;
+
+/* True when deadline_init_stats() has asked for a histogram of how
+ * long after each deadline passed the driver first found the target
+ * ready.
+ */
+static bool stats;
+static struct histogram ready_latency =
+	HISTOGRAM_INIT("polling after deadline passed");
+
+
+/* read_clock()
+ *
+ * in:     nothing
+ * out:    last_read set via side effect
+ * return: now()
+ *
+ * This module reads the clock only through this function, so that a
+ * trace can record exactly what time each event saw.
+ *
+ */
+
+static timeus_t
+read_clock(void) {
+	return (last_read = now());
+} /* read_clock() */
+
+
+/* deadline_last_read()
+ *
+ * in:     nothing
+ * out:    last_read cleared via side effect
+ * return: the time this module last read the clock, or 0 if it hasn't
+ *         since the last call.
+ *
+ */
+
+timeus_t
+deadline_last_read(void) {
+
+	timeus_t time = last_read;
+
+	last_read = 0;
+	return time;
+
+} /* deadline_last_read() */
+
+
+/* publish_deadline()
+ *
+ * in:     deadlines - every target's deadline
+ *         target    - the selected target
+ * out:    status page and ready interrupt timer updated via side effect
+ * return: nothing
+ *
+ * Copies the deadlines and the selected target to the shared status
+ * page and arms the ready interrupt timer for the selected target,
+ * if there are any.
+ *
+ */
+
+static void
+publish_deadline(void) {
+
+	struct itimerspec its;  /* when the ready interrupt should fire */
+	unsigned int t;         /* indexes deadlines */
+
+	if (status) {
+		for (t = 0; t < NUM_TARGETS; t++)
+			status->deadline[ t ] = deadlines[ t ];
+		status->target = target;
+	}
+
+	/* Arm the ready interrupt for the deadline, or disarm it if
+	 * the device is ready now.  now() counts CLOCK_MONOTONIC
+	 * microseconds, so the deadline converts directly to an
+	 * absolute CLOCK_MONOTONIC expiration time.  Drivers wait for
+	 * the target they have selected, so that is the one whose
+	 * deadline matters.
+	 */
+	if (irq_fd >= 0) {
+		memset(&its, 0, sizeof(its));
+		its.it_value.tv_sec =
+			deadlines[ target ] / MICROSECONDS_IN_SECOND;
+		its.it_value.tv_nsec =
+			(deadlines[ target ] % MICROSECONDS_IN_SECOND) * 1000;
+		timerfd_settime(irq_fd, TFD_TIMER_ABSTIME, &its, NULL);
+	}
+
+} /* publish_deadline() */
 
 
 /* deadline_clear()
  *
  * in:     nothing
- * out:    deadline set by side-effect
+ * out:    selected target's deadline set by side-effect
  * return: nothing
  *
- * Clears the deadline to 0, making the device ready.
+ * Clears the selected target's deadline to 0, making it ready.
  *
  */
 
 void
 deadline_clear(void) {
-	deadline = 0;
+	deadlines[ target ] = 0;
+	publish_deadline();
 } /* deadline_clear() */
 
 
+/* deadline_select()
+ *
+ * in:     in_target - chip-enable target number, less than NUM_TARGETS
+ * out:    target set by side-effect
+ * return: nothing
+ *
+ * Directs all subsequent deadline operations to in_target's deadline.
+ *
+ */
+
+void
+deadline_select(unsigned int in_target) {
+	target = in_target;
+	publish_deadline();
+} /* deadline_select() */
+
+
 /* deadline_init()
  *
  * in:     nothing
- * out:    deadline set by side-effect
+ * out:    deadlines and target set by side-effect
  * return: nothing
  *
- * Call this function on startup.  Presently this function simply
- * calls deadline_clear() to start the device in a ready state.
- * Retaining this function so that every de_*.c module has an _init()
- * function.
+ * Call this function on startup to start every target in a ready
+ * state with target 0 selected.
  *
  */
 
 void
 deadline_init(void) {
-	deadline_clear();
+	memset(deadlines, 0, sizeof(deadlines));
+	deadline_select(0);
 } /* deadline_init() */
 
 
+/* deadline_snapshot()
+ *
+ * in:     slot - snapshot number, less than NUM_SNAPSHOTS
+ * out:    snapshot slot replaced via side effect
+ * return: nothing
+ *
+ * Saves how much longer each target will be busy in snapshot slot.
+ *
+ */
+
+void
+deadline_snapshot(unsigned int slot) {
+
+	timeus_t timenow = read_clock();
+	unsigned int t;  /* indexes targets */
+
+	for (t = 0; t < NUM_TARGETS; t++)
+		snapshots[ slot ][ t ] = (timenow < deadlines[ t ]) ?
+			(deadlines[ t ] - timenow) : 0;
+
+} /* deadline_snapshot() */
+
+
+/* deadline_restore()
+ *
+ * in:     slot - snapshot number that deadline_snapshot() saved
+ * out:    deadlines set by side-effect
+ * return: nothing
+ *
+ * Makes each target busy for as long again as it had left when
+ * deadline_snapshot() saved slot, so that each becomes ready just as
+ * long after the restore as it would have after the snapshot.
+ *
+ */
+
+void
+deadline_restore(unsigned int slot) {
+
+	timeus_t timenow = read_clock();
+	unsigned int t;  /* indexes targets */
+
+	for (t = 0; t < NUM_TARGETS; t++)
+		deadlines[ t ] = snapshots[ slot ][ t ] ?
+			(timenow + snapshots[ slot ][ t ]) : 0;
+	publish_deadline();
+
+} /* deadline_restore() */
+
+
+/* deadline_init_status()
+ *
+ * in:     in_status - shared status page
+ * out:    status set via side effect
+ * return: nothing
+ *
+ * Call this on startup to have the deadline module publish every
+ * deadline it sets or clears in in_status, where the tracee's
+ * gpio_get() can read it without trapping.
+ *
+ */
+
+void
+deadline_init_status(struct gpio_status *in_status) {
+
+	status = in_status;
+	publish_deadline();
+
+} /* deadline_init_status() */
+
+
+/* deadline_init_irq()
+ *
+ * in:     fd - CLOCK_MONOTONIC timerfd shared with the tracee
+ * out:    irq_fd set via side effect
+ * return: nothing
+ *
+ * Call this on startup to have the deadline module arm fd to expire
+ * at every deadline it sets, raising the device's ready interrupt.
+ *
+ */
+
+void
+deadline_init_irq(int fd) {
+
+	irq_fd = fd;
+	publish_deadline();
+
+} /* deadline_init_irq() */
+
+
 /*
- * before_deadline()
+ * before_target_deadline()
  *
- * in:  deadline - the current value of the deadline state variable
+ * in:  t - chip-enable target number, less than NUM_TARGETS
  * out: nothing
- * return: true - if the current system time is earlier than the deadline.
- *         false - if the current system time is the same or later than the
- *		   deadline.
+ * return: true - if the current system time is earlier than t's deadline.
+ *         false - if the current system time is the same or later than
+ *                 t's deadline.
  *
- * Checks to see if the current system time is before the deadline state
- * variable or not.
+ * Checks to see if the current system time is before target t's
+ * deadline or not.  Once a deadline passes, the target stays ready
+ * until the next set_deadline(), so the first check that finds it
+ * passed clears it and later checks needn't consult the clock at all.
  */
 
 bool
-before_deadline(void) {
+before_target_deadline(unsigned int t) {
+
+	timeus_t timenow;
 
-	timeus_t timenow = now();
+	if (deadlines[ t ] == 0)
+		return false;
+	timenow = read_clock();
 
 #ifdef DIAGNOSTICS_GET
-	if (timenow < deadline) {
-		printf("Device busy at time 0x%lX on deadline 0x%lX "
-		       "(%lu us).\n", timenow, deadline,
-			(deadline - timenow));
+	if (timenow < deadlines[ t ]) {
+		printf("Target %u busy at time 0x%lX on deadline 0x%lX "
+		       "(%lu us).\n", t, timenow, deadlines[ t ],
+			(deadlines[ t ] - timenow));
 	}
 #endif
 	
-	return (timenow < deadline);
+	if (timenow < deadlines[ t ])
+		return true;
+	if (stats)
+		hist_record(&ready_latency,
+			(timenow - deadlines[ t ]) * NS_PER_US);
+	deadlines[ t ] = 0;
+	return false;
+
+}
+
+
+/*
+ * before_deadline()
+ *
+ * in:  target - the selected target
+ * out: nothing
+ * return: true - if the current system time is earlier than the selected
+ *                target's deadline.
+ *         false - otherwise.
+ *
+ * Checks to see if the current system time is before the selected
+ * target's deadline or not.
+ */
 
+bool
+before_deadline(void) {
+	return before_target_deadline(target);
 }
 
 
 /* set_deadline()
  *
  * in:     duration - the duration (in microseconds) to add to the current time
- * out:    deadline - set to the current time plus the duration
+ * out:    deadlines - selected target's set to the current time plus the
+ *                     duration
  * return: nothing
  *
- * Sets the deadline state variable to be the current system time plus the
- * specified duration.
+ * Sets the selected target's deadline to be the current system time
+ * plus the specified duration.
  */
 
 void
 set_deadline(timeus_t duration) {
 
-	deadline = now() + duration;
+	deadlines[ target ] = read_clock() + duration;
+	publish_deadline();
 
 #ifdef DIAGNOSTICS_SET
-	printf("Device set deadline 0x%lx (%lu us).\n", deadline, duration);
+	printf("Target %u set deadline 0x%lx (%lu us).\n", target,
+		deadlines[ target ], duration);
 #endif
 	
 } /* set_deadline() */
+
+
+/* deadline_init_stats()
+ *
+ * in:     nothing
+ * out:    ready latency histogram enabled
+ * return: nothing
+ *
+ */
+
+void
+deadline_init_stats(void) {
+	stats = true;
+} /* deadline_init_stats() */
+
+
+/* deadline_print_stats()
+ *
+ * in:     nothing
+ * out:    ready latency histogram to stderr
+ * return: nothing
+ *
+ */
+
+void
+deadline_print_stats(void) {
+	hist_print(&ready_latency);
+} /* deadline_print_stats() */
@@ -1,10 +1,21 @@
 #ifndef _DE_DEADLINE_H_
 #define _DE_DEADLINE_H_
 
+struct gpio_status;  /* from device_emu.h */
+
 void deadline_clear(void);
+void deadline_select(unsigned int);
 void deadline_init(void);
+void deadline_snapshot(unsigned int);
+void deadline_restore(unsigned int);
+void deadline_init_status(struct gpio_status *);
+void deadline_init_irq(int);
 
+bool before_target_deadline(unsigned int);
 bool before_deadline(void);
 void set_deadline(timeus_t);
+timeus_t deadline_last_read(void);
+void deadline_init_stats(void);
+void deadline_print_stats(void);
 
 #endif
@@ -6,19 +6,304 @@
  *
  */
 
+#define _GNU_SOURCE  /* for ucontext_t REG_* register indices */
+
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/user.h>
 #include <sys/ptrace.h>
+#include <signal.h>
+#include <pthread.h>
+#include <ucontext.h>
+#include <unistd.h>
+#include <sched.h>
+#include <stdbool.h>
 #include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
 
+#include "clock.h"
+#include "histogram.h"
+#include "device_emu.h"
 #include "framework.h" /* for RIP_IN_GPIO_SET/GET macros */
+#include "de_deadline.h"
 #include "de_ioregs.h"
 #include "de_gpio.h"
 #include "de_parser.h"
+#include "de_store.h"
+#include "de_trace.h"
+
+/* When using the shared-memory transport, the tracer polls the
+ * mailbox this many times between checks for ptrace() stops before
+ * yielding the CPU.  Polling keeps handshake latency low when tracer
+ * and tracee run on separate CPUs; yielding lets the tracee run when
+ * they share one.
+ */
+#define SHM_POLLS_PER_YIELD 64
 
 static volatile unsigned long *ioregs; /* address of ioregisters variable */
 
+/* True when each IO register has its own watchpoint; see
+ * device_init_registers().
+ */
+static bool precise;
+
+/* The shared-memory transport page, or NULL; see device_init_shm(). */
+static struct ioregs_shm *shm_page;
+
+/* True when the tracee is a fork server; see device_init_fork_server().
+ * Each test case it forks becomes the active tracee until it exits.
+ */
+static bool fork_server;
+static pid_t active_pid;
+
+/* Kinds of trap, for the trap latency histograms. */
+#define TRAP_WATCHPOINT 0
+#define TRAP_GPIO_GET   1
+#define TRAP_GPIO_SET   2
+#define NUM_TRAP_KINDS  3
+
+/* Shared trap counters, or NULL if none. */
+static struct device_counters *counters;
+
+/* True when device_init_stats() has asked for latency histograms. */
+static bool stats;
+
+static struct histogram trap_latency[ NUM_TRAP_KINDS ] = {
+	[ TRAP_WATCHPOINT ] = HISTOGRAM_INIT("watchpoint trap round trip"),
+	[ TRAP_GPIO_GET ]   = HISTOGRAM_INIT("gpio_get() trap round trip"),
+	[ TRAP_GPIO_SET ]   = HISTOGRAM_INIT("gpio_set() trap round trip"),
+};
+
+
+/* arm_watchpoints()
+ *
+ * in:     pid - PID of a tracee
+ * out:    pid's watchpoints set via side effect
+ * return: nothing
+ *
+ * Sets up the hardware watchpoints on pid's IO registers that the
+ * transport in use needs.
+ *
+ */
+
+static void
+arm_watchpoints(pid_t pid) {
+
+	if (shm_page)
+		ioregs_init_shm(shm_page, pid);
+	else if (precise)
+		ioregs_init_registers(ioregs, pid);
+	else
+		ioregs_init(ioregs, pid);
+
+} /* arm_watchpoints() */
+
+
+/* dispatch_trap()
+ *
+ * in:     child_pid - PID of child tracee
+ *         p_regs    - tracee CPU register values at the trap
+ * out:    p_regs    - may be updated to emulate an IO register read
+ *         emulator state updated by whichever handler runs
+ * return: the TRAP_* kind of trap it was
+ *
+ * The child tracee has stopped on a breakpoint or watchpoint.  Figure
+ * out which one and handle it.
+ *
+ */
+
+static unsigned int
+dispatch_trap(pid_t child_pid, struct user_regs_struct *p_regs) {
+
+	if (counters)
+		counters->traps++;
+
+	/* Figure out which breakpoint or watchpoint the
+	 * tracee hit and handle it.
+	 */
+	if (RIP_IN_GPIO_SET(p_regs->rip)) {
+		handle_breakpoint_gpio_set(child_pid, p_regs);
+		return TRAP_GPIO_SET;
+	} else if (RIP_IN_GPIO_GET(p_regs->rip)) {
+		handle_breakpoint_gpio_get(child_pid, p_regs);
+		return TRAP_GPIO_GET;
+	} else if (precise) {
+		handle_watchpoint_registers(child_pid, p_regs,
+			ioregs_watchpoints_hit(child_pid));
+	} else {
+		handle_watchpoint_ioregisters(child_pid, p_regs);
+	}
+	return TRAP_WATCHPOINT;
+
+} /* dispatch_trap() */
+
+
+/* trap_clock()
+ *
+ * in:     nothing
+ * out:    nothing
+ * return: hist_now() if collecting statistics, otherwise 0.
+ *
+ */
+
+static unsigned long
+trap_clock(void) {
+	return (stats ? hist_now() : 0);
+} /* trap_clock() */
+
+
+/* trap_done()
+ *
+ * in:     kind  - the TRAP_* kind of trap
+ *         start - trap_clock() when the device emulator got the trap
+ * out:    trap's latency recorded, if collecting statistics
+ * return: nothing
+ *
+ */
+
+static void
+trap_done(unsigned int kind, unsigned long start) {
+
+	if (stats)
+		hist_record(&trap_latency[ kind ], hist_now() - start);
+
+} /* trap_done() */
+
+
+/* handle_trap()
+ *
+ * in:     child_pid - PID of child tracee
+ * out:    emulator state updated by whichever handler runs
+ * return: nothing
+ *
+ * The child tracee has stopped on a breakpoint or watchpoint.  Get
+ * its registers, handle the trap, and let the tracee continue.
+ *
+ */
+
+static void
+handle_trap(pid_t child_pid) {
+
+	struct user_regs_struct regs; /* hold tracee register values. */
+	unsigned long start;          /* when we got the trap */
+	unsigned int kind;            /* TRAP_* kind of trap */
+
+	start = trap_clock();
+
+	/* Get tracee's registers to help us figure out what
+	 * function it was running when it trapped.
+	 */
+	ptrace(PTRACE_GETREGS, child_pid, NULL, &regs);
+
+	kind = dispatch_trap(child_pid, &regs);
+
+	/* Let the tracee continue. */
+	ptrace(PTRACE_CONT, child_pid, NULL, NULL);
+
+	trap_done(kind, start);
+
+} /* handle_trap() */
+
+
+/* handle_stop()
+ *
+ * in:     child_pid - PID of the child tracee
+ *         pid       - PID of the tracee that wait() reported on
+ *         status    - the status wait() reported
+ * out:    emulator state updated by whichever handler runs
+ * return: true once the child tracee has exited, otherwise false.
+ *
+ * Handles one change in a tracee's state.  Usually that is a trap.
+ * A fork server's child tracee also stops when it forks a test case
+ * and when it receives SIGCHLD, and each test case stops once on
+ * startup and on any signal it receives, such as a crash.  Arm each
+ * new test case's watchpoints, pass signals on, and let the tracee
+ * continue.
+ *
+ */
+
+static bool
+handle_stop(pid_t child_pid, pid_t pid, int status) {
+
+	if (WIFEXITED(status) || WIFSIGNALED(status)) {
+		if (pid == active_pid)
+			active_pid = child_pid;
+		return (pid == child_pid);
+	}
+
+	if ((status >> 8) == (SIGTRAP | (PTRACE_EVENT_FORK << 8))) {
+		/* The new test case reports its own SIGSTOP. */
+		ptrace(PTRACE_CONT, pid, NULL, NULL);
+	} else if ((pid != child_pid) && (WSTOPSIG(status) == SIGSTOP)) {
+		active_pid = pid;
+		arm_watchpoints(pid);
+		ptrace(PTRACE_CONT, pid, NULL, NULL);
+	} else if ((WSTOPSIG(status) == SIGCHLD) ||
+		   ((pid != child_pid) && (WSTOPSIG(status) != SIGTRAP))) {
+		ptrace(PTRACE_CONT, pid, NULL, (void *)(long)WSTOPSIG(status));
+	} else {
+		handle_trap(pid);
+	}
+	return false;
+
+} /* handle_stop() */
+
+
+/* handle_sigtrap()
+ *
+ * in:     signum  - SIGTRAP
+ *         info    - ignored
+ *         context - the ucontext_t of the code that trapped
+ * out:    context - may be updated to emulate an IO register read
+ *         emulator state updated by whichever handler runs
+ * return: nothing
+ *
+ * In in-process mode, breakpoints and watchpoints raise SIGTRAP in
+ * our own process rather than stopping a tracee.  Translate the
+ * interrupted context into the user_regs_struct the handlers expect,
+ * handle the trap, and copy back the registers an emulated IO
+ * register read may have changed.
+ *
+ * The handlers call printf() and usleep(), which are not
+ * async-signal-safe.  This is tolerable because SIGTRAP arrives only
+ * from the driver's register accesses and GPIO calls, never from
+ * inside the C library.
+ *
+ */
+
+static void
+handle_sigtrap(int signum, siginfo_t *info, void *context) {
+
+	greg_t *gregs = ((ucontext_t *)context)->uc_mcontext.gregs;
+	struct user_regs_struct regs;  /* registers as ptrace() has them */
+	unsigned long start;           /* when we got the trap */
+	unsigned int kind;             /* TRAP_* kind of trap */
+
+	start = trap_clock();
+	memset(&regs, 0, sizeof(regs));
+	regs.rip = gregs[ REG_RIP ];
+	regs.rbp = gregs[ REG_RBP ];
+	regs.rdi = gregs[ REG_RDI ];
+	regs.rsi = gregs[ REG_RSI ];
+	regs.rax = gregs[ REG_RAX ];
+	regs.rcx = gregs[ REG_RCX ];
+	regs.rdx = gregs[ REG_RDX ];
+
+	ioregs_watch_pause();
+	kind = dispatch_trap(getpid(), &regs);
+	ioregs_watch_resume();
+
+	gregs[ REG_RAX ] = regs.rax;
+	gregs[ REG_RCX ] = regs.rcx;
+	gregs[ REG_RDX ] = regs.rdx;
+
+	trap_done(kind, start);
+
+} /* handle_sigtrap() */
+
+
 /*
  * device_init()
  *
@@ -37,11 +322,12 @@ static volatile unsigned long *ioregs; /* address of ioregisters variable */
 
 void
 device_init(volatile unsigned long *in_ioregisters, pid_t child_pid) {
-	
+
 	int child_status;       /* child process status returned by wait() */
-	struct user_regs_struct regs; /* hold tracee register values. */
+	pid_t pid;              /* tracee wait() reported on */
 
 	ioregs = in_ioregisters;
+	active_pid = child_pid;
 
 	/* Wait for first trap. */
 	wait(&child_status);
@@ -51,10 +337,14 @@ device_init(volatile unsigned long *in_ioregisters, pid_t child_pid) {
 	 * tracee will trap and pass control to the parent tracer
 	 * whenever the child tracee reads or writes ioregisters.
 	 */
-	ioregs_init(in_ioregisters, child_pid);
-	
+	arm_watchpoints(child_pid);
+
+	/* A fork server's test cases become tracees, too. */
+	if (fork_server)
+		ptrace(PTRACE_SETOPTIONS, child_pid, NULL, PTRACE_O_TRACEFORK);
+
 	/* Init parser and its deadline and store sub-modules. */
-	parser_init(in_ioregisters);
+	parser_init(precise);
 
 	/* Setup complete.  Let tracee continue. */
 	ptrace(PTRACE_CONT, child_pid, NULL, NULL);
@@ -65,7 +355,8 @@ device_init(volatile unsigned long *in_ioregisters, pid_t child_pid) {
 		/* Wait until the tracee either hits a watchpoint or
 		 * terminates.
 		 */
-		wait(&child_status);
+		if ((pid = waitpid(-1, &child_status, __WALL)) < 0)
+			break; /* no tracee left */
 
 		/* The tracee will trap under four conditions:
 		 *  (1) tracee reached the end of its program and terminated,
@@ -77,26 +368,395 @@ device_init(volatile unsigned long *in_ioregisters, pid_t child_pid) {
 		 * condition actually happened and handle it.
 		 */
 
-		if (WIFEXITED(child_status))
+		if (handle_stop(child_pid, pid, child_status))
 			break; /* child done, we're done. */
+	}
+}
 
-		/* Get tracee's registers to help us figure out what
-		 * function it was running when it trapped.
-		 */
-		ptrace(PTRACE_GETREGS, child_pid, NULL, &regs);
 
-		/* Figure out which breakpoint or watchpoint the
-		 * tracee hit and handle it.
+/*
+ * device_init_registers()
+ *
+ * in:     in_ioregisters - a pointer to the ioregisters variable from main.c
+ *         child_pid      - PID of child tracee
+ * out:    none
+ * return: none
+ *
+ * Parent tracer process calls this function on startup instead of
+ * device_init() to give each of the child's IO registers a separate
+ * watchpoint.  The watchpoint that fires then tells the device
+ * emulator exactly which register the child touched, and whether it
+ * read or wrote the data register, instead of leaving the parser to
+ * deduce it from the command register.
+ */
+
+void
+device_init_registers(volatile unsigned long *in_ioregisters,
+	pid_t child_pid) {
+
+	precise = true;
+	device_init(in_ioregisters, child_pid);
+
+} /* device_init_registers() */
+
+
+/*
+ * device_init_shm()
+ *
+ * in:     shm       - the shared-memory transport page from main.c
+ *         child_pid - PID of child tracee
+ * out:    none
+ * return: none
+ *
+ * Parent tracer process calls this function on startup instead of
+ * device_init() when main.c has selected the shared-memory IO
+ * register transport.  Initializes the device emulator as
+ * device_init() does, then alternates between servicing register
+ * accesses the tracee posts to the shared-memory mailbox and
+ * handling whatever breakpoints and watchpoints the tracee still
+ * hits until the tracee exits.
+ */
+
+void
+device_init_shm(struct ioregs_shm *shm, pid_t child_pid) {
+
+	int child_status;       /* child process status returned by wait() */
+	unsigned int polls = 0; /* counts idle mailbox polls */
+	unsigned long start;    /* when we accepted a mailbox access */
+	pid_t pid;              /* tracee waitpid() reported on */
+
+	ioregs = shm->ioregisters;
+	shm_page = shm;
+	active_pid = child_pid;
+
+	/* Wait for first trap. */
+	wait(&child_status);
+
+	/* Init ioregisters module.  We still set up the hardware
+	 * watchpoint so that any tracee code that touches the
+	 * registers directly rather than through the framework's
+	 * accessors keeps working.
+	 */
+	arm_watchpoints(child_pid);
+
+	/* A fork server's test cases become tracees, too. */
+	if (fork_server)
+		ptrace(PTRACE_SETOPTIONS, child_pid, NULL, PTRACE_O_TRACEFORK);
+
+	/* Init parser and its deadline and store sub-modules. */
+	parser_init(false);
+
+	/* Setup complete.  Let tracee continue. */
+	ptrace(PTRACE_CONT, child_pid, NULL, NULL);
+
+	while (1) {
+
+		/* Service any register access waiting in the mailbox. */
+		if (ioregs_shm_accept()) {
+			start = trap_clock();
+			if (counters)
+				counters->traps++;
+			handle_watchpoint_ioregisters(active_pid, NULL);
+			ioregs_shm_complete();
+			trap_done(TRAP_WATCHPOINT, start);
+			polls = 0;
+			continue;
+		}
+
+		if (++polls < SHM_POLLS_PER_YIELD)
+			continue;
+		polls = 0;
+
+		/* The mailbox is quiet.  The tracee may be stopped on
+		 * a GPIO breakpoint, stopped on the watchpoint, done,
+		 * or simply busy doing something else.
 		 */
-		if (RIP_IN_GPIO_SET(regs.rip)) {
-			handle_breakpoint_gpio_set(&regs);
-		} else if (RIP_IN_GPIO_GET(regs.rip)) {
-			handle_breakpoint_gpio_get(child_pid, &regs);
-		} else {
-			handle_watchpoint_ioregisters(child_pid, &regs);
-                }
-
-		/* Let the tracee continue. */
-		ptrace(PTRACE_CONT, child_pid, NULL, NULL);
+		switch (pid = waitpid(-1, &child_status, WNOHANG | __WALL)) {
+		case 0:
+			sched_yield();  /* busy; let it run */
+			break;
+		case -1:
+			return;         /* no child left to trace */
+		default:
+			if (handle_stop(child_pid, pid, child_status))
+				return; /* child done, we're done. */
+		}
 	}
 }
+
+
+/* rearm_in_process()
+ *
+ * in:     nothing
+ * out:    watchpoint set via side effect
+ * return: nothing
+ *
+ * In in-process mode, fork() calls this in each test case a fork
+ * server forks.
+ *
+ */
+
+static void
+rearm_in_process(void) {
+
+	ioregs_init_in_process(ioregs);
+
+} /* rearm_in_process() */
+
+
+/*
+ * device_init_in_process()
+ *
+ * in:     in_ioregisters - a pointer to the ioregisters variable from main.c
+ * out:    none
+ * return: none
+ *
+ * Call this function on startup instead of forking and calling
+ * device_init() to run the device emulator in the same process as
+ * the driver.  Initializes the device emulator, installs a SIGTRAP
+ * handler, and arms a perf_event_open() watchpoint on our own
+ * ioregisters variable.  From then on, driver accesses to the IO
+ * registers and calls to gpio_set() and gpio_get() each raise a
+ * SIGTRAP that the handler services, so this function returns and
+ * lets the caller go on to run the driver.  The framework must not
+ * try to make itself a ptrace() tracee in this mode; see
+ * init_framework_in_process().
+ */
+
+void
+device_init_in_process(volatile unsigned long *in_ioregisters) {
+
+	struct sigaction action;  /* our SIGTRAP disposition */
+
+	ioregs = in_ioregisters;
+
+	memset(&action, 0, sizeof(action));
+	action.sa_sigaction = handle_sigtrap;
+	action.sa_flags = SA_SIGINFO;
+	sigemptyset(&action.sa_mask);
+	if (sigaction(SIGTRAP, &action, NULL)) {
+		perror("Failed to install SIGTRAP handler");
+		exit(-1);
+	}
+
+	/* Init parser and its deadline and store sub-modules. */
+	parser_init(false);
+
+	/* Init ioregisters module.  Set up hardware watchpoint on
+	 * our own ioregisters variable.  A fork server's test cases
+	 * inherit the whole device emulator but not the watchpoint,
+	 * so they set up their own.
+	 */
+	ioregs_init_in_process(in_ioregisters);
+	if (fork_server)
+		pthread_atfork(NULL, NULL, rearm_in_process);
+
+} /* device_init_in_process() */
+
+
+/*
+ * device_init_status()
+ *
+ * in:     status - the shared status page from main.c
+ * out:    none
+ * return: none
+ *
+ * Call this before any of the other device_init*() functions to have
+ * the device emulator publish its ready/busy deadline in status, so
+ * that the driver can poll the status pin without trapping.
+ */
+
+void
+device_init_status(struct gpio_status *status) {
+
+	deadline_init_status(status);
+
+} /* device_init_status() */
+
+
+/*
+ * device_init_counters()
+ *
+ * in:     in_counters - the shared trap counters from main.c
+ * out:    none
+ * return: none
+ *
+ * Call this before any of the other device_init*() functions to have
+ * the device emulator count the traps and mailbox accesses it
+ * services in in_counters.
+ */
+
+void
+device_init_counters(struct device_counters *in_counters) {
+
+	counters = in_counters;
+
+} /* device_init_counters() */
+
+
+/*
+ * device_init_irq()
+ *
+ * in:     fd - a CLOCK_MONOTONIC timerfd shared with the driver
+ * out:    none
+ * return: none
+ *
+ * Call this before any of the other device_init*() functions to have
+ * the device emulator raise a ready interrupt at the end of each busy
+ * period by arming fd to expire then.
+ */
+
+void
+device_init_irq(int fd) {
+
+	deadline_init_irq(fd);
+
+} /* device_init_irq() */
+
+
+/*
+ * device_init_fork_server()
+ *
+ * in:     nothing
+ * out:    none
+ * return: none
+ *
+ * Call this before any of the other device_init*() functions when
+ * the tracee will serve as a fork server, initializing the framework
+ * and driver once and then forking a new process for each test case.
+ * The device emulator then traces each test case as it would the
+ * tracee, and sets up its watchpoints.  Test cases begin with
+ * whatever device state the previous one left, so they should
+ * restore a snapshot first.
+ */
+
+void
+device_init_fork_server(void) {
+
+	fork_server = true;
+
+} /* device_init_fork_server() */
+
+
+/*
+ * device_init_image()
+ *
+ * in:     path          - image file to back the device's storage with
+ *         copy_on_write - nonzero to leave the file unmodified
+ * out:    none
+ * return: 0 on success, -1 if the file can't be opened.
+ *
+ * Call this before any of the other device_init*() functions, and
+ * after choosing the geometry, to have the device start with the
+ * storage the image file holds rather than blank storage.  The image
+ * is mapped, not read, so even a large one loads instantly.  Unless
+ * copy_on_write, the storage's final state goes back to the file;
+ * call device_sync_image() to be sure it has.
+ */
+
+int
+device_init_image(const char *path, int copy_on_write) {
+
+	return store_open_image(path, copy_on_write);
+
+} /* device_init_image() */
+
+
+/*
+ * device_sync_image()
+ *
+ * in:     nothing
+ * out:    image file updated via side effect
+ * return: none
+ *
+ * Call this after the tests finish, or at any checkpoint, to write the
+ * device's storage back to the image file device_init_image() opened.
+ * Does nothing if there is no image or it is copy-on-write.
+ */
+
+void
+device_sync_image(void) {
+
+	store_sync();
+
+} /* device_sync_image() */
+
+
+/*
+ * device_init_trace()
+ *
+ * in:     path - trace file to create
+ * out:    none
+ * return: 0 on success, -1 if the file can't be created.
+ *
+ * Call this before fork() and any of the other device_init*()
+ * functions, and after choosing the geometry, to have the device
+ * emulator record every IO register and GPIO pin event it handles in
+ * a binary trace file that replay_trace can check the device's
+ * behavior against later.  The trace is complete once the process
+ * exits.
+ */
+
+int
+device_init_trace(const char *path) {
+
+	return trace_open(path);
+
+} /* device_init_trace() */
+
+
+/*
+ * device_init_stats()
+ *
+ * in:     nothing
+ * out:    latency histograms enabled
+ * return: nothing
+ *
+ * Call this before fork() and any of the other device_init*()
+ * functions to have device_print_stats() report latency histograms
+ * for traps, for the time the parser spends in each machine state,
+ * and for how late the driver notices the device became ready.
+ */
+
+void
+device_init_stats(void) {
+
+	stats = true;
+	parser_init_stats();
+	deadline_init_stats();
+
+} /* device_init_stats() */
+
+
+/*
+ * device_print_stats()
+ *
+ * in:     nothing
+ * out:    device emulator statistics to stderr
+ * return: none
+ *
+ * Call this after the tests finish to report how the device emulator
+ * spent its effort.
+ */
+
+void
+device_print_stats(void) {
+
+	unsigned long hits, misses;  /* decode cache statistics */
+	unsigned int kind;           /* TRAP_* kinds of trap */
+
+	ioregs_decode_stats(&hits, &misses);
+	fprintf(stderr, "decode cache: %lu hits, %lu misses", hits, misses);
+	if (hits + misses)
+		fprintf(stderr, " (%.2f%% hits)",
+			100.0 * hits / (hits + misses));
+	fprintf(stderr, "\n");
+
+	if (!stats)
+		return;
+	for (kind = 0; kind < NUM_TRAP_KINDS; kind++)
+		hist_print(&trap_latency[ kind ]);
+	parser_print_stats();
+	deadline_print_stats();
+
+} /* device_print_stats() */
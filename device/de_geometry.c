@@ -0,0 +1,106 @@
+/*
+ * Device emulator storage geometry module.
+ *
+ * Copyright (c) 2023 Timothy Jon Fraser Consulting LLC.
+ *
+ */
+
+#include <sys/types.h>
+
+#include "device_emu.h"
+
+/* The geometry the device emulator and the framework share.  main.c
+ * may replace the default with geometry_init() before fork()ing.
+ */
+struct nand_geometry geometry = {
+	.num_blocks   = DEFAULT_NUM_BLOCKS,
+	.num_pages    = DEFAULT_NUM_PAGES,
+	.num_bytes    = DEFAULT_NUM_BYTES,
+	.block_cycles = 1,
+	.page_cycles  = 1,
+	.byte_cycles  = 1,
+	.page_shift   = 8,
+	.block_shift  = 16,
+};
+
+
+/* log2_exact()
+ *
+ * in:     n - a number
+ * out:    nothing
+ * return: log2(n) if n is a power of two, otherwise -1.
+ *
+ */
+
+static int
+log2_exact(unsigned long n) {
+
+	int bits = 0;  /* counts bits below n's one bit */
+
+	if (n == 0 || (n & (n - 1)))
+		return -1;
+	while (n >>= 1)
+		bits++;
+	return bits;
+
+} /* log2_exact() */
+
+
+/* address_cycles()
+ *
+ * in:     n - number of blocks, pages, or bytes
+ * out:    nothing
+ * return: number of address cycles it takes to send values 0 .. n-1.
+ *
+ */
+
+static unsigned int
+address_cycles(unsigned long n) {
+
+	unsigned int cycles = 1;  /* always send at least one cycle */
+
+	for (n -= 1; n >>= 8; )
+		cycles++;
+	return cycles;
+
+} /* address_cycles() */
+
+
+/* geometry_init()
+ *
+ * in:     num_blocks - erase blocks per target
+ *         num_pages  - pages per block
+ *         num_bytes  - bytes per page
+ * out:    geometry set via side effect
+ * return: 0 on success, -1 if any dimension is not a power of two or
+ *         is out of range, leaving geometry unchanged.
+ *
+ * Call this before device_init*() and before fork()ing.
+ *
+ */
+
+int
+geometry_init(unsigned long num_blocks, unsigned long num_pages,
+	unsigned long num_bytes) {
+
+	int block_bits = log2_exact(num_blocks);
+	int page_bits  = log2_exact(num_pages);
+	int byte_bits  = log2_exact(num_bytes);
+
+	if ((block_bits < 0) || (num_blocks > MAX_NUM_BLOCKS) ||
+	    (page_bits < 0)  || (num_pages > MAX_NUM_PAGES) ||
+	    (byte_bits < 0)  || (num_bytes > MAX_NUM_BYTES) ||
+	    (num_bytes < MIN_NUM_BYTES))
+		return -1;
+
+	geometry.num_blocks   = num_blocks;
+	geometry.num_pages    = num_pages;
+	geometry.num_bytes    = num_bytes;
+	geometry.block_cycles = address_cycles(num_blocks);
+	geometry.page_cycles  = address_cycles(num_pages);
+	geometry.byte_cycles  = address_cycles(num_bytes);
+	geometry.page_shift   = byte_bits;
+	geometry.block_shift  = byte_bits + page_bits;
+	return 0;
+
+} /* geometry_init() */
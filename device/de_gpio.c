@@ -10,26 +10,34 @@
 #include <sys/ptrace.h>
 #include <unistd.h>
 #include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
 
 #include "device_emu.h"
 #include "clock.h"
 #include "de_deadline.h"
 #include "de_parser.h"
+#include "de_ioregs.h"
 #include "de_gpio.h"
+#include "de_trace.h"
 
 
 /*
  * handle_breakpoint_gpio_set()
  *
- * in:  p_regs - pointer to register struct containing tracee's register values
- * out: parser state reset via parser_reset()
+ * in:  child_pid - PID of the child tracee
+ *      p_regs - pointer to register struct containing tracee's register values
+ * out: parser state reset via parser_reset(), target selected via
+ *      parser_select(), or state saved or restored via
+ *      parser_snapshot() or parser_restore(), event recorded if
+ *      tracing
  * return: nothing
  *
  * This function processes tracee calls to its gpio_set() function.
  */
 
 void
-handle_breakpoint_gpio_set(struct user_regs_struct *p_regs) {
+handle_breakpoint_gpio_set(pid_t child_pid, struct user_regs_struct *p_regs) {
 
 	/* The following code depends on some details specific to the amd64
 	 * GCC ABI: the instruction pointer is in rip, the first argument to
@@ -41,10 +49,60 @@ handle_breakpoint_gpio_set(struct user_regs_struct *p_regs) {
 	case PN_RESET:
 		if (p_regs->rsi == true) {
 			parser_reset();
+			trace_event(TR_RESET, 0, 0, parser_state());
 			usleep(RESET_DURATION);
 		}
 		break;
+	case PN_CHIP_SELECT:
+		if (!parser_select(child_pid, p_regs->rsi)) {
+			printf("device emulator: no such target.\n");
+			exit(1);
+		}
+		trace_event(TR_SELECT, p_regs->rsi, 0, parser_state());
+		break;
+	case PN_SNAPSHOT:
+		if (!parser_snapshot(p_regs->rsi)) {
+			printf("device emulator: no such snapshot.\n");
+			exit(1);
+		}
+		trace_event(TR_SNAPSHOT, p_regs->rsi, 0, parser_state());
+		break;
+	case PN_RESTORE:
+		if (!parser_restore(child_pid, p_regs->rsi)) {
+			printf("device emulator: no such snapshot.\n");
+			exit(1);
+		}
+		trace_event(TR_RESTORE, p_regs->rsi, 0, parser_state());
+		break;
+	}
+}
+
+
+/* get_status()
+ *
+ * in:  child_pid - PID of the child tracee
+ *      rva       - addr of tracee gpio_get() retval local var
+ *      t         - chip-enable target whose status pin to get
+ * out: tracee's retval set to t's status, virtual time advanced if
+ *      t is busy, event recorded if tracing
+ * return: nothing
+ *
+ */
+
+static void
+get_status(pid_t child_pid, unsigned long rva, unsigned int t) {
+
+	unsigned int pin;  /* status pin value */
+
+	if (before_target_deadline(t)) {
+		pin = DEVICE_BUSY;
+		clock_advance(BUSY_POLL_US);
+	} else {
+		pin = DEVICE_READY;
 	}
+	tracee_pokedata(child_pid, rva, pin);
+	trace_event(TR_STATUS, t, pin, parser_state());
+
 }
 
 
@@ -52,7 +110,7 @@ handle_breakpoint_gpio_set(struct user_regs_struct *p_regs) {
  *
  * in:  child_pid - PID of the child tracee
  *      p_regs - pointer to register struct containing tracee's register values
- * out: nothing
+ * out: event recorded if tracing
  * return: nothing
  *
  * This function processes tracee calls to its gpio_get() function.
@@ -73,14 +131,19 @@ handle_breakpoint_gpio_get(pid_t child_pid, struct user_regs_struct *p_regs) {
 
 	switch (p_regs->rdi) {
 	case PN_STATUS:
-		if (before_deadline()) {
-			ptrace(PTRACE_POKEDATA, child_pid, rva, DEVICE_BUSY);
-		} else {
-			ptrace(PTRACE_POKEDATA, child_pid, rva, DEVICE_READY);
-		}
+		get_status(child_pid, rva, parser_target());
 		break;
 	case PN_RESET:
-		ptrace(PTRACE_POKEDATA, child_pid, rva, 0);
+		tracee_pokedata(child_pid, rva, 0);
+		break;
+	case PN_CHIP_SELECT:
+		tracee_pokedata(child_pid, rva, parser_target());
+		break;
+	default:
+		if ((p_regs->rdi < PN_STATUS_TARGET(0)) ||
+		    (p_regs->rdi >= PN_STATUS_TARGET(NUM_TARGETS)))
+			break;
+		get_status(child_pid, rva, p_regs->rdi - PN_STATUS_TARGET(0));
 		break;
 	}
 }
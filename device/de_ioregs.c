@@ -5,13 +5,24 @@
  *
  */
 
+#define _GNU_SOURCE  /* for process_vm_readv() and process_vm_writev() */
+
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/user.h>
 #include <sys/ptrace.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <linux/hw_breakpoint.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdlib.h>
 #include <stdio.h>
 
+#include "device_emu.h"
 #include "de_ioregs.h"
 
 /* Macro to get the nth byte from unsigned long ul. */
@@ -35,12 +46,59 @@
 	 (BYTE(ul, MODRM_MOV) == 0x0D) || \
 	 (BYTE(ul, MODRM_MOV) == 0x15)))
 
+/* Macro that recognizes a call or jmp with a 32-bit displacement.
+ * The displacement depends on where the linker placed the caller and
+ * callee, so error_dump() doesn't print it.
+ */
+#define PATTERN_REL32(ul) ( \
+	(BYTE(ul, 3) == 0xE8) || \
+	(BYTE(ul, 3) == 0xE9))
+
+
+/* Decode cache.  Drivers read the data register from the same one
+ * or two instructions over and over, and program text doesn't
+ * change, so update_tracee_cpu_registers() remembers the ModR/M byte
+ * it decoded for each trapping RIP and skips both the PEEK and the
+ * decoding the next time it sees that RIP.  The cache is a small
+ * open-addressed hash table; RIP 0 marks an empty slot.  Once the
+ * table fills, new RIPs are simply decoded every time.
+ */
+#define DECODE_CACHE_SIZE 64   /* must be a power of 2 */
+#define DECODE_CACHE_HASH(rip) (((rip) ^ ((rip) >> 7)) & \
+	(DECODE_CACHE_SIZE - 1))
+
+struct decode_cache_entry {
+	unsigned long rip;     /* RIP after the trapping mov, 0 if empty */
+	unsigned char modrm;   /* the mov's decoded ModR/M byte */
+};
+
+static struct decode_cache_entry decode_cache[ DECODE_CACHE_SIZE ];
+static unsigned long decode_hits;    /* lookups that found their RIP */
+static unsigned long decode_misses;  /* lookups that had to decode */
+
 
 /* Address of the ioregisters variable.  The actual ioregister
  * variable is defined in main.c.
  */
 static volatile unsigned long *ioregs;
 
+/* Address of the shared-memory transport page, or NULL when the
+ * tracer and tracee each have their own copy of the ioregisters
+ * variable and we must use ptrace() to reach the tracee's copy.
+ */
+static struct ioregs_shm *shm;
+
+/* True when the device emulator runs in the same process as the
+ * driver, in which case "tracee" memory and CPU registers are our
+ * own and we reach them directly rather than through ptrace().
+ */
+static bool in_process;
+
+/* File descriptor of the perf event that implements the watchpoint
+ * on the ioregisters variable in in-process mode.
+ */
+static int watchpoint_fd = -1;
+
 
 /* ioregs_init()
  *
@@ -110,6 +168,468 @@ ioregs_init(volatile unsigned long *in_ioregisters, pid_t child_pid) {
 } /* ioregs_init() */
 
 
+/* Debug control register (DR7) value for ioregs_init_registers().
+ * Each of DR0-DR3 gets its local enable bit (bits 0, 2, 4, and 6),
+ * plus the local exact breakpoint bit (bit 8).  Each debug register
+ * then gets a four-bit field starting at bit 16: two bits of access
+ * type (01 = write, 11 = read-write) and two bits of length (00 = one
+ * byte).  DR0-DR2 watch for writes and DR3 for reads and writes.
+ */
+#define DR7_REGISTERS 0x31110155UL
+
+/* ioregs_init_registers()
+ *
+ * in:     in_ioregisters - address of ioregisters variable
+ *         child_pid      - PID of the child tracee
+ * out:    ioregs set via side effect
+ * return: nothing
+ *
+ * Call this on startup instead of ioregs_init() to give each IO
+ * register its own one-byte hardware watchpoint rather than watching
+ * the whole ioregisters variable with one:
+ *
+ *   DR0 - writes to the command register
+ *   DR1 - writes to the address register
+ *   DR2 - writes to the data register
+ *   DR3 - reads and writes of the data register
+ *
+ * x86 watchpoints can't watch for reads alone, so the device emulator
+ * recognizes a data register read by DR3 firing without DR2.  Drivers
+ * never read the command and address registers, so we don't watch
+ * for that.  Use ioregs_watchpoints_hit() to learn which watchpoints
+ * fired.
+ *
+ */
+
+void
+ioregs_init_registers(volatile unsigned long *in_ioregisters,
+	pid_t child_pid) {
+
+	/* Offset of the register each debug register watches. */
+	static const unsigned int watched[] = {
+		IOREG_COMMAND, IOREG_ADDRESS, IOREG_DATA, IOREG_DATA
+	};
+	unsigned int dr;  /* index of debug register */
+
+	/* Save address of ioregisters variable in ioregs. */
+	ioregs = in_ioregisters;
+
+	do {    /* Do once, break on error. Poor man's try/catch. */
+
+		/* Put the address of each register in its debug
+		 * register.
+		 */
+		for (dr = 0; dr < 4; dr++) {
+			if (ptrace(PTRACE_POKEUSER, child_pid,
+				offsetof(struct user, u_debugreg) +
+				(dr * sizeof(unsigned long)),
+				(volatile unsigned char *)ioregs + watched[ dr ]))
+				break;
+		}
+		if (dr < 4)
+			break;
+
+		/* Enable the watchpoints. */
+		if (ptrace(PTRACE_POKEUSER, child_pid,
+			offsetof(struct user, u_debugreg) + 56, DR7_REGISTERS))
+			break;
+
+		/* done; success. */
+		return;
+
+	} while (0);
+
+	/* if we reach here, ptrace() failed */
+	perror("Failed ptrace watchpoint setup.");
+	exit(-1);
+
+} /* ioregs_init_registers() */
+
+
+/* ioregs_watchpoints_hit()
+ *
+ * in:     child_pid - PID of the child tracee
+ * out:    nothing
+ * return: the WP_* bits for the watchpoints that fired
+ *
+ * Reads the tracee's debug status register (DR6) after a watchpoint
+ * trap.  Its low four bits say which of DR0-DR3 fired.  The kernel
+ * clears its copy of DR6 on each debug exception, so we needn't.
+ *
+ */
+
+unsigned int
+ioregs_watchpoints_hit(pid_t child_pid) {
+
+	return ptrace(PTRACE_PEEKUSER, child_pid,
+		offsetof(struct user, u_debugreg) + 48, NULL) &
+		(WP_COMMAND | WP_ADDRESS | WP_DATA_WRITE | WP_DATA);
+
+} /* ioregs_watchpoints_hit() */
+
+
+/* ioregs_init_shm()
+ *
+ * in:     in_shm    - address of shared-memory transport page
+ *         child_pid - PID of the child tracee
+ * out:    ioregs, shm set via side effect
+ * return: nothing
+ *
+ * Call this on startup instead of ioregs_init() when main.c has
+ * placed the IO registers in a shared page.  Sets up the same
+ * watchpoint ioregs_init() does so that any direct tracee access to
+ * the registers still traps, but lets ioregs_peek() and ioregs_poke()
+ * reach the registers directly rather than through ptrace().
+ *
+ */
+
+void
+ioregs_init_shm(struct ioregs_shm *in_shm, pid_t child_pid) {
+
+	shm = in_shm;
+	shm->request = 0;
+	shm->ack = 0;
+	ioregs_init(shm->ioregisters, child_pid);
+
+} /* ioregs_init_shm() */
+
+
+/* ioregs_init_in_process()
+ *
+ * in:     in_ioregisters - address of ioregisters variable
+ * out:    ioregs, in_process, watchpoint_fd set via side effect
+ * return: nothing
+ *
+ * Call this on startup instead of ioregs_init() when the device
+ * emulator runs in the same process as the driver.  Asks the kernel
+ * for a hardware watchpoint on our own ioregisters variable through
+ * perf_event_open() rather than through ptrace().  The watchpoint
+ * delivers a synchronous SIGTRAP to this process whenever it reads
+ * or writes ioregisters.  The caller must have installed a SIGTRAP
+ * handler first.
+ *
+ */
+
+void
+ioregs_init_in_process(volatile unsigned long *in_ioregisters) {
+
+	struct perf_event_attr attr;  /* describes the watchpoint */
+
+	/* Save address of ioregisters variable in ioregs. */
+	ioregs = in_ioregisters;
+	in_process = true;
+
+	/* A forked process inherits its parent's watchpoint_fd, but
+	 * not the watchpoint.  Make sure not to pause the parent's.
+	 */
+	if (watchpoint_fd >= 0)
+		close(watchpoint_fd);
+
+	memset(&attr, 0, sizeof(attr));
+	attr.type = PERF_TYPE_BREAKPOINT;
+	attr.size = sizeof(attr);
+	attr.bp_type = HW_BREAKPOINT_RW;
+	attr.bp_addr = (unsigned long)ioregs;
+	attr.bp_len = HW_BREAKPOINT_LEN_8;
+	attr.sample_period = 1;     /* every access, not a sample */
+	attr.exclude_kernel = 1;    /* user-space accesses only */
+	attr.exclude_hv = 1;
+	attr.sigtrap = 1;           /* deliver SIGTRAP synchronously... */
+	attr.remove_on_exec = 1;    /* ...which the kernel requires this */
+
+	watchpoint_fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1,
+		PERF_FLAG_FD_CLOEXEC);
+	if (watchpoint_fd < 0) {
+		perror("Failed perf_event_open() watchpoint setup.");
+		exit(-1);
+	}
+
+} /* ioregs_init_in_process() */
+
+
+/* ioregs_watch_pause()
+ * ioregs_watch_resume()
+ *
+ * in:     nothing
+ * out:    in-process watchpoint disabled or re-enabled
+ * return: nothing
+ *
+ * In in-process mode the device emulator's own accesses to the
+ * ioregisters variable would hit the watchpoint, too.  The SIGTRAP
+ * handler pauses the watchpoint on entry and resumes it on exit.
+ * These functions do nothing in the tracer/tracee modes.
+ *
+ */
+
+void
+ioregs_watch_pause(void) {
+
+	if (in_process)
+		ioctl(watchpoint_fd, PERF_EVENT_IOC_DISABLE, 0);
+
+} /* ioregs_watch_pause() */
+
+void
+ioregs_watch_resume(void) {
+
+	if (in_process)
+		ioctl(watchpoint_fd, PERF_EVENT_IOC_ENABLE, 0);
+
+} /* ioregs_watch_resume() */
+
+
+/* tracee_peekdata()
+ *
+ * in:     child_pid - PID of the child tracee
+ *         addr      - address in the tracee's memory
+ * out:    nothing
+ * return: the unsigned long at addr in the tracee's memory
+ *
+ * Reads tracee memory, directly in in-process mode and with
+ * ptrace() otherwise.
+ *
+ */
+
+unsigned long
+tracee_peekdata(pid_t child_pid, unsigned long addr) {
+
+	if (in_process)
+		return *((unsigned long *)addr);
+	return ptrace(PTRACE_PEEKDATA, child_pid, addr, NULL);
+
+} /* tracee_peekdata() */
+
+
+/* tracee_pokedata()
+ *
+ * in:     child_pid - PID of the child tracee
+ *         addr      - address in the tracee's memory
+ *         value     - new value for the unsigned long at addr
+ * out:    tracee memory updated via side effect
+ * return: nothing
+ *
+ * Writes tracee memory, directly in in-process mode and with
+ * ptrace() otherwise.
+ *
+ */
+
+void
+tracee_pokedata(pid_t child_pid, unsigned long addr, unsigned long value) {
+
+	if (in_process)
+		*((unsigned long *)addr) = value;
+	else
+		ptrace(PTRACE_POKEDATA, child_pid, addr, value);
+
+} /* tracee_pokedata() */
+
+
+/* ioregs_peek()
+ *
+ * in:     child_pid - PID of the child tracee
+ * out:    nothing
+ * return: present value of the tracee's ioregisters variable
+ *
+ * Reads the tracee's ioregisters variable, directly if it lives in
+ * the shared-memory transport page or in our own process and with
+ * ptrace() otherwise.
+ *
+ */
+
+unsigned long
+ioregs_peek(pid_t child_pid) {
+
+	if (shm)
+		return *ioregs;
+	return tracee_peekdata(child_pid, (unsigned long)ioregs);
+
+} /* ioregs_peek() */
+
+
+/* ioregs_poke()
+ *
+ * in:     child_pid - PID of the child tracee
+ *         value     - new value for the tracee's ioregisters variable
+ * out:    tracee's ioregisters variable set via side effect
+ * return: nothing
+ *
+ * Writes the tracee's ioregisters variable, directly if it lives in
+ * the shared-memory transport page or in our own process and with
+ * ptrace() otherwise.
+ *
+ */
+
+void
+ioregs_poke(pid_t child_pid, unsigned long value) {
+
+	if (shm)
+		*ioregs = value;
+	else
+		tracee_pokedata(child_pid, (unsigned long)ioregs, value);
+
+} /* ioregs_poke() */
+
+
+/* ioregs_peek_dma()
+ *
+ * in:     child_pid - PID of the child tracee
+ * out:    p_address - address of the tracee's DMA buffer
+ *         p_length  - number of bytes to transfer
+ * return: nothing
+ *
+ * Reads the tracee's DMA registers, directly if they live in the
+ * shared-memory transport page or in our own process and with
+ * ptrace() otherwise.
+ *
+ */
+
+void
+ioregs_peek_dma(pid_t child_pid, unsigned long *p_address,
+	unsigned long *p_length) {
+
+	volatile unsigned char *base = (volatile unsigned char *)ioregs;
+
+	if (shm || in_process) {
+		*p_address = *((volatile unsigned long *)
+			(base + IOREG_DMA_ADDRESS));
+		*p_length = *((volatile unsigned long *)
+			(base + IOREG_DMA_LENGTH));
+	} else {
+		*p_address = tracee_peekdata(child_pid,
+			(unsigned long)(base + IOREG_DMA_ADDRESS));
+		*p_length = tracee_peekdata(child_pid,
+			(unsigned long)(base + IOREG_DMA_LENGTH));
+	}
+
+} /* ioregs_peek_dma() */
+
+
+/* tracee_read()
+ *
+ * in:     child_pid - PID of the child tracee
+ *         addr      - address of the bytes in the tracee's memory
+ *         length    - number of bytes to read
+ * out:    buffer    - the bytes read
+ * return: 0 on success, -1 on failure
+ *
+ * Copies a run of bytes out of tracee memory in one step, directly in
+ * in-process mode and with process_vm_readv() otherwise.
+ *
+ */
+
+int
+tracee_read(pid_t child_pid, unsigned long addr, unsigned char *buffer,
+	unsigned long length) {
+
+	struct iovec local, remote;  /* describe source and destination */
+
+	if (in_process) {
+		memcpy(buffer, (void *)addr, length);
+		return 0;
+	}
+
+	local.iov_base = buffer;
+	local.iov_len = length;
+	remote.iov_base = (void *)addr;
+	remote.iov_len = length;
+	if (process_vm_readv(child_pid, &local, 1, &remote, 1, 0) !=
+	    (ssize_t)length)
+		return -1;
+	return 0;
+
+} /* tracee_read() */
+
+
+/* tracee_write()
+ *
+ * in:     child_pid - PID of the child tracee
+ *         addr      - address of the bytes in the tracee's memory
+ *         buffer    - the bytes to write
+ *         length    - number of bytes to write
+ * out:    tracee memory updated via side effect
+ * return: 0 on success, -1 on failure
+ *
+ * Copies a run of bytes into tracee memory in one step, directly in
+ * in-process mode and with process_vm_writev() otherwise.
+ *
+ */
+
+int
+tracee_write(pid_t child_pid, unsigned long addr, const unsigned char *buffer,
+	unsigned long length) {
+
+	struct iovec local, remote;  /* describe source and destination */
+
+	if (in_process) {
+		memcpy((void *)addr, buffer, length);
+		return 0;
+	}
+
+	local.iov_base = (void *)buffer;
+	local.iov_len = length;
+	remote.iov_base = (void *)addr;
+	remote.iov_len = length;
+	if (process_vm_writev(child_pid, &local, 1, &remote, 1, 0) !=
+	    (ssize_t)length)
+		return -1;
+	return 0;
+
+} /* tracee_write() */
+
+
+/* ioregs_shm_accept()
+ *
+ * in:     shm - the shared-memory transport mailbox
+ * out:    ioregisters updated via side effect for register writes
+ * return: true if the tracee has posted an access to service,
+ *         otherwise false.
+ *
+ * Checks the shared-memory mailbox for a register access the tracee
+ * has posted but the device emulator has not yet serviced.  If the
+ * access is a write, applies it to the ioregisters word so that the
+ * parser sees exactly what it would have seen had the tracee written
+ * the register directly and hit the watchpoint.  The caller must run
+ * the parser and then call ioregs_shm_complete() to release the tracee.
+ *
+ */
+
+bool
+ioregs_shm_accept(void) {
+
+	if (__atomic_load_n(&(shm->request), __ATOMIC_ACQUIRE) == shm->ack)
+		return false;  /* nothing posted */
+
+	if (shm->op == IOREG_OP_WRITE)
+		((volatile unsigned char *)ioregs)[ shm->offset ] =
+			shm->value;
+	return true;
+
+} /* ioregs_shm_accept() */
+
+
+/* ioregs_shm_complete()
+ *
+ * in:     shm - the shared-memory transport mailbox
+ * out:    mailbox value and ack updated via side effect
+ * return: nothing
+ *
+ * Finishes servicing the access ioregs_shm_accept() reported.  For
+ * reads, hands the tracee the register byte the parser left in the
+ * ioregisters word.  Then acknowledges the access, releasing the
+ * tracee.
+ *
+ */
+
+void
+ioregs_shm_complete(void) {
+
+	if (shm->op == IOREG_OP_READ)
+		shm->value = ((volatile unsigned char *)ioregs)[ shm->offset ];
+	__atomic_store_n(&(shm->ack), shm->request, __ATOMIC_RELEASE);
+
+} /* ioregs_shm_complete() */
+
+
 /* error_dump()
  *
  * in:     bytes   - the undecode-able bytes
@@ -118,7 +638,8 @@ ioregs_init(volatile unsigned long *in_ioregisters, pid_t child_pid) {
  * return: nothing
  *
  * Dumps a diagnostic message containing the bytes we couldn't decode and
- * exits the program.
+ * exits the program.  Masks the displacement of a call or jmp so that
+ * the message is the same however the program happens to be linked.
  *
  */
 
@@ -132,17 +653,173 @@ error_dump(unsigned long bytes, const char *cause_s) {
 	printf("Cause: %s.\n", cause_s);
 	printf("Please include the following program text bytes "
 	       "in a bug report:\n");
-	printf("Program text: %02lx %02lx %02lx %02lx "
-	       "%02lx %02lx %02lx %02lx\n",
-	       BYTE(bytes, 0), BYTE(bytes, 1),
-	       BYTE(bytes, 2), BYTE(bytes, 3),
-	       BYTE(bytes, 4), BYTE(bytes, 5),
-	       BYTE(bytes, 6), BYTE(bytes, 7));
+	if (PATTERN_REL32(bytes))
+		printf("Program text: %02lx %02lx %02lx %02lx "
+		       "xx xx xx xx\n",
+		       BYTE(bytes, 0), BYTE(bytes, 1),
+		       BYTE(bytes, 2), BYTE(bytes, 3));
+	else
+		printf("Program text: %02lx %02lx %02lx %02lx "
+		       "%02lx %02lx %02lx %02lx\n",
+		       BYTE(bytes, 0), BYTE(bytes, 1),
+		       BYTE(bytes, 2), BYTE(bytes, 3),
+		       BYTE(bytes, 4), BYTE(bytes, 5),
+		       BYTE(bytes, 6), BYTE(bytes, 7));
 	exit(-1);
 
 } /* error_dump() */
 
 
+/* decode_cache_lookup()
+ *
+ * in:     rip     - RIP of the tracee after the trapping mov
+ * out:    p_modrm - the cached ModR/M byte, on a hit
+ *         decode_hits, decode_misses updated
+ * return: true on a hit, false on a miss
+ *
+ */
+
+static bool
+decode_cache_lookup(unsigned long rip, unsigned char *p_modrm) {
+
+	unsigned int slot = DECODE_CACHE_HASH(rip);  /* slot to probe */
+	unsigned int probes;                         /* slots probed */
+
+	for (probes = 0; probes < DECODE_CACHE_SIZE; probes++) {
+		if (decode_cache[ slot ].rip == rip) {
+			*p_modrm = decode_cache[ slot ].modrm;
+			decode_hits++;
+			return true;
+		}
+		if (decode_cache[ slot ].rip == 0)
+			break;  /* empty slot; rip isn't in the table */
+		slot = (slot + 1) & (DECODE_CACHE_SIZE - 1);
+	}
+
+	decode_misses++;
+	return false;
+
+} /* decode_cache_lookup() */
+
+
+/* decode_cache_insert()
+ *
+ * in:     rip   - RIP of the tracee after the trapping mov
+ *         modrm - the ModR/M byte decoded for that mov
+ * out:    decode_cache updated, unless full
+ * return: nothing
+ *
+ */
+
+static void
+decode_cache_insert(unsigned long rip, unsigned char modrm) {
+
+	unsigned int slot = DECODE_CACHE_HASH(rip);  /* slot to probe */
+	unsigned int probes;                         /* slots probed */
+
+	for (probes = 0; probes < DECODE_CACHE_SIZE; probes++) {
+		if (decode_cache[ slot ].rip == 0) {
+			decode_cache[ slot ].rip = rip;
+			decode_cache[ slot ].modrm = modrm;
+			return;
+		}
+		slot = (slot + 1) & (DECODE_CACHE_SIZE - 1);
+	}
+
+} /* decode_cache_insert() */
+
+
+/* ioregs_decode_stats()
+ *
+ * in:     nothing
+ * out:    p_hits   - count of decode cache hits
+ *         p_misses - count of decode cache misses
+ * return: nothing
+ *
+ */
+
+void
+ioregs_decode_stats(unsigned long *p_hits, unsigned long *p_misses) {
+
+	*p_hits = decode_hits;
+	*p_misses = decode_misses;
+
+} /* ioregs_decode_stats() */
+
+
+/* decode_mov()
+ *
+ * in:     child_pid - process ID of tracee child process.
+ *         rip       - child tracee RIP at watchpoint activation.
+ * out:    Diagnostic messages to console on failure.
+ * return: the ModR/M byte of the mov that triggered the watchpoint.
+ *
+ * Peeks at and decodes the child tracee's program text preceeding
+ * rip.  See update_tracee_cpu_registers() below for details.  Exits
+ * the program if it can't decode the mov.
+ *
+ */
+
+static unsigned char
+decode_mov(pid_t child_pid, unsigned long rip) {
+
+	unsigned long bytes;   /* bytes containing mov to decode */
+	unsigned char modrm = 0;  /* the mov's ModR/M byte value */
+
+	/* After watchpoint activation, the traccee's instruction
+	 * pointer "rip" points to the instruction *after* the
+	 * instruction that triggered the watchpoint.  We want to
+	 * examine the instruction that triggered the watchpoint, but
+	 * we're not sure how long it is.  We'll peek an unsigned
+	 * long's worth of bytes from the tracee's program text that
+	 * preceeds where rip points.
+	 */
+	bytes = tracee_peekdata(child_pid, rip - sizeof(unsigned long));
+
+	/* Examine the bytes.  If we can unambiguously recognize the
+	 * instruction, pull out the ModR/M byte that will tell us
+	 * which register has the value the mov read.  Otherwise, barf
+	 * out the undecoded bytes so that we can extend this
+	 * disassembler.
+	 */
+	if (PATTERN_MOVZBL(bytes) && PATTERN_MOV(bytes)) {
+
+		/* We've hit an ambiguous situation where the bytes
+		 * could decode to either the movzbl or mov patterns.
+		 * Barf some debug output so we can improve the
+		 * disassembler.
+		 */
+		error_dump(bytes, "ambiguous pattern");
+
+	} else if (PATTERN_MOVZBL(bytes)) {
+
+		/* The bytes have the movzbl pattern.  Extract the
+		 * ModR/M byte.
+		 */
+		modrm = BYTE(bytes, MODRM_MOVZBL);
+
+	} else if (PATTERN_MOV(bytes)) {
+
+		/* The bytes have the mov pattern.  Extract the ModR/M
+		 * byte.
+		 */
+		modrm = BYTE(bytes, MODRM_MOV);
+
+	} else {
+
+		/* The bytes do not have a pattern we recognize.  Barf
+		 * some debug output so we can improve the
+		 * disassembler.
+		 */
+		error_dump(bytes, "unknown pattern");
+		
+	}
+
+	return modrm;
+
+} /* decode_mov() */
+
+
 /* update_tracee_cpu_registers()
  *
  * in:      child_pid - process ID of tracee child process.
@@ -244,6 +921,10 @@ error_dump(unsigned long bytes, const char *cause_s) {
  *     instruction described above to also happen to decode as a
  *     well-formed three-byte movzbl instruction, for example.
  *
+ * Drivers read the data register from the same few instructions
+ * millions of times, so this function caches the ModR/M byte it
+ * decodes for each RIP and only peeks and decodes on a cache miss.
+ *
  */
 
 void
@@ -251,59 +932,16 @@ update_tracee_cpu_registers(pid_t child_pid,
 	struct user_regs_struct *p_regs,
 	unsigned int value) {
 
-	unsigned long bytes;   /* bytes containing mov to decode */
 	unsigned char modrm;   /* the mov's ModR/M byte value */
 	
-	/* After watchpoint activation, the traccee's instruction
-	 * pointer "rip" points to the instruction *after* the
-	 * instruction that triggered the watchpoint.  We want to
-	 * examine the instruction that triggered the watchpoint, but
-	 * we're not sure how long it is.  We'll peek an unsigned
-	 * long's worth of bytes from the tracee's program text that
-	 * preceeds where rip points.
+	/* We've likely decoded the instruction at this RIP before.
+	 * If not, decode it now and remember it.
 	 */
-	bytes = ptrace(PTRACE_PEEKDATA, child_pid,
-		(p_regs->rip - sizeof(unsigned long)), NULL);
-
-	/* Examine the bytes.  If we can unambiguously recognize the
-	 * instruction, pull out the ModR/M byte that will tell us
-	 * which register has the value the mov read.  Otherwise, barf
-	 * out the undecoded bytes so that we can extend this
-	 * disassembler.
-	 */
-	if (PATTERN_MOVZBL(bytes) && PATTERN_MOV(bytes)) {
-
-		/* We've hit an ambiguous situation where the bytes
-		 * could decode to either the movzbl or mov patterns.
-		 * Barf some debug output so we can improve the
-		 * disassembler.
-		 */
-		error_dump(bytes, "ambiguous pattern");
-
-	} else if (PATTERN_MOVZBL(bytes)) {
-
-		/* The bytes have the movzbl pattern.  Extract the
-		 * ModR/M byte.
-		 */
-		modrm = BYTE(bytes, MODRM_MOVZBL);
-
-	} else if (PATTERN_MOV(bytes)) {
-
-		/* The bytes have the mov pattern.  Extract the ModR/M
-		 * byte.
-		 */
-		modrm = BYTE(bytes, MODRM_MOV);
-
-	} else {
-
-		/* The bytes do not have a pattern we recognize.  Barf
-		 * some debug output so we can improve the
-		 * disassembler.
-		 */
-		error_dump(bytes, "unknown pattern");
-		
+	if (!decode_cache_lookup(p_regs->rip, &modrm)) {
+		modrm = decode_mov(child_pid, p_regs->rip);
+		decode_cache_insert(p_regs->rip, modrm);
 	}
-	
+
 	/* Now that we have the ModR/M byte, use it to determine which
 	 * register the mov read the incorrect ioregisters value into
 	 * and set that register to the proper value.
@@ -332,11 +970,17 @@ update_tracee_cpu_registers(pid_t child_pid,
 		/* Should be unreachable if our pattern-recognizing
 		 * macros are correct, but better safe than sorry.
 		 */
-		error_dump(bytes, "unknown ModR/M byte");
+		error_dump(tracee_peekdata(child_pid,
+			p_regs->rip - sizeof(unsigned long)),
+			"unknown ModR/M byte");
 	}
 
-	/* Set the tracee's registers to our updated values. */
-	ptrace(PTRACE_SETREGS, child_pid, NULL, p_regs);
+	/* Set the tracee's registers to our updated values.  In
+	 * in-process mode, our SIGTRAP handler copies them back into
+	 * the interrupted context instead.
+	 */
+	if (!in_process)
+		ptrace(PTRACE_SETREGS, child_pid, NULL, p_regs);
 	return;
 
 } /* update_tracee_cpu_registers() */
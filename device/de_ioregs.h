@@ -10,8 +10,31 @@
 #define COMMAND_SHIFT 16
 #define ADDRESS_SHIFT 8
 
+/* Watchpoints ioregs_init_registers() sets, as DR6 reports them. */
+#define WP_COMMAND    0x1  /* DR0: write to the command register */
+#define WP_ADDRESS    0x2  /* DR1: write to the address register */
+#define WP_DATA_WRITE 0x4  /* DR2: write to the data register */
+#define WP_DATA       0x8  /* DR3: read or write of the data register */
+
+struct ioregs_shm;  /* from device_emu.h */
 
 void ioregs_init(volatile unsigned long *, pid_t);
+void ioregs_init_registers(volatile unsigned long *, pid_t);
+unsigned int ioregs_watchpoints_hit(pid_t);
+void ioregs_init_shm(struct ioregs_shm *, pid_t);
+void ioregs_init_in_process(volatile unsigned long *);
+void ioregs_watch_pause(void);
+void ioregs_watch_resume(void);
+unsigned long tracee_peekdata(pid_t, unsigned long);
+void tracee_pokedata(pid_t, unsigned long, unsigned long);
+unsigned long ioregs_peek(pid_t);
+void ioregs_poke(pid_t, unsigned long);
+void ioregs_peek_dma(pid_t, unsigned long *, unsigned long *);
+int tracee_read(pid_t, unsigned long, unsigned char *, unsigned long);
+int tracee_write(pid_t, unsigned long, const unsigned char *, unsigned long);
+bool ioregs_shm_accept(void);
+void ioregs_shm_complete(void);
+void ioregs_decode_stats(unsigned long *, unsigned long *);
 void update_tracee_cpu_registers(pid_t,	struct user_regs_struct *,
 	unsigned int);
 
@@ -12,13 +12,17 @@
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdlib.h>
+#include <string.h>
 #include <stdio.h> 
 
 #include "device_emu.h"
 #include "clock.h"
+#include "histogram.h"
 #include "de_deadline.h"
 #include "de_store.h"
 #include "de_ioregs.h"
+#include "de_parser.h"
+#include "de_trace.h"
 
 
 /* Device Emulator states */
@@ -42,10 +46,98 @@
 #define MS_ERASE_AWAITING_BLOCK_ADDRESS 0x0000000B
 #define MS_ERASE_AWAITING_EXECUTE       0x0000000C
 
+#define NUM_MS_STATES 0x0000000D
+
 
-static volatile unsigned long *ioregs; /* address of ioregisters variable */
 static unsigned int machine_state;     /* parser finite state machine state */
 
+/* Each chip-enable target has its own parser state.  machine_state
+ * holds the selected target's while the others wait here.
+ */
+static unsigned int target;            /* selected target */
+static unsigned int target_states[ NUM_TARGETS ];
+
+/* Snapshots of every target's parser state and the selected target. */
+static struct {
+	bool taken;                           /* slot holds a snapshot? */
+	unsigned int target;
+	unsigned int target_states[ NUM_TARGETS ];
+} snapshots[ NUM_SNAPSHOTS ];
+
+/* True when separate watchpoints on each IO register tell the parser
+ * exactly which register the driver accessed.
+ */
+static bool precise;
+
+/* While replaying a trace, the buffer that stands in for the driver's
+ * DMA buffer in the next DMA command, and its length.  NULL if none.
+ */
+static unsigned char *replay_dma;
+static unsigned long replay_dma_length;
+
+/* True when parser_init_stats() has asked for histograms of how long
+ * the parser stays in each machine state.  timed_state is the state
+ * the current dwell began in and state_entered when it began.
+ */
+static bool stats;
+static unsigned int timed_state;
+static unsigned long state_entered;
+static struct histogram state_dwell[ NUM_MS_STATES ] = {
+	[ MS_INITIAL_STATE ] = HISTOGRAM_INIT("in initial state"),
+	[ MS_BUG ] = HISTOGRAM_INIT("in bug state"),
+	[ MS_READ_AWAITING_BLOCK_ADDRESS ] =
+		HISTOGRAM_INIT("in read awaiting block address"),
+	[ MS_READ_AWAITING_PAGE_ADDRESS ] =
+		HISTOGRAM_INIT("in read awaiting page address"),
+	[ MS_READ_AWAITING_BYTE_ADDRESS ] =
+		HISTOGRAM_INIT("in read awaiting byte address"),
+	[ MS_READ_AWAITING_EXECUTE ] =
+		HISTOGRAM_INIT("in read awaiting execute"),
+	[ MS_READ_PROVIDING_DATA ] =
+		HISTOGRAM_INIT("in read providing data"),
+	[ MS_PROGRAM_AWAITING_BLOCK_ADDRESS ] =
+		HISTOGRAM_INIT("in program awaiting block address"),
+	[ MS_PROGRAM_AWAITING_PAGE_ADDRESS ] =
+		HISTOGRAM_INIT("in program awaiting page address"),
+	[ MS_PROGRAM_AWAITING_BYTE_ADDRESS ] =
+		HISTOGRAM_INIT("in program awaiting byte address"),
+	[ MS_PROGRAM_ACCEPTING_DATA ] =
+		HISTOGRAM_INIT("in program accepting data"),
+	[ MS_ERASE_AWAITING_BLOCK_ADDRESS ] =
+		HISTOGRAM_INIT("in erase awaiting block address"),
+	[ MS_ERASE_AWAITING_EXECUTE ] =
+		HISTOGRAM_INIT("in erase awaiting execute"),
+};
+
+
+/* time_state()
+ *
+ * in:     nothing
+ * out:    timed_state and state_entered updated, and the dwell in the
+ *         previous state recorded, if collecting statistics
+ * return: nothing
+ *
+ * Call this after anything that may change machine_state.  Dwell is
+ * measured on the real clock, even when the device emulator runs on
+ * virtual time, and spans target switches: it is the time the
+ * selected target spent in a state as the driver saw it.
+ *
+ */
+
+static void
+time_state(void) {
+
+	unsigned long timenow;  /* hist_now() */
+
+	if (!stats || (machine_state == timed_state))
+		return;
+	timenow = hist_now();
+	hist_record(&state_dwell[ timed_state ], timenow - state_entered);
+	timed_state = machine_state;
+	state_entered = timenow;
+
+} /* time_state() */
+
 
 /* clear_state()
  *
@@ -69,30 +161,69 @@ clear_state(void) {
 } /* clear_state() */
 
 
+/* select_target()
+ *
+ * in:     in_target - chip-enable target number, less than NUM_TARGETS
+ * out:    machine_state, target, and target_states updated, plus
+ *         deadline_select() and store_select() side effects
+ * return: nothing
+ *
+ * Sets the selected target's state aside and makes in_target's state
+ * current.
+ *
+ */
+
+static void
+select_target(unsigned int in_target) {
+
+	target_states[ target ] = machine_state;
+	target = in_target;
+	machine_state = target_states[ target ];
+	deadline_select(target);
+	store_select(target);
+	time_state();
+
+} /* select_target() */
+
+
 /* parser_reset()
  *
  * in:     nothing
- * out:    machine_state updated, plus clear_state() side effects
+ * out:    machine_state updated, plus clear_state() side effects on
+ *         every target; target 0 selected
  * return: nothing
  *
  * Clears internal device emulator state and sets machine_state to
- * MS_INITIAL_STATE.  This is the function to call on GPIO reset pin
- * set.
+ * MS_INITIAL_STATE on every target.  This is the function to call on
+ * GPIO reset pin set.
  *
  */
 
 void
 parser_reset(void) {
-	clear_state();
-	machine_state = MS_INITIAL_STATE;
+
+	unsigned int t;  /* indexes targets */
+
+	for (t = NUM_TARGETS; t-- > 0; ) {
+		select_target(t);
+		clear_state();
+		machine_state = MS_INITIAL_STATE;
+	}
+	time_state();
+
 } /* parser_reset() */
 
 
 /* parser_init()
  *
- * in:     in_ioregisters - address of ioregisters variable
- * out:    ioregs set to in_ioregisters
- *         machine_state set to MS_INITIAL_STATE
+ * in:     in_precise - true if separate watchpoints on each IO
+ *                      register will report the driver's accesses
+ *                      through handle_watchpoint_registers(), false
+ *                      if a single watchpoint on the whole
+ *                      ioregisters variable will report them through
+ *                      handle_watchpoint_ioregisters().
+ * out:    machine_state set to MS_INITIAL_STATE
+ *         precise set to in_precise
  *         deadline_init() side effects
  *         store_init() side effects
  *
@@ -103,22 +234,575 @@ parser_reset(void) {
  */
 
 void
-parser_init(volatile unsigned long *in_ioregisters) {
+parser_init(bool in_precise) {
 	
-	ioregs = in_ioregisters;
+	unsigned int t;  /* indexes targets */
+
+	for (t = 0; t < NUM_TARGETS; t++)
+		target_states[ t ] = MS_INITIAL_STATE;
 	machine_state = MS_INITIAL_STATE;
+	target = 0;
+	precise = in_precise;
+	timed_state = MS_INITIAL_STATE;
+	state_entered = (stats ? hist_now() : 0);
+	memset(snapshots, 0, sizeof(snapshots));
 	deadline_init();
 	store_init();
 	
 } /* parser_init() */
 
 
+/* expect_data()
+ *
+ * in:     child_pid - PID of the child tracee
+ * out:    tracee's ioregisters variable may be updated
+ * return: nothing
+ *
+ * Call this when the device begins providing or accepting data.  With
+ * a single watchpoint over the whole ioregisters variable, the parser
+ * can only recognize the driver's subsequent data register accesses
+ * because their traps show the C_DUMMY command we write here.  With
+ * separate watchpoints on each register, the watchpoint that fired
+ * tells us which register the driver touched, so we needn't bother.
+ *
+ */
+
+static void
+expect_data(pid_t child_pid) {
+
+	if (!precise)
+		ioregs_poke(child_pid, C_DUMMY << COMMAND_SHIFT);
+
+} /* expect_data() */
+
+
+/* parser_select()
+ *
+ * in:     child_pid - PID of the child tracee
+ *         in_target - chip-enable target number the driver selected
+ * out:    tracee's ioregisters variable may be updated, plus
+ *         select_target() side effects
+ * return: true on success, false if there is no such target
+ *
+ * This is the function to call on GPIO chip select pin set.  With a
+ * single watchpoint over the whole ioregisters variable, the parser
+ * relies on the command register to tell which register the driver
+ * accessed, and the command register holds whatever the driver last
+ * wrote to the previously selected target.  Put back the command
+ * that the newly selected target's state implies, so that a driver
+ * can return to a target in the middle of an operation.
+ *
+ */
+
+bool
+parser_select(pid_t child_pid, unsigned int in_target) {
+
+	if (in_target >= NUM_TARGETS)
+		return false;
+
+	select_target(in_target);
+	if (precise)
+		return true;
+
+	switch (machine_state) {
+	case MS_READ_AWAITING_BLOCK_ADDRESS:
+	case MS_READ_AWAITING_PAGE_ADDRESS:
+	case MS_READ_AWAITING_BYTE_ADDRESS:
+		ioregs_poke(child_pid, C_READ_SETUP << COMMAND_SHIFT);
+		break;
+	case MS_PROGRAM_AWAITING_BLOCK_ADDRESS:
+	case MS_PROGRAM_AWAITING_PAGE_ADDRESS:
+	case MS_PROGRAM_AWAITING_BYTE_ADDRESS:
+		ioregs_poke(child_pid, C_PROGRAM_SETUP << COMMAND_SHIFT);
+		break;
+	case MS_ERASE_AWAITING_BLOCK_ADDRESS:
+		ioregs_poke(child_pid, C_ERASE_SETUP << COMMAND_SHIFT);
+		break;
+	case MS_READ_PROVIDING_DATA:
+	case MS_PROGRAM_ACCEPTING_DATA:
+		expect_data(child_pid);
+		break;
+	}
+	return true;
+
+} /* parser_select() */
+
+
+/* parser_snapshot()
+ *
+ * in:     slot - snapshot number the driver chose
+ * out:    snapshot slot replaced, plus deadline_snapshot() and
+ *         store_snapshot() side effects
+ * return: true on success, false if there is no such snapshot slot
+ *
+ * This is the function to call on GPIO snapshot pin set.  Saves the
+ * complete state of every target in snapshot slot.
+ *
+ */
+
+bool
+parser_snapshot(unsigned int slot) {
+
+	if (slot >= NUM_SNAPSHOTS)
+		return false;
+
+	target_states[ target ] = machine_state;
+	snapshots[ slot ].taken = true;
+	snapshots[ slot ].target = target;
+	memcpy(snapshots[ slot ].target_states, target_states,
+		sizeof(target_states));
+	deadline_snapshot(slot);
+	store_snapshot(slot);
+	return true;
+
+} /* parser_snapshot() */
+
+
+/* parser_restore()
+ *
+ * in:     child_pid - PID of the child tracee
+ *         slot      - snapshot number the driver chose
+ * out:    every target's state replaced, plus deadline_restore(),
+ *         store_restore(), and parser_select() side effects
+ * return: true on success, false if parser_snapshot() never saved slot
+ *
+ * This is the function to call on GPIO restore pin set.  Returns
+ * every target to the state parser_snapshot() saved in slot and
+ * selects the target that was selected then.
+ *
+ */
+
+bool
+parser_restore(pid_t child_pid, unsigned int slot) {
+
+	if ((slot >= NUM_SNAPSHOTS) || !snapshots[ slot ].taken)
+		return false;
+
+	memcpy(target_states, snapshots[ slot ].target_states,
+		sizeof(target_states));
+	target = snapshots[ slot ].target;
+	machine_state = target_states[ target ];
+	deadline_restore(slot);
+	store_restore(slot);
+	return parser_select(child_pid, target);
+
+} /* parser_restore() */
+
+
+/* parser_init_stats()
+ *
+ * in:     nothing
+ * out:    machine state dwell histograms enabled
+ * return: nothing
+ *
+ * Call this before parser_init().
+ *
+ */
+
+void
+parser_init_stats(void) {
+	stats = true;
+} /* parser_init_stats() */
+
+
+/* parser_print_stats()
+ *
+ * in:     nothing
+ * out:    a dwell histogram to stderr for each machine state entered,
+ *         via hist_print()
+ * return: nothing
+ *
+ */
+
+void
+parser_print_stats(void) {
+
+	unsigned int s;  /* indexes machine states */
+
+	for (s = 0; s < NUM_MS_STATES; s++)
+		hist_print(&state_dwell[ s ]);
+
+} /* parser_print_stats() */
+
+
+/* parser_target()
+ *
+ * in:     nothing
+ * out:    nothing
+ * return: the selected target
+ *
+ */
+
+unsigned int
+parser_target(void) {
+	return target;
+} /* parser_target() */
+
+
+/* parser_state()
+ *
+ * in:     nothing
+ * out:    nothing
+ * return: the selected target's machine state
+ *
+ */
+
+unsigned int
+parser_state(void) {
+	return machine_state;
+} /* parser_state() */
+
+
+/* parser_replay_dma()
+ *
+ * in:     bytes  - buffer for the next DMA command to move bytes to
+ *                  or from
+ *         length - how many bytes it should move
+ * out:    replay_dma and replay_dma_length set via side effect
+ * return: nothing
+ *
+ * A trace replay has no tracee whose DMA registers and buffer a DMA
+ * command could use.  Call this before replaying a DMA command to
+ * have it use bytes instead.
+ *
+ */
+
+void
+parser_replay_dma(unsigned char *bytes, unsigned long length) {
+	replay_dma = bytes;
+	replay_dma_length = length;
+} /* parser_replay_dma() */
+
+
+/* transfer_dma()
+ *
+ * in:     child_pid - PID of the child tracee
+ *         to_driver - true to copy cache bytes into the driver's
+ *                     buffer, false to copy the driver's buffer into
+ *                     cache
+ * out:    cache, cursor, and the driver's buffer updated as that many
+ *         data register reads or writes would update them, plus
+ *         trace_dma() side effects
+ * return: true on success, false if the DMA registers describe a
+ *         transfer longer than a page or a buffer we can't reach
+ *
+ * Carries out a C_READ_DMA or C_PROGRAM_DMA command using the buffer
+ * address and length the driver left in its DMA registers, or the
+ * buffer parser_replay_dma() provided.
+ *
+ */
+
+static bool
+transfer_dma(pid_t child_pid, bool to_driver) {
+
+	static unsigned char buffer[ MAX_NUM_BYTES ];  /* bytes in transit */
+	unsigned char *bytes = buffer;      /* driver's bytes, here */
+	unsigned long address, length;      /* driver's DMA registers */
+
+	if (replay_dma) {
+		bytes = replay_dma;
+		length = replay_dma_length;
+		replay_dma = NULL;
+	} else {
+		ioregs_peek_dma(child_pid, &address, &length);
+	}
+	if (length > NUM_BYTES)
+		return false;
+
+	if (to_driver) {
+		store_get_cache_bytes(bytes, length);
+		if ((bytes == buffer) &&
+		    tracee_write(child_pid, address, bytes, length))
+			return false;
+	} else {
+		if ((bytes == buffer) &&
+		    tracee_read(child_pid, address, bytes, length))
+			return false;
+		store_set_cache_bytes(bytes, length);
+	}
+	trace_dma(bytes, length);
+	return true;
+
+} /* transfer_dma() */
+
+
+/* Inputs: the events handle_ioregs_event() receives, with command
+ * register writes told apart by command.  IN_OTHER_COMMAND is zero so
+ * that command_inputs[] maps every command it doesn't list to it.
+ */
+#define IN_OTHER_COMMAND   0x00
+#define IN_READ_SETUP      0x01
+#define IN_READ_EXECUTE    0x02
+#define IN_READ_DMA        0x03
+#define IN_PROGRAM_SETUP   0x04
+#define IN_PROGRAM_EXECUTE 0x05
+#define IN_PROGRAM_DMA     0x06
+#define IN_ERASE_SETUP     0x07
+#define IN_ERASE_EXECUTE   0x08
+#define IN_ADDRESS         0x09
+#define IN_DATA_WRITE      0x0A
+#define IN_DATA_READ       0x0B
+#define NUM_INPUTS         0x0C
+
+static const unsigned char command_inputs[ 256 ] = {
+	[ C_READ_SETUP ]      = IN_READ_SETUP,
+	[ C_READ_EXECUTE ]    = IN_READ_EXECUTE,
+	[ C_READ_DMA ]        = IN_READ_DMA,
+	[ C_PROGRAM_SETUP ]   = IN_PROGRAM_SETUP,
+	[ C_PROGRAM_EXECUTE ] = IN_PROGRAM_EXECUTE,
+	[ C_PROGRAM_DMA ]     = IN_PROGRAM_DMA,
+	[ C_ERASE_SETUP ]     = IN_ERASE_SETUP,
+	[ C_ERASE_EXECUTE ]   = IN_ERASE_EXECUTE,
+};
+
+static const unsigned char event_inputs[] = {
+	[ EV_ADDRESS ]    = IN_ADDRESS,
+	[ EV_DATA_WRITE ] = IN_DATA_WRITE,
+	[ EV_DATA_READ ]  = IN_DATA_READ,
+};
+
+
+/* Transition actions: the processing each transition in the
+ * transitions[] table below carries out on its way to its next state.
+ * A_BUG is zero so that any (state, input) pair the table leaves out
+ * sends the device to MS_BUG.
+ */
+#define A_BUG                0x00
+#define A_START              0x01  /* begin a new operation */
+#define A_BLOCK_CYCLE        0x02  /* accept a block address cycle */
+#define A_PAGE_CYCLE         0x03  /* accept a page address cycle */
+#define A_BYTE_CYCLE         0x04  /* accept a byte address cycle */
+#define A_PROGRAM_BYTE_CYCLE 0x05  /* ditto, then accept data */
+#define A_READ_EXECUTE       0x06  /* read page into cache */
+#define A_READ_DMA           0x07  /* copy cache to driver's buffer */
+#define A_READ_DATA          0x08  /* provide a cache byte */
+#define A_PROGRAM_DATA       0x09  /* accept a cache byte */
+#define A_PROGRAM_EXECUTE    0x0A  /* program cache into page */
+#define A_PROGRAM_DMA        0x0B  /* copy driver's buffer to cache */
+#define A_ERASE_EXECUTE      0x0C  /* erase block */
+
+
+/* read_data()
+ *
+ * in:     child_pid - PID of the child tracee
+ *         p_regs    - the tracee's CPU registers, or NULL if the
+ *                     access came through the shared-memory mailbox
+ * out:    tracee's CPU registers or ioregisters variable updated to
+ *         give the driver the next cache byte, cursor incremented
+ * return: the cache byte
+ *
+ */
+
+static unsigned char
+read_data(pid_t child_pid, struct user_regs_struct *p_regs) {
+
+	unsigned char cache_byte;
+	unsigned int return_value;
+
+	cache_byte = store_get_cache_byte();
+	if (precise) {
+		return_value = cache_byte;
+	} else {
+		return_value = (C_DUMMY << COMMAND_SHIFT) | cache_byte;
+		ioregs_poke(child_pid, return_value);
+	}
+	/* Make the child tracee believe it has read return_value from
+	 * its data register.
+	 */
+	if (p_regs)
+		update_tracee_cpu_registers(child_pid, p_regs, return_value);
+
+	increment_cursor(false);
+	return cache_byte;
+
+} /* read_data() */
+
+
+/* The device's state machine as a table of (state, input) -> (action,
+ * next state) transitions.  Any (state, input) pair the table leaves
+ * out has the A_BUG action and sends the device to MS_BUG.  See the
+ * manual for the state machine this table implements.
+ */
+struct transition {
+	unsigned char action;  /* one of the A_* actions */
+	unsigned char next;    /* one of the MS_* states */
+};
+
+/* The device accepts a setup command that begins a new operation in
+ * its initial state and in every state in which an operation may be
+ * finished.
+ */
+#define SETUP_TRANSITIONS(state)                                           \
+	[ state ][ IN_READ_SETUP ] =                                       \
+		{ A_START, MS_READ_AWAITING_BLOCK_ADDRESS },               \
+	[ state ][ IN_PROGRAM_SETUP ] =                                    \
+		{ A_START, MS_PROGRAM_AWAITING_BLOCK_ADDRESS },            \
+	[ state ][ IN_ERASE_SETUP ] =                                      \
+		{ A_START, MS_ERASE_AWAITING_BLOCK_ADDRESS }
+
+static const struct transition transitions[ NUM_MS_STATES ][ NUM_INPUTS ] = {
+	SETUP_TRANSITIONS(MS_INITIAL_STATE),
+
+	[ MS_READ_AWAITING_BLOCK_ADDRESS ][ IN_ADDRESS ] =
+		{ A_BLOCK_CYCLE, MS_READ_AWAITING_PAGE_ADDRESS },
+	[ MS_READ_AWAITING_PAGE_ADDRESS ][ IN_ADDRESS ] =
+		{ A_PAGE_CYCLE, MS_READ_AWAITING_BYTE_ADDRESS },
+	[ MS_READ_AWAITING_BYTE_ADDRESS ][ IN_ADDRESS ] =
+		{ A_BYTE_CYCLE, MS_READ_AWAITING_EXECUTE },
+	[ MS_READ_AWAITING_EXECUTE ][ IN_READ_EXECUTE ] =
+		{ A_READ_EXECUTE, MS_READ_PROVIDING_DATA },
+	[ MS_READ_PROVIDING_DATA ][ IN_DATA_READ ] =
+		{ A_READ_DATA, MS_READ_PROVIDING_DATA },
+	[ MS_READ_PROVIDING_DATA ][ IN_READ_EXECUTE ] =
+		{ A_READ_EXECUTE, MS_READ_PROVIDING_DATA },
+	[ MS_READ_PROVIDING_DATA ][ IN_READ_DMA ] =
+		{ A_READ_DMA, MS_READ_PROVIDING_DATA },
+	SETUP_TRANSITIONS(MS_READ_PROVIDING_DATA),
+
+	[ MS_PROGRAM_AWAITING_BLOCK_ADDRESS ][ IN_ADDRESS ] =
+		{ A_BLOCK_CYCLE, MS_PROGRAM_AWAITING_PAGE_ADDRESS },
+	[ MS_PROGRAM_AWAITING_PAGE_ADDRESS ][ IN_ADDRESS ] =
+		{ A_PAGE_CYCLE, MS_PROGRAM_AWAITING_BYTE_ADDRESS },
+	[ MS_PROGRAM_AWAITING_BYTE_ADDRESS ][ IN_ADDRESS ] =
+		{ A_PROGRAM_BYTE_CYCLE, MS_PROGRAM_ACCEPTING_DATA },
+	[ MS_PROGRAM_ACCEPTING_DATA ][ IN_DATA_WRITE ] =
+		{ A_PROGRAM_DATA, MS_PROGRAM_ACCEPTING_DATA },
+	[ MS_PROGRAM_ACCEPTING_DATA ][ IN_PROGRAM_EXECUTE ] =
+		{ A_PROGRAM_EXECUTE, MS_PROGRAM_ACCEPTING_DATA },
+	[ MS_PROGRAM_ACCEPTING_DATA ][ IN_PROGRAM_DMA ] =
+		{ A_PROGRAM_DMA, MS_PROGRAM_ACCEPTING_DATA },
+	SETUP_TRANSITIONS(MS_PROGRAM_ACCEPTING_DATA),
+
+	[ MS_ERASE_AWAITING_BLOCK_ADDRESS ][ IN_ADDRESS ] =
+		{ A_BLOCK_CYCLE, MS_ERASE_AWAITING_EXECUTE },
+	[ MS_ERASE_AWAITING_EXECUTE ][ IN_ERASE_EXECUTE ] =
+		{ A_ERASE_EXECUTE, MS_ERASE_AWAITING_EXECUTE },
+	SETUP_TRANSITIONS(MS_ERASE_AWAITING_EXECUTE),
+};
+
+/* The states in which the device may be busy.  Only the execute
+ * actions set a deadline, and they all lead to one of these states;
+ * A_START clears the deadline on the way out of them.  In every other
+ * state the device is always ready, so there's no need to look at the
+ * clock.  A new transition that sets a deadline must add the state it
+ * leads to here.
+ */
+static const bool busy_states[ NUM_MS_STATES ] = {
+	[ MS_READ_PROVIDING_DATA ]    = true,
+	[ MS_PROGRAM_ACCEPTING_DATA ] = true,
+	[ MS_ERASE_AWAITING_EXECUTE ] = true,
+};
+
+
+/* take_transition()
+ *
+ * in:     see handle_ioregs_event()
+ * out:    see handle_ioregs_event()
+ * return: for EV_DATA_READ, the byte the driver read, otherwise 0.
+ *
+ * Looks the event up in the transitions[] table, carries out the
+ * action it finds there, and enters the next state.
+ *
+ */
+
+static unsigned char
+take_transition(pid_t child_pid, struct user_regs_struct *p_regs,
+	unsigned int event, unsigned char value) {
+
+	const struct transition *p_t;  /* the transition to take */
+	unsigned int input;            /* event, told apart by command */
+	unsigned char returned = 0;    /* byte the driver read */
+
+	if (busy_states[ machine_state ] && before_deadline()) {
+		machine_state = MS_BUG;
+		return 0;
+	}
+
+	input = ((event == EV_COMMAND) ?
+		command_inputs[ value ] : event_inputs[ event ]);
+	p_t = &transitions[ machine_state ][ input ];
+
+	switch (p_t->action) {
+	case A_START:
+		/* A new setup command abandons any earlier operation. */
+		clear_state();
+		break;
+	case A_BLOCK_CYCLE:
+		if (!set_cursor_cycle(CURSOR_BLOCK, value))
+			return 0;
+		break;
+	case A_PAGE_CYCLE:
+		if (!set_cursor_cycle(CURSOR_PAGE, value))
+			return 0;
+		break;
+	case A_BYTE_CYCLE:
+		if (!set_cursor_cycle(CURSOR_BYTE, value))
+			return 0;
+		break;
+	case A_PROGRAM_BYTE_CYCLE:
+		if (!set_cursor_cycle(CURSOR_BYTE, value))
+			return 0;
+		expect_data(child_pid);
+		break;
+	case A_READ_EXECUTE:
+		set_deadline(READ_PAGE_DURATION);
+		store_copy_page_to_cache();
+		expect_data(child_pid);
+		break;
+	case A_READ_DMA:
+		if (!transfer_dma(child_pid, true)) {
+			machine_state = MS_BUG;
+			return 0;
+		}
+		expect_data(child_pid);
+		break;
+	case A_READ_DATA:
+		returned = read_data(child_pid, p_regs);
+		break;
+	case A_PROGRAM_DATA:
+		store_set_cache_byte(value);
+		increment_cursor(true);
+		break;
+	case A_PROGRAM_EXECUTE:
+		set_deadline(WRITE_PAGE_DURATION);
+		store_copy_page_from_cache();
+		store_clear_cache();
+		increment_page();
+		expect_data(child_pid);
+		break;
+	case A_PROGRAM_DMA:
+		if (!transfer_dma(child_pid, false)) {
+			machine_state = MS_BUG;
+			return 0;
+		}
+		expect_data(child_pid);
+		break;
+	case A_ERASE_EXECUTE:
+		set_deadline(ERASE_BLOCK_DURATION);
+		store_erase_block();
+		expect_data(child_pid);
+		increment_block();
+		break;
+	default:
+		machine_state = MS_BUG;
+		return 0;
+	}
+	machine_state = p_t->next;
+	return returned;
+
+} /* take_transition() */
+
+
 /*
- * handle_watchpoint_ioregisters()
+ * handle_ioregs_event()
  *
  * in:  child_pid - PID of the child tracee
  *      p_regs    - pointer to register struct containing tracee's
- *                  register values
+ *                  register values, or NULL if the access came
+ *                  through the shared-memory transport mailbox
+ *      event     - which register the driver accessed and how, one
+ *                  of the EV_* values from de_parser.h
+ *      value     - for writes, the byte the driver wrote
  * out: p_regs    - registers may be updated to change value read from
  *                  ioregisters
  *      machine_state - may be updated based on IO register inputs
@@ -126,12 +810,70 @@ parser_init(volatile unsigned long *in_ioregisters) {
  *      cache         - may be updated based on IO register inputs
  *      data_store    - may be updated based on IO register inputs
  *      deadline      - may be set based on IO register inputs
+ *      trace         - event recorded, if tracing
+ * return: for EV_DATA_READ, the byte the driver read, otherwise 0.
+ *
+ * This function implements the device's state machine in terms of
+ * register-level events: the driver wrote the command register, wrote
+ * the address register, wrote the data register, or read the data
+ * register.  It looks the event up in the transitions[] table, carries
+ * out the action it finds there, and enters the next state, except
+ * that an address cycle leaves the state alone until the address is
+ * complete.  Any event that arrives while the device is busy is a
+ * bug.
+ *
+ * This function is the one source of truth for the device protocol
+ * regardless of transport.  Accesses that arrive through the
+ * shared-memory mailbox rather than a watchpoint trap come here with
+ * no tracee CPU registers to fix up; the mailbox hands the tracee the
+ * value this function leaves in the ioregisters word instead.
+ */
+
+unsigned char
+handle_ioregs_event(pid_t child_pid, struct user_regs_struct *p_regs,
+	unsigned int event, unsigned char value) {
+
+	unsigned char returned;  /* byte the driver read */
+
+#ifdef DIAGNOSTICS
+	printf("Device emulator %s in state %02u received "
+	       "event %u, value 0x%02x.\n",
+	       (before_deadline() ? "busy" : "ready"),
+	       machine_state, event, value);
+#endif
+
+	if (machine_state == MS_BUG) {
+		printf("device emulator: in machine state bug.\n");
+		exit(1);
+	}
+
+	returned = take_transition(child_pid, p_regs, event, value);
+	trace_event(event, value, returned, machine_state);
+	time_state();
+	return returned;
+
+} /* handle_ioregs_event() */
+
+
+/*
+ * handle_watchpoint_ioregisters()
+ *
+ * in:  child_pid - PID of the child tracee
+ *      p_regs    - pointer to register struct containing tracee's
+ *                  register values, or NULL if the access came
+ *                  through the shared-memory transport mailbox
+ * out: see handle_ioregs_event()
  * return: nothing
  *
  * This function handles tracee reads and writes to the ioregisters
- * variable.  It implements a state machine that determines how to
- * handle the values in the ioregister variable. See the manual for
- * details on this state machine.
+ * variable when a single watchpoint covers all three registers and
+ * so tells us only that the driver touched one of them.  It works out
+ * which register the driver most likely touched by a process of
+ * elimination based on the parser's state and the command register,
+ * relying on the C_DUMMY command expect_data() leaves there while the
+ * device provides or accepts data, and passes the resulting event to
+ * handle_ioregs_event().
+ *
  */
 
 void
@@ -139,269 +881,121 @@ handle_watchpoint_ioregisters(pid_t child_pid,
 	struct user_regs_struct *p_regs) {
 
 	unsigned int peeked;
-	unsigned int command;
-	unsigned char cache_byte;
-	unsigned int return_value;
-				  
-	peeked = ptrace(PTRACE_PEEKDATA, child_pid, ioregs, NULL);
+	unsigned char command;
+	unsigned char address;
+
+	peeked = ioregs_peek(child_pid);
 	command = (peeked & MASK_COMMAND) >> COMMAND_SHIFT;
+	address = (peeked & MASK_ADDRESS) >> ADDRESS_SHIFT;
 
-#ifdef DIAGNOSTICS	
+#ifdef DIAGNOSTICS
 	printf("Device emulator %s in state %02u received "
 	       "C=%02u, A=0x%02x, D=0x%02x.\n",
 	       (before_deadline() ? "busy" : "ready"),
-	       machine_state, command,
-	       (peeked & MASK_ADDRESS) >> ADDRESS_SHIFT,
-	       (peeked & MASK_DATA));
+	       machine_state, command, address, (peeked & MASK_DATA));
 #endif
-	
-	switch (machine_state) {
-	case MS_INITIAL_STATE:
-		switch (command) {
-		case C_READ_SETUP:
-			machine_state = MS_READ_AWAITING_BLOCK_ADDRESS;
-			break;
-		case C_PROGRAM_SETUP:
-			machine_state = MS_PROGRAM_AWAITING_BLOCK_ADDRESS;
-			break;
-		case C_ERASE_SETUP:
-			machine_state = MS_ERASE_AWAITING_BLOCK_ADDRESS;
-			break;
-		default:
-			machine_state = MS_BUG;
-			break;
-		}
-		break;
 
-	case MS_READ_AWAITING_BLOCK_ADDRESS:
-		if (before_deadline() || (command != C_READ_SETUP)) {
-			machine_state = MS_BUG;
-		} else {
-			set_cursor_byte((peeked & MASK_ADDRESS)
-				>> ADDRESS_SHIFT, CURSOR_BLOCK_SHIFT);
-			machine_state = MS_READ_AWAITING_PAGE_ADDRESS;
+	/* C_DUMMY in the command register means the driver is
+	 * reading or writing data, depending on which way the data is
+	 * flowing.
+	 */
+	if (command == C_DUMMY) {
+		if (machine_state == MS_READ_PROVIDING_DATA) {
+			handle_ioregs_event(child_pid, p_regs,
+				EV_DATA_READ, 0);
+			return;
 		}
-		break;
-
-	case MS_READ_AWAITING_PAGE_ADDRESS:
-		if (before_deadline() || (command != C_READ_SETUP)) {
-			machine_state = MS_BUG;
-		} else {
-			set_cursor_byte((peeked & MASK_ADDRESS)
-				>> ADDRESS_SHIFT, CURSOR_PAGE_SHIFT);
-			machine_state = MS_READ_AWAITING_BYTE_ADDRESS;
+		if (machine_state == MS_PROGRAM_ACCEPTING_DATA) {
+			handle_ioregs_event(child_pid, p_regs,
+				EV_DATA_WRITE, peeked & MASK_DATA);
+			return;
 		}
-		break;
+	}
 
+	/* While the parser awaits an address, the setup command
+	 * remaining in the command register means the driver is
+	 * writing the address register.
+	 */
+	switch (machine_state) {
+	case MS_READ_AWAITING_BLOCK_ADDRESS:
+	case MS_READ_AWAITING_PAGE_ADDRESS:
 	case MS_READ_AWAITING_BYTE_ADDRESS:
-		if (before_deadline() || (command != C_READ_SETUP)) {
-			machine_state = MS_BUG;
-		} else {
-			set_cursor_byte((peeked & MASK_ADDRESS)
-				>> ADDRESS_SHIFT, CURSOR_BYTE_SHIFT);
-			machine_state = MS_READ_AWAITING_EXECUTE;
+		if (command == C_READ_SETUP) {
+			handle_ioregs_event(child_pid, p_regs,
+				EV_ADDRESS, address);
+			return;
 		}
 		break;
-
-	case MS_READ_AWAITING_EXECUTE:
-		if (before_deadline() || (command != C_READ_EXECUTE)) {
-			machine_state = MS_BUG;
-		} else {
-			set_deadline(READ_PAGE_DURATION);
-			store_copy_page_to_cache();
-			machine_state = MS_READ_PROVIDING_DATA;
-
-			ptrace(PTRACE_POKEDATA,
-			       child_pid,
-			       ioregs,
-			       C_DUMMY << COMMAND_SHIFT);
+	case MS_PROGRAM_AWAITING_BLOCK_ADDRESS:
+	case MS_PROGRAM_AWAITING_PAGE_ADDRESS:
+	case MS_PROGRAM_AWAITING_BYTE_ADDRESS:
+		if (command == C_PROGRAM_SETUP) {
+			handle_ioregs_event(child_pid, p_regs,
+				EV_ADDRESS, address);
+			return;
 		}
 		break;
-
-	case MS_READ_PROVIDING_DATA:
-		if (before_deadline()) {
-			machine_state = MS_BUG;
-		} else {
-			switch (command) {
-			case C_DUMMY:
-				cache_byte = store_get_cache_byte();
-				return_value = (C_DUMMY << COMMAND_SHIFT)
-					| cache_byte;
-				/* Make the child tracee believe it has read
-				 * return_value from its data register.
-				 */
-				ptrace(PTRACE_POKEDATA,
-				       child_pid,
-				       ioregs,
-				       return_value);
-				update_tracee_cpu_registers(child_pid, p_regs,
-					return_value);
-				
-				increment_cursor(false);
-				break;
-			case C_READ_EXECUTE:
-				set_deadline(READ_PAGE_DURATION);
-				store_copy_page_to_cache();
-				machine_state = MS_READ_PROVIDING_DATA;
-
-				ptrace(PTRACE_POKEDATA,
-				       child_pid,
-				       ioregs,
-				       C_DUMMY << COMMAND_SHIFT);
-				break;
-			case C_READ_SETUP:
-				clear_state();
-				machine_state = MS_READ_AWAITING_BLOCK_ADDRESS;
-				break;
-			case C_PROGRAM_SETUP:
-				clear_state();
-				machine_state =
-					MS_PROGRAM_AWAITING_BLOCK_ADDRESS;
-				break;
-			case C_ERASE_SETUP:
-				clear_state();
-				machine_state = MS_ERASE_AWAITING_BLOCK_ADDRESS;
-				break;
-			default:
-				machine_state = MS_BUG;
-				break;
-			}
+	case MS_ERASE_AWAITING_BLOCK_ADDRESS:
+		if (command == C_ERASE_SETUP) {
+			handle_ioregs_event(child_pid, p_regs,
+				EV_ADDRESS, address);
+			return;
 		}
 		break;
+	}
 
-	case MS_PROGRAM_AWAITING_BLOCK_ADDRESS:
-		if (before_deadline() || (command != C_PROGRAM_SETUP)) {
-			machine_state = MS_BUG;
-		} else {
-			set_cursor_byte((peeked & MASK_ADDRESS)
-				>> ADDRESS_SHIFT, CURSOR_BLOCK_SHIFT);
-			machine_state = MS_PROGRAM_AWAITING_PAGE_ADDRESS;
-		}
-		break;
+	/* Otherwise, the driver is writing the command register. */
+	handle_ioregs_event(child_pid, p_regs, EV_COMMAND, command);
 
-	case MS_PROGRAM_AWAITING_PAGE_ADDRESS:
-		if (before_deadline() || (command != C_PROGRAM_SETUP)) {
-			machine_state = MS_BUG;
-		} else {
-			set_cursor_byte((peeked & MASK_ADDRESS) >>ADDRESS_SHIFT,
-					CURSOR_PAGE_SHIFT);
-			machine_state = MS_PROGRAM_AWAITING_BYTE_ADDRESS;
-		}
-		break;
+} /* handle_watchpoint_ioregisters() */
 
-	case MS_PROGRAM_AWAITING_BYTE_ADDRESS:
-		if (before_deadline() || (command != C_PROGRAM_SETUP)) {
-			machine_state = MS_BUG;
-		} else {
-			set_cursor_byte((peeked & MASK_ADDRESS)
-				>> ADDRESS_SHIFT, CURSOR_BYTE_SHIFT);
-			machine_state = MS_PROGRAM_ACCEPTING_DATA;
-
-			ptrace(PTRACE_POKEDATA,
-			       child_pid,
-			       ioregs,
-			       C_DUMMY << COMMAND_SHIFT);
-		}
-		break;
 
-	case MS_PROGRAM_ACCEPTING_DATA:
-		if (before_deadline()) {
-			machine_state = MS_BUG;
-		} else {
-			switch (command) {
-			case C_DUMMY:
-				store_set_cache_byte(peeked & MASK_DATA);
-				increment_cursor(true);
-				break;
-			case C_PROGRAM_EXECUTE:
-				set_deadline(WRITE_PAGE_DURATION);
-				store_copy_page_from_cache();
-				store_clear_cache();
-				increment_page();
-
-				ptrace(PTRACE_POKEDATA,
-				       child_pid,
-				       ioregs,
-				       C_DUMMY << COMMAND_SHIFT);
-
-				break;
-			case C_READ_SETUP:
-				clear_state();
-				machine_state = MS_READ_AWAITING_BLOCK_ADDRESS;
-				break;
-			case C_PROGRAM_SETUP:
-                                clear_state();
-                                machine_state =
-					MS_PROGRAM_AWAITING_BLOCK_ADDRESS;
-                                break;
-			case C_ERASE_SETUP:
-				clear_state();
-				machine_state =
-					MS_ERASE_AWAITING_BLOCK_ADDRESS;
-				break;
-			default:
-				machine_state = MS_BUG;
-				break;
-			}
-		}
-		break;
+/*
+ * handle_watchpoint_registers()
+ *
+ * in:  child_pid - PID of the child tracee
+ *      p_regs    - pointer to register struct containing tracee's
+ *                  register values
+ *      hit       - the WP_* watchpoints that fired, from
+ *                  ioregs_watchpoints_hit()
+ * out: see handle_ioregs_event()
+ * return: nothing
+ *
+ * This function handles tracee reads and writes to the ioregisters
+ * variable when separate watchpoints cover each register.  The
+ * watchpoints that fired say exactly which register the driver touched
+ * and whether it read or wrote the data register, so there's no need
+ * for guesswork and no need to peek at the registers at all for data
+ * reads.  If the driver touched several registers with a single
+ * instruction, we fall back to handle_watchpoint_ioregisters().
+ *
+ */
 
-	case MS_ERASE_AWAITING_BLOCK_ADDRESS:
-		if (before_deadline() || (command != C_ERASE_SETUP)) {
-			machine_state = MS_BUG;
-		} else {
-			set_cursor_byte((peeked & MASK_ADDRESS)
-				>> ADDRESS_SHIFT, CURSOR_BLOCK_SHIFT);
-			machine_state = MS_ERASE_AWAITING_EXECUTE;
-		}
+void
+handle_watchpoint_registers(pid_t child_pid,
+	struct user_regs_struct *p_regs, unsigned int hit) {
+
+	switch (hit) {
+	case WP_COMMAND:
+		handle_ioregs_event(child_pid, p_regs, EV_COMMAND,
+			(ioregs_peek(child_pid) & MASK_COMMAND)
+			>> COMMAND_SHIFT);
 		break;
-
-	case MS_ERASE_AWAITING_EXECUTE:
-		if (before_deadline()) {
-			machine_state = MS_BUG;
-		} else {
-			switch (command) {
-			case C_ERASE_EXECUTE:
-				set_deadline(ERASE_BLOCK_DURATION);
-				store_erase_block();
-
-				ptrace(PTRACE_POKEDATA,
-				       child_pid,
-				       ioregs,
-				       C_DUMMY << COMMAND_SHIFT);
-
-				increment_block();
-				break;
-			case C_READ_SETUP:
-				clear_state();
-				machine_state = MS_READ_AWAITING_BLOCK_ADDRESS;
-				break;
-			case C_PROGRAM_SETUP:
-				clear_state();
-				machine_state =
-					MS_PROGRAM_AWAITING_BLOCK_ADDRESS;
-				break;
-			case C_ERASE_SETUP:
-				clear_state();
-				machine_state =
-					MS_ERASE_AWAITING_BLOCK_ADDRESS;
-				break;
-			default:
-				machine_state = MS_BUG;
-				break;
-			}
-		}
+	case WP_ADDRESS:
+		handle_ioregs_event(child_pid, p_regs, EV_ADDRESS,
+			(ioregs_peek(child_pid) & MASK_ADDRESS)
+			>> ADDRESS_SHIFT);
 		break;
-
-	case MS_BUG:
-		printf("device emulator: in machine state bug.\n");
-		exit(1);
+	case (WP_DATA_WRITE | WP_DATA):
+		handle_ioregs_event(child_pid, p_regs, EV_DATA_WRITE,
+			ioregs_peek(child_pid) & MASK_DATA);
+		break;
+	case WP_DATA:
+		handle_ioregs_event(child_pid, p_regs, EV_DATA_READ, 0);
 		break;
-
 	default:
-		machine_state = MS_BUG;
-		printf("device emulator: in machine state bug.\n");
-		exit(1);
+		handle_watchpoint_ioregisters(child_pid, p_regs);
 		break;
 	}
-}
+
+} /* handle_watchpoint_registers() */
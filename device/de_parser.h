@@ -1,8 +1,26 @@
 #ifndef _DE_PARSER_H_
 #define _DE_PARSER_H_
 
+/* IO register events: which register the driver accessed and how. */
+#define EV_COMMAND    0  /* driver wrote the command register */
+#define EV_ADDRESS    1  /* driver wrote the address register */
+#define EV_DATA_WRITE 2  /* driver wrote the data register */
+#define EV_DATA_READ  3  /* driver read the data register */
+
 void parser_reset(void);
-void parser_init(volatile unsigned long *);
+void parser_init(bool);
+bool parser_select(pid_t, unsigned int);
+bool parser_snapshot(unsigned int);
+bool parser_restore(pid_t, unsigned int);
+unsigned int parser_target(void);
+unsigned int parser_state(void);
+void parser_replay_dma(unsigned char *, unsigned long);
+void parser_init_stats(void);
+void parser_print_stats(void);
+unsigned char handle_ioregs_event(pid_t, struct user_regs_struct *,
+	unsigned int, unsigned char);
 void handle_watchpoint_ioregisters(pid_t, struct user_regs_struct *);
+void handle_watchpoint_registers(pid_t, struct user_regs_struct *,
+	unsigned int);
 
 #endif
@@ -5,21 +5,117 @@
  *
  */
 
+#define _GNU_SOURCE  /* for fallocate() */
+
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 #include <stdbool.h>
+#include <stdlib.h>
 #include <string.h>
+#include <stdio.h>
+#include <unistd.h>
 
 #include "device_emu.h"
 #include "de_store.h"
 
-/* cursor */
-static unsigned int cursor = 0;
+/* The data store is sparse.  Each target has a table of blocks, and
+ * each block a table of pages, and both are allocated only when the
+ * driver first programs a page in them.  A bitmap in each block
+ * records which of its pages hold programmed data; every other page
+ * reads as all-zeroes without any backing memory.  Erasing a block
+ * simply clears its bitmap, keeping the page memory for reuse.
+ * store_init() sizes the tables for the geometry in effect.
+ *
+ * Blocks and pages are reference-counted so that snapshots can share
+ * them with the live data store.  Taking a snapshot copies only the
+ * targets' tables of blocks.  Programming a page in a shared block
+ * first gives the live store its own copy of the block's page table,
+ * and then its own copy of the page if that is shared too.  Erasing a
+ * shared block simply drops the live store's reference to it.
+ *
+ * Alternatively, store_open_image() backs the data store with an
+ * image file instead.  The image holds every target's storage in
+ * turn, each laid out as the cursor addresses it, so the byte at
+ * cursor c of target t is at file offset t * TARGET_SIZE + c.  The
+ * page table is unused then: every page lives in the mapping.  A
+ * bitmap per target, BITMAP_WORDS for each block, still records which
+ * pages hold data; it starts all set, as any page of the image may.
+ * Erasing a block clears its bits and punches its pages out of a
+ * shared image so that the erase reaches the file without writing a
+ * block of zeroes.  A copy-on-write image's pages are simply ignored
+ * until programmed again.
+ */
+#define BITS_PER_WORD (8 * sizeof(unsigned long))
+#define BITMAP_WORDS  ((NUM_PAGES + BITS_PER_WORD - 1) / BITS_PER_WORD)
+#define TARGET_SIZE   (NUM_BLOCKS * NUM_PAGES * NUM_BYTES)
+
+struct store_page {
+	unsigned long refs;       /* live store and snapshots sharing it */
+	unsigned char data[];     /* NUM_BYTES long */
+};
+
+struct store_block {
+	unsigned long refs;       /* live store and snapshots sharing it */
+	unsigned long *written;   /* page holds data?  BITMAP_WORDS long */
+	struct store_page *pages[]; /* NUM_PAGES long, NULL until
+				     * programmed */
+};
+
+/* Each chip-enable target has its own cursor, cache, and data store. */
+struct target_store {
+	unsigned long cursor;
+	unsigned int cycle;          /* address cycles of field so far */
+	unsigned char *cache;        /* NUM_BYTES long */
+	struct store_block **blocks; /* NUM_BLOCKS long, NULL until
+				      * programmed */
+	unsigned char *image;        /* TARGET_SIZE long in the image, or
+				      * NULL if there is none */
+	unsigned long *image_written; /* image page holds data?
+				       * BITMAP_WORDS per block */
+};
+
+static struct target_store stores[ NUM_TARGETS ];
+
+/* Snapshots of every target's cursor, cache, and data store. */
+static struct target_store snapshots[ NUM_SNAPSHOTS ][ NUM_TARGETS ];
+
+/* The selected target's store.  The functions below operate on it. */
+static struct target_store *store = &stores[ 0 ];
+
+/* The geometry store_init() sized the stores for. */
+static struct nand_geometry sized;
+
+/* The image file store_open_image() opened, or -1, and its mapping. */
+static int image_fd = -1;
+static bool image_private;     /* copy-on-write? */
+static unsigned char *image;   /* mapping, or NULL */
+static size_t image_size;      /* length of mapping */
+
+
+/* store_alloc()
+ *
+ * in:     size - bytes to allocate
+ * out:    nothing
+ * return: size bytes of zeroed memory.
+ *
+ * Exits on allocation failure, as there is no way to tell the driver.
+ *
+ */
 
-/* array to store the simulated flash storage */
-static unsigned char data_store[NUM_BLOCKS * NUM_PAGES * NUM_BYTES];
+static void *
+store_alloc(size_t size) {
 
-/* array to store the cache */
-static unsigned char cache[NUM_BYTES];
+	void *p = calloc(1, size);  /* the allocation */
+
+	if (!p) {
+		perror("device emulator: failed to allocate storage");
+		exit(1);
+	}
+	return p;
+
+} /* store_alloc() */
 
 
 /* store_clear_cache()
@@ -34,7 +130,7 @@ static unsigned char cache[NUM_BYTES];
 
 void
 store_clear_cache(void) {
-	memset(cache, 0, sizeof(cache));
+	memset(store->cache, 0, NUM_BYTES);
 }
 
 
@@ -51,28 +147,426 @@ store_clear_cache(void) {
 void
 store_clear_cursor(void) {
 
-	cursor = 0;
+	store->cursor = 0;
+	store->cycle = 0;
 
 } /* store_clear_cursor() */
 
 
+/* page_written()
+ *
+ * in:     block, page - a page of the selected target's data store
+ * out:    nothing
+ * return: the page's data, or NULL if the page reads as all-zeroes.
+ *
+ */
+
+static unsigned char *
+page_written(unsigned long block, unsigned long page) {
+
+	struct store_block *p_block;  /* the block's page table */
+	unsigned long *written;       /* the block's image bitmap */
+
+	if (store->image) {
+		written = store->image_written + block * BITMAP_WORDS;
+		if (!(written[ page / BITS_PER_WORD ] &
+		      (1UL << (page % BITS_PER_WORD))))
+			return NULL;
+		return store->image + (block << CURSOR_BLOCK_SHIFT) +
+			(page << CURSOR_PAGE_SHIFT);
+	}
+
+	p_block = store->blocks[ block ];
+	if (!p_block ||
+	    !(p_block->written[ page / BITS_PER_WORD ] &
+	      (1UL << (page % BITS_PER_WORD))))
+		return NULL;
+	return p_block->pages[ page ]->data;
+
+} /* page_written() */
+
+
+/* block_release()
+ *
+ * in:     p_block - a block, or NULL
+ * out:    p_block and its pages freed via side effect if this was
+ *         the last reference to them
+ * return: nothing
+ *
+ * Drops one reference to p_block.
+ *
+ */
+
+static void
+block_release(struct store_block *p_block) {
+
+	unsigned long p;  /* indexes pages */
+
+	if (!p_block || --p_block->refs)
+		return;
+	for (p = 0; p < sized.num_pages; p++)
+		if (p_block->pages[ p ] && !--p_block->pages[ p ]->refs)
+			free(p_block->pages[ p ]);
+	free(p_block);
+
+} /* block_release() */
+
+
+/* block_to_write()
+ *
+ * in:     block - a block of the selected target's data store
+ * out:    block materialized or unshared via side effect
+ * return: the block's page table, which no snapshot shares.
+ *
+ * Allocates the block's page table on first use, or copies it if a
+ * snapshot shares it.  A block's bitmap follows its table of pages in
+ * the same allocation.
+ *
+ */
+
+static struct store_block *
+block_to_write(unsigned long block) {
+
+	struct store_block *p_shared = store->blocks[ block ];
+	struct store_block *p_block;  /* the block's own page table */
+	size_t size = sizeof(struct store_block) +
+		NUM_PAGES * sizeof(struct store_page *) +
+		BITMAP_WORDS * sizeof(unsigned long);
+	unsigned long p;              /* indexes pages */
+
+	if (p_shared && (p_shared->refs == 1))
+		return p_shared;
+
+	p_block = store_alloc(size);
+	if (p_shared) {
+		memcpy(p_block, p_shared, size);
+		for (p = 0; p < NUM_PAGES; p++)
+			if (p_block->pages[ p ])
+				p_block->pages[ p ]->refs++;
+		p_shared->refs--;
+	}
+	p_block->refs = 1;
+	p_block->written = (unsigned long *)&p_block->pages[ NUM_PAGES ];
+	store->blocks[ block ] = p_block;
+	return p_block;
+
+} /* block_to_write() */
+
+
+/* page_to_write()
+ *
+ * in:     block, page - a page of the selected target's data store
+ * out:    block and page materialized or unshared and marked written
+ *         via side effect
+ * return: memory to hold the page's data
+ *
+ * Allocates whatever memory the page needs on first use, or when a
+ * snapshot shares it.  Callers overwrite the whole page, so a shared
+ * page's old data needn't be copied.
+ *
+ */
+
+static unsigned char *
+page_to_write(unsigned long block, unsigned long page) {
+
+	struct store_block *p_block;  /* the block's page table */
+
+	if (store->image) {
+		store->image_written[ block * BITMAP_WORDS +
+			page / BITS_PER_WORD ] |=
+			(1UL << (page % BITS_PER_WORD));
+		return page_written(block, page);
+	}
+
+	p_block = block_to_write(block);
+	if (p_block->pages[ page ] && (p_block->pages[ page ]->refs > 1)) {
+		p_block->pages[ page ]->refs--;
+		p_block->pages[ page ] = NULL;
+	}
+	if (!p_block->pages[ page ]) {
+		p_block->pages[ page ] = store_alloc(sizeof(struct store_page) +
+			NUM_BYTES);
+		p_block->pages[ page ]->refs = 1;
+	}
+	p_block->written[ page / BITS_PER_WORD ] |=
+		(1UL << (page % BITS_PER_WORD));
+	return p_block->pages[ page ]->data;
+
+} /* page_to_write() */
+
+
+/* store_select()
+ *
+ * in:     target - chip-enable target number, less than NUM_TARGETS
+ * out:    store set via side effect
+ * return: nothing
+ *
+ * Directs all subsequent store operations to target's cursor, cache,
+ * and data store.
+ *
+ */
+
+void
+store_select(unsigned int target) {
+
+	store = &stores[ target ];
+
+} /* store_select() */
+
+
+/* store_open_image()
+ *
+ * in:     path          - image file to back the data store with
+ *         copy_on_write - true to leave the file unmodified
+ * out:    image_fd and image_private set via side effect
+ * return: 0 on success, -1 if the file can't be opened.
+ *
+ * Call this before store_init() to have it map the data store from
+ * the image file at path rather than start blank.  Unless
+ * copy_on_write, the image is created if need be, grown to the size
+ * the geometry needs, and receives the data store's final state.
+ * Replaces any image an earlier call opened.
+ *
+ */
+
+int
+store_open_image(const char *path, bool copy_on_write) {
+
+	if (image_fd >= 0)
+		close(image_fd);
+	image_fd = open(path, copy_on_write ? O_RDONLY : (O_RDWR | O_CREAT),
+		0666);
+	if (image_fd < 0) {
+		perror(path);
+		return -1;
+	}
+	image_private = copy_on_write;
+	return 0;
+
+} /* store_open_image() */
+
+
+/* map_image()
+ *
+ * in:     nothing
+ * out:    image and image_size set via side effect
+ * return: nothing
+ *
+ * Maps the image file for the current geometry.  Parts of the data
+ * store beyond the end of a copy-on-write image are anonymous memory,
+ * so they read as all-zeroes just as they would past the end of a
+ * shared image that store_open_image() grew.  Exits on failure, as
+ * there is no way to tell the driver.
+ *
+ */
+
+static void
+map_image(void) {
+
+	struct stat st;        /* image file size */
+	size_t file_size;      /* bytes of the mapping the file backs */
+
+	image_size = NUM_TARGETS * TARGET_SIZE;
+	if (fstat(image_fd, &st))
+		goto fail;
+	if (!image_private && ((size_t)st.st_size < image_size) &&
+	    ftruncate(image_fd, image_size))
+		goto fail;
+	file_size = image_private && ((size_t)st.st_size < image_size) ?
+		st.st_size : image_size;
+
+	image = mmap(NULL, image_size, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (image == MAP_FAILED)
+		goto fail;
+	if (file_size &&
+	    (mmap(image, file_size, PROT_READ | PROT_WRITE, MAP_FIXED |
+		    (image_private ? (MAP_PRIVATE | MAP_NORESERVE) : MAP_SHARED),
+		    image_fd, 0) == MAP_FAILED))
+		goto fail;
+	return;
+
+fail:
+	perror("device emulator: failed to map image");
+	exit(1);
+
+} /* map_image() */
+
+
+/* store_sync()
+ *
+ * in:     nothing
+ * out:    image file updated via side effect
+ * return: nothing
+ *
+ * Writes the data store's dirty pages back to its image file, if it
+ * has one that isn't copy-on-write.  Call this at exit and at
+ * checkpoints; the data store itself never waits on the file.
+ *
+ */
+
+void
+store_sync(void) {
+
+	if (image && !image_private && msync(image, image_size, MS_SYNC))
+		perror("device emulator: failed to sync image");
+
+} /* store_sync() */
+
+
+/* target_release()
+ *
+ * in:     p_store - a target's live or snapshot store
+ * out:    p_store cleared and its memory released via side effect
+ * return: nothing
+ *
+ */
+
+static void
+target_release(struct target_store *p_store) {
+
+	unsigned long b;  /* indexes blocks */
+
+	for (b = 0; p_store->blocks && (b < sized.num_blocks); b++)
+		block_release(p_store->blocks[ b ]);
+	free(p_store->blocks);
+	free(p_store->cache);
+	free(p_store->image_written);
+	memset(p_store, 0, sizeof(*p_store));
+
+} /* target_release() */
+
+
+/* target_copy()
+ *
+ * in:     p_from - a target's live or snapshot store
+ * out:    p_to   - a copy of p_from, sharing its blocks
+ * return: nothing
+ *
+ * Releases whatever p_to held before.  The copy's cursor, cache, and
+ * table of blocks are its own, but it shares every block with p_from.
+ *
+ */
+
+static void
+target_copy(struct target_store *p_to, const struct target_store *p_from) {
+
+	unsigned long b;  /* indexes blocks */
+
+	target_release(p_to);
+	*p_to = *p_from;
+	p_to->cache = store_alloc(NUM_BYTES);
+	memcpy(p_to->cache, p_from->cache, NUM_BYTES);
+	p_to->blocks = store_alloc(NUM_BLOCKS * sizeof(struct store_block *));
+	memcpy(p_to->blocks, p_from->blocks,
+		NUM_BLOCKS * sizeof(struct store_block *));
+	for (b = 0; b < NUM_BLOCKS; b++)
+		if (p_to->blocks[ b ])
+			p_to->blocks[ b ]->refs++;
+
+} /* target_copy() */
+
+
+/* store_snapshot()
+ *
+ * in:     slot - snapshot number, less than NUM_SNAPSHOTS
+ * out:    snapshot slot replaced via side effect
+ * return: nothing
+ *
+ * Saves every target's cursor, cache, and data store in snapshot
+ * slot.  The snapshot shares the data store copy-on-write, so this
+ * costs only a copy of each target's table of blocks.  Exits if the
+ * data store is an image file, which can't be shared that way.
+ *
+ */
+
+void
+store_snapshot(unsigned int slot) {
+
+	unsigned int t;  /* indexes targets */
+
+	if (image) {
+		printf("device emulator: can't snapshot an image.\n");
+		exit(1);
+	}
+	for (t = 0; t < NUM_TARGETS; t++)
+		target_copy(&snapshots[ slot ][ t ], &stores[ t ]);
+
+} /* store_snapshot() */
+
+
+/* store_restore()
+ *
+ * in:     slot - snapshot number that store_snapshot() saved
+ * out:    every target's cursor, cache, and data store replaced via
+ *         side effect
+ * return: nothing
+ *
+ * Returns every target's cursor, cache, and data store to the state
+ * store_snapshot() saved in slot.  The snapshot remains, so the
+ * stores can return to it again later.  Leaves the selected target
+ * selected.
+ *
+ */
+
+void
+store_restore(unsigned int slot) {
+
+	unsigned int t;  /* indexes targets */
+
+	for (t = 0; t < NUM_TARGETS; t++)
+		target_copy(&stores[ t ], &snapshots[ slot ][ t ]);
+
+} /* store_restore() */
+
+
 /* store_init()
  *
  * in:     nothing
- * out:    cache, cursor, and data store all cleared via side effect
+ * out:    every target's cache, cursor, and data store cleared via
+ *         side effect; target 0 selected
  * return: nothing
  *
- * Call this function on startup to produce a cleared all-zeroes
- * cache, cursor, and data store.
+ * Call this function on startup to produce cleared all-zeroes
+ * caches, cursors, and data stores sized for the current geometry,
+ * or data stores mapped from the image file if store_open_image()
+ * opened one.  Frees any storage and snapshots an earlier run
+ * materialized.
  *
  */
 
 void
 store_init(void) {
 
-	store_clear_cache();
-	store_clear_cursor();
-	memset(data_store, 0, sizeof(data_store));
+	unsigned int s, t;     /* index snapshots and targets */
+
+	for (s = 0; s < NUM_SNAPSHOTS; s++)
+		for (t = 0; t < NUM_TARGETS; t++)
+			target_release(&snapshots[ s ][ t ]);
+	for (t = 0; t < NUM_TARGETS; t++)
+		target_release(&stores[ t ]);
+	if (image) {
+		store_sync();
+		munmap(image, image_size);
+		image = NULL;
+	}
+
+	sized = geometry;
+	if (image_fd >= 0)
+		map_image();
+	for (t = 0; t < NUM_TARGETS; t++) {
+		stores[ t ].cache = store_alloc(NUM_BYTES);
+		if (image) {
+			stores[ t ].image = image + t * TARGET_SIZE;
+			stores[ t ].image_written = store_alloc(NUM_BLOCKS *
+				BITMAP_WORDS * sizeof(unsigned long));
+			memset(stores[ t ].image_written, 0xFF, NUM_BLOCKS *
+				BITMAP_WORDS * sizeof(unsigned long));
+		} else
+			stores[ t ].blocks = store_alloc(NUM_BLOCKS *
+				sizeof(struct store_block *));
+	}
+	store_select(0);
 
 } /* store_init() */
 
@@ -94,18 +588,18 @@ void
 increment_cursor(bool remain) {
 	
 	if (remain) {
-		unsigned int bytes = cursor & CURSOR_BYTE_MASK;
+		unsigned long bytes = store->cursor & CURSOR_BYTE_MASK;
 		if (bytes + 1 < NUM_BYTES)
-			cursor += 1;
+			store->cursor += 1;
 		else
-			cursor = cursor & ~CURSOR_BYTE_MASK;
+			store->cursor &= ~CURSOR_BYTE_MASK;
 			
 	} else {
-		cursor += 1;
+		store->cursor += 1;
 
 		// wrap cursor to remain in storage
-		if (cursor >= (NUM_BLOCKS * NUM_PAGES * NUM_BYTES))
-			cursor = 0;
+		if (store->cursor >= (NUM_BLOCKS * NUM_PAGES * NUM_BYTES))
+			store->cursor = 0;
 	}
 }
 
@@ -125,10 +619,10 @@ increment_cursor(bool remain) {
 void
 increment_page(void) {
 	
-	unsigned int page = cursor & CURSOR_PAGE_MASK;
+	unsigned long page = store->cursor & CURSOR_PAGE_MASK;
 	page = page >> CURSOR_PAGE_SHIFT;
 
-	unsigned int block = cursor & CURSOR_BLOCK_MASK;
+	unsigned long block = store->cursor & CURSOR_BLOCK_MASK;
 	block = block >> CURSOR_BLOCK_SHIFT;
 
         page += 1;
@@ -140,9 +634,9 @@ increment_page(void) {
 			block = 0;
 	}
 
-        cursor = 0;
-	cursor = cursor | (block << CURSOR_BLOCK_SHIFT);
-	cursor = cursor | (page << CURSOR_PAGE_SHIFT);
+        store->cursor = 0;
+	store->cursor = store->cursor | (block << CURSOR_BLOCK_SHIFT);
+	store->cursor = store->cursor | (page << CURSOR_PAGE_SHIFT);
 }
 
 
@@ -160,7 +654,7 @@ increment_page(void) {
 void
 increment_block(void) {
 	
-	unsigned int block = cursor & CURSOR_BLOCK_MASK;
+	unsigned long block = store->cursor & CURSOR_BLOCK_MASK;
 	block = block >> CURSOR_BLOCK_SHIFT;
 
 	block += 1;
@@ -169,28 +663,61 @@ increment_block(void) {
 		block = 0;
 	}
 
-	cursor = 0;
-	cursor = cursor | (block << CURSOR_BLOCK_SHIFT);
+	store->cursor = 0;
+	store->cursor = store->cursor | (block << CURSOR_BLOCK_SHIFT);
 }
 
 
 /*
- * set_cursor_byte()
+ * set_cursor_cycle()
  *
  * in:  cursor - the current value of the cursor
- *      value - the value to set the cursor byte to
- *      shift - the byte in the cursor to set (left shift)
- * out: cursor - the cursor with the specified byte set
- * return: nothing
- *
- * Sets the specified byte in the cursor to value.
+ *      field  - CURSOR_BLOCK, CURSOR_PAGE, or CURSOR_BYTE
+ *      value  - the byte of that field's address the driver sent
+ * out: cursor - the cursor with the next byte of the field set
+ * return: true if value was the field's last address cycle, else false.
+ *
+ * Sets the next byte of the specified field of the cursor to value,
+ * least significant byte first.  The first cycle clears the field,
+ * and bits beyond the field's width are ignored.
  */
 
-void
-set_cursor_byte(unsigned int value, unsigned int shift) {       
-	cursor = cursor & ~(0xFF << shift); // clear the byte
-	cursor = cursor | (value << shift);
-}
+bool
+set_cursor_cycle(unsigned int field, unsigned char value) {
+
+	unsigned long mask;     /* the field's bits in the cursor */
+	unsigned int shift;     /* position of its least significant bit */
+	unsigned int cycles;    /* address cycles that make up the field */
+
+	switch (field) {
+	case CURSOR_BLOCK:
+		mask = CURSOR_BLOCK_MASK;
+		shift = CURSOR_BLOCK_SHIFT;
+		cycles = geometry.block_cycles;
+		break;
+	case CURSOR_PAGE:
+		mask = CURSOR_PAGE_MASK;
+		shift = CURSOR_PAGE_SHIFT;
+		cycles = geometry.page_cycles;
+		break;
+	default:
+		mask = CURSOR_BYTE_MASK;
+		shift = CURSOR_BYTE_SHIFT;
+		cycles = geometry.byte_cycles;
+		break;
+	}
+
+	if (store->cycle == 0)
+		store->cursor &= ~mask;  /* clear the field */
+	store->cursor |= ((unsigned long)value << (shift + 8 * store->cycle))
+		& mask;
+
+	if (++store->cycle < cycles)
+		return false;
+	store->cycle = 0;
+	return true;
+
+} /* set_cursor_cycle() */
 
 
 /* store_copy_page_to_cache()
@@ -207,14 +734,23 @@ set_cursor_byte(unsigned int value, unsigned int shift) {
 
 void
 store_copy_page_to_cache(void) {
-	memcpy(cache, &data_store[cursor & ~CURSOR_BYTE_MASK], NUM_BYTES);
-}
+
+	unsigned char *p_page = page_written(
+		(store->cursor & CURSOR_BLOCK_MASK) >> CURSOR_BLOCK_SHIFT,
+		(store->cursor & CURSOR_PAGE_MASK) >> CURSOR_PAGE_SHIFT);
+
+	if (p_page)
+		memcpy(store->cache, p_page, NUM_BYTES);
+	else
+		memset(store->cache, 0, NUM_BYTES);
+
+} /* store_copy_page_to_cache() */
 
 
 /* store_copy_page_from_cache()
  *
  * in:     cursor - indicates page in data store to receive data
- * out:    data_store modified by side-effect
+ * out:    data store modified by side-effect
  * return: nothing
  *
  * Copies a page of data from cache to the page in the data store
@@ -226,12 +762,11 @@ store_copy_page_to_cache(void) {
 
 void
 store_copy_page_from_cache(void) {
-	
-	for (int i=0; i < NUM_BYTES; i++) {
-		int idx = (cursor & ~CURSOR_BYTE_MASK);
-		idx += i;
-		data_store[idx] = cache[i];
-	}
+
+	memcpy(page_to_write(
+		(store->cursor & CURSOR_BLOCK_MASK) >> CURSOR_BLOCK_SHIFT,
+		(store->cursor & CURSOR_PAGE_MASK) >> CURSOR_PAGE_SHIFT),
+		store->cache, NUM_BYTES);
 
 } /* store_copy_from_cache() */
 
@@ -249,7 +784,7 @@ store_copy_page_from_cache(void) {
 
 unsigned char
 store_get_cache_byte(void) {
-	return cache[cursor & CURSOR_BYTE_MASK];
+	return store->cache[store->cursor & CURSOR_BYTE_MASK];
 }
 
 
@@ -266,10 +801,64 @@ store_get_cache_byte(void) {
 
 void
 store_set_cache_byte(unsigned char byte) {
-	cache[cursor & CURSOR_BYTE_MASK] = byte;
+	store->cache[store->cursor & CURSOR_BYTE_MASK] = byte;
 }
 
 
+/* store_get_cache_bytes()
+ *
+ * in:     cursor - indicates the first byte to get from cache
+ *         cache  - holds bytes to get
+ *         length - number of bytes to get
+ * out:    buffer - bytes read from cache
+ *         cursor - advanced past the bytes read
+ * return: nothing
+ *
+ * Reads length bytes from cache exactly as that many data register
+ * reads would, for DMA.
+ *
+ */
+
+void
+store_get_cache_bytes(unsigned char *buffer, unsigned int length) {
+
+	unsigned int i;  /* indexes buffer */
+
+	for (i = 0; i < length; i++) {
+		buffer[i] = store_get_cache_byte();
+		increment_cursor(false);
+	}
+
+} /* store_get_cache_bytes() */
+
+
+/* store_set_cache_bytes()
+ *
+ * in:     buffer - byte values to store in cache
+ *         length - number of bytes to store
+ *         cursor - cache location to store the first byte in
+ * out:    cache  - updated via side effect
+ *         cursor - advanced past the bytes stored
+ * return: nothing
+ *
+ * Stores length bytes in cache exactly as that many data register
+ * writes would, for DMA.
+ *
+ */
+
+void
+store_set_cache_bytes(const unsigned char *buffer, unsigned int length) {
+
+	unsigned int i;  /* indexes buffer */
+
+	for (i = 0; i < length; i++) {
+		store_set_cache_byte(buffer[i]);
+		increment_cursor(true);
+	}
+
+} /* store_set_cache_bytes() */
+
+
 /* store_erase_block()
  *
  * in:     cursor - indicates block to erase
@@ -284,6 +873,31 @@ store_set_cache_byte(unsigned char byte) {
 
 void
 store_erase_block(void) {
-	memset(&data_store[(cursor & CURSOR_BLOCK_MASK)], 0,
-		NUM_PAGES*NUM_BYTES);
-}
+
+	unsigned long block =
+		(store->cursor & CURSOR_BLOCK_MASK) >> CURSOR_BLOCK_SHIFT;
+	struct store_block *p_block;  /* the block's page table */
+	off_t offset;                 /* of the block in the image file */
+
+	if (store->image) {
+		memset(store->image_written + block * BITMAP_WORDS, 0,
+			BITMAP_WORDS * sizeof(unsigned long));
+		if (image_private)
+			return;
+		offset = (store->image - image) + (block << CURSOR_BLOCK_SHIFT);
+		if (fallocate(image_fd, FALLOC_FL_PUNCH_HOLE |
+			FALLOC_FL_KEEP_SIZE, offset, NUM_PAGES * NUM_BYTES))
+			memset(image + offset, 0, NUM_PAGES * NUM_BYTES);
+		return;
+	}
+
+	p_block = store->blocks[ block ];
+	if (p_block && (p_block->refs > 1)) {
+		block_release(p_block);
+		store->blocks[ block ] = NULL;
+	} else if (p_block) {
+		memset(p_block->written, 0,
+			BITMAP_WORDS * sizeof(unsigned long));
+	}
+
+} /* store_erase_block() */
@@ -2,27 +2,43 @@
 #ifndef _DE_STORE_H_
 #define _DE_STORE_H_
 
-/* cursor address masks */
-#define CURSOR_BLOCK_MASK 0x00FF0000
-#define CURSOR_PAGE_MASK  0x0000FF00
-#define CURSOR_BYTE_MASK  0x000000FF
+/* The cursor is a byte offset into the selected target's storage.
+ * Its fields' widths follow the geometry.
+ */
 
 /* cursor bit shifts */
-#define CURSOR_BLOCK_SHIFT 16
-#define CURSOR_PAGE_SHIFT   8
-#define CURSOR_BYTE_SHIFT   0
+#define CURSOR_BLOCK_SHIFT (geometry.block_shift)
+#define CURSOR_PAGE_SHIFT  (geometry.page_shift)
+#define CURSOR_BYTE_SHIFT  0
+
+/* cursor address masks */
+#define CURSOR_BLOCK_MASK ((NUM_BLOCKS - 1) << CURSOR_BLOCK_SHIFT)
+#define CURSOR_PAGE_MASK  ((NUM_PAGES - 1) << CURSOR_PAGE_SHIFT)
+#define CURSOR_BYTE_MASK  (NUM_BYTES - 1)
+
+/* cursor address fields, for set_cursor_cycle() */
+#define CURSOR_BLOCK 0
+#define CURSOR_PAGE  1
+#define CURSOR_BYTE  2
 
 void store_clear_cache(void);
 void store_clear_cursor(void);
+void store_select(unsigned int);
+int store_open_image(const char *, bool);
+void store_sync(void);
 void store_init(void);
+void store_snapshot(unsigned int);
+void store_restore(unsigned int);
 void increment_cursor(bool);
 void increment_page(void);
 void increment_block(void);
-void set_cursor_byte(unsigned int, unsigned int);
+bool set_cursor_cycle(unsigned int, unsigned char);
 void store_copy_page_to_cache(void);
 void store_copy_page_from_cache(void);
 unsigned char store_get_cache_byte(void);
 void store_set_cache_byte(unsigned char);
+void store_get_cache_bytes(unsigned char *, unsigned int);
+void store_set_cache_bytes(const unsigned char *, unsigned int);
 void store_erase_block(void);
 
 #endif
@@ -0,0 +1,225 @@
+/*
+ * Device emulator IO event trace module.
+ *
+ * Copyright (c) 2023 Timothy Jon Fraser Consulting LLC.
+ *
+ * When main.c asks for a trace, the device emulator records every IO
+ * register and GPIO pin event it handles, together with what the
+ * driver got back and the parser state that resulted, in a compact
+ * binary trace file.  The replay_trace program feeds a trace back
+ * through the parser and store to check that they still behave the
+ * same way, with no tracee and no ptrace().  See de_trace.h for the
+ * file format.
+ *
+ * Records collect in a flat buffer that goes to the file in a single
+ * write() when it fills, rather than in a ring buffer.  The thread
+ * that handles the events is also the one that writes the file, so
+ * it empties the whole buffer every time it writes; there is no
+ * second thread draining one end while events fill the other, which
+ * is all a ring's wrap-around would buy.
+ *
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/user.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "clock.h"
+#include "device_emu.h"
+#include "de_deadline.h"
+#include "de_parser.h"
+#include "de_trace.h"
+
+#define TRACE_BUFFER_BYTES 0x10000  /* bytes to collect per write() */
+
+/* The trace file, or -1 if we aren't tracing. */
+static int trace_fd = -1;
+
+/* Records waiting to be written to the trace file. */
+static unsigned char buffer[ TRACE_BUFFER_BYTES ];
+static size_t buffered;
+
+
+/* write_all()
+ *
+ * in:     bytes  - bytes to write to the trace file
+ *         length - how many
+ * out:    trace file appended via side effect
+ * return: nothing
+ *
+ */
+
+static void
+write_all(const unsigned char *bytes, size_t length) {
+
+	ssize_t written;  /* bytes each write() wrote */
+
+	for (; length; bytes += written, length -= written) {
+		if ((written = write(trace_fd, bytes, length)) < 0) {
+			perror("Failed to write trace");
+			exit(-1);
+		}
+	}
+
+} /* write_all() */
+
+
+/* append()
+ *
+ * in:     bytes  - bytes to add to the trace
+ *         length - how many
+ * out:    buffer updated, perhaps flushed to the trace file
+ * return: nothing
+ *
+ */
+
+static void
+append(const void *bytes, size_t length) {
+
+	if (buffered + length > sizeof(buffer))
+		trace_flush();
+	if (length > sizeof(buffer)) {
+		write_all(bytes, length);
+		return;
+	}
+	memcpy(&buffer[ buffered ], bytes, length);
+	buffered += length;
+
+} /* append() */
+
+
+/* trace_flush()
+ *
+ * in:     nothing
+ * out:    buffered records written to the trace file
+ * return: nothing
+ *
+ * The trace module calls this whenever its buffer fills, at exit,
+ * and before fork() so that a child never writes its parent's
+ * records a second time.
+ *
+ */
+
+void
+trace_flush(void) {
+
+	if ((trace_fd < 0) || !buffered)
+		return;
+	write_all(buffer, buffered);
+	buffered = 0;
+
+} /* trace_flush() */
+
+
+/* trace_open()
+ *
+ * in:     path - trace file to create
+ * out:    trace_fd set via side effect
+ * return: 0 on success, -1 if the file can't be created.
+ *
+ * Call this after choosing the geometry and before fork() to begin
+ * recording.  Any existing file at path is replaced.  Test cases a
+ * fork server forks in in-process mode each run their own copy of
+ * the device emulator and append their records as they exit.
+ *
+ */
+
+int
+trace_open(const char *path) {
+
+	struct trace_header header;  /* begins the trace file */
+
+	if ((trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND,
+		0644)) < 0) {
+		perror("Failed to open trace");
+		return -1;
+	}
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+	header.num_blocks = NUM_BLOCKS;
+	header.num_pages = NUM_PAGES;
+	header.num_bytes = NUM_BYTES;
+	append(&header, sizeof(header));
+	trace_flush();
+
+	atexit(trace_flush);
+	pthread_atfork(trace_flush, NULL, NULL);
+	return 0;
+
+} /* trace_open() */
+
+
+/* trace_event()
+ *
+ * in:     kind     - one of the TR_* kinds
+ *         value    - the byte the driver wrote or pin argument
+ *         returned - the byte or pin value the driver got back
+ *         state    - the parser state that resulted
+ * out:    record added to trace, if tracing, plus
+ *         deadline_last_read() side effects
+ * return: nothing
+ *
+ * Event handlers call this once they have handled each event.  The
+ * record's time is the time the deadline module read from the clock
+ * while handling it, if any, so that replay can show the deadline
+ * module exactly the same time.
+ *
+ */
+
+void
+trace_event(unsigned int kind, unsigned char value, unsigned char returned,
+	unsigned int state) {
+
+	struct trace_record record;
+
+	if (trace_fd < 0)
+		return;
+
+	record.time = deadline_last_read();
+	record.length = 0;
+	record.kind = kind;
+	record.value = value;
+	record.returned = returned;
+	record.state = state;
+	append(&record, sizeof(record));
+
+} /* trace_event() */
+
+
+/* trace_dma()
+ *
+ * in:     bytes  - the bytes a DMA command moved
+ *         length - how many
+ * out:    TR_DMA record and payload added to trace, if tracing
+ * return: nothing
+ *
+ * DMA commands move a whole buffer between the driver's memory and
+ * the cache at once.  A trace has to hold the buffer for replay to
+ * move the same bytes without the driver's memory to move them from.
+ * The TR_DMA record comes just before the DMA command's own record.
+ *
+ */
+
+void
+trace_dma(const unsigned char *bytes, unsigned long length) {
+
+	struct trace_record record;
+
+	if (trace_fd < 0)
+		return;
+
+	memset(&record, 0, sizeof(record));
+	record.kind = TR_DMA;
+	record.length = length;
+	append(&record, sizeof(record));
+	append(bytes, length);
+
+} /* trace_dma() */
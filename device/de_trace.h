@@ -0,0 +1,49 @@
+#ifndef _DE_TRACE_H_
+#define _DE_TRACE_H_
+
+#include <stdint.h>
+
+/* Trace record kinds.  The first four are the parser's EV_* IO
+ * register events; the rest are GPIO pin events and DMA payloads.
+ */
+#define TR_COMMAND    EV_COMMAND     /* driver wrote command register */
+#define TR_ADDRESS    EV_ADDRESS     /* driver wrote address register */
+#define TR_DATA_WRITE EV_DATA_WRITE  /* driver wrote data register */
+#define TR_DATA_READ  EV_DATA_READ   /* driver read data register */
+#define TR_RESET      4  /* driver set the reset pin */
+#define TR_SELECT     5  /* driver set the chip select pin */
+#define TR_SNAPSHOT   6  /* driver set the snapshot pin */
+#define TR_RESTORE    7  /* driver set the restore pin */
+#define TR_STATUS     8  /* driver got a target's status pin */
+#define TR_DMA        9  /* bytes the next DMA command moved */
+
+#define TRACE_MAGIC "NANDTRC1"
+
+/* A trace file begins with this header... */
+struct trace_header {
+	char magic[ 8 ];        /* TRACE_MAGIC, unterminated */
+	uint64_t num_blocks;    /* the geometry the trace was made with */
+	uint64_t num_pages;
+	uint64_t num_bytes;
+};
+
+/* ...followed by these records, each TR_DMA record followed in turn
+ * by its length bytes of payload.
+ */
+struct trace_record {
+	uint64_t time;      /* now() as the event saw it, or 0 if the
+			       event didn't look at the clock */
+	uint32_t length;    /* TR_DMA payload bytes, otherwise 0 */
+	uint8_t kind;       /* one of the TR_* kinds above */
+	uint8_t value;      /* command, address, or data byte written,
+			       or pin argument */
+	uint8_t returned;   /* data byte or pin value the driver got */
+	uint8_t state;      /* parser state after the event */
+};
+
+int trace_open(const char *);
+void trace_flush(void);
+void trace_event(unsigned int, unsigned char, unsigned char, unsigned int);
+void trace_dma(const unsigned char *, unsigned long);
+
+#endif
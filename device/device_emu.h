@@ -8,6 +8,17 @@
 #define IOREG_ADDRESS 0x01
 #define IOREG_DATA    0x00
 
+/* DMA register offsets.  These two unsigned-long-sized registers
+ * follow the unsigned long that holds the command, address, and data
+ * registers.  Drivers write them with ordinary stores that don't trap;
+ * the device reads them when the driver writes C_READ_DMA or
+ * C_PROGRAM_DMA to the command register.
+ */
+#define IOREG_DMA_ADDRESS 0x08  /* address of the driver's buffer */
+#define IOREG_DMA_LENGTH  0x10  /* bytes to transfer, at most NUM_BYTES */
+
+#define IOREG_WORDS 3  /* unsigned longs of IO registers in all */
+
 /* Read commands */
 #define C_READ_SETUP   0x01
 #define C_READ_EXECUTE 0x02
@@ -23,18 +34,123 @@
 /* Extra commands */
 #define C_DUMMY 0x07
 
+/* DMA commands.  These transfer a whole page (or part of one) between
+ * the device's cache and the buffer described by the DMA registers in
+ * a single step, in place of a page's worth of data register reads
+ * after C_READ_EXECUTE or writes before C_PROGRAM_EXECUTE.
+ */
+#define C_READ_DMA    0x08
+#define C_PROGRAM_DMA 0x09
+
 /* Device Emulator busy/ready */
 #define DEVICE_BUSY  1
 #define DEVICE_READY 0
 
-/* Device Emulator pins */
-#define PN_STATUS 0
-#define PN_RESET  1
+/* Device Emulator pins.  The device has NUM_TARGETS chip-enable
+ * targets, each with its own parser state, store, and deadline.
+ * gpio_set(PN_CHIP_SELECT, t) selects target t, and the IO registers
+ * and PN_STATUS then address target t until the driver selects
+ * another.  Meanwhile, PN_STATUS_TARGET(t) always reports target t's
+ * ready/busy status, so a driver can start a long operation on one
+ * target and go on to use another while it completes.  Target 0 is
+ * selected on startup and after PN_RESET, which resets every target.
+ */
+#define PN_STATUS      0
+#define PN_RESET       1
+#define PN_CHIP_SELECT 2
+#define PN_STATUS_TARGET(t) (0x10 + (t))
+
+#define NUM_TARGETS 4
+
+/* Snapshot pins.  These are the emulator's, not the device's: tests
+ * use them to rewind the device rather than rebuild its state
+ * through the driver.  gpio_set(PN_SNAPSHOT, s) saves every target's
+ * parser state, cursor, cache, deadline, and storage in snapshot s,
+ * and gpio_set(PN_RESTORE, s) returns the device to that state.  A
+ * snapshot survives any number of restores.
+ */
+#define PN_SNAPSHOT 3
+#define PN_RESTORE  4
+
+#define NUM_SNAPSHOTS 4
+
+/* In virtual time, a driver that polls a busy device without sleeping
+ * between polls would otherwise never see the deadline arrive.  Each
+ * such poll costs the driver this many microseconds of virtual time,
+ * much as spinning costs real time on the real clock.
+ */
+#define BUSY_POLL_US 10
+
+/* Shared status page.
+ *
+ * Optionally, main.c creates this MAP_SHARED page before fork()ing
+ * and the device emulator publishes the selected target and the time
+ * at which each target will next become ready there whenever they
+ * change.  The tracee maps it read-only, and its gpio_get() answers
+ * PN_STATUS and PN_STATUS_TARGET() polls by comparing the deadline
+ * with now() instead of trapping to the device emulator.  gpio_set()
+ * and other pin polls still trap.
+ */
+struct gpio_status {
+	volatile unsigned long deadline[ NUM_TARGETS ]; /* busy until now()
+							 * reaches these */
+	volatile unsigned long target;                  /* selected target */
+};
 
-/* data storage constants */
-#define NUM_BLOCKS 256
-#define NUM_PAGES  256
-#define NUM_BYTES  256
+/* Shared trap counters.
+ *
+ * For benchmarks, main.c creates this MAP_SHARED page before
+ * fork()ing and the device emulator counts every trap and mailbox
+ * access it services in it, so that the tracee can tell how many
+ * round trips to the device emulator each workload cost.  emulator
+ * is the PID of the process running the device emulator, whose CPU
+ * time the tracee also charges to the workload unless it is the
+ * tracee itself.
+ */
+struct device_counters {
+	volatile unsigned long traps;  /* traps serviced so far */
+	pid_t emulator;                /* device emulator's process */
+};
+
+/* Data storage geometry.  Each target has NUM_BLOCKS erase blocks of
+ * NUM_PAGES pages of NUM_BYTES bytes, each a power of two.  main.c
+ * may choose a geometry other than the default with geometry_init()
+ * before fork()ing, so that the device emulator and the framework
+ * agree on it.
+ *
+ * Drivers send block, page, and byte addresses in that order, each
+ * in as many address cycles as it takes to hold its largest value,
+ * least significant byte first.  The default geometry needs one
+ * cycle for each.
+ */
+struct nand_geometry {
+	unsigned long num_blocks;   /* erase blocks per target */
+	unsigned long num_pages;    /* pages per block */
+	unsigned long num_bytes;    /* bytes per page */
+	unsigned int block_cycles;  /* address cycles for a block number */
+	unsigned int page_cycles;   /* address cycles for a page number */
+	unsigned int byte_cycles;   /* address cycles for a byte offset */
+	unsigned int page_shift;    /* log2(num_bytes) */
+	unsigned int block_shift;   /* log2(num_pages * num_bytes) */
+};
+
+extern struct nand_geometry geometry;  /* from de_geometry.c */
+
+#define NUM_BLOCKS (geometry.num_blocks)
+#define NUM_PAGES  (geometry.num_pages)
+#define NUM_BYTES  (geometry.num_bytes)
+
+#define DEFAULT_NUM_BLOCKS 256
+#define DEFAULT_NUM_PAGES  256
+#define DEFAULT_NUM_BYTES  256
+
+#define MAX_BLOCK_CYCLES 3
+#define MAX_PAGE_CYCLES  2
+#define MAX_BYTE_CYCLES  2
+#define MAX_NUM_BLOCKS   (1UL << (8 * MAX_BLOCK_CYCLES))
+#define MAX_NUM_PAGES    (1UL << (8 * MAX_PAGE_CYCLES))
+#define MAX_NUM_BYTES    (1UL << (8 * MAX_BYTE_CYCLES))
+#define MIN_NUM_BYTES    16
 
 /* Durations (microseconds) */
 #define READ_PAGE_DURATION   100
@@ -42,6 +158,50 @@
 #define ERASE_BLOCK_DURATION 2000
 #define RESET_DURATION       500
 
+/* Shared-memory IO register transport.
+ *
+ * In this optional transport, main.c places the IO registers in a
+ * MAP_SHARED page it creates before fork()ing so that the tracer and
+ * tracee share a single copy.  A driver's direct accesses to the
+ * ioregisters word still hit the watchpoint, but the device emulator
+ * reads and writes the shared copy itself rather than peeking and
+ * poking the tracee's memory with ptrace().  Drivers that opt in to
+ * the framework's ioreg_readb() and ioreg_writeb() accessors avoid
+ * the trap as well: the accessors pass each register access to the
+ * device emulator through the mailbox that follows the registers
+ * rather than touching the registers themselves.  The tracee fills
+ * in op, offset, and value and then increments request.  The device
+ * emulator services the access, fills in value for reads, and then
+ * copies request to ack.  The DMA registers need no mailbox; the
+ * device emulator reads the tracee's plain stores to them directly.
+ */
+#define IOREG_OP_READ  0
+#define IOREG_OP_WRITE 1
+
+struct ioregs_shm {
+	volatile unsigned long ioregisters[ IOREG_WORDS ]; /* emulated regs */
+	unsigned long request;  /* tracee increments to ring the doorbell */
+	unsigned long ack;      /* emulator sets to request when done */
+	unsigned int op;        /* IOREG_OP_READ or IOREG_OP_WRITE */
+	unsigned int offset;    /* IOREG_COMMAND, IOREG_ADDRESS, or IOREG_DATA */
+	unsigned int value;     /* byte written by tracee or read from device */
+};
+
 void device_init(volatile unsigned long *in_ioregisters, pid_t child_pid);
+void device_init_registers(volatile unsigned long *in_ioregisters,
+	pid_t child_pid);
+void device_init_shm(struct ioregs_shm *shm, pid_t child_pid);
+void device_init_in_process(volatile unsigned long *in_ioregisters);
+void device_init_status(struct gpio_status *status);
+void device_init_counters(struct device_counters *counters);
+void device_init_irq(int fd);
+void device_init_fork_server(void);
+int device_init_image(const char *path, int copy_on_write);
+void device_sync_image(void);
+int device_init_trace(const char *path);
+void device_init_stats(void);
+void device_print_stats(void);
+int geometry_init(unsigned long num_blocks, unsigned long num_pages,
+	unsigned long num_bytes);
 
 #endif
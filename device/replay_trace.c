@@ -0,0 +1,220 @@
+/* Device emulator trace replay program.
+ *
+ * Copyright (c) 2023 Timothy Jon Fraser Consulting LLC.
+ *
+ * This program feeds a trace that the device emulator recorded with
+ * --trace back through the parser and store, with no tracee and no
+ * ptrace(), and checks that the device still gives the driver the
+ * same bytes and pin values and passes through the same machine
+ * states.  Time follows the timestamps in the trace on the virtual
+ * clock, so the device is busy exactly when it was, but replay never
+ * waits for it.  Use it to check a change to the parser or store
+ * against captured driver traffic.
+ *
+ */
+
+#include <sys/types.h>
+#include <sys/user.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "clock.h"
+#include "device_emu.h"
+#include "de_deadline.h"
+#include "de_parser.h"
+#include "de_trace.h"
+
+/* Bytes a replayed DMA command must move to match the trace, and the
+ * bytes it actually moved.
+ */
+static unsigned char dma_expected[ MAX_NUM_BYTES ];
+static unsigned char dma_actual[ MAX_NUM_BYTES ];
+
+/* Names of the TR_* record kinds, for reporting divergences. */
+static const char *kind_names[] = {
+	[ TR_COMMAND ]    = "command",
+	[ TR_ADDRESS ]    = "address",
+	[ TR_DATA_WRITE ] = "data write",
+	[ TR_DATA_READ ]  = "data read",
+	[ TR_RESET ]      = "reset",
+	[ TR_SELECT ]     = "chip select",
+	[ TR_SNAPSHOT ]   = "snapshot",
+	[ TR_RESTORE ]    = "restore",
+	[ TR_STATUS ]     = "status",
+	[ TR_DMA ]        = "DMA",
+};
+
+
+/* replay_ioregs()
+ *
+ * in:     p_r        - an IO register event record
+ *         dma_length - bytes of the TR_DMA record just before it, or
+ *                      -1 if there wasn't one
+ * out:    nothing
+ * return: the byte the driver read, for a data read, otherwise 0, or
+ *         -1 if a DMA command moved different bytes than it did in
+ *         the trace.
+ *
+ */
+
+static int
+replay_ioregs(const struct trace_record *p_r, long dma_length) {
+
+	unsigned char returned;  /* the byte the driver read */
+	bool dma;                /* is this a DMA command? */
+
+	/* Give a DMA command the bytes it moved in the trace, or, if
+	 * it failed in the trace, a transfer too long to succeed.
+	 */
+	dma = ((p_r->kind == TR_COMMAND) &&
+	       ((p_r->value == C_READ_DMA) || (p_r->value == C_PROGRAM_DMA)));
+	if (dma && (dma_length < 0))
+		parser_replay_dma(dma_actual, MAX_NUM_BYTES + 1);
+	else if (dma && (p_r->value == C_READ_DMA))
+		parser_replay_dma(dma_actual, dma_length);
+	else if (dma)
+		parser_replay_dma(dma_expected, dma_length);
+
+	returned = handle_ioregs_event(0, NULL, p_r->kind, p_r->value);
+	if (!dma)
+		return returned;
+
+	parser_replay_dma(NULL, 0);
+	if ((p_r->value == C_READ_DMA) && (dma_length > 0) &&
+	    memcmp(dma_actual, dma_expected, dma_length))
+		return -1;
+	return 0;
+
+} /* replay_ioregs() */
+
+
+/* replay_record()
+ *
+ * in:     p_r        - a record other than TR_DMA
+ *         dma_length - see replay_ioregs()
+ * out:    device emulator state updated
+ * return: the byte or pin value the driver got, or -1 if a DMA
+ *         command moved different bytes than it did in the trace, or
+ *         a GPIO call failed that succeeded in the trace.
+ *
+ */
+
+static int
+replay_record(const struct trace_record *p_r, long dma_length) {
+
+	switch (p_r->kind) {
+	case TR_COMMAND:
+	case TR_ADDRESS:
+	case TR_DATA_WRITE:
+	case TR_DATA_READ:
+		return replay_ioregs(p_r, dma_length);
+	case TR_RESET:
+		parser_reset();
+		return 0;
+	case TR_SELECT:
+		return (parser_select(0, p_r->value) ? 0 : -1);
+	case TR_SNAPSHOT:
+		return (parser_snapshot(p_r->value) ? 0 : -1);
+	case TR_RESTORE:
+		return (parser_restore(0, p_r->value) ? 0 : -1);
+	case TR_STATUS:
+		return (before_target_deadline(p_r->value) ?
+			DEVICE_BUSY : DEVICE_READY);
+	default:
+		return -1;
+	}
+
+} /* replay_record() */
+
+
+int
+main(int argc, char *argv[]) {
+
+	FILE *trace;                /* the trace to replay */
+	struct trace_header header; /* trace geometry */
+	struct trace_record r;      /* each record in turn */
+	unsigned long events = 0;   /* records replayed */
+	long dma_length = -1;       /* bytes of preceding TR_DMA, if any */
+	timeus_t offset = 0;        /* virtual time minus trace time */
+	bool synced = false;        /* offset set? */
+	int returned;               /* what replay gave the driver */
+	struct timespec start, end; /* how long replay took */
+	double seconds;
+
+	if (argc != 2) {
+		fprintf(stderr, "USAGE: %s <trace file>\n", argv[ 0 ]);
+		return -1;
+	}
+	if (!(trace = fopen(argv[ 1 ], "r"))) {
+		perror("Failed to open trace");
+		return -1;
+	}
+	if ((fread(&header, sizeof(header), 1, trace) != 1) ||
+	    memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) ||
+	    geometry_init(header.num_blocks, header.num_pages,
+		header.num_bytes)) {
+		fprintf(stderr, "%s is not a device emulator trace.\n",
+			argv[ 1 ]);
+		return -1;
+	}
+
+	clock_init_virtual();
+	parser_init(true);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	while (fread(&r, sizeof(r), 1, trace) == 1) {
+
+		if (r.kind == TR_DMA) {
+			if ((r.length > MAX_NUM_BYTES) ||
+			    (fread(dma_expected, 1, r.length, trace) !=
+				r.length)) {
+				fprintf(stderr, "Trace is truncated.\n");
+				return -1;
+			}
+			dma_length = r.length;
+			continue;
+		}
+
+		/* Move the virtual clock to the time the event saw.
+		 * Traces record now() on whichever clock the device
+		 * emulator used, so line the first time up with the
+		 * virtual clock's beginning.
+		 */
+		if (r.time && !synced) {
+			offset = now() - r.time;
+			synced = true;
+		}
+		if (r.time && (r.time + offset > now()))
+			clock_advance(r.time + offset - now());
+
+		returned = replay_record(&r, dma_length);
+		dma_length = -1;
+		events++;
+
+		if ((returned != r.returned) || (parser_state() != r.state)) {
+			printf("Event %lu (%s 0x%02x) diverged from the "
+			       "trace", events, ((r.kind < TR_DMA) ?
+				kind_names[ r.kind ] : "unknown"), r.value);
+			if (returned < 0)
+				printf(".\n");
+			else
+				printf(": driver got 0x%02x, not 0x%02x, in "
+				       "state %02u, not %02u.\n", returned,
+				       r.returned, parser_state(), r.state);
+			return 1;
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	seconds = (end.tv_sec - start.tv_sec) +
+		(end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("Replayed %lu events; the device behaved as traced.\n",
+	       events);
+	fprintf(stderr, "Replay took %.3f s (%.0f events/s).\n", seconds,
+		(seconds > 0) ? events / seconds : 0.0);
+	return 0;
+
+} /* main() */
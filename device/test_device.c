@@ -69,7 +69,7 @@ void gpio_set(unsigned int pin, unsigned int value)
 	BREAKPOINT;
 }
 
-/* gpio_get()
+/* gpio_get_trap()
  *
  * in:     pin   - the pin number to get.
  * out:    none
@@ -79,7 +79,7 @@ void gpio_set(unsigned int pin, unsigned int value)
  * the following functionality:
  *   Returns 0 if the pin'th pin is clear, otherwise returns 1.
  */
-unsigned int gpio_get(unsigned int pin)
+unsigned int gpio_get_trap(unsigned int pin)
 {
 	/* It is important that this local variable be an unsigned long.
 	 * The tracer will modify the value of this variable using
@@ -95,6 +95,19 @@ unsigned int gpio_get(unsigned int pin)
 
 }
 
+/* gpio_get()
+ *
+ * in:     pin   - the pin number to get.
+ * out:    none
+ * return: the value of the pin'th pin, either 0 or 1.
+ *
+ * Like the framework's gpio_get(), but always traps.
+ */
+unsigned int gpio_get(unsigned int pin)
+{
+	return gpio_get_trap(pin);
+}
+
 /* This word in memory represents our emulated IO registers.
  * When we fork(), we will get a new child process that is a (nearly)
  * identical copy of the parent.  Consequently, both the parent and the
@@ -147,6 +160,31 @@ void set_status_pin_test(void);
 void get_reset_pin_test(void);
 void write_and_read_all_pages_test(void);
 void erase_all_blocks_test(void);
+void independent_targets_test(void);
+void overlapped_targets_test(void);
+void interleaved_targets_test(void);
+void multi_cycle_address_test(void);
+void snapshot_restore_test(void);
+void sparse_store_test(void);
+void image_test(void);
+
+/* Geometry for multi_cycle_address_test(): 3 block address cycles,
+ * 2 page address cycles, and 2 byte address cycles, for 128 GiB.
+ */
+#define BIG_NUM_BLOCKS 0x20000
+#define BIG_NUM_PAGES  0x200
+#define BIG_NUM_BYTES  0x800
+
+/* Which pass of image_test() the child tracee runs.  The parent sets
+ * it before each fork() and reopens the image in between.
+ */
+enum image_pass {
+	IMAGE_WRITE,      /* shared image: program blocks 3 and 4 */
+	IMAGE_ERASE,      /* shared image reopened: check, erase block 4 */
+	IMAGE_PRIVATE,    /* copy-on-write: check, erase 3, program 4 */
+	IMAGE_UNCHANGED   /* shared image again: check */
+};
+static enum image_pass image_pass;
 
 /*
  * tester_main()
@@ -184,6 +222,59 @@ int tester_main(void)
 	get_reset_pin_test();
 	//write_and_read_all_pages_test(); // takes ~1 hour to run this test
 	erase_all_blocks_test();
+	independent_targets_test();
+	overlapped_targets_test();
+	interleaved_targets_test();
+	snapshot_restore_test();
+	sparse_store_test();
+
+	return 0;
+}
+
+/*
+ * image_tester_main()
+ *
+ * in:     none
+ * out:    none
+ * return: none
+ *
+ * This is the "main" routine for the child tracee when the device's
+ * storage is an image file.
+ */
+int image_tester_main(void)
+{
+	pid_t child_pid;          /* my pid, the child tracee */
+
+	/* Initiate a trace and pause, just as tester_main() does. */
+	ptrace(PTRACE_TRACEME, 0, NULL, NULL);
+	child_pid = getpid();
+	kill(child_pid, SIGTRAP);
+
+	image_test();
+
+	return 0;
+}
+
+/*
+ * big_tester_main()
+ *
+ * in:     none
+ * out:    none
+ * return: none
+ *
+ * This is the "main" routine for the child tracee when the device
+ * has the BIG_* geometry.
+ */
+int big_tester_main(void)
+{
+	pid_t child_pid;          /* my pid, the child tracee */
+
+	/* Initiate a trace and pause, just as tester_main() does. */
+	ptrace(PTRACE_TRACEME, 0, NULL, NULL);
+	child_pid = getpid();
+	kill(child_pid, SIGTRAP);
+
+	multi_cycle_address_test();
 
 	return 0;
 }
@@ -1040,7 +1131,428 @@ void erase_all_blocks_test()
 	}
 }
 
-int main()
+/*
+ * write_target_page()
+ *
+ * in:     block - block address of the page to write
+ *         value - value to write to every byte of the page
+ * out:    none
+ * return: none
+ *
+ * Writes page 0 of block on the selected target and waits for the
+ * write to complete.
+ */
+static void write_target_page(unsigned char block, unsigned char value)
+{
+	ioregisters = C_PROGRAM_SETUP << COMMAND_SHIFT;
+	ioregisters = C_PROGRAM_SETUP << COMMAND_SHIFT | (block << 8); /* block address */
+	ioregisters = C_PROGRAM_SETUP << COMMAND_SHIFT | 0x00000000; /* page address */
+	ioregisters = C_PROGRAM_SETUP << COMMAND_SHIFT | 0x00000000; /* byte address */
+
+	for (int i=0;i<256;i++) {
+		ioregisters = (C_DUMMY << COMMAND_SHIFT) | value;
+	}
+	ioregisters = C_PROGRAM_EXECUTE << COMMAND_SHIFT;
+
+	wait_for_device();
+}
+
+/*
+ * check_target_page()
+ *
+ * in:     block - block address of the page to read
+ *         value - value expected in every byte of the page
+ * out:    none
+ * return: none
+ *
+ * Reads page 0 of block on the selected target.  Asserts if any byte
+ * is not value.
+ */
+static void check_target_page(unsigned char block, unsigned char value)
+{
+	ioregisters = C_READ_SETUP << COMMAND_SHIFT;
+	ioregisters = C_READ_SETUP << COMMAND_SHIFT | (block << 8); /* block address */
+	ioregisters = C_READ_SETUP << COMMAND_SHIFT | 0x00000000; /* page address */
+	ioregisters = C_READ_SETUP << COMMAND_SHIFT | 0x00000000; /* byte address */
+
+	ioregisters = C_READ_EXECUTE << COMMAND_SHIFT;
+
+	wait_for_device();
+
+	for (int i=0;i<256;i++) {
+		assert(((ioregisters & MASK_DATA) == value) &&
+		       "expected (ioregisters & MASK_DATA) == value");
+	}
+}
+
+/*
+ * erase_target_block()
+ *
+ * in:     block - block address of the block to erase
+ * out:    none
+ * return: none
+ *
+ * Erases block on the selected target and waits for the erase to
+ * complete.
+ */
+static void erase_target_block(unsigned char block)
+{
+	ioregisters = C_ERASE_SETUP << COMMAND_SHIFT;
+	ioregisters = C_ERASE_SETUP << COMMAND_SHIFT | (block << 8); /* block address */
+	ioregisters = C_ERASE_EXECUTE << COMMAND_SHIFT;
+
+	wait_for_device();
+}
+
+/*
+ * independent_targets_test()
+ *
+ * in:     none
+ * out:    none
+ * return: none
+ *
+ * Writes different data to the same page on two chip-enable targets
+ * and reads both back.  Asserts if either target sees the other's
+ * data or if gpio_get() reports the wrong selected target.
+ */
+void independent_targets_test()
+{
+	gpio_set(PN_CHIP_SELECT, 1);
+	write_target_page(0x10, 0x11);
+	gpio_set(PN_CHIP_SELECT, 0);
+	write_target_page(0x10, 0x22);
+
+	gpio_set(PN_CHIP_SELECT, 1);
+	assert((gpio_get(PN_CHIP_SELECT) == 1) &&
+	       "expected gpio_get(PN_CHIP_SELECT) == 1");
+	check_target_page(0x10, 0x11);
+	gpio_set(PN_CHIP_SELECT, 0);
+	assert((gpio_get(PN_CHIP_SELECT) == 0) &&
+	       "expected gpio_get(PN_CHIP_SELECT) == 0");
+	check_target_page(0x10, 0x22);
+}
+
+/*
+ * overlapped_targets_test()
+ *
+ * in:     none
+ * out:    none
+ * return: none
+ *
+ * Starts an erase on one chip-enable target and, while it is still
+ * busy, writes and reads a page on another.  Asserts if the erasing
+ * target's status pin does not report it busy, if the other target
+ * is not ready, or if the data is wrong.
+ */
+void overlapped_targets_test()
+{
+	gpio_set(PN_CHIP_SELECT, 2);
+	write_target_page(0x20, 0x33);
+
+	ioregisters = C_ERASE_SETUP << COMMAND_SHIFT;
+	ioregisters = C_ERASE_SETUP << COMMAND_SHIFT | 0x00002000; /* block address */
+	ioregisters = C_ERASE_EXECUTE << COMMAND_SHIFT;
+
+	assert((gpio_get(PN_STATUS_TARGET(2)) == DEVICE_BUSY) &&
+	       "expected gpio_get(PN_STATUS_TARGET(2)) == DEVICE_BUSY");
+
+	gpio_set(PN_CHIP_SELECT, 3);
+	assert((gpio_get(PN_STATUS) == DEVICE_READY) &&
+	       "expected gpio_get(PN_STATUS) == DEVICE_READY");
+	write_target_page(0x20, 0x44);
+	check_target_page(0x20, 0x44);
+
+	while (gpio_get(PN_STATUS_TARGET(2)) != DEVICE_READY) {
+		usleep(BUSY_SLEEP_DURATION);
+	}
+	gpio_set(PN_CHIP_SELECT, 2);
+	check_target_page(0x20, 0x00);
+	gpio_set(PN_CHIP_SELECT, 0);
+}
+
+/*
+ * interleaved_targets_test()
+ *
+ * in:     none
+ * out:    none
+ * return: none
+ *
+ * Begins a read on one chip-enable target, switches to another
+ * target partway through the address cycle and again partway through
+ * reading the page, and finishes each operation after switching back.
+ * Asserts if any target returns the wrong data.
+ */
+void interleaved_targets_test()
+{
+	gpio_set(PN_CHIP_SELECT, 1);
+	ioregisters = C_READ_SETUP << COMMAND_SHIFT;
+	ioregisters = C_READ_SETUP << COMMAND_SHIFT | 0x00001000; /* block address */
+
+	gpio_set(PN_CHIP_SELECT, 0);
+	ioregisters = C_READ_SETUP << COMMAND_SHIFT;
+	ioregisters = C_READ_SETUP << COMMAND_SHIFT | 0x00001000; /* block address */
+	ioregisters = C_READ_SETUP << COMMAND_SHIFT | 0x00000000; /* page address */
+	ioregisters = C_READ_SETUP << COMMAND_SHIFT | 0x00000000; /* byte address */
+	ioregisters = C_READ_EXECUTE << COMMAND_SHIFT;
+	wait_for_device();
+	for (int i=0;i<128;i++) {
+		assert(((ioregisters & MASK_DATA) == 0x22) &&
+		       "expected (ioregisters & MASK_DATA) == 0x22");
+	}
+
+	gpio_set(PN_CHIP_SELECT, 1);
+	ioregisters = C_READ_SETUP << COMMAND_SHIFT | 0x00000000; /* page address */
+	ioregisters = C_READ_SETUP << COMMAND_SHIFT | 0x00000000; /* byte address */
+	ioregisters = C_READ_EXECUTE << COMMAND_SHIFT;
+	wait_for_device();
+	for (int i=0;i<256;i++) {
+		assert(((ioregisters & MASK_DATA) == 0x11) &&
+		       "expected (ioregisters & MASK_DATA) == 0x11");
+	}
+
+	gpio_set(PN_CHIP_SELECT, 0);
+	for (int i=128;i<256;i++) {
+		assert(((ioregisters & MASK_DATA) == 0x22) &&
+		       "expected (ioregisters & MASK_DATA) == 0x22");
+	}
+}
+
+/*
+ * snapshot_restore_test()
+ *
+ * in:     none
+ * out:    none
+ * return: none
+ *
+ * Programs a page, snapshots the device, then overwrites the page and
+ * erases its block.  Restoring the snapshot must bring the page's
+ * first contents back.  Then snapshots the device part way through
+ * reading the page and reads the rest of it twice, restoring the
+ * snapshot in between; the second read must pick up exactly where
+ * the first one did.
+ */
+void snapshot_restore_test()
+{
+	/* Program block 5 page 0 with each byte's number and snapshot. */
+	ioregisters = C_PROGRAM_SETUP << COMMAND_SHIFT;
+	ioregisters = C_PROGRAM_SETUP << COMMAND_SHIFT | 0x00000500; /* block address */
+	ioregisters = C_PROGRAM_SETUP << COMMAND_SHIFT | 0x00000000; /* page address */
+	ioregisters = C_PROGRAM_SETUP << COMMAND_SHIFT | 0x00000000; /* byte address */
+	for (int i=0;i<256;i++) {
+		ioregisters = (C_DUMMY << COMMAND_SHIFT) | i;
+	}
+	ioregisters = C_PROGRAM_EXECUTE << COMMAND_SHIFT;
+	wait_for_device();
+
+	gpio_set(PN_SNAPSHOT, 0);
+
+	/* Overwrite it with 0x22, then erase its block. */
+	ioregisters = C_PROGRAM_SETUP << COMMAND_SHIFT;
+	ioregisters = C_PROGRAM_SETUP << COMMAND_SHIFT | 0x00000500; /* block address */
+	ioregisters = C_PROGRAM_SETUP << COMMAND_SHIFT | 0x00000000; /* page address */
+	ioregisters = C_PROGRAM_SETUP << COMMAND_SHIFT | 0x00000000; /* byte address */
+	for (int i=0;i<256;i++) {
+		ioregisters = (C_DUMMY << COMMAND_SHIFT) | 0x22;
+	}
+	ioregisters = C_PROGRAM_EXECUTE << COMMAND_SHIFT;
+	wait_for_device();
+
+	ioregisters = C_ERASE_SETUP << COMMAND_SHIFT;
+	ioregisters = C_ERASE_SETUP << COMMAND_SHIFT | 0x00000500; /* block address */
+	ioregisters = C_ERASE_EXECUTE << COMMAND_SHIFT;
+	wait_for_device();
+
+	/* Restore, and read the first 16 bytes back. */
+	gpio_set(PN_RESTORE, 0);
+
+	ioregisters = C_READ_SETUP << COMMAND_SHIFT;
+	ioregisters = C_READ_SETUP << COMMAND_SHIFT | 0x00000500; /* block address */
+	ioregisters = C_READ_SETUP << COMMAND_SHIFT | 0x00000000; /* page address */
+	ioregisters = C_READ_SETUP << COMMAND_SHIFT | 0x00000000; /* byte address */
+	ioregisters = C_READ_EXECUTE << COMMAND_SHIFT;
+	wait_for_device();
+
+	for (int i=0;i<16;i++) {
+		assert(((ioregisters & MASK_DATA) == i) &&
+		       "expected (ioregisters & MASK_DATA) == i");
+	}
+
+	/* Snapshot mid-read, then read the rest of the page twice. */
+	gpio_set(PN_SNAPSHOT, 1);
+	for (int pass=0;pass<2;pass++) {
+		for (int i=16;i<256;i++) {
+			assert(((ioregisters & MASK_DATA) == i) &&
+			       "expected (ioregisters & MASK_DATA) == i");
+		}
+		gpio_set(PN_RESTORE, 1);
+	}
+
+	ioregisters = C_ERASE_SETUP << COMMAND_SHIFT;
+	ioregisters = C_ERASE_SETUP << COMMAND_SHIFT | 0x00000500; /* block address */
+	ioregisters = C_ERASE_EXECUTE << COMMAND_SHIFT;
+	wait_for_device();
+}
+
+/*
+ * sparse_store_test()
+ *
+ * in:     none
+ * out:    none
+ * return: none
+ *
+ * Reads a block that was never programmed, then programs it, erases
+ * it, and programs it again.  Asserts if the never-programmed and
+ * erased pages do not read as all-zeroes, if the erase disturbs the
+ * neighbouring block, or if the page does not take its new data
+ * after the erase.
+ */
+void sparse_store_test()
+{
+	check_target_page(0x40, 0x00);
+
+	write_target_page(0x40, 0x55);
+	write_target_page(0x41, 0x66);
+	erase_target_block(0x40);
+	check_target_page(0x40, 0x00);
+	check_target_page(0x41, 0x66);
+
+	write_target_page(0x40, 0x77);
+	check_target_page(0x40, 0x77);
+
+	erase_target_block(0x40);
+	erase_target_block(0x41);
+}
+
+/*
+ * image_test()
+ *
+ * in:     none
+ * out:    none
+ * return: none
+ *
+ * Runs the image_pass pass of the image file test.  The first pass
+ * programs two blocks of a shared image.  The second, after the
+ * image is reopened, checks that both persisted and erases one.  The
+ * third, on the same file opened copy-on-write, checks that the
+ * erase persisted too, then erases the other block and reprograms
+ * the first.  The last, on the shared image again, checks that the
+ * copy-on-write pass left the file unchanged.  Asserts if any page
+ * holds the wrong data.
+ */
+void image_test()
+{
+	switch (image_pass) {
+
+	case IMAGE_WRITE:
+		write_target_page(0x03, 0x5A);
+		write_target_page(0x04, 0x6B);
+		check_target_page(0x03, 0x5A);
+		check_target_page(0x04, 0x6B);
+		break;
+
+	case IMAGE_ERASE:
+		check_target_page(0x03, 0x5A);
+		check_target_page(0x04, 0x6B);
+		erase_target_block(0x04);
+		check_target_page(0x04, 0x00);
+		check_target_page(0x03, 0x5A);
+		break;
+
+	case IMAGE_PRIVATE:
+		check_target_page(0x03, 0x5A);
+		check_target_page(0x04, 0x00);
+		erase_target_block(0x03);
+		check_target_page(0x03, 0x00);
+		write_target_page(0x04, 0x7C);
+		check_target_page(0x04, 0x7C);
+		break;
+
+	case IMAGE_UNCHANGED:
+		check_target_page(0x03, 0x5A);
+		check_target_page(0x04, 0x00);
+		break;
+	}
+}
+
+/*
+ * multi_cycle_address_test()
+ *
+ * in:     none
+ * out:    none
+ * return: none
+ *
+ * Writes a page whose block, page, and byte addresses each take more
+ * than one address cycle, reads part of it back from a byte offset
+ * that also takes more than one cycle, and then reads the page whose
+ * address differs only in the high cycles.  Asserts if the data read
+ * is wrong or if the second page is not all-zeroes.
+ */
+void multi_cycle_address_test()
+{
+	ioregisters = C_PROGRAM_SETUP << COMMAND_SHIFT;
+	ioregisters = C_PROGRAM_SETUP << COMMAND_SHIFT | 0x00000300; /* block address, low */
+	ioregisters = C_PROGRAM_SETUP << COMMAND_SHIFT | 0x00000200; /* block address */
+	ioregisters = C_PROGRAM_SETUP << COMMAND_SHIFT | 0x00000100; /* block address, high */
+	ioregisters = C_PROGRAM_SETUP << COMMAND_SHIFT | 0x0000A500; /* page address, low */
+	ioregisters = C_PROGRAM_SETUP << COMMAND_SHIFT | 0x00000100; /* page address, high */
+	ioregisters = C_PROGRAM_SETUP << COMMAND_SHIFT | 0x00000000; /* byte address, low */
+	ioregisters = C_PROGRAM_SETUP << COMMAND_SHIFT | 0x00000000; /* byte address, high */
+
+	for (int i=0;i<BIG_NUM_BYTES;i++) {
+		ioregisters = (C_DUMMY << COMMAND_SHIFT) | (i >> 8);
+	}
+	ioregisters = C_PROGRAM_EXECUTE << COMMAND_SHIFT;
+
+	wait_for_device();
+
+	ioregisters = C_READ_SETUP << COMMAND_SHIFT;
+	ioregisters = C_READ_SETUP << COMMAND_SHIFT | 0x00000300; /* block address, low */
+	ioregisters = C_READ_SETUP << COMMAND_SHIFT | 0x00000200; /* block address */
+	ioregisters = C_READ_SETUP << COMMAND_SHIFT | 0x00000100; /* block address, high */
+	ioregisters = C_READ_SETUP << COMMAND_SHIFT | 0x0000A500; /* page address, low */
+	ioregisters = C_READ_SETUP << COMMAND_SHIFT | 0x00000100; /* page address, high */
+	ioregisters = C_READ_SETUP << COMMAND_SHIFT | 0x00000000; /* byte address, low */
+	ioregisters = C_READ_SETUP << COMMAND_SHIFT | 0x00000500; /* byte address, high */
+
+	ioregisters = C_READ_EXECUTE << COMMAND_SHIFT;
+
+	wait_for_device();
+
+	for (int i=0x500;i<BIG_NUM_BYTES;i++) {
+		assert(((ioregisters & MASK_DATA) == (i >> 8)) &&
+		       "expected (ioregisters & MASK_DATA) == (i >> 8)");
+	}
+
+	ioregisters = C_READ_SETUP << COMMAND_SHIFT;
+	ioregisters = C_READ_SETUP << COMMAND_SHIFT | 0x00000300; /* block address, low */
+	ioregisters = C_READ_SETUP << COMMAND_SHIFT | 0x00000200; /* block address */
+	ioregisters = C_READ_SETUP << COMMAND_SHIFT | 0x00000000; /* block address, high */
+	ioregisters = C_READ_SETUP << COMMAND_SHIFT | 0x0000A500; /* page address, low */
+	ioregisters = C_READ_SETUP << COMMAND_SHIFT | 0x00000000; /* page address, high */
+	ioregisters = C_READ_SETUP << COMMAND_SHIFT | 0x00000000; /* byte address, low */
+	ioregisters = C_READ_SETUP << COMMAND_SHIFT | 0x00000000; /* byte address, high */
+
+	ioregisters = C_READ_EXECUTE << COMMAND_SHIFT;
+
+	wait_for_device();
+
+	for (int i=0;i<BIG_NUM_BYTES;i++) {
+		assert(((ioregisters & MASK_DATA) == 0x00) &&
+		       "expected (ioregisters & MASK_DATA) == 0x00");
+	}
+}
+
+/*
+ * run_tests()
+ *
+ * in:     child_main - "main" routine for the child tracee
+ * out:    none
+ * return: none
+ *
+ * Forks a child tracee to run child_main and emulates the device for
+ * it until it exits.
+ */
+static void run_tests(int (*child_main)(void))
 {
 	pid_t child_pid;          /* receives what fork() gives us. */
 
@@ -1051,13 +1563,62 @@ int main()
 		exit(-1);
 
 	case 0:  /* I am the child. */
-		tester_main();
-		break;
+		exit(child_main());
 
 	default: /* I am the parent; child_pid holds child pid. */
 		device_init(&ioregisters, child_pid);
 	}
+}
+
+/*
+ * run_image_tests()
+ *
+ * in:     none
+ * out:    none
+ * return: none
+ *
+ * Runs every pass of image_test() against a temporary image file,
+ * opening the file afresh for each pass.
+ */
+static void run_image_tests(void)
+{
+	char path[] = "/tmp/test_device_XXXXXX";  /* the image file */
+	int fd;                                     /* from mkstemp() */
+
+	fd = mkstemp(path);
+	assert((fd >= 0) && "expected mkstemp() >= 0");
+	close(fd);
+
+	for (image_pass = IMAGE_WRITE; image_pass <= IMAGE_UNCHANGED;
+	     image_pass++) {
+		assert((device_init_image(path,
+			image_pass == IMAGE_PRIVATE) == 0) &&
+		       "expected device_init_image() == 0");
+		run_tests(image_tester_main);
+		device_sync_image();
+	}
+
+	unlink(path);
+}
+
+int main()
+{
+	run_tests(tester_main);
+
+	/* Run the multiple-cycle addressing test on a much larger
+	 * device.  Choose its geometry before fork()ing so the child
+	 * sees it too.
+	 */
+	assert((geometry_init(BIG_NUM_BLOCKS, BIG_NUM_PAGES,
+		BIG_NUM_BYTES) == 0) && "expected geometry_init() == 0");
+	run_tests(big_tester_main);
+
+	/* Test image files last, on the default geometry, as the image
+	 * stays open once device_init_image() opens it.
+	 */
+	assert((geometry_init(DEFAULT_NUM_BLOCKS, DEFAULT_NUM_PAGES,
+		DEFAULT_NUM_BYTES) == 0) && "expected geometry_init() == 0");
+	run_image_tests();
 
-	/* Both child and parent end up here. */
 	exit(0);
 }
@@ -14,10 +14,20 @@
 
 volatile unsigned long* driver_ioregister;
 
+/* Built with -DIOREG_ACCESSORS (test_mailbox_alpha_0), this driver
+ * reaches the IO registers through the framework's ioreg_readb() and
+ * ioreg_writeb() accessors, which --shared-memory turns into trap-free
+ * mailbox accesses.  Otherwise it dereferences them itself.
+ */
+
 // Resets the nand device to its inital state
 void nand_set_register(unsigned char offset, unsigned char value)
 {
+#ifdef IOREG_ACCESSORS
+	ioreg_writeb(value, (unsigned char*)driver_ioregister + offset);
+#else
 	*((unsigned char*)driver_ioregister + offset) = value;
+#endif
 }
 
 // Waits for device status to be ready for an action
@@ -28,8 +38,13 @@ int nand_wait(unsigned int interval_us)
 	 * monotonically with clock ticks.  The now() function has
 	 * similar behavior.
 	 */
-	timeus_t timeout = now() + interval_us;
+	timeus_t timeout;
+
+	/* Sleep until the device's ready interrupt when there is one. */
+	if (irq_enabled())
+		return irq_wait_ready(interval_us);
 
+	timeout = now() + interval_us;
 	do {
 		if (gpio_get(PN_STATUS) == DEVICE_READY) {
 			return 0;
@@ -44,7 +59,12 @@ int nand_wait(unsigned int interval_us)
 void nand_read(unsigned char *buffer, unsigned int length)
 {
 	while (length--) {
+#ifdef IOREG_ACCESSORS
+		*buffer++ = ioreg_readb((unsigned char*)driver_ioregister +
+			IOREG_DATA);
+#else
 		*buffer++ = *((unsigned char*)driver_ioregister + IOREG_DATA);
+#endif
 	}
 }
 
@@ -52,18 +72,33 @@ void nand_read(unsigned char *buffer, unsigned int length)
 void nand_program(unsigned char *buffer, unsigned int length)
 {
 	while (length--) {
+#ifdef IOREG_ACCESSORS
+		ioreg_writeb(*buffer++,
+			(unsigned char*)driver_ioregister + IOREG_DATA);
+#else
 		*((unsigned char*)driver_ioregister + IOREG_DATA) = 
 			*buffer++;
+#endif
 	}
 }
 
+// Points the DMA registers at buffer for a C_READ_DMA or C_PROGRAM_DMA
+void nand_dma(unsigned char *buffer, unsigned int length)
+{
+	*(volatile unsigned long *)((unsigned char*)driver_ioregister +
+		IOREG_DMA_ADDRESS) = (unsigned long)buffer;
+	*(volatile unsigned long *)((unsigned char*)driver_ioregister +
+		IOREG_DMA_LENGTH) = length;
+}
+
 struct nand_driver get_driver()
 {
 	struct nand_jump_table njt = {
 		.read_buffer = nand_read,
 		.set_register = nand_set_register,
 		.wait_ready = nand_wait,
-		.write_buffer = nand_program
+		.write_buffer = nand_program,
+		.dma_buffer = nand_dma
 	};
 
 	struct nand_driver nd = {
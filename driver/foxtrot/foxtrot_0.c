@@ -29,8 +29,13 @@ int nand_wait(unsigned int interval_us)
 	 * monotonically with clock ticks.  The now() function has
 	 * similar behavior.
 	 */
-	timeus_t timeout = now() + interval_us;
+	timeus_t timeout;
 
+	/* Sleep until the device's ready interrupt when there is one. */
+	if (irq_enabled())
+		return irq_wait_ready(interval_us);
+
+	timeout = now() + interval_us;
 	do {
 		if (gpio_get(PN_STATUS) == DEVICE_READY) {
 			return 0;
@@ -61,6 +66,15 @@ void nand_program(const unsigned char* buffer, unsigned int length)
 
 }
 
+// Points the DMA registers at buffer for a C_READ_DMA or C_PROGRAM_DMA
+void nand_dma(unsigned char* buffer, unsigned int length)
+{
+	*(volatile unsigned long *)((unsigned char*)driver_ioregister +
+		IOREG_DMA_ADDRESS) = (unsigned long)buffer;
+	*(volatile unsigned long *)((unsigned char*)driver_ioregister +
+		IOREG_DMA_LENGTH) = length;
+}
+
 // Performs functionality simular to exec_op in linux kernal
 // Returns 0 on success
 int exec_op(struct nand_operation *commands)
@@ -91,6 +105,11 @@ int exec_op(struct nand_operation *commands)
 			nand_read(command.ctx.data_out.buf,
 				command.ctx.data_out.len);
 			break;
+		case NAND_OP_DMA_INSTR:
+			nand_dma(command.ctx.dma.buf, command.ctx.dma.len);
+			nand_set_register(IOREG_COMMAND,
+				command.ctx.dma.opcode);
+			break;
 		case NAND_OP_WAITRDY_INSTR:
 			if (nand_wait(command.ctx.waitrdy.timeout_ms))
 				return -1;  /* timeout */
@@ -108,6 +127,7 @@ struct nand_driver get_driver()
 {
 	struct nand_driver nd = {
 		.type = NAND_EXEC_OP,
+		.flags = NAND_DRIVER_DMA,
 		.operation.exec_op = exec_op,
 	};
 	return nd;
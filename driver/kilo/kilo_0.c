@@ -23,21 +23,18 @@ int exec_op(struct nand_operation *commands);
 
 volatile unsigned long* driver_ioregister;
 
-struct nand_storage_chip kilo_storage_chip = {
-	.nblocks = NUM_BLOCKS,
-	.npages_per_block = NUM_PAGES,
-	.nbytes_per_page = NUM_BYTES,
-	.ref_count = 1,
-	.next_storage = NULL,
-	.controller = NULL    /* set this during initialization */
-};
+/* Room for one storage chip for each of the device's chip-enable
+ * targets.  register_nand_device() lists as many as the original DIB
+ * does: one, unless the test stripes across the targets.
+ */
+struct nand_storage_chip kilo_storage_chips[NUM_TARGETS];
 
 struct nand_controller_chip kilo_controller_chip = {
 	.exec_op = exec_op,
 	.nstorage = NAND_STORAGE_CHIPS_PER_CONTROLLER,
 	.ref_count = NAND_STORAGE_CHIPS_PER_CONTROLLER,
-	.first_storage = &kilo_storage_chip,
-	.last_storage = &kilo_storage_chip
+	.first_storage = &kilo_storage_chips[0],
+	.last_storage = &kilo_storage_chips[0]
 };
 
 struct nand_device kilo_device = {
@@ -62,8 +59,13 @@ int nand_wait(unsigned int interval_us)
 	 * monotonically with clock ticks.  The now() function has
 	 * similar behavior.
 	 */
-	timeus_t timeout = now() + interval_us;
+	timeus_t timeout;
 
+	/* Sleep until the device's ready interrupt when there is one. */
+	if (irq_enabled())
+		return irq_wait_ready(interval_us);
+
+	timeout = now() + interval_us;
 	do {
 		if (gpio_get(PN_STATUS) == DEVICE_READY) {
 			return 0;
@@ -94,6 +96,15 @@ void nand_program(const unsigned char* buffer, unsigned int length)
 
 }
 
+// Points the DMA registers at buffer for a C_READ_DMA or C_PROGRAM_DMA
+void nand_dma(unsigned char* buffer, unsigned int length)
+{
+	*(volatile unsigned long *)((unsigned char*)driver_ioregister +
+		IOREG_DMA_ADDRESS) = (unsigned long)buffer;
+	*(volatile unsigned long *)((unsigned char*)driver_ioregister +
+		IOREG_DMA_LENGTH) = length;
+}
+
 // Performs functionality simular to exec_op in linux kernal
 // Returns 0 on success
 int exec_op(struct nand_operation *commands)
@@ -123,6 +134,11 @@ int exec_op(struct nand_operation *commands)
 			nand_read(command.ctx.data_out.buf,
 				command.ctx.data_out.len);
 			break;
+		case NAND_OP_DMA_INSTR:
+			nand_dma(command.ctx.dma.buf, command.ctx.dma.len);
+			nand_set_register(IOREG_COMMAND,
+				command.ctx.dma.opcode);
+			break;
 		case NAND_OP_WAITRDY_INSTR:
 			if (nand_wait(command.ctx.waitrdy.timeout_ms))
 				return -1;  /* timeout */
@@ -152,11 +168,38 @@ int exec_op(struct nand_operation *commands)
 
 struct nand_device *register_nand_device(struct nand_device *old_dib)
 {
+	unsigned int nstorage = NAND_STORAGE_CHIPS_PER_CONTROLLER;
+
 	/* Refuse to interact with a malformed initial DIB. */
 	if (verify_dib(old_dib)) return NULL;
 
+	/* Describe as many of the device's storage chips as the
+	 * original DIB does.
+	 */
+	if (old_dib && (old_dib->controller->nstorage > nstorage) &&
+	    (old_dib->controller->nstorage <= NUM_TARGETS))
+		nstorage = old_dib->controller->nstorage;
+
+	/* Link our storage chips into a list whose ends point back to
+	 * our controller.
+	 */
+	for (unsigned int i = 0; i < nstorage; i++) {
+		kilo_storage_chips[i].nblocks = NUM_BLOCKS;
+		kilo_storage_chips[i].npages_per_block = NUM_PAGES;
+		kilo_storage_chips[i].nbytes_per_page = NUM_BYTES;
+		kilo_storage_chips[i].ref_count = 1;
+		kilo_storage_chips[i].next_storage =
+			(i + 1 < nstorage ? &kilo_storage_chips[i + 1] : NULL);
+		kilo_storage_chips[i].controller = NULL;
+	}
+	kilo_storage_chips[0].controller = &kilo_controller_chip;
+	kilo_storage_chips[nstorage - 1].controller = &kilo_controller_chip;
+	kilo_controller_chip.nstorage = nstorage;
+	kilo_controller_chip.ref_count = nstorage;
+	kilo_controller_chip.last_storage = &kilo_storage_chips[nstorage - 1];
+	kilo_device.ref_count = nstorage + 1;
+
 	/* Link our device into a new DIB. */
-	kilo_storage_chip.controller = &kilo_controller_chip;
 	kilo_device.next_device = old_dib;
 	return &kilo_device;  /* our device is the first in the new DIB */
 }
@@ -174,6 +217,7 @@ struct nand_driver get_driver()
 {
 	struct nand_driver ret = {
 		.type = NAND_EXEC_OP,
+		.flags = NAND_DRIVER_DMA,
 		.operation.exec_op = kilo_device.controller->exec_op,
 	};
 	return ret;
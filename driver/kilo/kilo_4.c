@@ -24,9 +24,6 @@ int exec_op(struct nand_operation *commands);
 volatile unsigned long* driver_ioregister;
 
 struct nand_storage_chip kilo_storage_chip = {
-	.nblocks = NUM_BLOCKS,
-	.npages_per_block = NUM_PAGES,
-	.nbytes_per_page = NUM_BYTES,
 	.ref_count = 0, /* BUG: bad reference count. */
 	.next_storage = NULL,
 	.controller = NULL    /* set this during initialization */
@@ -155,6 +152,11 @@ struct nand_device *register_nand_device(struct nand_device *old_dib)
 	/* Refuse to interact with a malformed initial DIB. */
 	if (verify_dib(old_dib)) return NULL;
 
+	/* Describe the geometry the device has been given. */
+	kilo_storage_chip.nblocks = NUM_BLOCKS;
+	kilo_storage_chip.npages_per_block = NUM_PAGES;
+	kilo_storage_chip.nbytes_per_page = NUM_BYTES;
+
 	/* Link our device into a new DIB. */
 	kilo_storage_chip.controller = &kilo_controller_chip;
 	kilo_device.next_device = old_dib;
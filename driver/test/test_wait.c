@@ -59,6 +59,25 @@ gpio_get(unsigned int pin) {
 }
 
 
+/* irq_enabled()
+ * irq_wait_ready()
+ *
+ * These stub functions replace the framework's ready interrupt
+ * functions so the drivers link.  This unit test never enables
+ * interrupts; it tests how drivers poll.
+ */
+
+int
+irq_enabled(void) {
+	return 0;
+}
+
+int
+irq_wait_ready(unsigned int interval_us) {
+	return -1;
+}
+
+
 /* invoke_nand_wait()
  *
  * in:     p_nd - pointer to driver configuration containing jump table
@@ -3,16 +3,62 @@
 #include <sys/types.h>
 #include <sys/ptrace.h>
 #include <signal.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
+#include "histogram.h"
+#include "device_emu.h"
 #include "fw_jumptable.h"
 #include "fw_execop.h"
+#include "fw_stripe.h"
+#include "fw_vector.h"
+#include "fw_cache.h"
+#include "fw_coalesce.h"
 #include "framework.h"
+#include "fw_ring.h"
 #include "driver.h"
 
 
 struct nand_driver driver;
 
+/* False when the device emulator runs in this process rather than in
+ * a parent tracer, in which case there is no tracer to hand over to.
+ */
+static bool traced = true;
+
+/* True when framework_init_stats() has asked for histograms of how
+ * long each read_nand(), write_nand(), erase_nand(), readv_nand(),
+ * and writev_nand() call takes.
+ */
+static bool stats;
+static struct histogram write_latency = HISTOGRAM_INIT("write_nand() call");
+static struct histogram read_latency  = HISTOGRAM_INIT("read_nand() call");
+static struct histogram erase_latency = HISTOGRAM_INIT("erase_nand() call");
+static struct histogram writev_latency = HISTOGRAM_INIT("writev_nand() call");
+static struct histogram readv_latency  = HISTOGRAM_INIT("readv_nand() call");
+
+
+/* init_framework_in_process()
+ *
+ * in:     nothing
+ * out:    traced cleared via side effect
+ * return: nothing
+ *
+ * Call this before init_framework() when the device emulator runs in
+ * this same process.  Tells init_framework() not to make this process
+ * a ptrace() tracee and not to stop for a tracer that doesn't exist.
+ *
+ */
+
+void
+init_framework_in_process(void) {
+	traced = false;
+} /* init_framework_in_process() */
+
+
 struct nand_device *
 init_framework(volatile unsigned long *ioregister,
 	struct nand_device *old_dib) {
@@ -22,20 +68,30 @@ init_framework(volatile unsigned long *ioregister,
 	new_dib = init_nand_driver(ioregister, old_dib);
 	driver = get_driver();
 
-	/* Initiate a trace.  Parent is the tracer, child is the tracee. */
-	ptrace(0, 0, NULL, NULL);
+	if (traced) {
+		/* Initiate a trace.  Parent is the tracer, child is
+		 * the tracee.
+		 */
+		ptrace(0, 0, NULL, NULL);
 
-	/* Child pauses itself so that parent can set up watchpoints. */
-	kill(getpid(), 5);
+		/* Child pauses itself so that parent can set up
+		 * watchpoints.
+		 */
+		kill(getpid(), 5);
+	}
 
 	return new_dib;
 }
 
 
-int
-write_nand(unsigned char *buffer, unsigned int offset, unsigned int size) {
+static int
+dispatch_write(unsigned char *buffer, unsigned long offset, unsigned int size) {
 	
-	if (driver.type == NAND_JUMP_TABLE)
+	if (stripe_enabled())
+	{
+		return stripe_write(buffer, offset, size);
+	}
+	else if (driver.type == NAND_JUMP_TABLE)
 	{
 		return jt_write(buffer, offset, size);
 	}
@@ -47,10 +103,14 @@ write_nand(unsigned char *buffer, unsigned int offset, unsigned int size) {
 }
 
 
-int
-read_nand(unsigned char *buffer, unsigned int offset, unsigned int size) {
+static int
+dispatch_read(unsigned char *buffer, unsigned long offset, unsigned int size) {
 	
-	if (driver.type == NAND_JUMP_TABLE)
+	if (stripe_enabled())
+	{
+		return stripe_read(buffer, offset, size);
+	}
+	else if (driver.type == NAND_JUMP_TABLE)
 	{
 		return jt_read(buffer, offset, size);
 	}
@@ -63,10 +123,14 @@ read_nand(unsigned char *buffer, unsigned int offset, unsigned int size) {
 }
 
 
-int
-erase_nand(unsigned int offset, unsigned int size) {
+static int
+dispatch_erase(unsigned long offset, unsigned long size) {
 	
-	if (driver.type == NAND_JUMP_TABLE)
+	if (stripe_enabled())
+	{
+		return stripe_erase(offset, size);
+	}
+	else if (driver.type == NAND_JUMP_TABLE)
 	{
 		return jt_erase(offset, size);
 	}
@@ -78,3 +142,415 @@ erase_nand(unsigned int offset, unsigned int size) {
 	return -1;
 }
 
+
+/* direct_write(), direct_read(), direct_erase()
+ *
+ * Go through the write coalescing layer, when it's on, to the
+ * striped, jump table, or exec_op framework.  Reads flush the staged
+ * writes they touch first; erases drop the staged writes they'd
+ * erase.
+ *
+ */
+
+static int
+direct_write(unsigned char *buffer, unsigned long offset, unsigned int size) {
+
+	int staged;  /* coalesce_write()'s result */
+
+	if (coalesce_enabled() &&
+	    (staged = coalesce_write(buffer, offset, size, dispatch_write)))
+		return (staged < 0 ? -1 : 0);
+	return dispatch_write(buffer, offset, size);
+
+}
+
+
+static int
+direct_read(unsigned char *buffer, unsigned long offset, unsigned int size) {
+
+	if (coalesce_enabled() &&
+	    coalesce_read(offset, size, dispatch_write))
+		return -1;
+	return dispatch_read(buffer, offset, size);
+
+}
+
+
+static int
+direct_erase(unsigned long offset, unsigned long size) {
+
+	if (coalesce_enabled())
+		coalesce_drop(offset, size, nand_erase_size());
+	return dispatch_erase(offset, size);
+
+}
+
+
+/* route_write(), route_read(), route_erase()
+ *
+ * Go through the page cache, when there is one, to the striped,
+ * jump table, or exec_op framework.  Writes go through to the device
+ * and leave the cache holding the pages as the device programmed
+ * them; erases invalidate.  Each first finishes the asynchronous
+ * requests on the device.
+ *
+ */
+
+static int
+route_write(unsigned char *buffer, unsigned long offset, unsigned int size) {
+
+	int result;  /* direct_write()'s result */
+
+	ring_drain();
+	result = direct_write(buffer, offset, size);
+
+	if (cache_enabled())
+		cache_write(buffer, offset, size, result != 0);
+	return result;
+
+}
+
+
+static int
+route_read(unsigned char *buffer, unsigned long offset, unsigned int size) {
+
+	ring_drain();
+	if (cache_enabled())
+		return cache_read(buffer, offset, size, direct_read);
+	return direct_read(buffer, offset, size);
+
+}
+
+
+static int
+route_erase(unsigned long offset, unsigned long size) {
+
+	int result;  /* direct_erase()'s result */
+
+	ring_drain();
+	result = direct_erase(offset, size);
+
+	if (cache_enabled())
+		cache_invalidate(offset, size, nand_erase_size());
+	return result;
+
+}
+
+
+int
+write_nand(unsigned char *buffer, unsigned long offset, unsigned int size) {
+
+	unsigned long start;  /* when the call began */
+	int result;           /* route_write()'s result */
+
+	if (!stats)
+		return route_write(buffer, offset, size);
+	start = hist_now();
+	result = route_write(buffer, offset, size);
+	hist_record(&write_latency, hist_now() - start);
+	return result;
+
+}
+
+
+int
+read_nand(unsigned char *buffer, unsigned long offset, unsigned int size) {
+
+	unsigned long start;  /* when the call began */
+	int result;           /* route_read()'s result */
+
+	if (!stats)
+		return route_read(buffer, offset, size);
+	start = hist_now();
+	result = route_read(buffer, offset, size);
+	hist_record(&read_latency, hist_now() - start);
+	return result;
+
+}
+
+
+int
+erase_nand(unsigned long offset, unsigned long size) {
+
+	unsigned long start;  /* when the call began */
+	int result;           /* route_erase()'s result */
+
+	if (!stats)
+		return route_erase(offset, size);
+	start = hist_now();
+	result = route_erase(offset, size);
+	hist_record(&erase_latency, hist_now() - start);
+	return result;
+
+}
+
+
+/* route_submit()
+ *
+ * in:     op     - NAND_IO_READ, NAND_IO_WRITE, or NAND_IO_ERASE
+ *         offset - device address of an asynchronous request
+ *         size   - bytes in the request
+ * out:    staged writes the request reads flushed, staged writes it
+ *         replaces dropped, and cached pages it changes invalidated
+ * return: -1 on error (specifically, device timeout) else 0.
+ *
+ * fw_ring.c issues requests to the device a step at a time rather
+ * than through write_nand(), read_nand(), and erase_nand().  It calls
+ * this first, so that the write coalescing layer and the page cache
+ * see each request as they would the synchronous call.
+ *
+ */
+
+int
+route_submit(enum nand_io_op op, unsigned long offset, unsigned long size) {
+
+	switch (op) {
+	case NAND_IO_WRITE:
+		if (coalesce_enabled())
+			coalesce_drop(offset, size, NUM_BYTES);
+		if (cache_enabled())
+			cache_invalidate(offset, size, NUM_BYTES);
+		return 0;
+	case NAND_IO_ERASE:
+		if (coalesce_enabled())
+			coalesce_drop(offset, size, nand_erase_size());
+		if (cache_enabled())
+			cache_invalidate(offset, size, nand_erase_size());
+		return 0;
+	default:
+		if (coalesce_enabled())
+			return coalesce_read(offset, size, dispatch_write);
+		return 0;
+	}
+
+} /* route_submit() */
+
+
+/* nand_flush()
+ *
+ * in:     nothing
+ * out:    every asynchronous request finished and every write the
+ *         coalescing layer has staged written to the device
+ * return: -1 on error (specifically, device timeout) else 0.
+ *
+ */
+
+int
+nand_flush(void) {
+
+	ring_drain();
+	if (!coalesce_enabled())
+		return 0;
+	return coalesce_flush(dispatch_write);
+
+} /* nand_flush() */
+
+
+/* stripe_vector()
+ *
+ * in:     write  - true to write, false to read
+ *         iov    - segments
+ *         iovcnt - number of segments
+ * out:    data read into the segments' buffers, for a read
+ * return: -1 on error (specifically, device timeout) or if it can't
+ *         allocate a bounce buffer, else 0.
+ *
+ * The striped framework takes one contiguous buffer per call, so
+ * gather each run of contiguous segments into a bounce buffer and
+ * write it, or read it and scatter it to the segments.
+ *
+ */
+
+static int
+stripe_vector(bool write, const struct nand_iovec *iov,
+	unsigned int iovcnt) {
+
+	unsigned char *bounce;  /* a run's data, contiguous */
+	unsigned int run;       /* segments in the current run */
+	unsigned int size;      /* bytes in the current run */
+	unsigned int cursor;    /* index into bounce */
+	unsigned int s;         /* counts segments */
+	int result = 0;         /* optimistically presume success */
+
+	for (; iovcnt && !result; iov += run, iovcnt -= run) {
+
+		run = vector_run(iov, iovcnt);
+		for (size = 0, s = 0; s < run; s++)
+			size += iov[ s ].length;
+		if (!(bounce = malloc(size ? size : 1)))
+			return -1;
+
+		for (cursor = 0, s = 0; write && (s < run); s++) {
+			memcpy(&bounce[ cursor ], iov[ s ].buffer,
+				iov[ s ].length);
+			cursor += iov[ s ].length;
+		}
+		result = (write ? stripe_write(bounce, iov[ 0 ].offset, size) :
+			stripe_read(bounce, iov[ 0 ].offset, size));
+		for (cursor = 0, s = 0; !write && (s < run); s++) {
+			memcpy(iov[ s ].buffer, &bounce[ cursor ],
+				iov[ s ].length);
+			cursor += iov[ s ].length;
+		}
+		free(bounce);
+	}
+	return result;
+
+} /* stripe_vector() */
+
+
+static int
+route_writev(const struct nand_iovec *iov, unsigned int iovcnt) {
+
+	unsigned int s;  /* counts segments */
+
+	ring_drain();
+
+	/* The page cache doesn't keep vectored writes, which may
+	 * program a page in pieces from several segments.
+	 */
+	for (s = 0; cache_enabled() && (s < iovcnt); s++)
+		cache_invalidate(iov[ s ].offset, iov[ s ].length, NUM_BYTES);
+
+	/* Each page a segment touches is programmed whole, so it
+	 * supersedes any staged write to that page.
+	 */
+	for (s = 0; coalesce_enabled() && (s < iovcnt); s++)
+		coalesce_drop(iov[ s ].offset, iov[ s ].length, NUM_BYTES);
+
+	if (stripe_enabled())
+	{
+		return stripe_vector(true, iov, iovcnt);
+	}
+	else if (driver.type == NAND_JUMP_TABLE)
+	{
+		return jt_writev(iov, iovcnt);
+	}
+	else if (driver.type == NAND_EXEC_OP)
+	{
+		return exec_writev(iov, iovcnt);
+	}
+	return -1;
+}
+
+
+static int
+route_readv(const struct nand_iovec *iov, unsigned int iovcnt) {
+
+	unsigned int s;  /* counts segments */
+
+	ring_drain();
+
+	for (s = 0; coalesce_enabled() && (s < iovcnt); s++)
+		if (coalesce_read(iov[ s ].offset, iov[ s ].length,
+		    dispatch_write))
+			return -1;
+
+	if (stripe_enabled())
+	{
+		return stripe_vector(false, iov, iovcnt);
+	}
+	else if (driver.type == NAND_JUMP_TABLE)
+	{
+		return jt_readv(iov, iovcnt);
+	}
+	else if (driver.type == NAND_EXEC_OP)
+	{
+		return exec_readv(iov, iovcnt);
+	}
+	return -1;
+}
+
+
+/* writev_nand()
+ *
+ * in:     iov    - segments to write, each a device offset, a buffer,
+ *                  and a length
+ *         iovcnt - number of segments
+ * out:    nothing
+ * return: -1 on error (specifically, device timeout) else 0.
+ *
+ * Writes the segments in order.  Each run of segments that begin
+ * where the one before ends is written as a single write_nand() of
+ * their concatenated buffers would write it, with one setup command
+ * and address for the whole run; see fw_vector.c.
+ *
+ */
+
+int
+writev_nand(const struct nand_iovec *iov, unsigned int iovcnt) {
+
+	unsigned long start;  /* when the call began */
+	int result;           /* route_writev()'s result */
+
+	if (!stats)
+		return route_writev(iov, iovcnt);
+	start = hist_now();
+	result = route_writev(iov, iovcnt);
+	hist_record(&writev_latency, hist_now() - start);
+	return result;
+
+} /* writev_nand() */
+
+
+/* readv_nand()
+ *
+ * in:     iov    - segments to read, each a device offset, a buffer,
+ *                  and a length
+ *         iovcnt - number of segments
+ * out:    data read into the segments' buffers
+ * return: -1 on error (specifically, device timeout) else 0.
+ *
+ * Reads the segments, sharing one setup command and address among
+ * each run of contiguous segments as writev_nand() does.
+ *
+ */
+
+int
+readv_nand(const struct nand_iovec *iov, unsigned int iovcnt) {
+
+	unsigned long start;  /* when the call began */
+	int result;           /* route_readv()'s result */
+
+	if (!stats)
+		return route_readv(iov, iovcnt);
+	start = hist_now();
+	result = route_readv(iov, iovcnt);
+	hist_record(&readv_latency, hist_now() - start);
+	return result;
+
+} /* readv_nand() */
+
+
+/* framework_init_stats()
+ *
+ * in:     nothing
+ * out:    per-call latency histograms enabled
+ * return: nothing
+ *
+ */
+
+void
+framework_init_stats(void) {
+	stats = true;
+} /* framework_init_stats() */
+
+
+/* framework_print_stats()
+ *
+ * in:     nothing
+ * out:    per-call latency histograms to stderr
+ * return: nothing
+ *
+ */
+
+void
+framework_print_stats(void) {
+
+	hist_print(&write_latency);
+	hist_print(&read_latency);
+	hist_print(&erase_latency);
+	hist_print(&writev_latency);
+	hist_print(&readv_latency);
+
+} /* framework_print_stats() */
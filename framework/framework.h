@@ -7,7 +7,8 @@
 #define MAX_STORAGE_CHIPS 8
 
 /* The tracer can use these macros to determine if the tracee trapped
- * on the breakpoint in gpio_set() or the breakpoint in gpio_get().
+ * on the breakpoint in gpio_set() or the breakpoint in gpio_get_trap(),
+ * which gpio_get() calls unless a shared status page answers for it.
  * Typically a tracer (debugger) would know the precise address of the
  * breakpoints it has set in the tracee and when responding to a trap
  * would simply retrieve the tracee's instruciton pointer value
@@ -29,23 +30,19 @@
         (((void *)a >= (void *)f) && ((void *)a < ((void *)f + l)))
 /* Return true if address a is in named function. */
 #define GPIO_SET_LENGTH 0x0E  /* length of gpio_set() program text */
-#define GPIO_GET_LENGTH 0x43  /* length of gpio_get() program text */
+#define GPIO_GET_LENGTH 0x43  /* length of gpio_get_trap() program text */
 #define RIP_IN_GPIO_SET(a) RIP_IN_FUNCTION(a, &gpio_set, GPIO_SET_LENGTH)
-#define RIP_IN_GPIO_GET(a) RIP_IN_FUNCTION(a, &gpio_get, GPIO_GET_LENGTH)
+#define RIP_IN_GPIO_GET(a) RIP_IN_FUNCTION(a, &gpio_get_trap, GPIO_GET_LENGTH)
 
-/* The NAND_OP_ADDR_INSTR instruction has an array of addresses.  The
- * number of cells in the array that contain meaningful data depends
- * on the preceeding NAND_OP_CMD_INSTR instruction.  Data in and out
- * instructions need three addresses: erase block, page, and byte.
- * Erase instructions need only one: block.
+/* The NAND_OP_ADDR_INSTR instruction has an array of address cycles.
+ * The number of cells in the array that contain meaningful data
+ * depends on the preceeding NAND_OP_CMD_INSTR instruction and on the
+ * device's geometry.  Data in and out instructions need three
+ * addresses: erase block, page, and byte.  Erase instructions need
+ * only one: block.  Each address takes as many cycles as the
+ * geometry requires, up to the MAX_*_CYCLES in device_emu.h.
  */
-#define NAND_INSTR_BLOCK 0  /* index of erase block number */
-#define NAND_INSTR_PAGE  1  /* index of page number */
-#define NAND_INSTR_BYTE  2  /* index of byte offset */
-
-#define NAND_INSTR_NUM_ADDR_IO    3
-#define NAND_INSTR_NUM_ADDR_ERASE 1
-#define NAND_INSTR_NUM_ADDR_MAX   NAND_INSTR_NUM_ADDR_IO
+#define NAND_INSTR_NUM_ADDR_MAX 7  /* 3 block + 2 page + 2 byte cycles */
 
 
 enum nand_op_instr_type {
@@ -54,6 +51,7 @@ enum nand_op_instr_type {
 	NAND_OP_DATA_IN_INSTR,
 	NAND_OP_DATA_OUT_INSTR,
 	NAND_OP_WAITRDY_INSTR,
+	NAND_OP_DMA_INSTR,
 };
 
 struct nand_op_cmd_instr {
@@ -79,6 +77,12 @@ struct nand_op_waitrdy_instr {
 	unsigned int timeout_ms;
 };
 
+struct nand_op_dma_instr {  /* C_READ_DMA or C_PROGRAM_DMA a buffer */
+	unsigned char opcode;
+	unsigned int len;
+	unsigned char *buf;
+};
+
 struct nand_op_instr {
 	enum nand_op_instr_type type;
 	union {
@@ -87,6 +91,7 @@ struct nand_op_instr {
 		struct nand_op_data_in_instr data_in;
 		struct nand_op_data_out_instr data_out;
 		struct nand_op_waitrdy_instr waitrdy;
+		struct nand_op_dma_instr dma;
 	} ctx;
 };
 
@@ -130,6 +135,11 @@ struct nand_jump_table
 	void (*read_buffer)(unsigned char *buffer, unsigned int length);
 	void (*write_buffer)(unsigned char *buffer, unsigned int length);
 	int (*wait_ready)(unsigned int interval_us);
+	/* Optional.  Loads the DMA registers to describe buffer; the
+	 * framework then issues C_READ_DMA or C_PROGRAM_DMA in place of
+	 * calling read_buffer() or write_buffer().
+	 */
+	void (*dma_buffer)(unsigned char *buffer, unsigned int length);
 };
 
 enum nand_driver_type {
@@ -137,9 +147,13 @@ enum nand_driver_type {
 	NAND_EXEC_OP,
 };
 
+/* nand_driver flags */
+#define NAND_DRIVER_DMA 0x1  /* exec_op() understands NAND_OP_DMA_INSTR */
+
 struct nand_driver
 {
 	enum nand_driver_type type;
+	unsigned int flags;
 	union {
 		struct nand_jump_table jump_table;
 		int (*exec_op)(struct nand_operation *commands);
@@ -148,14 +162,95 @@ struct nand_driver
 
 void gpio_set(unsigned int, unsigned int);
 unsigned int gpio_get(unsigned int);
+unsigned int gpio_get_trap(unsigned int);
+
+void ioreg_writeb(unsigned char, volatile unsigned char *);
+unsigned char ioreg_readb(volatile unsigned char *);
+
+int irq_enabled(void);
+int irq_wait_ready(unsigned int);
 
 // USER/TESTER INTERFACE
 
+/* One segment of a readv_nand() or writev_nand() call. */
+struct nand_iovec {
+	unsigned long offset;     /* device address */
+	unsigned char *buffer;    /* data to write or buffer to read into */
+	unsigned int length;      /* bytes */
+};
+
+/* Page cache counters; see fw_cache.c. */
+struct nand_cache_stats {
+	unsigned long lookups;      /* pages read_nand() looked for */
+	unsigned long hits;         /* pages it found in the cache */
+	unsigned long bytes_saved;  /* bytes it didn't read from device */
+	unsigned long evictions;    /* pages dropped to make room */
+};
+
+/* Write coalescing counters; see fw_coalesce.c. */
+struct nand_coalesce_stats {
+	unsigned long staged;    /* small writes held back */
+	unsigned long programs;  /* page programs issued for them */
+	unsigned long saved;     /* programs superseded and never issued */
+};
+
+/* Asynchronous I/O.  Requests submitted with nand_io_submit()
+ * complete in submission order; see fw_ring.c.  NAND_RING_ENTRIES
+ * bounds the requests submitted plus completions not yet reaped, and
+ * must be a power of two.
+ */
+#define NAND_RING_ENTRIES 16
+
+enum nand_io_op {
+	NAND_IO_READ,
+	NAND_IO_WRITE,
+	NAND_IO_ERASE,
+};
+
+struct nand_io_request {
+	enum nand_io_op op;
+	unsigned char *buffer;     /* data to write or read, NULL to erase */
+	unsigned long offset;      /* device address */
+	unsigned long size;        /* bytes */
+	unsigned long user_data;   /* returned in the completion */
+};
+
+struct nand_io_completion {
+	unsigned long user_data;   /* from the request */
+	int result;                /* as write/read/erase_nand() return */
+	unsigned long latency_ns;  /* from submission to completion */
+};
+
+struct ioregs_shm;  /* from device_emu.h */
+struct gpio_status; /* from device_emu.h */
+
+void ioreg_init_shm(struct ioregs_shm *);
+void gpio_init_status(const struct gpio_status *);
+void irq_init(int);
+void init_framework_in_process(void);
 struct nand_device *init_framework(volatile unsigned long *,
 	struct nand_device *);
-int write_nand(unsigned char *, unsigned int, unsigned int);
-int read_nand(unsigned char *, unsigned int, unsigned int);
-int erase_nand(unsigned int, unsigned int);
+int write_nand(unsigned char *, unsigned long, unsigned int);
+int read_nand(unsigned char *, unsigned long, unsigned int);
+int erase_nand(unsigned long, unsigned long);
+int writev_nand(const struct nand_iovec *, unsigned int);
+int readv_nand(const struct nand_iovec *, unsigned int);
+int nand_io_submit(const struct nand_io_request *);
+int nand_io_poll(struct nand_io_completion *);
+int nand_io_wait(struct nand_io_completion *);
+int stripe_init(struct nand_device *);
+unsigned long nand_erase_size(void);
+void stripe_print_stats(void);
+int cache_init(unsigned int);
+void cache_invalidate_all(void);
+void cache_get_stats(struct nand_cache_stats *);
+void cache_print_stats(void);
+int coalesce_init(void);
+int nand_flush(void);
+void coalesce_get_stats(struct nand_coalesce_stats *);
+void coalesce_print_stats(void);
+void framework_init_stats(void);
+void framework_print_stats(void);
 
 int verify_dib(struct nand_device *);
 
@@ -0,0 +1,69 @@
+/* Framework NAND address cycle module.
+ *
+ * Copyright (c) 2023 Timothy Jon Fraser Consulting LLC.
+ *
+ * The device takes an address as a block number, a page number, and
+ * a byte offset, each in as many address cycles as the geometry
+ * requires, least significant byte first.  Erases take only the block
+ * number.  This module turns device byte offsets into those cycles.
+ *
+ */
+
+#include <sys/types.h>
+#include <stdbool.h>
+
+#include "device_emu.h"
+#include "framework.h"
+#include "fw_address.h"
+
+
+/* put_cycles()
+ *
+ * in:     value  - block number, page number, or byte offset
+ *         cycles - number of address cycles to send it in
+ * out:    addrs  - receives the cycles, least significant byte first
+ * return: cycles
+ *
+ */
+
+static unsigned int
+put_cycles(unsigned char *addrs, unsigned long value, unsigned int cycles) {
+
+	unsigned int c;  /* counts cycles */
+
+	for (c = 0; c < cycles; c++) {
+		addrs[ c ] = value & 0xFF;
+		value >>= 8;
+	}
+	return cycles;
+
+} /* put_cycles() */
+
+
+/* nand_address()
+ *
+ * in:     offset - device byte offset, wrapped to the size of a target
+ *         erase  - true for an erase, which takes the block number
+ *                  alone; false for a read or program
+ * out:    addrs  - receives the address cycles, room for at least
+ *                  NAND_INSTR_NUM_ADDR_MAX of them
+ * return: the number of address cycles in addrs
+ *
+ */
+
+unsigned int
+nand_address(unsigned char *addrs, unsigned long offset, bool erase) {
+
+	unsigned int n;  /* counts cycles */
+
+	n = put_cycles(addrs, (offset >> geometry.block_shift) % NUM_BLOCKS,
+		geometry.block_cycles);
+	if (erase)
+		return n;
+	n += put_cycles(&addrs[ n ], (offset >> geometry.page_shift) %
+		NUM_PAGES, geometry.page_cycles);
+	n += put_cycles(&addrs[ n ], offset % NUM_BYTES,
+		geometry.byte_cycles);
+	return n;
+
+} /* nand_address() */
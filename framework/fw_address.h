@@ -0,0 +1,6 @@
+#ifndef _FW_ADDRESS_H_
+#define _FW_ADDRESS_H_
+
+unsigned int nand_address(unsigned char *, unsigned long, bool);
+
+#endif
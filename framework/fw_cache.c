@@ -0,0 +1,487 @@
+/* Framework page cache module.
+ *
+ * Copyright (c) 2023 Timothy Jon Fraser Consulting LLC.
+ *
+ * Once cache_init() has given it room for some number of pages, the
+ * framework keeps copies of recently read pages and serves
+ * read_nand() from them, going to the device only for pages it
+ * doesn't hold.  On a miss it reads just the bytes the caller wants,
+ * as it would without the cache, and keeps the pages that read
+ * covered whole.
+ *
+ * Writes go through to the device.  A page the device programs holds
+ * exactly the bytes written to it and zeroes everywhere else, so
+ * after a successful write_nand() the cache keeps each page it
+ * touched as the device now holds it, without reading it back.  A
+ * failed write, a vectored write, and a write submitted to the rings
+ * invalidate the pages they touch instead, and an erase invalidates
+ * every page of every erase unit it touches.  When the cache is full,
+ * the least recently used page makes way for a new one.
+ *
+ * A miss still reads only the bytes the caller wants, so it sees
+ * whatever the driver actually put there.  A hit on a page written
+ * through the cache, however, returns what the framework asked the
+ * driver to write: a driver that silently programs the wrong data
+ * goes unnoticed until the page is evicted or invalidated.  Test
+ * drivers' correctness without the cache.
+ *
+ * The cache knows pages by their logical page number, wrapped to the
+ * size of the logical device, so it works the same whether or not
+ * the framework stripes.  Anything else that changes device storage,
+ * such as restoring a snapshot, must call cache_invalidate_all().
+ *
+ */
+
+#include <sys/types.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "device_emu.h"
+#include "framework.h"
+#include "fw_cache.h"
+
+#define PAGE_SIZE  NUM_BYTES
+#define NONE       (-1)     /* no entry, ending a list */
+#define FILL_PAGES 16       /* most pages one device read fills */
+
+/* Entries live in an array and link to one another by index: into a
+ * hash chain for lookup, and into a list from most to least recently
+ * used.  Entry e's copy of its page is at data[ e * PAGE_SIZE ].
+ */
+struct entry {
+	unsigned long page;  /* logical page number */
+	bool valid;          /* holds a page? */
+	int hash_next;       /* next entry in this hash chain */
+	int lru_prev;        /* next more recently used entry */
+	int lru_next;        /* next less recently used entry */
+};
+
+static unsigned int capacity;     /* pages the cache holds, 0 if off */
+static unsigned int num_buckets;  /* a power of two >= capacity */
+static struct entry *entries;
+static int *buckets;              /* first entry in each hash chain */
+static unsigned char *data;       /* the pages themselves */
+static int lru_head, lru_tail;    /* most and least recently used */
+static struct nand_cache_stats counters;
+
+
+/* device_pages()
+ *
+ * in:     nothing
+ * out:    nothing
+ * return: number of pages on the logical device.
+ *
+ */
+
+static unsigned long
+device_pages(void) {
+	return nand_erase_size() / PAGE_SIZE * NUM_BLOCKS;
+} /* device_pages() */
+
+
+/* bucket()
+ *
+ * in:     page - logical page number
+ * out:    nothing
+ * return: pointer to the head of page's hash chain.
+ *
+ */
+
+static int *
+bucket(unsigned long page) {
+	return &buckets[ page & (num_buckets - 1) ];
+} /* bucket() */
+
+
+/* lru_unlink(), lru_push()
+ *
+ * Take entry e out of the LRU list, or put it at the most recently
+ * used end.
+ *
+ */
+
+static void
+lru_unlink(int e) {
+
+	int prev = entries[ e ].lru_prev;
+	int next = entries[ e ].lru_next;
+
+	if (prev != NONE)
+		entries[ prev ].lru_next = next;
+	else
+		lru_head = next;
+	if (next != NONE)
+		entries[ next ].lru_prev = prev;
+	else
+		lru_tail = prev;
+
+} /* lru_unlink() */
+
+
+static void
+lru_push(int e) {
+
+	entries[ e ].lru_prev = NONE;
+	entries[ e ].lru_next = lru_head;
+	if (lru_head != NONE)
+		entries[ lru_head ].lru_prev = e;
+	else
+		lru_tail = e;
+	lru_head = e;
+
+} /* lru_push() */
+
+
+/* lookup()
+ *
+ * in:     page - logical page number
+ * out:    nothing
+ * return: the entry holding page, or NONE.
+ *
+ */
+
+static int
+lookup(unsigned long page) {
+
+	int e;  /* each entry in page's hash chain */
+
+	for (e = *bucket(page); e != NONE; e = entries[ e ].hash_next)
+		if (entries[ e ].page == page)
+			return e;
+	return NONE;
+
+} /* lookup() */
+
+
+/* drop()
+ *
+ * in:     e - a valid entry
+ * out:    e invalidated and moved to the least recently used end, so
+ *         that it is the next to be reused
+ * return: nothing
+ *
+ */
+
+static void
+drop(int e) {
+
+	int *p_link;  /* the link that points to e */
+
+	for (p_link = bucket(entries[ e ].page); *p_link != e;
+	     p_link = &entries[ *p_link ].hash_next)
+		;
+	*p_link = entries[ e ].hash_next;
+	entries[ e ].valid = false;
+
+	lru_unlink(e);
+	entries[ e ].lru_next = NONE;
+	entries[ e ].lru_prev = lru_tail;
+	if (lru_tail != NONE)
+		entries[ lru_tail ].lru_next = e;
+	else
+		lru_head = e;
+	lru_tail = e;
+
+} /* drop() */
+
+
+/* insert()
+ *
+ * in:     page - logical page number
+ * out:    page's entry is the most recently used
+ * return: page's entry, for the caller to fill in.
+ *
+ * Reuses page's entry if it has one, otherwise evicts the least
+ * recently used page.
+ *
+ */
+
+static int
+insert(unsigned long page) {
+
+	int e;  /* page's entry */
+
+	if ((e = lookup(page)) == NONE) {
+		e = lru_tail;
+		if (entries[ e ].valid) {
+			drop(e);
+			counters.evictions++;
+		}
+		entries[ e ].page = page;
+		entries[ e ].valid = true;
+		entries[ e ].hash_next = *bucket(page);
+		*bucket(page) = e;
+	}
+	lru_unlink(e);
+	lru_push(e);
+	return e;
+
+} /* insert() */
+
+
+/* cache_init()
+ *
+ * in:     pages - number of pages to cache, 0 for no cache
+ * out:    cache allocated and emptied
+ * return: 0 on success, -1 if it can't allocate the cache.
+ *
+ */
+
+int
+cache_init(unsigned int pages) {
+
+	unsigned int b;  /* counts buckets */
+	unsigned int e;  /* counts entries */
+
+	capacity = 0;
+	if (!pages)
+		return 0;
+
+	for (num_buckets = 1; num_buckets < pages; num_buckets <<= 1)
+		;
+	entries = calloc(pages, sizeof(*entries));
+	buckets = malloc(num_buckets * sizeof(*buckets));
+	data = malloc((size_t)pages * PAGE_SIZE);
+	if (!entries || !buckets || !data) {
+		free(entries);
+		free(buckets);
+		free(data);
+		return -1;
+	}
+
+	for (b = 0; b < num_buckets; b++)
+		buckets[ b ] = NONE;
+	lru_head = lru_tail = NONE;
+	for (e = 0; e < pages; e++)
+		lru_push(e);
+	capacity = pages;
+	return 0;
+
+} /* cache_init() */
+
+
+/* cache_enabled()
+ *
+ * in:     nothing
+ * out:    nothing
+ * return: true if cache_init() turned the cache on.
+ *
+ */
+
+bool
+cache_enabled(void) {
+	return (capacity > 0);
+} /* cache_enabled() */
+
+
+/* cache_invalidate_all()
+ *
+ * in:     nothing
+ * out:    every cached page dropped
+ * return: nothing
+ *
+ */
+
+void
+cache_invalidate_all(void) {
+
+	unsigned int e;  /* counts entries */
+
+	for (e = 0; e < capacity; e++)
+		if (entries[ e ].valid)
+			drop(e);
+
+} /* cache_invalidate_all() */
+
+
+/* cache_invalidate()
+ *
+ * in:     offset - device address of the first byte changed
+ *         size   - number of bytes changed
+ *         unit   - bytes in the unit the device changes them in
+ * out:    every cached page of every unit the range touches dropped
+ * return: nothing
+ *
+ */
+
+void
+cache_invalidate(unsigned long offset, unsigned long size,
+	unsigned long unit) {
+
+	unsigned long pages = device_pages();  /* logical device size */
+	unsigned long first;  /* first page to drop */
+	unsigned long count;  /* pages to drop */
+	unsigned int e;       /* counts entries */
+
+	if (!size)
+		return;
+	first = offset / unit * unit / PAGE_SIZE;
+	count = ((offset + size + unit - 1) / unit * unit) / PAGE_SIZE - first;
+	if (count >= pages) {
+		cache_invalidate_all();
+		return;
+	}
+	first %= pages;
+
+	for (e = 0; e < capacity; e++)
+		if (entries[ e ].valid &&
+		    ((entries[ e ].page + pages - first) % pages < count))
+			drop(e);
+
+} /* cache_invalidate() */
+
+
+/* cache_write()
+ *
+ * in:     buffer - data written
+ *         offset - device address it was written to
+ *         size   - number of bytes written
+ *         failed - true if the write failed
+ * out:    cached copies of the pages written
+ * return: nothing
+ *
+ * Call after writing to the device.  Caches what the device now
+ * holds in each page the write touched: the bytes written, and
+ * zeroes ahead of and behind them.
+ *
+ */
+
+void
+cache_write(const unsigned char *buffer, unsigned long offset,
+	unsigned int size, bool failed) {
+
+	unsigned long pages = device_pages();  /* logical device size */
+	unsigned char *p_page;  /* the cached copy of a page */
+	unsigned int byte;      /* cursor's byte within its page */
+	unsigned int piece;     /* bytes of buffer in one page */
+	unsigned int cursor;    /* index into buffer */
+
+	if (failed) {
+		cache_invalidate(offset, size, PAGE_SIZE);
+		return;
+	}
+
+	for (cursor = 0; cursor < size; cursor += piece) {
+		byte = (offset + cursor) % PAGE_SIZE;
+		piece = PAGE_SIZE - byte;
+		if (piece > size - cursor)
+			piece = size - cursor;
+		p_page = &data[ (size_t)insert(((offset + cursor) / PAGE_SIZE)
+			% pages) * PAGE_SIZE ];
+		memset(p_page, 0, PAGE_SIZE);
+		memcpy(&p_page[ byte ], &buffer[ cursor ], piece);
+	}
+
+} /* cache_write() */
+
+
+/* cache_read()
+ *
+ * in:     offset - read data beginning at this device address
+ *         size   - number of bytes to read, can be multiple pages
+ *         read   - reads from the device on a miss
+ * out:    buffer - receives the data
+ * return: -1 on error (specifically, device timeout) else 0.
+ *
+ * Copies cached pages to buffer and reads runs of up to FILL_PAGES
+ * missing pages from the device in one go, straight into buffer, then
+ * caches the pages in the run that the read covered whole.  Each page
+ * the caller wants counts as one lookup.
+ *
+ */
+
+int
+cache_read(unsigned char *buffer, unsigned long offset, unsigned int size,
+	int (*read)(unsigned char *, unsigned long, unsigned int)) {
+
+	unsigned long pages = device_pages();  /* logical device size */
+	unsigned long page;   /* logical page the cursor is in */
+	unsigned long miss;   /* pages in a run of misses */
+	unsigned int byte;    /* cursor's byte within its page */
+	unsigned int piece;   /* bytes of buffer from one page */
+	unsigned int cursor;  /* index into buffer */
+	unsigned int start;   /* buffer index of the first whole page */
+	int e;                /* entry holding a page */
+
+	for (cursor = 0; cursor < size; ) {
+
+		page = (offset + cursor) / PAGE_SIZE;
+		byte = (offset + cursor) % PAGE_SIZE;
+		piece = PAGE_SIZE - byte;
+		if (piece > size - cursor)
+			piece = size - cursor;
+		counters.lookups++;
+
+		if ((e = lookup(page % pages)) != NONE) {
+			lru_unlink(e);
+			lru_push(e);
+			memcpy(&buffer[ cursor ],
+				&data[ (size_t)e * PAGE_SIZE + byte ], piece);
+			counters.hits++;
+			counters.bytes_saved += piece;
+			cursor += piece;
+			continue;
+		}
+
+		/* Read this page and the missing pages after it that
+		 * the caller wants in one go, only as much of them as the
+		 * caller wants, and cache the ones read whole.
+		 */
+		for (miss = 1; (miss < FILL_PAGES) && (miss < capacity) &&
+			     ((page + miss) * PAGE_SIZE < offset + size) &&
+			     (lookup((page + miss) % pages) == NONE); miss++)
+			counters.lookups++;
+		piece = miss * PAGE_SIZE - byte;
+		if (piece > size - cursor)
+			piece = size - cursor;
+		if (read(&buffer[ cursor ], offset + cursor, piece))
+			return -1;
+		start = cursor + (byte ? PAGE_SIZE - byte : 0);
+		for (; start + PAGE_SIZE <= cursor + piece; start += PAGE_SIZE)
+			memcpy(&data[ (size_t)insert(((offset + start) /
+				PAGE_SIZE) % pages) * PAGE_SIZE ],
+				&buffer[ start ], PAGE_SIZE);
+		cursor += piece;
+	}
+	return 0;
+
+} /* cache_read() */
+
+
+/* cache_get_stats()
+ *
+ * in:     nothing
+ * out:    p_stats - the cache's counters
+ * return: nothing
+ *
+ */
+
+void
+cache_get_stats(struct nand_cache_stats *p_stats) {
+	*p_stats = counters;
+} /* cache_get_stats() */
+
+
+/* cache_print_stats()
+ *
+ * in:     nothing
+ * out:    the cache's counters to stderr
+ * return: nothing
+ *
+ */
+
+void
+cache_print_stats(void) {
+
+	if (!capacity)
+		return;
+	fprintf(stderr, "Page cache of %u pages: %lu lookups, %lu hits "
+		"(%.1f%%), %lu bytes not read from device, %lu evictions.\n",
+		capacity, counters.lookups, counters.hits,
+		(counters.lookups ?
+			100.0 * counters.hits / counters.lookups : 0.0),
+		counters.bytes_saved, counters.evictions);
+
+} /* cache_print_stats() */
@@ -0,0 +1,10 @@
+#ifndef _FW_CACHE_H_
+#define _FW_CACHE_H_
+
+bool cache_enabled(void);
+void cache_invalidate(unsigned long, unsigned long, unsigned long);
+void cache_write(const unsigned char *, unsigned long, unsigned int, bool);
+int cache_read(unsigned char *, unsigned long, unsigned int,
+	int (*)(unsigned char *, unsigned long, unsigned int));
+
+#endif
@@ -0,0 +1,324 @@
+/* Framework write coalescing module.
+ *
+ * Copyright (c) 2023 Timothy Jon Fraser Consulting LLC.
+ *
+ * The device programs whole pages, zeroing whatever part of a page a
+ * write leaves out, so a small write costs a full page program.  Once
+ * coalesce_init() turns it on, the framework stages each write that
+ * falls within a single page, short of filling it, rather than
+ * program the page at once.  Because each write replaces everything
+ * in the pages it touches, a later write to a staged page supersedes
+ * the staged one.  So does a write that covers the page or spans it,
+ * which goes straight to the device, and an erase of the page's
+ * block, which finds nothing to erase.  Either way, the staged write
+ * is dropped and its program saved.  What the device holds in the
+ * end is just what it would have held had every write reached it at
+ * once.
+ *
+ * A staged write reaches the device when a read touches its page,
+ * when nand_flush() is called, or when it is the least recently
+ * staged of STAGED_PAGES writes and another needs its place.
+ * Callers flush before anything that looks at or replaces device
+ * storage behind the framework's back, such as taking or restoring
+ * a device emulator snapshot.
+ *
+ */
+
+#include <sys/types.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "device_emu.h"
+#include "framework.h"
+#include "fw_coalesce.h"
+
+#define PAGE_SIZE    NUM_BYTES
+#define STAGED_PAGES 4
+
+/* A staged write, holding the bytes that write_nand() asked to write
+ * to page, starting at offset.
+ */
+struct staged {
+	bool valid;            /* holds a write? */
+	unsigned long page;    /* logical page number, wrapped */
+	unsigned long offset;  /* device address of the write */
+	unsigned int size;     /* bytes in the write */
+	unsigned long used;    /* stage_clock when staged */
+	unsigned char *data;   /* PAGE_SIZE bytes */
+};
+
+static bool enabled;
+static struct staged staged[ STAGED_PAGES ];
+static unsigned long stage_clock;   /* counts coalesce_write() calls */
+static struct nand_coalesce_stats counters;
+
+
+/* device_pages()
+ *
+ * in:     nothing
+ * out:    nothing
+ * return: number of pages on the logical device.
+ *
+ */
+
+static unsigned long
+device_pages(void) {
+	return nand_erase_size() / PAGE_SIZE * NUM_BLOCKS;
+} /* device_pages() */
+
+
+/* overlaps()
+ *
+ * in:     p_s    - a staged write
+ *         offset - device address of a range
+ *         size   - bytes in the range
+ *         unit   - bytes in the unit the range affects
+ * out:    nothing
+ * return: true if the range affects p_s's page.
+ *
+ */
+
+static bool
+overlaps(const struct staged *p_s, unsigned long offset, unsigned long size,
+	unsigned long unit) {
+
+	unsigned long pages = device_pages();  /* logical device size */
+	unsigned long first;  /* first page the range affects */
+	unsigned long count;  /* pages it affects */
+
+	if (!p_s->valid || !size)
+		return false;
+	first = offset / unit * unit / PAGE_SIZE;
+	count = ((offset + size + unit - 1) / unit * unit) / PAGE_SIZE - first;
+	return ((count >= pages) ||
+		((p_s->page + pages - (first % pages)) % pages < count));
+
+} /* overlaps() */
+
+
+/* flush_one()
+ *
+ * in:     p_s   - a staged write
+ *         write - writes to the device, bypassing this module
+ * out:    p_s written to the device and emptied
+ * return: -1 on error (specifically, device timeout) else 0.
+ *
+ */
+
+static int
+flush_one(struct staged *p_s,
+	int (*write)(unsigned char *, unsigned long, unsigned int)) {
+
+	p_s->valid = false;
+	counters.programs++;
+	return write(p_s->data, p_s->offset, p_s->size);
+
+} /* flush_one() */
+
+
+/* coalesce_init()
+ *
+ * in:     nothing
+ * out:    coalescing on
+ * return: 0 on success, -1 if it can't allocate staging buffers.
+ *
+ */
+
+int
+coalesce_init(void) {
+
+	unsigned int s;  /* counts staged writes */
+
+	for (s = 0; s < STAGED_PAGES; s++)
+		if (!(staged[ s ].data = malloc(PAGE_SIZE)))
+			return -1;
+	enabled = true;
+	return 0;
+
+} /* coalesce_init() */
+
+
+/* coalesce_enabled()
+ *
+ * in:     nothing
+ * out:    nothing
+ * return: true if coalesce_init() turned coalescing on.
+ *
+ */
+
+bool
+coalesce_enabled(void) {
+	return enabled;
+} /* coalesce_enabled() */
+
+
+/* coalesce_write()
+ *
+ * in:     buffer - data to write
+ *         offset - device address to receive it
+ *         size   - number of bytes to write
+ *         write  - writes to the device, to make room
+ * out:    the write staged, if small enough
+ * return: 1 if it staged the write, 0 if the caller must write it
+ *         to the device itself, or -1 if making room failed.
+ *
+ * Drops every staged write the new write supersedes.
+ *
+ */
+
+int
+coalesce_write(const unsigned char *buffer, unsigned long offset,
+	unsigned int size,
+	int (*write)(unsigned char *, unsigned long, unsigned int)) {
+
+	struct staged *p_s;        /* each staged write */
+	struct staged *p_free;     /* where to stage this write */
+	bool small;                /* within one page, not filling it? */
+
+	for (p_s = staged; p_s < &staged[ STAGED_PAGES ]; p_s++) {
+		if (overlaps(p_s, offset, size, PAGE_SIZE)) {
+			p_s->valid = false;
+			counters.saved++;
+		}
+	}
+
+	small = (size > 0) && (size < PAGE_SIZE) &&
+		((offset % PAGE_SIZE) + size <= PAGE_SIZE);
+	if (!small)
+		return 0;
+
+	/* Take an empty slot, or make one from the least recently
+	 * staged write.
+	 */
+	p_free = staged;
+	for (p_s = staged; p_s < &staged[ STAGED_PAGES ]; p_s++) {
+		if (!p_s->valid) {
+			p_free = p_s;
+			break;
+		}
+		if (p_s->used < p_free->used)
+			p_free = p_s;
+	}
+	if (p_free->valid && flush_one(p_free, write))
+		return -1;
+
+	p_free->valid = true;
+	p_free->page = (offset / PAGE_SIZE) % device_pages();
+	p_free->offset = offset;
+	p_free->size = size;
+	p_free->used = ++stage_clock;
+	memcpy(p_free->data, buffer, size);
+	counters.staged++;
+	return 1;
+
+} /* coalesce_write() */
+
+
+/* coalesce_read()
+ *
+ * in:     offset - device address of a range about to be read
+ *         size   - bytes in the range
+ *         write  - writes to the device
+ * out:    staged writes to pages in the range written to the device
+ * return: -1 on error (specifically, device timeout) else 0.
+ *
+ */
+
+int
+coalesce_read(unsigned long offset, unsigned long size,
+	int (*write)(unsigned char *, unsigned long, unsigned int)) {
+
+	struct staged *p_s;  /* each staged write */
+	int result = 0;      /* optimistically presume success */
+
+	for (p_s = staged; p_s < &staged[ STAGED_PAGES ]; p_s++)
+		if (overlaps(p_s, offset, size, PAGE_SIZE) &&
+		    flush_one(p_s, write))
+			result = -1;
+	return result;
+
+} /* coalesce_read() */
+
+
+/* coalesce_drop()
+ *
+ * in:     offset - device address of a range about to be erased or
+ *                  rewritten in whole units
+ *         size   - bytes in the range
+ *         unit   - bytes in the unit the device erases or programs
+ * out:    staged writes to pages in those units dropped
+ * return: nothing
+ *
+ */
+
+void
+coalesce_drop(unsigned long offset, unsigned long size, unsigned long unit) {
+
+	struct staged *p_s;  /* each staged write */
+
+	for (p_s = staged; p_s < &staged[ STAGED_PAGES ]; p_s++) {
+		if (overlaps(p_s, offset, size, unit)) {
+			p_s->valid = false;
+			counters.saved++;
+		}
+	}
+
+} /* coalesce_drop() */
+
+
+/* coalesce_flush()
+ *
+ * in:     write - writes to the device
+ * out:    every staged write written to the device
+ * return: -1 on error (specifically, device timeout) else 0.
+ *
+ */
+
+int
+coalesce_flush(int (*write)(unsigned char *, unsigned long, unsigned int)) {
+
+	struct staged *p_s;  /* each staged write */
+	int result = 0;      /* optimistically presume success */
+
+	for (p_s = staged; p_s < &staged[ STAGED_PAGES ]; p_s++)
+		if (p_s->valid && flush_one(p_s, write))
+			result = -1;
+	return result;
+
+} /* coalesce_flush() */
+
+
+/* coalesce_get_stats()
+ *
+ * in:     nothing
+ * out:    p_stats - the module's counters
+ * return: nothing
+ *
+ */
+
+void
+coalesce_get_stats(struct nand_coalesce_stats *p_stats) {
+	*p_stats = counters;
+} /* coalesce_get_stats() */
+
+
+/* coalesce_print_stats()
+ *
+ * in:     nothing
+ * out:    the module's counters to stderr
+ * return: nothing
+ *
+ */
+
+void
+coalesce_print_stats(void) {
+
+	if (!enabled)
+		return;
+	fprintf(stderr, "Write coalescing: %lu writes staged, %lu page "
+		"programs issued for them, %lu saved.\n", counters.staged,
+		counters.programs, counters.saved);
+
+} /* coalesce_print_stats() */
@@ -0,0 +1,12 @@
+#ifndef _FW_COALESCE_H_
+#define _FW_COALESCE_H_
+
+bool coalesce_enabled(void);
+int coalesce_write(const unsigned char *, unsigned long, unsigned int,
+	int (*)(unsigned char *, unsigned long, unsigned int));
+int coalesce_read(unsigned long, unsigned long,
+	int (*)(unsigned char *, unsigned long, unsigned int));
+void coalesce_drop(unsigned long, unsigned long, unsigned long);
+int coalesce_flush(int (*)(unsigned char *, unsigned long, unsigned int));
+
+#endif
@@ -1,6 +1,7 @@
 // Copyright (c) 2022 Provatek, LLC.
 
 #include <sys/types.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <assert.h>
 
@@ -11,17 +12,16 @@
 #include "device_emu.h"
 #include "driver.h"
 #include "framework.h"
+#include "fw_address.h"
 #include "fw_execop.h"
+#include "fw_vector.h"
 
 #define PAGE_SIZE  NUM_BYTES
 #define BLOCK_SIZE (NUM_PAGES * PAGE_SIZE) /* device block size in bytes */
 
-/* The following three macros return the number of the block, the
- * number of the page within its block, and the number of the byte
- * within its page of the offset o, respectively.
+/* This macro returns the number of the byte within its page of the
+ * offset o.
  */
-#define BLOCK(o)        ((o) / BLOCK_SIZE)
-#define PAGE(o)         (((o) % BLOCK_SIZE) / PAGE_SIZE)
 #define BYTE(o)         ((o) % PAGE_SIZE)
 
 /* These constants indicate how many NAND instructions are needed in
@@ -31,30 +31,78 @@
 
 #define DATA_XFER_INSTRUCTIONS 3     /* xfer, execute, wait */
 #define ERASE_INSTRUCTIONS     2     /* execute, wait */
+#define SETUP_INSTRUCTIONS     2     /* setup, address */
+
+/* Operations are streamed to the driver in chunks.  Rather than
+ * describe a whole transfer or erase in one operation, whose
+ * instruction array grows with its size, the framework hands the
+ * driver's exec_op() one operation for each CHUNK_PAGES pages
+ * transferred or CHUNK_BLOCKS blocks erased.  Only the first chunk
+ * begins with the setup command and address; the rest continue where
+ * the one before left off, just as the device does.  The driver
+ * begins issuing commands after the framework plans the first chunk,
+ * and no transfer or erase needs more than a chunk's worth of
+ * instructions.
+ */
+#define CHUNK_PAGES  16
+#define CHUNK_BLOCKS 16
+
+/* Operation plans.
+ *
+ * Rather than malloc() and fill in a fresh instruction array for
+ * every chunk, the framework keeps NUM_PLANS operations whose
+ * instruction arrays it reuses from call to call.  Each plan
+ * remembers the shape of the chunk it holds: its operation's setup
+ * command, whether it is the operation's first chunk, the byte within
+ * the first page where a transfer begins, the chunk's size in bytes
+ * or blocks, and whether the driver takes DMA instructions.  A chunk
+ * with the same shape as a plan's reuses that plan, patching in only
+ * its own address and buffer pointers.  Any other chunk rebuilds the
+ * least recently used plan, growing its array only when the chunk
+ * needs more instructions than the array has ever held, so that
+ * repeated operations of a few shapes allocate nothing at all.  The
+ * middle chunks of every large transfer share one shape.
+ */
+#define NUM_PLANS 4
+
+struct plan {
+	unsigned char setup;      /* C_*_SETUP opcode, 0 if never built */
+	bool first;               /* begins with setup and address? */
+	unsigned int byte;        /* BYTE(offset) of a transfer */
+	unsigned long size;       /* bytes to transfer or blocks to erase */
+	unsigned int flags;       /* driver.flags when plan was built */
+	unsigned long used;       /* plan_clock when last used */
+	unsigned int capacity;    /* instructions operation.instrs holds */
+	struct nand_operation operation;
+};
+
+static struct plan plans[ NUM_PLANS ];
+static unsigned long plan_clock;     /* counts plan_get() calls */
 
 extern struct nand_driver driver;    /* from framework.c */
 
 
 /* instruction_count_data_xfer()
  *
- * in:     byte_addr - byte offset from start of page
+ * in:     first     - true for an operation's first chunk
+ *         byte_addr - byte offset from start of page
  *         size      - size of transfer in bytes
  * out:    nothing
  * return: number of NAND instructions needed
  *
  * Returns the number of NAND instructions needed for the read or
- * program operation described by the input parms.
+ * program chunk described by the input parms.
  *
  */
 
 static unsigned int
-instruction_count_data_xfer(unsigned int byte_addr,
+instruction_count_data_xfer(bool first, unsigned int byte_addr,
 			    unsigned int size) {
 
 	unsigned int count = 0; /* the instruction count accumulates here */
 
-	count++;    /* read or program setup instruction */
-	count++;    /* address instruction */
+	if (first)
+		count += SETUP_INSTRUCTIONS;
 
 	/* The device transfers data in whole pages, so we need to
 	 * consider the bytes of the first page that preceed
@@ -79,22 +127,23 @@ instruction_count_data_xfer(unsigned int byte_addr,
 
 /* instruction_count_erase()
  *
- * in:     num_blocks  - number of blocks to erase
+ * in:     first       - true for an operation's first chunk
+ *         num_blocks  - number of blocks to erase
  * out:    nothing
  * return: number of NAND instructions needed
  *
- * Returns the number of NAND instructions needed for the erase operation
+ * Returns the number of NAND instructions needed for the erase chunk
  * described by the input parms.
  *
  */
 
 static unsigned int
-instruction_count_erase(unsigned int num_blocks) {
+instruction_count_erase(bool first, unsigned long num_blocks) {
 
 	unsigned int count = 0; /* the instruction count accumulates here */
 
-	count++;    /* erase setup instruction */
-	count++;    /* address instruction */
+	if (first)
+		count += SETUP_INSTRUCTIONS;
 
 	count += ERASE_INSTRUCTIONS * num_blocks;
 	
@@ -109,6 +158,7 @@ static void
 print_operation(struct nand_operation *op) {
 
 	unsigned int i;                /* counts instructions in operation */
+	unsigned int a;                /* counts address cycles */
 	struct nand_op_instr *p_instr; /* points to each instruction */
 	
 	printf("Operation (%u): ", op->ninstrs);
@@ -122,24 +172,12 @@ print_operation(struct nand_operation *op) {
 			break;
 
 		case NAND_OP_ADDR_INSTR:
-			switch (p_instr->ctx.addr.naddrs) {
-			case NAND_INSTR_NUM_ADDR_IO:
-				printf("XADDR 0x%02x%02x%02x ",
-					p_instr->ctx.addr.addrs[
-					NAND_INSTR_BLOCK ],
-					p_instr->ctx.addr.addrs[
-					NAND_INSTR_PAGE ],
-					p_instr->ctx.addr.addrs[
-					NAND_INSTR_BYTE ]);
-				break;
-			case NAND_INSTR_NUM_ADDR_ERASE:
-				printf("EADDR 0x%02x ",
-					p_instr->ctx.addr.addrs[
-					NAND_INSTR_BLOCK ]);
-				break;
-			default:
-				assert(0);  /* bad number of addrs */
-			}
+			assert(p_instr->ctx.addr.naddrs <=
+				NAND_INSTR_NUM_ADDR_MAX);
+			printf("ADDR");
+			for (a = 0; a < p_instr->ctx.addr.naddrs; a++)
+				printf(" 0x%02x", p_instr->ctx.addr.addrs[ a ]);
+			printf(" ");
 			break;
 
 		case NAND_OP_DATA_IN_INSTR:
@@ -154,6 +192,11 @@ print_operation(struct nand_operation *op) {
 			printf("WAIT %u ", p_instr->ctx.waitrdy.timeout_ms);
 			break;
 
+		case NAND_OP_DMA_INSTR:
+			printf("DMA 0x%02x 0x%02x ", p_instr->ctx.dma.opcode,
+				p_instr->ctx.dma.len);
+			break;
+
 		default:
 			assert(0);  /* bad instruction type */
 
@@ -166,118 +209,352 @@ print_operation(struct nand_operation *op) {
 } /* print_operation() */
 
 #endif
-	
-/* exec_write()
+
+
+/* plan_get()
  *
- * in:     buffer - array of bytes to write to storage device
- *         offset - device address to receive data
- *         size   - number of bytes to write, can be multiple pages
- * out:    nothing
- * return: -1 on error (specifically, device timeout) else 0.
- *          
- * Writes size bytes from buffer to NAND storage device.  Writes them
- * to storage starting at the storage address in offset.
+ * in:     setup  - C_PROGRAM_SETUP, C_READ_SETUP, or C_ERASE_SETUP
+ *         first  - true for an operation's first chunk
+ *         byte   - BYTE(offset) for a transfer's first chunk, else 0
+ *         size   - bytes to transfer or blocks to erase in the chunk
+ *         count  - instructions the chunk needs
+ * out:    pp_plan - a plan whose array holds at least count
+ *                   instructions
+ * return: true if *pp_plan already holds a chunk of this shape,
+ *         false if the caller must build one in it.
  *
- * This version of write works with drivers that provide the framework
- * with a command interpreter rather than a jump table.
+ */
+
+static bool
+plan_get(unsigned char setup, bool first, unsigned int byte,
+	unsigned long size, unsigned int count, struct plan **pp_plan) {
+
+	struct plan *p_plan;  /* each plan in turn */
+	struct plan *p_lru;   /* least recently used plan */
+
+	plan_clock++;
+	p_lru = &plans[ 0 ];
+	for (p_plan = plans; p_plan < &plans[ NUM_PLANS ]; p_plan++) {
+		if ((p_plan->setup == setup) && (p_plan->first == first) &&
+		    (p_plan->byte == byte) && (p_plan->size == size) &&
+		    (p_plan->flags == driver.flags)) {
+			p_plan->used = plan_clock;
+			*pp_plan = p_plan;
+			return true;
+		}
+		if (p_plan->used < p_lru->used)
+			p_lru = p_plan;
+	}
+
+	if (p_lru->capacity < count) {
+		p_lru->operation.instrs = realloc(p_lru->operation.instrs,
+			count * sizeof(struct nand_op_instr));
+		assert(p_lru->operation.instrs != NULL);
+		p_lru->capacity = count;
+	}
+	p_lru->setup = setup;
+	p_lru->first = first;
+	p_lru->byte = byte;
+	p_lru->size = size;
+	p_lru->flags = driver.flags;
+	p_lru->used = plan_clock;
+	*pp_plan = p_lru;
+	return false;
+
+} /* plan_get() */
+
+
+/* plan_patch()
+ *
+ * in:     p_plan - a plan built by plan_transfer() or plan_erase()
+ *         offset - device address of the transfer or of the first
+ *                  block to erase
+ *         buffer - the chunk's part of the caller's data, or NULL
+ *                  for an erase
+ * out:    p_plan's address and buffer pointers set
+ * return: nothing
+ *
+ * Fills in the parts of a chunk that differ between chunks of the
+ * same shape.  A first chunk gets the address.  Each transfer
+ * instruction gets the part of buffer that follows the parts the
+ * instructions before it transfer.
  *
  */
 
-int
-exec_write(const unsigned char* buffer, unsigned int offset,
-	unsigned int size) {
+static void
+plan_patch(struct plan *p_plan, unsigned long offset,
+	unsigned char *buffer) {
+
+	struct nand_operation *op = &p_plan->operation;
+	struct nand_op_instr *p_instr;  /* points to each instruction */
+	unsigned int cursor = 0;        /* index into buffer */
+
+	if (p_plan->first)
+		op->instrs[ 1 ].ctx.addr.naddrs = nand_address(
+			op->instrs[ 1 ].ctx.addr.addrs, offset,
+			(p_plan->setup == C_ERASE_SETUP));
+
+	for (p_instr = op->instrs; p_instr < &op->instrs[ op->ninstrs ];
+	     p_instr++) {
+		switch (p_instr->type) {
+		case NAND_OP_DATA_IN_INSTR:
+			p_instr->ctx.data_in.buf = &buffer[ cursor ];
+			cursor += p_instr->ctx.data_in.len;
+			break;
+		case NAND_OP_DATA_OUT_INSTR:
+			p_instr->ctx.data_out.buf = &buffer[ cursor ];
+			cursor += p_instr->ctx.data_out.len;
+			break;
+		case NAND_OP_DMA_INSTR:
+			p_instr->ctx.dma.buf = &buffer[ cursor ];
+			cursor += p_instr->ctx.dma.len;
+			break;
+		default:
+			break;
+		}
+	}
 
-	struct nand_operation operation; /* the NAND operation to send */
+} /* plan_patch() */
+
+
+/* plan_transfer()
+ *
+ * in:     p_plan - a plan from plan_get() for C_PROGRAM_SETUP or
+ *                  C_READ_SETUP
+ *         byte   - BYTE(offset) of the chunk's first byte
+ *         size   - number of bytes in the chunk, can be multiple pages
+ * out:    p_plan holds a program or read chunk of this shape
+ * return: nothing
+ *
+ * Builds a chunk for exec_transfer(), leaving the address and buffer
+ * pointers for plan_patch().
+ *
+ */
+
+static void
+plan_transfer(struct plan *p_plan, unsigned int byte, unsigned int size) {
+
+	struct nand_op_instr *instrs = p_plan->operation.instrs;
+	bool write = (p_plan->setup == C_PROGRAM_SETUP);
 	unsigned int i = 0;              /* counts instructions in operation */
-	unsigned int cursor = 0;         /* index into buffer parm */
 	unsigned int size_remaining;     /* bytes left to transfer */
 	unsigned int available;          /* space available in current page */
 	unsigned int size_this_page;     /* bytes xferred in current page */
-	int ret_val = 0;                 /* optimistically presume success */
+	unsigned int xfer;               /* index of each page's transfer */
 
-#ifdef DIAGNOSTICS
-	printf("Framework exec_write() start addr 0x%08x "
-		"size 0x%08x instruction count 0x%08x.\n",
-	       offset, size, instruction_count_data_xfer(BYTE(offset), size));
-#endif 
-	
-	operation.instrs = malloc(instruction_count_data_xfer(BYTE(offset),
-		size) * sizeof(struct nand_op_instr));
-	assert(operation.instrs != NULL);
-
-	/* Begin with a C_PROGRAM_SETUP. */
-	operation.instrs[i].type = NAND_OP_CMD_INSTR;
-	operation.instrs[i].ctx.cmd.opcode = C_PROGRAM_SETUP;
-	i++;
-
-	/* Then specify the address. */
-	operation.instrs[i].type = NAND_OP_ADDR_INSTR;
-	operation.instrs[i].ctx.addr.naddrs = NAND_INSTR_NUM_ADDR_IO;
-	operation.instrs[i].ctx.addr.addrs[ NAND_INSTR_BLOCK ] = BLOCK(offset);
-	operation.instrs[i].ctx.addr.addrs[ NAND_INSTR_PAGE ]  = PAGE(offset);
-	operation.instrs[i].ctx.addr.addrs[ NAND_INSTR_BYTE ]  = BYTE(offset);
-	i++;
+	/* A first chunk begins with a C_PROGRAM_SETUP or C_READ_SETUP
+	 * and then specifies the address.
+	 */
+	if (p_plan->first) {
+		instrs[i].type = NAND_OP_CMD_INSTR;
+		instrs[i].ctx.cmd.opcode = p_plan->setup;
+		i++;
+		instrs[i].type = NAND_OP_ADDR_INSTR;
+		i++;
+	}
 
 	/* The driver expects to transfer the data one page at a time.
-	 * The first page is special: the data must begin at
-	 * BYTE(offset), and if BYTE(offset) is not 0 (that is, if the
-	 * beginning of the transfer is not page-aligned) the first
-	 * page won't be able to hold a full PAGE_SIZE of bytes.  All
-	 * subsequent pages will be able to hold up to PAGE_SIZE
-	 * bytes.  Use 'available' to manage this first
-	 * page/subsequent pages capacity logic. Add a transfer,
-	 * execute, waitrdy trio for each page to the operation.
+	 * The first page is special: the data must begin at byte, and
+	 * if byte is not 0 (that is, if the beginning of the transfer
+	 * is not page-aligned) the first page won't be able to hold a
+	 * full PAGE_SIZE of bytes.  All subsequent pages will be able
+	 * to hold up to PAGE_SIZE bytes.  Use 'available' to manage
+	 * this first page/subsequent pages capacity logic.  Add a
+	 * transfer, execute, waitrdy trio for each page written, or
+	 * an execute, waitrdy, transfer trio for each page read.
 	 */
 	size_remaining = size;
-	available = PAGE_SIZE - BYTE(offset);  /* First page capacity. */
+	available = PAGE_SIZE - byte;  /* First page capacity. */
 	while (size_remaining > 0) {
 
-		/* Add a data-in aka write aka program
-		 * instruction. Give each of these instructions a
-		 * pointer into the buffer parm to indicate the data
-		 * to write.  Use cursor to indicate the start of this
-		 * portion of the buffer parm.
+		/* Add a C_PROGRAM_EXECUTE or C_READ_EXECUTE command
+		 * and a waitrdy instruction, after the transfer for a
+		 * write or before it for a read.
 		 */
-		size_this_page = (size_remaining < available ?
-			size_remaining : available);
-		operation.instrs[i].type = NAND_OP_DATA_IN_INSTR;
-		operation.instrs[i].ctx.data_in.len = size_this_page;
-		operation.instrs[i].ctx.data_in.buf = &buffer[cursor];
-		i++;
-		
-		/* Add a C_PROGRAM_EXECUTE command. */
-		operation.instrs[i].type = NAND_OP_CMD_INSTR;
-		operation.instrs[i].ctx.cmd.opcode = C_PROGRAM_EXECUTE;
+		xfer = (write ? i : i + 2);
+		i = (write ? i + 1 : i);
+		instrs[i].type = NAND_OP_CMD_INSTR;
+		instrs[i].ctx.cmd.opcode = (write ? C_PROGRAM_EXECUTE :
+			C_READ_EXECUTE);
 		i++;
-		
-		/* Add a waitrdy instruction. */
-		operation.instrs[i].type = NAND_OP_WAITRDY_INSTR;
-		operation.instrs[i].ctx.waitrdy.timeout_ms =
-			TIMEOUT_WRITE_PAGE_US;
+		instrs[i].type = NAND_OP_WAITRDY_INSTR;
+		instrs[i].ctx.waitrdy.timeout_ms = (write ?
+			TIMEOUT_WRITE_PAGE_US : TIMEOUT_READ_PAGE_US);
 		i++;
+		i = (write ? i : i + 1);
+
+		/* Add a data-in aka write aka program instruction or
+		 * a data-out aka read instruction.  plan_patch() will
+		 * point each of these instructions at its portion of
+		 * the caller's buffer.  Drivers that can DMA get a
+		 * C_PROGRAM_DMA or C_READ_DMA instruction instead.
+		 */
+		size_this_page = (size_remaining < available ?
+			size_remaining : available);
+		if (driver.flags & NAND_DRIVER_DMA) {
+			instrs[xfer].type = NAND_OP_DMA_INSTR;
+			instrs[xfer].ctx.dma.opcode = (write ? C_PROGRAM_DMA :
+				C_READ_DMA);
+			instrs[xfer].ctx.dma.len = size_this_page;
+		} else if (write) {
+			instrs[xfer].type = NAND_OP_DATA_IN_INSTR;
+			instrs[xfer].ctx.data_in.len = size_this_page;
+		} else {
+			instrs[xfer].type = NAND_OP_DATA_OUT_INSTR;
+			instrs[xfer].ctx.data_out.len = size_this_page;
+		}
 		
 		size_remaining -= size_this_page;
-		cursor += size_this_page;
-		assert(cursor + size_remaining == size);
 		available = PAGE_SIZE;      /* Subsequent page capacity. */
 		
 	} /* while bytes remain to transfer */
 
-	operation.ninstrs = i;  /* record how many instructions we added */
+	p_plan->operation.ninstrs = i;  /* record how many we added */
 	
-	assert(operation.ninstrs == instruction_count_data_xfer(BYTE(offset),
-		size));
+	assert(p_plan->operation.ninstrs ==
+		instruction_count_data_xfer(p_plan->first, byte, size));
+
+} /* plan_transfer() */
+
+
+/* plan_erase()
+ *
+ * in:     p_plan     - a plan from plan_get() for C_ERASE_SETUP
+ *         num_blocks - number of blocks to erase in the chunk
+ * out:    p_plan holds an erase chunk of this shape
+ * return: nothing
+ *
+ * Builds a chunk for exec_erase(), leaving the address for
+ * plan_patch().
+ *
+ */
+
+static void
+plan_erase(struct plan *p_plan, unsigned long num_blocks) {
+
+	struct nand_op_instr *instrs = p_plan->operation.instrs;
+	unsigned int i = 0;         /* counts instructions */
+	unsigned long b;            /* counts blocks */
+
+	if (p_plan->first) {
+		instrs[i].type = NAND_OP_CMD_INSTR;
+		instrs[i++].ctx.cmd.opcode = C_ERASE_SETUP;
+		instrs[i++].type = NAND_OP_ADDR_INSTR;
+	}
+
+	for (b = 0; b < num_blocks; b++) {
+		instrs[i].type = NAND_OP_CMD_INSTR;
+		instrs[i++].ctx.cmd.opcode = C_ERASE_EXECUTE;
+
+		instrs[i].type = NAND_OP_WAITRDY_INSTR;
+		instrs[i++].ctx.waitrdy.timeout_ms = TIMEOUT_ERASE_BLOCK_US;
+	}
+
+	p_plan->operation.ninstrs = i;  /* record how many we added */
+
+	assert(p_plan->operation.ninstrs ==
+		instruction_count_erase(p_plan->first, num_blocks));
+
+} /* plan_erase() */
+
+
+/* exec_chunk()
+ *
+ * in:     op - the next chunk, complete with address and buffers
+ * out:    nothing
+ * return: -1 on error (specifically, device timeout) else 0.
+ *
+ */
+
+static int
+exec_chunk(struct nand_operation *op) {
 
 #ifdef DIAGNOSTICS
-	print_operation(&operation);
+	print_operation(op);
 #endif
+
+	if (driver.operation.exec_op(op))
+		return -1;  /* timeout */
+	return 0;
+
+} /* exec_chunk() */
+
+
+/* exec_transfer()
+ *
+ * in:     setup  - C_PROGRAM_SETUP or C_READ_SETUP
+ *         buffer - data to write, or buffer to receive data read
+ *         offset - device address of the first byte to transfer
+ *         size   - number of bytes to transfer, can be multiple pages
+ * out:    buffer - receives data read, for C_READ_SETUP
+ * return: -1 on error (specifically, device timeout) else 0.
+ *
+ * Streams a program or read operation to the driver one chunk at a
+ * time.  The first chunk ends at the end of the CHUNK_PAGES'th page;
+ * each later chunk covers up to CHUNK_PAGES more.
+ *
+ */
+
+static int
+exec_transfer(unsigned char setup, unsigned char *buffer,
+	unsigned long offset, unsigned int size) {
+
+	struct plan *p_plan;        /* plan holding each chunk */
+	bool first = true;          /* first chunk? */
+	unsigned int byte;          /* BYTE() of the chunk's start */
+	unsigned int cursor = 0;    /* index into buffer parm */
+	unsigned int chunk;         /* bytes in this chunk */
+
+	do {
+		byte = (first ? BYTE(offset) : 0);
+		chunk = CHUNK_PAGES * PAGE_SIZE - byte;
+		if (chunk > size - cursor)
+			chunk = size - cursor;
+
+		if (!plan_get(setup, first, byte, chunk,
+			instruction_count_data_xfer(first, byte, chunk),
+			&p_plan))
+			plan_transfer(p_plan, byte, chunk);
+		plan_patch(p_plan, offset, &buffer[ cursor ]);
+		if (exec_chunk(&p_plan->operation))
+			return -1;
+
+		cursor += chunk;
+		first = false;
+	} while (cursor < size);
+
+	return 0;
+
+} /* exec_transfer() */
+
 	
-	if (driver.operation.exec_op(&operation)) {
-		ret_val = -1;  /* timeout */
-	}
+/* exec_write()
+ *
+ * in:     buffer - array of bytes to write to storage device
+ *         offset - device address to receive data
+ *         size   - number of bytes to write, can be multiple pages
+ * out:    nothing
+ * return: -1 on error (specifically, device timeout) else 0.
+ *          
+ * Writes size bytes from buffer to NAND storage device.  Writes them
+ * to storage starting at the storage address in offset.
+ *
+ * This version of write works with drivers that provide the framework
+ * with a command interpreter rather than a jump table.
+ *
+ */
+
+int
+exec_write(const unsigned char* buffer, unsigned long offset,
+	unsigned int size) {
+
+#ifdef DIAGNOSTICS
+	printf("Framework exec_write() start addr 0x%08lx "
+		"size 0x%08x.\n", offset, size);
+#endif 
 
-	free(operation.instrs);
-	return ret_val;
+	return exec_transfer(C_PROGRAM_SETUP, (unsigned char *)buffer,
+		offset, size);
 
 } /* exec_write() */
 
@@ -298,99 +575,14 @@ exec_write(const unsigned char* buffer, unsigned int offset,
  */
 
 int
-exec_read(unsigned char* buffer, unsigned int offset, unsigned int size) {
-
-	struct nand_operation operation; /* the NAND operation to send */
-	unsigned int i = 0;              /* counts instructions in operation */
-	unsigned int cursor = 0;         /* index into buffer parm */
-	unsigned int size_remaining;     /* bytes left to transfer */
-	unsigned int available;          /* space available in current page */
-	unsigned int size_this_page;     /* bytes xferred in current page */
-	int ret_val = 0;                 /* optimistically presume success */
+exec_read(unsigned char* buffer, unsigned long offset, unsigned int size) {
 
 #ifdef DIAGNOSTICS
-	printf("Framework exec_read() start addr 0x%08x "
-		"size 0x%08x instruction count 0x%08x.\n",
-	       offset, size, instruction_count_data_xfer(BYTE(offset), size));
+	printf("Framework exec_read() start addr 0x%08lx "
+		"size 0x%08x.\n", offset, size);
 #endif 
-	
-	operation.instrs = malloc(instruction_count_data_xfer(BYTE(offset),
-		size) * sizeof(struct nand_op_instr));
-	assert(operation.instrs != NULL);
-
-	/* Begin with a C_READ_SETUP. */
-	operation.instrs[i].type = NAND_OP_CMD_INSTR;
-	operation.instrs[i].ctx.cmd.opcode = C_READ_SETUP;
-	i++;
-
-	/* Then specify the address. */
-	operation.instrs[i].type = NAND_OP_ADDR_INSTR;
-	operation.instrs[i].ctx.addr.naddrs = NAND_INSTR_NUM_ADDR_IO;
-	operation.instrs[i].ctx.addr.addrs[ NAND_INSTR_BLOCK ] = BLOCK(offset);
-	operation.instrs[i].ctx.addr.addrs[ NAND_INSTR_PAGE ]  = PAGE(offset);
-	operation.instrs[i].ctx.addr.addrs[ NAND_INSTR_BYTE ]  = BYTE(offset);
-	i++;
-
-	/* The driver expects to transfer the data one page at a time.
-	 * The first page is special: the data must begin at
-	 * BYTE(offset), and if BYTE(offset) is not 0 (that is, if the
-	 * beginning of the transfer is not page-aligned) the first
-	 * page won't be able to hold a full PAGE_SIZE of bytes.  All
-	 * subsequent pages will be able to hold up to PAGE_SIZE
-	 * bytes.  Use 'available' to manage this first
-	 * page/subsequent pages capacity logic. Add a transfer,
-	 * execute, waitrdy trio for each page to the operation.
-	 */
-	size_remaining = size;
-	available = PAGE_SIZE - BYTE(offset);  /* First page capacity. */
-	while (size_remaining > 0) {
-
-		/* Add a C_READ_EXECUTE command. */
-		operation.instrs[i].type = NAND_OP_CMD_INSTR;
-		operation.instrs[i].ctx.cmd.opcode = C_READ_EXECUTE;
-		i++;
-		
-		/* Add a waitrdy instruction. */
-		operation.instrs[i].type = NAND_OP_WAITRDY_INSTR;
-		operation.instrs[i].ctx.waitrdy.timeout_ms =
-			TIMEOUT_READ_PAGE_US;
-		i++;
-
-		/* Add a data-out aka read instruction. Give each of
-		 * these instructions a pointer into the buffer parm
-		 * to indicate where to put the data.  Use cursor to
-		 * indicate the start of this portion of the buffer
-		 * parm.
-		 */
-		size_this_page = (size_remaining < available ?
-			size_remaining : available);
-		operation.instrs[i].type = NAND_OP_DATA_OUT_INSTR;
-		operation.instrs[i].ctx.data_in.len = size_this_page;
-		operation.instrs[i].ctx.data_in.buf = &buffer[cursor];
-		i++;
-		
-		size_remaining -= size_this_page;
-		cursor += size_this_page;
-		assert(cursor + size_remaining == size);
-		available = PAGE_SIZE;      /* Subsequent page capacity. */
-		
-	} /* while bytes remain to transfer */
-
-	operation.ninstrs = i;  /* record how many instructions we added */
-	
-	assert(operation.ninstrs == instruction_count_data_xfer(BYTE(offset),
-		size));
-
-#ifdef DIAGNOSTICS
-	print_operation(&operation);
-#endif
-	
-	if (driver.operation.exec_op(&operation)) {
-		ret_val = -1;  /* timeout */
-	}
 
-	free(operation.instrs);
-	return ret_val;
+	return exec_transfer(C_READ_SETUP, buffer, offset, size);
 	
 } /* exec_read() */
 
@@ -405,7 +597,8 @@ exec_read(unsigned char* buffer, unsigned int offset, unsigned int size) {
  * return: -1 on device timeout, otherwise 0 (presumed success).
  *
  * This function uses the operation interpreter to erase a
- * contiguous series of blocks on the device.
+ * contiguous series of blocks on the device, CHUNK_BLOCKS blocks
+ * at a time.
  *
  * Note that, like the real Linux framework, it expects callers to
  * identify the first block to erase in terms of its number of bytes
@@ -423,14 +616,13 @@ exec_read(unsigned char* buffer, unsigned int offset, unsigned int size) {
  */
 
 int
-exec_erase(unsigned int offset, unsigned int size) {
+exec_erase(unsigned long offset, unsigned long size) {
 	
-	struct nand_operation operation; /* the NAND operation to send */
-	unsigned char start_block;  /* block number of first block to erase */
-	unsigned int num_blocks;    /* number of complete blocks to erase */
-	int i = 0;                  /* counts instructions */
-	unsigned int b;             /* counts blocks */
-	int ret_val = 0;            /* optimistically presume success */
+	struct plan *p_plan;        /* plan holding each chunk */
+	unsigned long start_block;  /* block number of first block to erase */
+	unsigned long num_blocks;   /* number of complete blocks to erase */
+	unsigned long b = 0;        /* counts blocks erased */
+	unsigned long chunk;        /* blocks in this chunk */
 	
 	/* The offset and size input parms describe the region to
 	 * erase in terms of bytes.  Describe it in terms of blocks,
@@ -444,46 +636,203 @@ exec_erase(unsigned int offset, unsigned int size) {
 	if (size % BLOCK_SIZE) num_blocks++;  /* Round up for partial blocks */
 
 #ifdef DIAGNOSTICS
-	printf("Framework exec_erase() start block 0x%02x "
-		"num blocks 0x%02x instruction count 0x%08x.\n",
-		start_block, num_blocks, instruction_count_erase(num_blocks));
+	printf("Framework exec_erase() start block 0x%02lx "
+		"num blocks 0x%02lx.\n", start_block, num_blocks);
 #endif 
 
-	operation.instrs = malloc(instruction_count_erase(num_blocks)
-		* sizeof(struct nand_op_instr));
-	assert(operation.instrs != NULL);
-	
-	operation.ninstrs = 2; // SETUP + ADDR INSTRUCTION
+	do {
+		chunk = ((num_blocks - b < CHUNK_BLOCKS) ? num_blocks - b :
+			CHUNK_BLOCKS);
+		if (!plan_get(C_ERASE_SETUP, (b == 0), 0, chunk,
+			instruction_count_erase((b == 0), chunk), &p_plan))
+			plan_erase(p_plan, chunk);
+		plan_patch(p_plan, start_block * BLOCK_SIZE, NULL);
+		if (exec_chunk(&p_plan->operation))
+			return -1;
+		b += chunk;
+	} while (b < num_blocks);
+
+	return 0;
+}
 
-	operation.instrs[i].type = NAND_OP_CMD_INSTR;
-	operation.instrs[i++].ctx.cmd.opcode = C_ERASE_SETUP;
 
-	operation.instrs[i].type = NAND_OP_ADDR_INSTR;
-	operation.instrs[i].ctx.addr.naddrs = NAND_INSTR_NUM_ADDR_ERASE;
-	operation.instrs[i].ctx.addr.addrs[ NAND_INSTR_BLOCK ] =
-		start_block;
-	i++;
+/* Vectored operations.
+ *
+ * vector_transfer() builds readv_nand() and writev_nand() operations
+ * one instruction at a time in the vector operation, whose array
+ * grows as needed and is kept from call to call.  Each run's
+ * instructions point straight into its segments' buffers, so they
+ * aren't worth keeping as plans.  Like other transfers, vectored
+ * transfers reach the driver in chunks of at most CHUNK_PAGES
+ * execute commands, and only a new run re-addresses the device.
+ */
+static struct nand_operation vector;
+static unsigned int vector_capacity;  /* instructions vector.instrs holds */
+static unsigned int vector_pages;     /* execute commands in vector */
 
-	for (b = 0; b < num_blocks; b++) {
-		operation.ninstrs++;
-		operation.instrs[i].type = NAND_OP_CMD_INSTR;
-		operation.instrs[i++].ctx.cmd.opcode = C_ERASE_EXECUTE;
-
-		operation.ninstrs++;
-		operation.instrs[i].type = NAND_OP_WAITRDY_INSTR;
-		operation.instrs[i++].ctx.waitrdy.timeout_ms =
-			TIMEOUT_ERASE_BLOCK_US;
+
+/* vector_add()
+ *
+ * in:     type - type of instruction to add
+ * out:    vector grown by one instruction
+ * return: the new instruction.
+ *
+ */
+
+static struct nand_op_instr *
+vector_add(enum nand_op_instr_type type) {
+
+	struct nand_op_instr *p_instr;  /* the new instruction */
+
+	if (vector.ninstrs == vector_capacity) {
+		vector_capacity = (vector_capacity ? 2 * vector_capacity :
+			SETUP_INSTRUCTIONS + DATA_XFER_INSTRUCTIONS * CHUNK_PAGES);
+		vector.instrs = realloc(vector.instrs,
+			vector_capacity * sizeof(struct nand_op_instr));
+		assert(vector.instrs != NULL);
 	}
+	p_instr = &vector.instrs[ vector.ninstrs++ ];
+	p_instr->type = type;
+	return p_instr;
 
-	assert(operation.ninstrs == instruction_count_erase(num_blocks));
+} /* vector_add() */
 
-#ifdef DIAGNOSTICS
-	print_operation(&operation);
-#endif
-	
-	if (driver.operation.exec_op(&operation))
-		ret_val = -1;  /* timeout */
 
-	free(operation.instrs);
-	return ret_val;
-}
+/* vector_flush()
+ *
+ * in:     nothing
+ * out:    vector emptied
+ * return: -1 on error (specifically, device timeout) else 0.
+ *
+ * Hands the driver whatever vector holds.
+ *
+ */
+
+static int
+vector_flush(void) {
+
+	int result = 0;  /* exec_chunk()'s result */
+
+	if (vector.ninstrs)
+		result = exec_chunk(&vector);
+	vector.ninstrs = 0;
+	vector_pages = 0;
+	return result;
+
+} /* vector_flush() */
+
+
+/* vector_command(), vector_address(), vector_transfer_data(),
+ * vector_wait()
+ *
+ * The vector_ops that let vector_transfer() build exec_op
+ * operations.  vector_wait() hands the driver a chunk once it
+ * holds CHUNK_PAGES execute commands.
+ *
+ */
+
+static void
+vector_command(unsigned char opcode) {
+	vector_add(NAND_OP_CMD_INSTR)->ctx.cmd.opcode = opcode;
+} /* vector_command() */
+
+
+static void
+vector_address(unsigned long offset) {
+
+	struct nand_op_instr *p_instr = vector_add(NAND_OP_ADDR_INSTR);
+
+	p_instr->ctx.addr.naddrs = nand_address(p_instr->ctx.addr.addrs,
+		offset, false);
+
+} /* vector_address() */
+
+
+static void
+vector_transfer_data(bool write, unsigned char *buffer, unsigned int length) {
+
+	struct nand_op_instr *p_instr;  /* the transfer instruction */
+
+	if (driver.flags & NAND_DRIVER_DMA) {
+		p_instr = vector_add(NAND_OP_DMA_INSTR);
+		p_instr->ctx.dma.opcode = (write ? C_PROGRAM_DMA : C_READ_DMA);
+		p_instr->ctx.dma.len = length;
+		p_instr->ctx.dma.buf = buffer;
+	} else if (write) {
+		p_instr = vector_add(NAND_OP_DATA_IN_INSTR);
+		p_instr->ctx.data_in.len = length;
+		p_instr->ctx.data_in.buf = buffer;
+	} else {
+		p_instr = vector_add(NAND_OP_DATA_OUT_INSTR);
+		p_instr->ctx.data_out.len = length;
+		p_instr->ctx.data_out.buf = buffer;
+	}
+
+} /* vector_transfer_data() */
+
+
+static int
+vector_wait(unsigned int timeout_us) {
+
+	vector_add(NAND_OP_WAITRDY_INSTR)->ctx.waitrdy.timeout_ms = timeout_us;
+	if (++vector_pages < CHUNK_PAGES)
+		return 0;
+	return vector_flush();
+
+} /* vector_wait() */
+
+
+static const struct vector_ops exec_vector_ops = {
+	.command  = vector_command,
+	.address  = vector_address,
+	.transfer = vector_transfer_data,
+	.wait     = vector_wait,
+};
+
+
+/* exec_writev()
+ *
+ * in:     iov    - segments to write
+ *         iovcnt - number of segments
+ * out:    nothing
+ * return: -1 on error (specifically, device timeout) else 0.
+ *
+ * Writes the segments with one setup command and address per run of
+ * contiguous segments; see fw_vector.c.
+ *
+ */
+
+int
+exec_writev(const struct nand_iovec *iov, unsigned int iovcnt) {
+
+	vector.ninstrs = 0;
+	vector_pages = 0;
+	if (vector_transfer(&exec_vector_ops, true, iov, iovcnt))
+		return -1;
+	return vector_flush();
+
+} /* exec_writev() */
+
+
+/* exec_readv()
+ *
+ * in:     iov    - segments to read
+ *         iovcnt - number of segments
+ * out:    data read into the segments' buffers
+ * return: -1 on error (specifically, device timeout) else 0.
+ *
+ * Reads the segments with one setup command and address per run of
+ * contiguous segments; see fw_vector.c.
+ *
+ */
+
+int
+exec_readv(const struct nand_iovec *iov, unsigned int iovcnt) {
+
+	vector.ninstrs = 0;
+	vector_pages = 0;
+	if (vector_transfer(&exec_vector_ops, false, iov, iovcnt))
+		return -1;
+	return vector_flush();
+
+} /* exec_readv() */
@@ -1,8 +1,12 @@
 #ifndef _FW_EXECOP_H_
 #define _FW_EXECOP_H_
 
-int exec_write(const unsigned char *, unsigned int, unsigned int);
-int exec_read(unsigned char *, unsigned int, unsigned int);
-int exec_erase(unsigned int, unsigned int);
+struct nand_iovec;  /* from framework.h */
+
+int exec_write(const unsigned char *, unsigned long, unsigned int);
+int exec_read(unsigned char *, unsigned long, unsigned int);
+int exec_erase(unsigned long, unsigned long);
+int exec_writev(const struct nand_iovec *, unsigned int);
+int exec_readv(const struct nand_iovec *, unsigned int);
 
 #endif
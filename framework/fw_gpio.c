@@ -1,5 +1,8 @@
+#include <sys/types.h>
 #include <assert.h>
 
+#include "clock.h"
+#include "device_emu.h"
 #include "framework.h"
 
 /* This is an x86/amd64-specific assembly breakpoint instruction that
@@ -21,6 +24,11 @@
 
 #define BREAKPOINT asm("int $3")
 
+/* The device emulator's shared status page, or NULL if gpio_get()
+ * must trap to learn whether the device is busy.
+ */
+static const struct gpio_status *status;
+
 /* gpio_set()
  *
  * in:     pin   - the pin number to set.
@@ -34,7 +42,7 @@
  *   Otherwise, sets the GPIO pin indicagted by pin.
  *
  * If you modify this function, make sure to adjust the
- * RIP_IN_GPIO_GET() macro.
+ * RIP_IN_GPIO_SET() macro.
  */
 
 void
@@ -42,7 +50,7 @@ gpio_set(unsigned int pin, unsigned int value) {
 	BREAKPOINT;
 }
 
-/* gpio_get()
+/* gpio_get_trap()
  *
  * in:     pin   - the pin number to get.
  * out:    none
@@ -53,13 +61,13 @@ gpio_set(unsigned int pin, unsigned int value) {
  *   Returns 0 if the pin'th pin is clear, otherwise returns 1.
  *
  * If you modify this function, make sure to adjust the
- * RIP_IN_GPIO_SET() macro.
+ * RIP_IN_GPIO_GET() macro.
  */
 
 #define DUMMY 0xAB  /* dummy gpio_get() result to detect breakpoint failure */
 
 unsigned int
-gpio_get(unsigned int pin) {
+gpio_get_trap(unsigned int pin) {
 	
 	/* It is important that this local variable be an unsigned long.
 	 * The tracer will modify the value of this variable using
@@ -74,4 +82,59 @@ gpio_get(unsigned int pin) {
 	assert(retval != DUMMY); /* tracee should have modified retval */
 	return retval;
 
+} /* gpio_get_trap() */
+
+
+/* gpio_init_status()
+ *
+ * in:     in_status - the device's shared status page
+ * out:    status set via side effect
+ * return: nothing
+ *
+ * Call this on startup to have gpio_get() read the status pin from
+ * the status page the device emulator publishes rather than trapping
+ * to ask for it.
+ *
+ */
+
+void
+gpio_init_status(const struct gpio_status *in_status) {
+	status = in_status;
+} /* gpio_init_status() */
+
+
+/* gpio_get()
+ *
+ * in:     pin   - the pin number to get.
+ * out:    none
+ * return: the value of the pin'th pin, either 0 or 1.
+ *
+ * Returns 0 if the pin'th pin is clear, otherwise returns 1.  Reads
+ * the status pins straight from the device's status page when there
+ * is one; traps to the device emulator via gpio_get_trap() otherwise.
+ *
+ */
+
+unsigned int
+gpio_get(unsigned int pin) {
+
+	unsigned int target;  /* whose status pin to read */
+
+	if (!status)
+		return gpio_get_trap(pin);
+
+	if (pin == PN_STATUS)
+		target = status->target;
+	else if ((pin >= PN_STATUS_TARGET(0)) &&
+		 (pin < PN_STATUS_TARGET(NUM_TARGETS)))
+		target = pin - PN_STATUS_TARGET(0);
+	else
+		return gpio_get_trap(pin);
+
+	if (now() < status->deadline[ target ]) {
+		clock_advance(BUSY_POLL_US);  /* see device_emu.h */
+		return DEVICE_BUSY;
+	}
+	return DEVICE_READY;
+
 } /* gpio_get() */
@@ -0,0 +1,152 @@
+/* Framework IO register accessor module.
+ *
+ * Copyright (c) 2023 Timothy Jon Fraser Consulting LLC.
+ *
+ * Drivers may opt in to reading and writing the emulated device's IO
+ * registers through these accessors, much as real Linux drivers use
+ * readb() and writeb(), rather than dereferencing the registers
+ * themselves.  The test drivers don't; the rig exists to watch what
+ * their own code does to the registers.  Only alpha_0, built with
+ * -DIOREG_ACCESSORS as test_mailbox_alpha_0, opts in.  By default
+ * the accessors simply dereference the register address, and the
+ * device emulator's hardware watchpoint traps the access.  When
+ * main.c selects the shared-memory transport, the accessors instead
+ * post each access to a mailbox in the shared page and wait for the
+ * device emulator to service it, avoiding the trap.
+ *
+ */
+
+#include <sched.h>
+#include <stddef.h>
+
+#include "device_emu.h"
+#include "framework.h"
+
+/* The tracee polls for the device emulator's acknowledgement this
+ * many times before yielding the CPU.
+ */
+#define SHM_POLLS_PER_YIELD 64
+
+/* Shared-memory transport page, or NULL if main.c did not select
+ * the shared-memory transport.
+ */
+static struct ioregs_shm *shm;
+
+
+/* IN_SHM_REGISTERS()
+ *
+ * True iff address a lies within the shared page's command, address,
+ * and data register word.  The DMA registers after it need no mailbox.
+ */
+#define IN_SHM_REGISTERS(a) \
+	(shm && ((volatile unsigned char *)(a) >= \
+	 (volatile unsigned char *)shm->ioregisters) && \
+	 ((volatile unsigned char *)(a) < \
+	 (volatile unsigned char *)shm->ioregisters + \
+	 sizeof(shm->ioregisters[ 0 ])))
+
+
+/* ioreg_init_shm()
+ *
+ * in:     in_shm - the shared-memory transport page
+ * out:    shm set via side effect
+ * return: nothing
+ *
+ * main.c calls this function in the child tracee before
+ * init_framework() to select the shared-memory transport.
+ *
+ */
+
+void
+ioreg_init_shm(struct ioregs_shm *in_shm) {
+	shm = in_shm;
+} /* ioreg_init_shm() */
+
+
+/* mailbox_post()
+ *
+ * in:     op     - IOREG_OP_READ or IOREG_OP_WRITE
+ *         offset - register offset
+ *         value  - value to write; ignored for reads
+ * out:    shared-memory mailbox updated via side effect
+ * return: the value the device emulator left in the mailbox
+ *
+ * Posts a register access to the device emulator and waits for it to
+ * acknowledge.  The tracee is the only writer of request and the
+ * device emulator is the only writer of ack, so a release store on
+ * one side and an acquire load on the other is all the
+ * synchronization we need.
+ *
+ */
+
+static unsigned int
+mailbox_post(unsigned int op, unsigned int offset, unsigned int value) {
+
+	unsigned long seq;           /* this access's sequence number */
+	unsigned int polls = 0;      /* counts polls since last yield */
+
+	shm->op = op;
+	shm->offset = offset;
+	shm->value = value;
+	seq = shm->request + 1;
+	__atomic_store_n(&(shm->request), seq, __ATOMIC_RELEASE);
+
+	while (__atomic_load_n(&(shm->ack), __ATOMIC_ACQUIRE) != seq) {
+		if (++polls == SHM_POLLS_PER_YIELD) {
+			polls = 0;
+			sched_yield();
+		}
+	}
+
+	return shm->value;
+
+} /* mailbox_post() */
+
+
+/* ioreg_writeb()
+ *
+ * in:     value - byte to write
+ *         addr  - address of IO register to receive it
+ * out:    IO register updated via side effect
+ * return: nothing
+ *
+ * Writes value to the IO register at addr.
+ *
+ */
+
+void
+ioreg_writeb(unsigned char value, volatile unsigned char *addr) {
+
+	if (IN_SHM_REGISTERS(addr)) {
+		mailbox_post(IOREG_OP_WRITE,
+			addr - (volatile unsigned char *)shm->ioregisters,
+			value);
+		return;
+	}
+
+	*addr = value;
+
+} /* ioreg_writeb() */
+
+
+/* ioreg_readb()
+ *
+ * in:     addr - address of IO register to read
+ * out:    nothing
+ * return: byte read from the IO register
+ *
+ * Reads the IO register at addr.
+ *
+ */
+
+unsigned char
+ioreg_readb(volatile unsigned char *addr) {
+
+	if (IN_SHM_REGISTERS(addr))
+		return mailbox_post(IOREG_OP_READ,
+			addr - (volatile unsigned char *)shm->ioregisters,
+			0);
+
+	return *addr;
+
+} /* ioreg_readb() */
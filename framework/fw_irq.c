@@ -0,0 +1,107 @@
+/* Framework ready/busy interrupt module.
+ *
+ * Copyright (c) 2023 Timothy Jon Fraser Consulting LLC.
+ *
+ * Real NAND controllers raise an interrupt on the rising edge of the
+ * device's ready/busy line so that drivers needn't poll.  When
+ * main.c selects interrupt mode, it shares a timerfd between the
+ * device emulator and the driver.  The device emulator arms the
+ * timer to expire at the end of each busy period, and drivers that
+ * support interrupts call irq_wait_ready() to sleep until it does
+ * rather than polling gpio_get() every NAND_POLL_INTERVAL_US.
+ *
+ */
+
+#define _GNU_SOURCE  /* for ppoll() */
+
+#include <sys/types.h>
+#include <poll.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "clock.h"
+#include "device_emu.h"
+#include "framework.h"
+
+/* Macros for converting between various units of time. */
+#define US_PER_S  1000000UL
+#define NS_PER_US 1000UL
+
+/* The timerfd the device emulator arms, or -1 if main.c did not
+ * select interrupt mode.
+ */
+static int irq_fd = -1;
+
+
+/* irq_init()
+ *
+ * in:     fd - the timerfd the device emulator arms
+ * out:    irq_fd set via side effect
+ * return: nothing
+ *
+ * main.c calls this function in the child tracee before
+ * init_framework() to select interrupt mode.
+ *
+ */
+
+void
+irq_init(int fd) {
+	irq_fd = fd;
+} /* irq_init() */
+
+
+/* irq_enabled()
+ *
+ * in:     nothing
+ * out:    nothing
+ * return: 1 in interrupt mode, otherwise 0.
+ *
+ * Drivers call this to decide between irq_wait_ready() and polling.
+ *
+ */
+
+int
+irq_enabled(void) {
+	return (irq_fd >= 0);
+} /* irq_enabled() */
+
+
+/* irq_wait_ready()
+ *
+ * in:     interval_us - give up after this many microseconds
+ * out:    nothing
+ * return: 0 if the device became ready, -1 on timeout.
+ *
+ * Waits for the device to become ready, sleeping until the device
+ * emulator's ready interrupt or the timeout, whichever comes first.
+ * The status pin remains the authority on readiness; the interrupt
+ * only says when it is worth checking again.
+ *
+ */
+
+int
+irq_wait_ready(unsigned int interval_us) {
+
+	timeus_t timeout = now() + interval_us;  /* give up at this time */
+	timeus_t t;                              /* time of each check */
+	timeus_t remaining;                      /* until timeout */
+	struct pollfd pfd;                       /* wait on the timerfd */
+	struct timespec ts;                      /* ppoll() timeout */
+	uint64_t expirations;                    /* read from the timerfd */
+
+	pfd.fd = irq_fd;
+	pfd.events = POLLIN;
+
+	while (gpio_get(PN_STATUS) != DEVICE_READY) {
+		if ((t = now()) >= timeout)
+			return ((gpio_get(PN_STATUS) == DEVICE_READY) ? 0 : -1);
+		remaining = timeout - t;
+		ts.tv_sec = remaining / US_PER_S;
+		ts.tv_nsec = (remaining % US_PER_S) * NS_PER_US;
+		if (ppoll(&pfd, 1, &ts, NULL) > 0)
+			read(irq_fd, &expirations, sizeof(expirations));
+	}
+	return 0;
+
+} /* irq_wait_ready() */
@@ -1,19 +1,48 @@
 // Copyright (c) 2022 Provatek, LLC.
 
 #include <sys/types.h>
+#include <stdbool.h>
 #ifdef DIAGNOSTICS
 #include <stdio.h>
 #endif
 #include "device_emu.h"
 #include "driver.h"
 #include "framework.h"
+#include "fw_address.h"
 #include "fw_jumptable.h"
+#include "fw_vector.h"
 
 extern struct nand_driver driver;  /* from framework.c */
 
 #define BLOCK_SIZE  (NUM_PAGES * NUM_BYTES) /* device block size in bytes */
 
 
+/* jt_address()
+ *
+ * in:     offset - device address
+ *         erase  - true to send only the block address, for an erase
+ * out:    nothing
+ * return: nothing
+ *
+ * Writes the address cycles for offset to the address register.
+ *
+ */
+
+static void
+jt_address(unsigned long offset, bool erase) {
+
+	unsigned char addrs[ NAND_INSTR_NUM_ADDR_MAX ];  /* address cycles */
+	unsigned int naddrs;                            /* how many */
+	unsigned int a;                                 /* indexes addrs */
+
+	naddrs = nand_address(addrs, offset, erase);
+	for (a = 0; a < naddrs; a++)
+		driver.operation.jump_table.set_register(IOREG_ADDRESS,
+			addrs[ a ]);
+
+} /* jt_address() */
+
+
 /* jt_write()
  *
  * in:     buffer - array of bytes to write to storage device
@@ -27,26 +56,24 @@ extern struct nand_driver driver;  /* from framework.c */
  *
  * This version of write works with drivers that provide the framework
  * with a jump table of functions rather than a command interpreter.
+ * If the jump table has a dma_buffer() function, each page crosses to
+ * the device in a single C_PROGRAM_DMA rather than byte by byte.
  *
  */
 
 int
-jt_write(unsigned char *buffer, unsigned int offset, unsigned int size) {
+jt_write(unsigned char *buffer, unsigned long offset, unsigned int size) {
 	
 	unsigned int bytes_left = size;
 	unsigned int cursor = 0;
 
-	unsigned char byte_addr = offset % NUM_BYTES;
-	unsigned char page_addr = offset / NUM_PAGES;
-	unsigned char block_addr = offset / BLOCK_SIZE;
+	unsigned int byte_addr = offset % NUM_BYTES;
 
 	unsigned int size_to_write;
 
 	driver.operation.jump_table.set_register(IOREG_COMMAND, 
 		C_PROGRAM_SETUP);
-	driver.operation.jump_table.set_register(IOREG_ADDRESS, block_addr);
-	driver.operation.jump_table.set_register(IOREG_ADDRESS, page_addr);
-	driver.operation.jump_table.set_register(IOREG_ADDRESS, byte_addr);
+	jt_address(offset, false);
 
 	while (bytes_left) {
 		size_to_write = NUM_BYTES;
@@ -65,8 +92,15 @@ jt_write(unsigned char *buffer, unsigned int offset, unsigned int size) {
 		       size_to_write, size, cursor);
 #endif
 		
-		driver.operation.jump_table.write_buffer(&buffer[cursor], 
-			size_to_write);
+		if (driver.operation.jump_table.dma_buffer) {
+			driver.operation.jump_table.dma_buffer(
+				&buffer[cursor], size_to_write);
+			driver.operation.jump_table.set_register(
+				IOREG_COMMAND, C_PROGRAM_DMA);
+		} else {
+			driver.operation.jump_table.write_buffer(
+				&buffer[cursor], size_to_write);
+		}
 		driver.operation.jump_table.set_register(IOREG_COMMAND, 
 			C_PROGRAM_EXECUTE);
 		if (driver.operation.jump_table.wait_ready(
@@ -92,26 +126,24 @@ jt_write(unsigned char *buffer, unsigned int offset, unsigned int size) {
  *
  * This version of read works with drivers that provide the framework
  * with a jump table of functions rather than a command interpreter.
+ * If the jump table has a dma_buffer() function, each page crosses
+ * from the device in a single C_READ_DMA rather than byte by byte.
  *
  */
 
 int
-jt_read(unsigned char *buffer, unsigned int offset, unsigned int size) {
+jt_read(unsigned char *buffer, unsigned long offset, unsigned int size) {
 	
 	unsigned int bytes_left = size;
 	unsigned int cursor = 0;
 
-	unsigned char byte_addr = offset % NUM_BYTES;
-	unsigned char page_addr = offset / NUM_PAGES;
-	unsigned char block_addr = offset / BLOCK_SIZE;
+	unsigned int byte_addr = offset % NUM_BYTES;
 
 	unsigned int size_to_read;
 
 	driver.operation.jump_table.set_register(IOREG_COMMAND, 
 		C_READ_SETUP);
-	driver.operation.jump_table.set_register(IOREG_ADDRESS, block_addr);
-	driver.operation.jump_table.set_register(IOREG_ADDRESS, page_addr);
-	driver.operation.jump_table.set_register(IOREG_ADDRESS, byte_addr);
+	jt_address(offset, false);
 	while(bytes_left) {
 		driver.operation.jump_table.set_register(IOREG_COMMAND, 
 			C_READ_EXECUTE);
@@ -134,8 +166,15 @@ jt_read(unsigned char *buffer, unsigned int offset, unsigned int size) {
 		       size_to_read, size, cursor);
 #endif
 
-		driver.operation.jump_table.read_buffer(&buffer[cursor], 
-			size_to_read);
+		if (driver.operation.jump_table.dma_buffer) {
+			driver.operation.jump_table.dma_buffer(
+				&buffer[cursor], size_to_read);
+			driver.operation.jump_table.set_register(
+				IOREG_COMMAND, C_READ_DMA);
+		} else {
+			driver.operation.jump_table.read_buffer(
+				&buffer[cursor], size_to_read);
+		}
 
 		cursor += size_to_read;
 		bytes_left -= size_to_read;
@@ -172,11 +211,11 @@ jt_read(unsigned char *buffer, unsigned int offset, unsigned int size) {
  */
 
 int
-jt_erase(unsigned int offset, unsigned int size) {
+jt_erase(unsigned long offset, unsigned long size) {
 
-	unsigned char start_block;  /* block number of first block to erase */
-	unsigned int num_blocks;    /* number of complete blocks to erase */
-	unsigned int b;             /* counts blocks as we erase them */
+	unsigned long start_block;  /* block number of first block to erase */
+	unsigned long num_blocks;   /* number of complete blocks to erase */
+	unsigned long b;            /* counts blocks as we erase them */
 	
 	/* The offset and size input parms describe the region to
 	 * erase in terms of bytes.  Describe it in terms of blocks,
@@ -190,14 +229,13 @@ jt_erase(unsigned int offset, unsigned int size) {
 	if (size % BLOCK_SIZE) num_blocks++;  /* Round up for partial blocks */
 
 #ifdef DIAGNOSTICS
-	printf("Framework jt_erase() start block 0x%02x num blocks 0x%02x.\n",
+	printf("Framework jt_erase() start block 0x%02lx num blocks 0x%02lx.\n",
 		start_block, num_blocks);
 #endif 
 
 	driver.operation.jump_table.set_register(IOREG_COMMAND, 
 		C_ERASE_SETUP);
-	driver.operation.jump_table.set_register(IOREG_ADDRESS, 
-		start_block);
+	jt_address(start_block * BLOCK_SIZE, true);
 	for (b = 0; b < num_blocks; b++) {
 		driver.operation.jump_table.set_register(IOREG_COMMAND, 
 			C_ERASE_EXECUTE);
@@ -208,3 +246,88 @@ jt_erase(unsigned int offset, unsigned int size) {
 	return 0;
 	
 } /* jt_erase() */
+
+
+/* jt_command(), jt_run_address(), jt_transfer(), jt_wait()
+ *
+ * The vector_ops that let vector_transfer() drive jump table
+ * drivers.  jt_transfer() DMAs when the jump table can.
+ *
+ */
+
+static void
+jt_command(unsigned char opcode) {
+	driver.operation.jump_table.set_register(IOREG_COMMAND, opcode);
+} /* jt_command() */
+
+
+static void
+jt_run_address(unsigned long offset) {
+	jt_address(offset, false);
+} /* jt_run_address() */
+
+
+static void
+jt_transfer(bool write, unsigned char *buffer, unsigned int length) {
+
+	if (driver.operation.jump_table.dma_buffer) {
+		driver.operation.jump_table.dma_buffer(buffer, length);
+		driver.operation.jump_table.set_register(IOREG_COMMAND,
+			(write ? C_PROGRAM_DMA : C_READ_DMA));
+	} else if (write) {
+		driver.operation.jump_table.write_buffer(buffer, length);
+	} else {
+		driver.operation.jump_table.read_buffer(buffer, length);
+	}
+
+} /* jt_transfer() */
+
+
+static int
+jt_wait(unsigned int timeout_us) {
+	return (driver.operation.jump_table.wait_ready(timeout_us) ? -1 : 0);
+} /* jt_wait() */
+
+
+static const struct vector_ops jt_vector_ops = {
+	.command  = jt_command,
+	.address  = jt_run_address,
+	.transfer = jt_transfer,
+	.wait     = jt_wait,
+};
+
+
+/* jt_writev()
+ *
+ * in:     iov    - segments to write
+ *         iovcnt - number of segments
+ * out:    nothing
+ * return: -1 on error (specifically, device timeout) else 0.
+ *
+ * Writes the segments with one setup command and address per run of
+ * contiguous segments; see fw_vector.c.
+ *
+ */
+
+int
+jt_writev(const struct nand_iovec *iov, unsigned int iovcnt) {
+	return vector_transfer(&jt_vector_ops, true, iov, iovcnt);
+} /* jt_writev() */
+
+
+/* jt_readv()
+ *
+ * in:     iov    - segments to read
+ *         iovcnt - number of segments
+ * out:    data read into the segments' buffers
+ * return: -1 on error (specifically, device timeout) else 0.
+ *
+ * Reads the segments with one setup command and address per run of
+ * contiguous segments; see fw_vector.c.
+ *
+ */
+
+int
+jt_readv(const struct nand_iovec *iov, unsigned int iovcnt) {
+	return vector_transfer(&jt_vector_ops, false, iov, iovcnt);
+} /* jt_readv() */
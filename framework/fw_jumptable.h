@@ -1,9 +1,13 @@
 #ifndef _FW_JUMPTABLE_H_
 #define _FW_JUMPTABLE_H_
 
-int jt_write(unsigned char *, unsigned int, unsigned int);
-int jt_read(unsigned char *, unsigned int, unsigned int);
-int jt_erase(unsigned int, unsigned int);
+struct nand_iovec;  /* from framework.h */
+
+int jt_write(unsigned char *, unsigned long, unsigned int);
+int jt_read(unsigned char *, unsigned long, unsigned int);
+int jt_erase(unsigned long, unsigned long);
+int jt_writev(const struct nand_iovec *, unsigned int);
+int jt_readv(const struct nand_iovec *, unsigned int);
 
 
 #endif
@@ -0,0 +1,716 @@
+/* Framework asynchronous submit/complete I/O module.
+ *
+ * Copyright (c) 2023 Timothy Jon Fraser Consulting LLC.
+ *
+ * In the style of io_uring, callers describe reads, writes, and
+ * erases as requests and nand_io_submit() them to a submission ring.
+ * Requests run on the device one at a time, in submission order.
+ * Each one's first step goes to the device as soon as the device is
+ * free: the setup command, the address, and the execute command,
+ * preceded by the first page's data for a write.  The framework then
+ * returns to the caller without waiting for the device to become
+ * ready, so the caller's work overlaps the device's busy period.
+ *
+ * nand_io_wait() finishes the request on the device, waiting for
+ * ready after each page or block and issuing the next, posts its
+ * completion to a completion ring with its result and its latency
+ * from submission to completion, and starts the next submitted
+ * request before it returns.  nand_io_poll() reaps a completion only
+ * if one is already posted; it never touches the device.  A caller
+ * must leave a request's buffer alone until it reaps the request's
+ * completion.
+ *
+ * The framework issues the steps in the caller's thread rather than
+ * in a worker thread.  The device emulator traces a single thread:
+ * its watchpoints live in that thread's debug registers, and its GPIO
+ * breakpoints and shared-memory mailbox expect that thread to stop
+ * for them.  A driver running in a second thread would touch the IO
+ * registers without the emulator ever seeing it.
+ *
+ * Before it issues a request, the framework has the write coalescing
+ * and page cache layers treat it as they would the synchronous call;
+ * see route_submit().  Synchronous calls finish every submitted
+ * request first; see ring_drain().  With striping on, each request
+ * runs through the striped framework, which overlaps the chips' busy
+ * periods itself, when submitted.
+ *
+ */
+
+#include <sys/types.h>
+#include <stdbool.h>
+
+#include "histogram.h"
+#include "device_emu.h"
+#include "driver.h"
+#include "framework.h"
+#include "fw_step.h"
+#include "fw_stripe.h"
+#include "fw_ring.h"
+
+#define PAGE_SIZE  NUM_BYTES
+#define BLOCK_SIZE (NUM_PAGES * PAGE_SIZE) /* device block size in bytes */
+
+/* Ring positions count up forever; a position's slot is its value
+ * modulo NAND_RING_ENTRIES, which is a power of two.
+ * nand_io_submit() refuses a request unless there's room for its
+ * completion, too, so the completion ring never overflows.
+ */
+#define SLOT(position) ((position) & (NAND_RING_ENTRIES - 1))
+
+struct submission {
+	struct nand_io_request request;
+	unsigned long submitted;   /* hist_now() at nand_io_submit() */
+};
+
+static struct submission sq[ NAND_RING_ENTRIES ];
+static struct nand_io_completion cq[ NAND_RING_ENTRIES ];
+static unsigned long sq_head, sq_tail;  /* next to finish, next free */
+static unsigned long cq_head, cq_tail;  /* next to reap, next free */
+
+/* The request at sq_head, once started, is on the device until it
+ * finishes.  done counts the bytes it has transferred or the blocks
+ * it has erased, and piece the bytes of the page in progress.
+ */
+static bool active;
+static unsigned long done;
+static unsigned int piece;
+
+
+/* finish()
+ *
+ * in:     result - the request's result
+ * out:    completion for the request at sq_head posted
+ * return: nothing
+ *
+ */
+
+static void
+finish(int result) {
+
+	struct submission *p_s = &sq[ SLOT(sq_head) ];
+	struct nand_io_completion *p_c = &cq[ SLOT(cq_tail) ];
+
+	p_c->user_data = p_s->request.user_data;
+	p_c->result = result;
+	p_c->latency_ns = hist_now() - p_s->submitted;
+
+	active = false;
+	sq_head++;
+	cq_tail++;
+
+} /* finish() */
+
+
+/* issue_page()
+ *
+ * in:     p_r - the active request, a read or write
+ * out:    the next page's program or read started
+ * return: nothing
+ *
+ * A write sends the page's data and then executes; a read executes,
+ * and takes the page's data once the device is ready.  Only the
+ * first page begins partway through.
+ *
+ */
+
+static void
+issue_page(const struct nand_io_request *p_r) {
+
+	piece = PAGE_SIZE - ((p_r->offset + done) % PAGE_SIZE);
+	if (piece > p_r->size - done)
+		piece = p_r->size - done;
+
+	if (p_r->op == NAND_IO_WRITE) {
+		step_data(true, &p_r->buffer[ done ], piece);
+		step_command(C_PROGRAM_EXECUTE);
+	} else {
+		step_command(C_READ_EXECUTE);
+	}
+
+} /* issue_page() */
+
+
+/* blocks()
+ *
+ * in:     p_r - an erase request
+ * out:    nothing
+ * return: number of whole blocks the erase covers.
+ *
+ */
+
+static unsigned long
+blocks(const struct nand_io_request *p_r) {
+	return ((p_r->offset % BLOCK_SIZE) + p_r->size + BLOCK_SIZE - 1) /
+		BLOCK_SIZE;
+} /* blocks() */
+
+
+/* start()
+ *
+ * in:     nothing
+ * out:    the request at sq_head issued to the device, or finished
+ * return: nothing
+ *
+ * Issues the request's first step and leaves it active, unless it
+ * finishes at once: an empty request, one the coalescing layer
+ * can't prepare for, an unknown op, or any request when striping.
+ *
+ */
+
+static void
+start(void) {
+
+	struct nand_io_request *p_r = &sq[ SLOT(sq_head) ].request;
+
+	if (!p_r->size) {
+		finish(0);
+		return;
+	}
+	if (route_submit(p_r->op, p_r->offset, p_r->size)) {
+		finish(-1);
+		return;
+	}
+
+	if (stripe_enabled()) {
+		switch (p_r->op) {
+		case NAND_IO_WRITE:
+			finish(stripe_write(p_r->buffer, p_r->offset,
+				p_r->size));
+			return;
+		case NAND_IO_READ:
+			finish(stripe_read(p_r->buffer, p_r->offset,
+				p_r->size));
+			return;
+		case NAND_IO_ERASE:
+			finish(stripe_erase(p_r->offset, p_r->size));
+			return;
+		default:
+			finish(-1);
+			return;
+		}
+	}
+
+	done = 0;
+	switch (p_r->op) {
+	case NAND_IO_WRITE:
+		step_command(C_PROGRAM_SETUP);
+		step_address(p_r->offset, false);
+		issue_page(p_r);
+		break;
+	case NAND_IO_READ:
+		step_command(C_READ_SETUP);
+		step_address(p_r->offset, false);
+		issue_page(p_r);
+		break;
+	case NAND_IO_ERASE:
+		step_command(C_ERASE_SETUP);
+		step_address(p_r->offset / BLOCK_SIZE * BLOCK_SIZE, true);
+		step_command(C_ERASE_EXECUTE);
+		break;
+	default:
+		finish(-1);
+		return;
+	}
+	active = true;
+
+} /* start() */
+
+
+/* advance()
+ *
+ * in:     nothing
+ * out:    the active request carried one step further
+ * return: nothing
+ *
+ * Waits for the device to finish the active request's page or block,
+ * then takes a read's data and issues the next page or block, or
+ * finishes the request.
+ *
+ */
+
+static void
+advance(void) {
+
+	struct nand_io_request *p_r = &sq[ SLOT(sq_head) ].request;
+
+	switch (p_r->op) {
+	case NAND_IO_WRITE:
+		if (step_wait(TIMEOUT_WRITE_PAGE_US)) {
+			finish(-1);
+			return;
+		}
+		done += piece;
+		break;
+	case NAND_IO_READ:
+		if (step_wait(TIMEOUT_READ_PAGE_US)) {
+			finish(-1);
+			return;
+		}
+		step_data(false, &p_r->buffer[ done ], piece);
+		done += piece;
+		break;
+	default:
+		if (step_wait(TIMEOUT_ERASE_BLOCK_US)) {
+			finish(-1);
+			return;
+		}
+		if (++done < blocks(p_r))
+			step_command(C_ERASE_EXECUTE);
+		else
+			finish(0);
+		return;
+	}
+
+	if (done < p_r->size)
+		issue_page(p_r);
+	else
+		finish(0);
+
+} /* advance() */
+
+
+/* kick()
+ *
+ * in:     nothing
+ * out:    the oldest submitted request started, if the device is free
+ * return: nothing
+ *
+ */
+
+static void
+kick(void) {
+
+	while (!active && (sq_head != sq_tail))
+		start();
+
+} /* kick() */
+
+
+/* nand_io_submit()
+ *
+ * in:     p_request - read, write, or erase to perform
+ * out:    p_request copied to the submission ring and, if the device
+ *         is free, started
+ * return: 0 on success, -1 if the rings are full.
+ *
+ * Never waits for the device to become ready.  Callers that get -1
+ * should reap a completion and try again.
+ *
+ */
+
+int
+nand_io_submit(const struct nand_io_request *p_request) {
+
+	struct submission *p_s;  /* p_request's slot */
+
+	if ((sq_tail - sq_head) + (cq_tail - cq_head) >= NAND_RING_ENTRIES)
+		return -1;
+
+	p_s = &sq[ SLOT(sq_tail) ];
+	p_s->request = *p_request;
+	p_s->submitted = hist_now();
+	sq_tail++;
+	kick();
+	return 0;
+
+} /* nand_io_submit() */
+
+
+/* nand_io_poll()
+ *
+ * in:     nothing
+ * out:    p_completion - the oldest unreaped completion, if any
+ * return: 1 if it reaped a completion, else 0.
+ *
+ * Never touches the device, so it returns at once.
+ *
+ */
+
+int
+nand_io_poll(struct nand_io_completion *p_completion) {
+
+	if (cq_head == cq_tail)
+		return 0;
+	*p_completion = cq[ SLOT(cq_head) ];
+	cq_head++;
+	return 1;
+
+} /* nand_io_poll() */
+
+
+/* nand_io_wait()
+ *
+ * in:     nothing
+ * out:    p_completion - the oldest unreaped completion
+ * return: 0 on success, -1 if no request is submitted or unreaped.
+ *
+ * Finishes the request on the device if no completion is posted yet,
+ * starts the next one, and reaps the oldest completion.
+ *
+ */
+
+int
+nand_io_wait(struct nand_io_completion *p_completion) {
+
+	if (cq_head == cq_tail) {
+		while (active)
+			advance();
+		kick();
+	}
+	return (nand_io_poll(p_completion) ? 0 : -1);
+
+} /* nand_io_wait() */
+
+
+/* ring_drain()
+ *
+ * in:     nothing
+ * out:    every submitted request finished and its completion posted
+ * return: nothing
+ *
+ * The synchronous calls use the device directly, so they call this
+ * first to keep their commands from landing in the middle of a
+ * request's.  Completions wait for the caller to reap them as usual.
+ *
+ */
+
+void
+ring_drain(void) {
+
+	while (active) {
+		advance();
+		kick();
+	}
+
+} /* ring_drain() */
+
+
+#ifdef UNIT_TEST
+
+/* This UNIT_TEST code implements a unit test for this module.
+ * Compile with -DUNIT_TEST to test this module in isolation. Don't
+ * use -DUNIT_TEST when compiling this module for inclusion in the
+ * framework library.
+ *
+ * The stubs below stand in for the rest of the framework and for the
+ * device.  They log each step the module issues as a letter: S for a
+ * setup command, A for an address, D for a data transfer, E for an
+ * execute command, and W for a wait for ready.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#define LOG_SIZE 64
+#define PIPELINE 3     /* requests test_wrap() keeps outstanding */
+#define FAIL_AT  7     /* test_wrap() request whose wait times out */
+
+static char step_log[ LOG_SIZE ];    /* steps issued, as letters */
+static unsigned int log_len;
+static bool busy;                    /* executing, not yet waited for */
+static unsigned long fail_user_data = ~0UL;  /* request to time out */
+static unsigned char *buffer;        /* 3 pages for requests' data */
+
+static void
+log_step(char step) {
+	if (log_len < LOG_SIZE - 1)
+		step_log[ log_len++ ] = step;
+	step_log[ log_len ] = '\0';
+}
+
+void
+step_command(unsigned char opcode) {
+
+	switch (opcode) {
+	case C_READ_EXECUTE:
+	case C_PROGRAM_EXECUTE:
+	case C_ERASE_EXECUTE:
+		log_step('E');
+		busy = true;
+		break;
+	default:
+		log_step('S');
+	}
+}
+
+void
+step_address(unsigned long chip_offset, bool erase) {
+	log_step('A');
+}
+
+void
+step_data(bool to_device, unsigned char *p_data, unsigned int length) {
+	log_step('D');
+	if (!to_device)
+		memset(p_data, 'r', length);
+}
+
+int
+step_wait(unsigned int timeout_us) {
+
+	log_step('W');
+	if (!busy)
+		return -1;
+	busy = false;
+	return (active && (sq[ SLOT(sq_head) ].request.user_data ==
+		fail_user_data) ? -1 : 0);
+}
+
+int
+route_submit(enum nand_io_op op, unsigned long offset, unsigned long size) {
+	return 0;
+}
+
+bool
+stripe_enabled(void) {
+	return false;
+}
+
+int
+stripe_write(const unsigned char *p_data, unsigned long offset,
+	unsigned int size) {
+	return -1;
+}
+
+int
+stripe_read(unsigned char *p_data, unsigned long offset, unsigned int size) {
+	return -1;
+}
+
+int
+stripe_erase(unsigned long offset, unsigned long size) {
+	return -1;
+}
+
+
+/* submit()
+ *
+ * in:     op        - request's op
+ *         offset    - request's device address
+ *         size      - request's size in bytes
+ *         user_data - request's user data
+ * out:    request submitted, step log emptied first
+ * return: nand_io_submit()'s result.
+ *
+ */
+
+static int
+submit(enum nand_io_op op, unsigned long offset, unsigned long size,
+	unsigned long user_data) {
+
+	struct nand_io_request request = {
+		.op = op, .buffer = (op == NAND_IO_ERASE ? NULL : buffer),
+		.offset = offset, .size = size, .user_data = user_data,
+	};
+
+	log_len = 0;
+	step_log[ 0 ] = '\0';
+	return nand_io_submit(&request);
+
+} /* submit() */
+
+
+/* expect()
+ *
+ * in:     when  - what the module just did, for the message
+ *         steps - the steps it should have issued
+ * out:    step log emptied
+ * return: 0 if the module issued steps, else -1.
+ *
+ */
+
+static int
+expect(const char *when, const char *steps) {
+
+	int ret_val = 0;   /* optimistically presume success */
+
+	if (strcmp(step_log, steps)) {
+		printf("      Fail - %s issued \"%s\", expected \"%s\".\n",
+			when, step_log, steps);
+		ret_val = -1;
+	}
+	log_len = 0;
+	step_log[ 0 ] = '\0';
+	return ret_val;
+
+} /* expect() */
+
+
+/* reap()
+ *
+ * in:     user_data - user data the next completion should carry
+ *         result    - result it should carry
+ * out:    the next completion reaped with nand_io_wait()
+ * return: 0 if it matched, else -1.
+ *
+ */
+
+static int
+reap(unsigned long user_data, int result) {
+
+	struct nand_io_completion completion;  /* what nand_io_wait() got */
+
+	if (nand_io_wait(&completion)) {
+		puts("      Fail - nothing to reap.");
+		return -1;
+	}
+	if ((completion.user_data != user_data) ||
+	    (completion.result != result)) {
+		printf("      Fail - reaped request %lu result %d, expected "
+			"request %lu result %d.\n", completion.user_data,
+			completion.result, user_data, result);
+		return -1;
+	}
+	return 0;
+
+} /* reap() */
+
+
+static int
+test_issue(void) {
+
+	puts("Test: submitting a request issues its first step, and only "
+	     "waiting for\n      it waits for the device:");
+
+	/* 600 bytes from byte 100 span three pages. */
+	if (submit(NAND_IO_WRITE, 100, 2 * NUM_BYTES + 88, 1) ||
+	    expect("submitting a write", "SADE") ||
+	    reap(1, 0) ||
+	    expect("waiting for a write", "WDEWDEW"))
+		return -1;
+	if (submit(NAND_IO_READ, 0, NUM_BYTES + 44, 2) ||
+	    expect("submitting a read", "SAE") ||
+	    reap(2, 0) ||
+	    expect("waiting for a read", "WDEWD"))
+		return -1;
+	if (buffer[ NUM_BYTES + 43 ] != 'r') {
+		puts("      Fail - the read didn't fill the buffer.");
+		return -1;
+	}
+	if (submit(NAND_IO_ERASE, NUM_PAGES * NUM_BYTES - 1, 2, 3) ||
+	    expect("submitting an erase", "SAE") ||
+	    reap(3, 0) ||
+	    expect("waiting for an erase", "WEW"))
+		return -1;
+
+	/* A second request starts when the first completes. */
+	if (submit(NAND_IO_ERASE, 0, 1, 4) ||
+	    submit(NAND_IO_ERASE, 0, 1, 5) ||
+	    expect("submitting behind a busy request", "") ||
+	    reap(4, 0) ||
+	    expect("completing the first request", "WSAE") ||
+	    reap(5, 0) ||
+	    expect("completing the second request", "W"))
+		return -1;
+
+	puts("      Pass - steps issued at submission and completion.\n");
+	return 0;
+
+} /* test_issue() */
+
+
+static int
+test_full(void) {
+
+	struct nand_io_completion completion;  /* what nand_io_poll() got */
+	unsigned long r;                       /* counts requests */
+
+	printf("Test: fill the %u-entry rings with requests and then with "
+	       "unreaped\n      completions:\n", NAND_RING_ENTRIES);
+
+	for (r = 0; r < NAND_RING_ENTRIES; r++) {
+		if (submit(NAND_IO_ERASE, 0, 1, r)) {
+			printf("      Fail - refused request %lu.\n", r);
+			return -1;
+		}
+	}
+	if (submit(NAND_IO_ERASE, 0, 1, r) != -1) {
+		puts("      Fail - accepted a request with the rings full.");
+		return -1;
+	}
+	if (nand_io_poll(&completion)) {
+		puts("      Fail - polled a completion before waiting.");
+		return -1;
+	}
+
+	/* Reaping a completion makes room for one more request. */
+	if (reap(0, 0) || submit(NAND_IO_ERASE, 0, 1, r++))
+		return -1;
+	if (submit(NAND_IO_ERASE, 0, 1, r) != -1) {
+		puts("      Fail - accepted a request with the rings full.");
+		return -1;
+	}
+
+	/* Completions hold their places until reaped. */
+	ring_drain();
+	if (submit(NAND_IO_ERASE, 0, 1, r) != -1) {
+		puts("      Fail - accepted a request with the completion "
+		     "ring full.");
+		return -1;
+	}
+	for (r = 1; r <= NAND_RING_ENTRIES; r++) {
+		if (!nand_io_poll(&completion) ||
+		    (completion.user_data != r)) {
+			printf("      Fail - didn't poll request %lu.\n", r);
+			return -1;
+		}
+	}
+	if (nand_io_poll(&completion) || !nand_io_wait(&completion)) {
+		puts("      Fail - reaped a completion from empty rings.");
+		return -1;
+	}
+
+	puts("      Pass - full rings refused requests until reaped.\n");
+	return 0;
+
+} /* test_full() */
+
+
+static int
+test_wrap(void) {
+
+	unsigned long total = 5 * NAND_RING_ENTRIES + 3;  /* requests */
+	unsigned long submitted;   /* requests submitted */
+	unsigned long reaped;      /* completions reaped */
+
+	printf("Test: run %lu requests, %u at a time, through the rings "
+	       "and wrap\n      around them; request %u times out:\n",
+	       total, PIPELINE, FAIL_AT);
+
+	fail_user_data = FAIL_AT;
+	for (submitted = 0; submitted < PIPELINE; submitted++)
+		if (submit(NAND_IO_READ, submitted * 7, NUM_BYTES, submitted))
+			return -1;
+	for (reaped = 0; reaped < total; reaped++) {
+		if (reap(reaped, (reaped == FAIL_AT ? -1 : 0)))
+			return -1;
+		if (submitted == total)
+			continue;
+		if (submit(NAND_IO_READ, submitted * 7, NUM_BYTES, submitted))
+			return -1;
+		submitted++;
+	}
+	fail_user_data = ~0UL;
+
+	puts("      Pass - completions came back in submission order.\n");
+	return 0;
+
+} /* test_wrap() */
+
+
+int
+main(int argc, char *argv[]) {
+
+	buffer = malloc(3 * NUM_BYTES);
+	assert(buffer);
+
+	if (test_issue()) return -1;
+	if (test_full()) return -1;
+	if (test_wrap()) return -1;
+	return 0;
+
+} /* main() */
+
+#endif
@@ -0,0 +1,9 @@
+#ifndef _FW_RING_H_
+#define _FW_RING_H_
+
+void ring_drain(void);
+
+/* from framework.c */
+int route_submit(enum nand_io_op, unsigned long, unsigned long);
+
+#endif
@@ -0,0 +1,164 @@
+/* Framework single-step I/O module.
+ *
+ * Copyright (c) 2023 Timothy Jon Fraser Consulting LLC.
+ *
+ * The jump table and exec_op frameworks hand the driver whole reads,
+ * writes, and erases.  The striped and asynchronous frameworks
+ * instead interleave the steps of several operations, so they issue
+ * each command, address, data transfer, and wait on its own.  These
+ * helpers issue one such step to the selected chip, using the
+ * driver's jump table or wrapping the step in a one-instruction
+ * operation for its exec_op() function.
+ *
+ */
+
+#include <sys/types.h>
+#include <stdbool.h>
+
+#include "device_emu.h"
+#include "driver.h"
+#include "framework.h"
+#include "fw_address.h"
+#include "fw_step.h"
+
+extern struct nand_driver driver;    /* from framework.c */
+
+
+static int
+exec_instr(struct nand_op_instr *instr) {
+
+	struct nand_operation operation;  /* one-instruction operation */
+
+	operation.ninstrs = 1;
+	operation.instrs = instr;
+	return driver.operation.exec_op(&operation);
+
+} /* exec_instr() */
+
+
+/* step_command()
+ *
+ * in:     opcode - C_* command
+ * out:    opcode sent to the device
+ * return: nothing
+ *
+ */
+
+void
+step_command(unsigned char opcode) {
+
+	struct nand_op_instr instr;  /* C_* command instruction */
+
+	if (driver.type == NAND_JUMP_TABLE) {
+		driver.operation.jump_table.set_register(IOREG_COMMAND, opcode);
+		return;
+	}
+	instr.type = NAND_OP_CMD_INSTR;
+	instr.ctx.cmd.opcode = opcode;
+	exec_instr(&instr);
+
+} /* step_command() */
+
+
+/* step_address()
+ *
+ * in:     chip_offset - device address on the selected chip
+ *         erase       - true to send only the block address
+ * out:    chip_offset's address cycles sent to the device
+ * return: nothing
+ *
+ */
+
+void
+step_address(unsigned long chip_offset, bool erase) {
+
+	struct nand_op_instr instr;  /* address instruction */
+	unsigned int a;              /* indexes address cycles */
+
+	instr.type = NAND_OP_ADDR_INSTR;
+	instr.ctx.addr.naddrs = nand_address(instr.ctx.addr.addrs,
+		chip_offset, erase);
+	if (driver.type == NAND_JUMP_TABLE) {
+		for (a = 0; a < instr.ctx.addr.naddrs; a++)
+			driver.operation.jump_table.set_register(
+				IOREG_ADDRESS, instr.ctx.addr.addrs[ a ]);
+		return;
+	}
+	exec_instr(&instr);
+
+} /* step_address() */
+
+
+/* step_data()
+ *
+ * in:     to_device - true to send data for a program, false to take
+ *                     data from a read
+ *         buffer    - the data
+ *         length    - bytes to transfer, at most one page
+ * out:    buffer filled, when reading
+ * return: nothing
+ *
+ * Transfers by DMA when the driver can.
+ *
+ */
+
+void
+step_data(bool to_device, unsigned char *buffer, unsigned int length) {
+
+	struct nand_op_instr instr;  /* data or DMA instruction */
+
+	if (driver.type == NAND_JUMP_TABLE) {
+		if (driver.operation.jump_table.dma_buffer) {
+			driver.operation.jump_table.dma_buffer(buffer, length);
+			driver.operation.jump_table.set_register(
+				IOREG_COMMAND,
+				(to_device ? C_PROGRAM_DMA : C_READ_DMA));
+		} else if (to_device) {
+			driver.operation.jump_table.write_buffer(buffer,
+				length);
+		} else {
+			driver.operation.jump_table.read_buffer(buffer,
+				length);
+		}
+		return;
+	}
+	if (driver.flags & NAND_DRIVER_DMA) {
+		instr.type = NAND_OP_DMA_INSTR;
+		instr.ctx.dma.opcode = (to_device ? C_PROGRAM_DMA : C_READ_DMA);
+		instr.ctx.dma.len = length;
+		instr.ctx.dma.buf = buffer;
+	} else if (to_device) {
+		instr.type = NAND_OP_DATA_IN_INSTR;
+		instr.ctx.data_in.len = length;
+		instr.ctx.data_in.buf = buffer;
+	} else {
+		instr.type = NAND_OP_DATA_OUT_INSTR;
+		instr.ctx.data_out.len = length;
+		instr.ctx.data_out.buf = buffer;
+	}
+	exec_instr(&instr);
+
+} /* step_data() */
+
+
+/* step_wait()
+ *
+ * in:     timeout_us - give up after this long
+ * out:    nothing
+ * return: -1 if the selected chip didn't become ready in time,
+ *         else 0.
+ *
+ */
+
+int
+step_wait(unsigned int timeout_us) {
+
+	struct nand_op_instr instr;  /* waitrdy instruction */
+
+	if (driver.type == NAND_JUMP_TABLE)
+		return driver.operation.jump_table.wait_ready(timeout_us);
+	instr.type = NAND_OP_WAITRDY_INSTR;
+	instr.ctx.waitrdy.timeout_ms = timeout_us;
+	return exec_instr(&instr);
+
+} /* step_wait() */
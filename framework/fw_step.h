@@ -0,0 +1,9 @@
+#ifndef _FW_STEP_H_
+#define _FW_STEP_H_
+
+void step_command(unsigned char);
+void step_address(unsigned long, bool);
+void step_data(bool, unsigned char *, unsigned int);
+int step_wait(unsigned int);
+
+#endif
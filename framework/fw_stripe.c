@@ -0,0 +1,400 @@
+/* Framework striped (RAID-0) I/O module.
+ *
+ * Copyright (c) 2023 Timothy Jon Fraser Consulting LLC.
+ *
+ * In striped mode, the framework presents all the storage chips
+ * that the first device in the DIB lists as a single logical device
+ * whose consecutive pages rotate among the chips: logical page L
+ * lives on chip (L % nchips) as that chip's page (L / nchips).  The
+ * framework selects each chip with the device's PN_CHIP_SELECT pin
+ * and starts one page's program or read on it, then moves on to the
+ * next chip without waiting, so that the chips' busy periods
+ * overlap.  It waits for a chip only when it needs that chip again.
+ *
+ * Because every chip holds pages of each stripe, the logical erase
+ * block is the "superblock" made up of the same block on every chip.
+ * nand_erase_size() reports its size.
+ *
+ */
+
+#include <sys/types.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "clock.h"
+#include "device_emu.h"
+#include "driver.h"
+#include "framework.h"
+#include "fw_step.h"
+#include "fw_stripe.h"
+
+#define PAGE_SIZE   NUM_BYTES
+#define BLOCK_SIZE  (NUM_PAGES * PAGE_SIZE)  /* chip block size in bytes */
+#define CHIP_PAGES  (NUM_BLOCKS * NUM_PAGES) /* pages per chip */
+
+static unsigned int nchips;          /* chips to stripe across, 0 if off */
+static bool busy[ NUM_TARGETS ];     /* chip may still be busy */
+
+/* Aggregate throughput statistics for stripe_print_stats(). */
+static unsigned long bytes_read;     /* bytes read from all chips */
+static unsigned long bytes_written;  /* bytes written to all chips */
+static unsigned long bytes_erased;   /* bytes erased on all chips */
+static timeus_t elapsed_us;          /* time spent in striped I/O */
+
+
+/* stripe_init()
+ *
+ * in:     dib - the DIB init_framework() returned
+ * out:    nchips set via side effect
+ * return: number of chips to stripe across, or -1 if the first
+ *         device in dib lists no storage chips, more storage chips
+ *         than the device has targets, or a chip whose geometry
+ *         doesn't match the device's.
+ *
+ * Call this after init_framework() to make read_nand(), write_nand(),
+ * and erase_nand() stripe across the storage chips of the first
+ * device in the DIB.  The nth storage chip in the list is the
+ * device's nth chip-enable target.
+ *
+ */
+
+int
+stripe_init(struct nand_device *dib) {
+
+	struct nand_storage_chip *p_sc;  /* iterates through storage chips */
+	unsigned int count = 0;          /* counts storage chips */
+
+	if (!dib || !dib->controller)
+		return -1;
+
+	for (p_sc = dib->controller->first_storage; p_sc != NULL;
+		p_sc = p_sc->next_storage) {
+		if ((count == NUM_TARGETS) ||
+		    (p_sc->nblocks != NUM_BLOCKS) ||
+		    (p_sc->npages_per_block != NUM_PAGES) ||
+		    (p_sc->nbytes_per_page != NUM_BYTES))
+			return -1;
+		count++;
+	}
+	if (count == 0)
+		return -1;
+
+	nchips = count;
+	return nchips;
+
+} /* stripe_init() */
+
+
+/* stripe_enabled()
+ *
+ * in:     nothing
+ * out:    nothing
+ * return: true if stripe_init() has enabled striping, else false.
+ *
+ */
+
+bool
+stripe_enabled(void) {
+	return (nchips > 0);
+} /* stripe_enabled() */
+
+
+/* nand_erase_size()
+ *
+ * in:     nothing
+ * out:    nothing
+ * return: the size in bytes of the unit that erase_nand() erases.
+ *
+ * erase_nand() always erases whole erase units.  Without striping,
+ * that's one block.  With striping, it's one block on every chip.
+ *
+ */
+
+unsigned long
+nand_erase_size(void) {
+	return (nchips ? nchips : 1) * BLOCK_SIZE;
+} /* nand_erase_size() */
+
+
+/* wait_chip()
+ *
+ * in:     chip       - chip to wait for
+ *         timeout_us - give up after this long
+ * out:    chip selected and its busy flag cleared, if it was busy
+ * return: -1 if the chip timed out, else 0.
+ *
+ * Steps of an operation go to the selected chip through the helpers
+ * in fw_step.c.
+ *
+ */
+
+static int
+wait_chip(unsigned int chip, unsigned int timeout_us) {
+
+	if (!busy[ chip ])
+		return 0;
+	busy[ chip ] = false;
+
+	gpio_set(PN_CHIP_SELECT, chip);
+	return step_wait(timeout_us);
+
+} /* wait_chip() */
+
+
+/* wait_all()
+ *
+ * in:     timeout_us - timeout for each chip's wait
+ * out:    busy cleared via side effect
+ * return: -1 if any chip timed out, else 0.
+ *
+ * Waits for every chip the framework has left busy, then selects
+ * chip 0 again for the benefit of non-striped callers.
+ *
+ */
+
+static int
+wait_all(unsigned int timeout_us) {
+
+	unsigned int c;       /* indexes chips */
+	int ret_val = 0;      /* optimistically presume success */
+
+	for (c = 0; c < nchips; c++) {
+		if (wait_chip(c, timeout_us))
+			ret_val = -1;
+	}
+	gpio_set(PN_CHIP_SELECT, 0);
+	return ret_val;
+
+} /* wait_all() */
+
+
+/* issue_page()
+ *
+ * in:     setup  - C_READ_SETUP or C_PROGRAM_SETUP
+ *         offset - logical address of the first byte to transfer
+ * out:    nothing
+ * return: the chip that holds offset's page, now selected.
+ *
+ * Selects the chip holding the logical page at offset and sends the
+ * setup command and the address of offset on that chip.
+ *
+ */
+
+static unsigned int
+issue_page(unsigned char setup, unsigned long offset) {
+
+	unsigned long page = (offset / PAGE_SIZE) % (nchips * CHIP_PAGES);
+	unsigned int chip = page % nchips;   /* logical page's chip */
+	unsigned long chip_page = page / nchips; /* its page on that chip */
+
+	gpio_set(PN_CHIP_SELECT, chip);
+	step_command(setup);
+	step_address(chip_page * PAGE_SIZE + offset % PAGE_SIZE, false);
+	return chip;
+
+} /* issue_page() */
+
+
+/* stripe_write()
+ *
+ * in:     buffer - array of bytes to write to the logical device
+ *         offset - logical address to receive data
+ *         size   - number of bytes to write, can be multiple pages
+ * out:    nothing
+ * return: -1 on error (specifically, device timeout) else 0.
+ *
+ * Writes size bytes from buffer to the logical device, programming
+ * each page on its own chip while earlier pages' programs complete
+ * on the others.
+ *
+ */
+
+int
+stripe_write(const unsigned char *buffer, unsigned long offset,
+	unsigned int size) {
+
+	timeus_t start = now();        /* for throughput statistics */
+	unsigned int cursor = 0;       /* index into buffer parm */
+	unsigned int size_this_page;   /* bytes xferred in current page */
+	unsigned int chip;             /* chip holding the current page */
+	int ret_val = 0;               /* optimistically presume success */
+
+	while (cursor < size) {
+		size_this_page = PAGE_SIZE - ((offset + cursor) % PAGE_SIZE);
+		if (size_this_page > size - cursor)
+			size_this_page = size - cursor;
+
+		/* The page's chip may still be busy with the page
+		 * nchips pages back.
+		 */
+		chip = ((offset + cursor) / PAGE_SIZE) % nchips;
+		if (wait_chip(chip, TIMEOUT_WRITE_PAGE_US)) {
+			ret_val = -1;
+			break;
+		}
+
+		issue_page(C_PROGRAM_SETUP, offset + cursor);
+		step_data(true, (unsigned char *)&buffer[ cursor ],
+			size_this_page);
+		step_command(C_PROGRAM_EXECUTE);
+		busy[ chip ] = true;
+
+		cursor += size_this_page;
+	}
+
+	if (wait_all(TIMEOUT_WRITE_PAGE_US))
+		ret_val = -1;
+
+	bytes_written += cursor;
+	elapsed_us += now() - start;
+	return ret_val;
+
+} /* stripe_write() */
+
+
+/* stripe_read()
+ *
+ * in:     offset - read data from this logical address
+ *         size   - number of bytes to read, can be multiple pages
+ * out:    buffer - array to receive bytes read from the logical device
+ * return: -1 on error (specifically, device timeout) else 0.
+ *
+ * Reads size bytes from the logical device to buffer.  Starts reads
+ * of up to nchips consecutive pages, one on each chip, and as it
+ * collects each page's data starts the read of the page nchips
+ * further on, which lives on the same chip.
+ *
+ */
+
+int
+stripe_read(unsigned char *buffer, unsigned long offset, unsigned int size) {
+
+	timeus_t start = now();        /* for throughput statistics */
+	unsigned int issued = 0;       /* bytes whose reads have started */
+	unsigned int cursor = 0;       /* bytes collected into buffer */
+	unsigned int size_this_page;   /* bytes xferred in current page */
+	unsigned int chip;             /* chip holding the current page */
+	unsigned int p;                /* counts pages started */
+	int ret_val = 0;               /* optimistically presume success */
+
+	/* Start reads on each chip. */
+	for (p = 0; (p < nchips) && (issued < size); p++) {
+		chip = issue_page(C_READ_SETUP, offset + issued);
+		step_command(C_READ_EXECUTE);
+		busy[ chip ] = true;
+		issued += PAGE_SIZE - ((offset + issued) % PAGE_SIZE);
+	}
+
+	while (cursor < size) {
+		size_this_page = PAGE_SIZE - ((offset + cursor) % PAGE_SIZE);
+		if (size_this_page > size - cursor)
+			size_this_page = size - cursor;
+
+		/* Collect this page once its chip is ready. */
+		chip = ((offset + cursor) / PAGE_SIZE) % nchips;
+		if (wait_chip(chip, TIMEOUT_READ_PAGE_US)) {
+			ret_val = -1;
+			break;
+		}
+		step_data(false, &buffer[ cursor ], size_this_page);
+		cursor += size_this_page;
+
+		/* Start the read of the next page on the same chip. */
+		if (issued < size) {
+			issue_page(C_READ_SETUP, offset + issued);
+			step_command(C_READ_EXECUTE);
+			busy[ chip ] = true;
+			issued += PAGE_SIZE;
+		}
+	}
+
+	if (wait_all(TIMEOUT_READ_PAGE_US))
+		ret_val = -1;
+
+	bytes_read += cursor;
+	elapsed_us += now() - start;
+	return ret_val;
+
+} /* stripe_read() */
+
+
+/* stripe_erase()
+ *
+ * in:     offset - logical address in the first superblock to erase
+ *         size   - number of bytes to erase, rounded out to whole
+ *                  superblocks
+ * out:    nothing
+ * return: -1 on device timeout, otherwise 0 (presumed success).
+ *
+ * Erases a contiguous series of superblocks, erasing each block on
+ * every chip at once.
+ *
+ */
+
+int
+stripe_erase(unsigned long offset, unsigned long size) {
+
+	timeus_t start = now();        /* for throughput statistics */
+	unsigned long erase_size = nand_erase_size();
+	unsigned long first;           /* first superblock to erase */
+	unsigned long count;           /* number of superblocks to erase */
+	unsigned long b;               /* counts superblocks */
+	unsigned long issued = 0;      /* superblocks issued on every chip */
+	unsigned int c;                /* counts chips */
+	int ret_val = 0;               /* optimistically presume success */
+
+	first = offset / erase_size;
+	size += offset % erase_size;   /* part ahead of region start */
+	count = size / erase_size;
+	if (size % erase_size) count++;  /* Round up for partial blocks */
+
+	for (b = 0; (b < count) && !ret_val; b++) {
+		for (c = 0; c < nchips; c++) {
+			if (wait_chip(c, TIMEOUT_ERASE_BLOCK_US)) {
+				ret_val = -1;
+				break;
+			}
+			gpio_set(PN_CHIP_SELECT, c);
+			step_command(C_ERASE_SETUP);
+			step_address(((first + b) % NUM_BLOCKS) * BLOCK_SIZE,
+				true);
+			step_command(C_ERASE_EXECUTE);
+			busy[ c ] = true;
+		}
+		if (!ret_val)
+			issued++;
+	}
+
+	if (wait_all(TIMEOUT_ERASE_BLOCK_US))
+		ret_val = -1;
+
+	bytes_erased += issued * erase_size;
+	elapsed_us += now() - start;
+	return ret_val;
+
+} /* stripe_erase() */
+
+
+/* stripe_print_stats()
+ *
+ * in:     nothing
+ * out:    striped I/O statistics to stderr
+ * return: nothing
+ *
+ * Reports the aggregate throughput of striped reads and writes.
+ *
+ */
+
+void
+stripe_print_stats(void) {
+
+	fprintf(stderr, "striped across %u chips: read %lu bytes, wrote %lu "
+		"bytes, erased %lu bytes in %lu us", nchips, bytes_read,
+		bytes_written, bytes_erased, elapsed_us);
+	if (elapsed_us)
+		fprintf(stderr, " (%.1f KiB/s read+write)",
+			(bytes_read + bytes_written) * 1000000.0 /
+			1024.0 / elapsed_us);
+	fprintf(stderr, "\n");
+
+} /* stripe_print_stats() */
@@ -0,0 +1,9 @@
+#ifndef _FW_STRIPE_H_
+#define _FW_STRIPE_H_
+
+bool stripe_enabled(void);
+int stripe_write(const unsigned char *, unsigned long, unsigned int);
+int stripe_read(unsigned char *, unsigned long, unsigned int);
+int stripe_erase(unsigned long, unsigned long);
+
+#endif
@@ -0,0 +1,167 @@
+/* Framework vectored (scatter/gather) I/O module.
+ *
+ * Copyright (c) 2023 Timothy Jon Fraser Consulting LLC.
+ *
+ * readv_nand() and writev_nand() take an array of segments, each a
+ * device offset, a buffer, and a length.  Segments that each begin
+ * where the one before ends make up a run, which the framework
+ * transfers as if it were a single read_nand() or write_nand() call
+ * with the run's buffers concatenated: one setup command and one
+ * address for the whole run, and one execute command per page, with
+ * each page's data crossing in as many pieces as there are segments
+ * in it.  Only a new run re-addresses the device.  Like consecutive
+ * write_nand() calls, a run that programs a page another run also
+ * programs replaces that page's contents.
+ *
+ * This module walks the segments and pages; the jump table and
+ * exec_op frameworks supply the vector_ops that issue each command,
+ * address, transfer, and wait.
+ *
+ */
+
+#include <sys/types.h>
+#include <stdbool.h>
+
+#include "device_emu.h"
+#include "driver.h"
+#include "framework.h"
+#include "fw_vector.h"
+
+#define PAGE_SIZE NUM_BYTES
+
+
+/* vector_run()
+ *
+ * in:     iov    - segments
+ *         iovcnt - number of segments, at least 1
+ * out:    nothing
+ * return: number of segments in the run that iov[ 0 ] begins.
+ *
+ * Empty segments never end a run.
+ *
+ */
+
+unsigned int
+vector_run(const struct nand_iovec *iov, unsigned int iovcnt) {
+
+	unsigned long end;  /* device offset just past the run so far */
+	unsigned int s;     /* counts segments */
+
+	end = iov[ 0 ].offset + iov[ 0 ].length;
+	for (s = 1; s < iovcnt; s++) {
+		if (iov[ s ].length && (iov[ s ].offset != end))
+			break;
+		end += iov[ s ].length;
+	}
+	return s;
+
+} /* vector_run() */
+
+
+/* transfer_run()
+ *
+ * in:     p_ops  - how to issue commands
+ *         write  - true to program, false to read
+ *         iov    - the run's segments
+ *         iovcnt - number of segments in the run
+ * out:    data read into the segments' buffers, for a read
+ * return: -1 on error (specifically, device timeout) else 0.
+ *
+ * A write sends each page's data and then executes; a read executes
+ * and then takes each page's data.  Either way, the first page holds
+ * only the bytes from the run's first offset to the end of the page.
+ *
+ */
+
+static int
+transfer_run(const struct vector_ops *p_ops, bool write,
+	const struct nand_iovec *iov, unsigned int iovcnt) {
+
+	unsigned int left;       /* bytes left in the current page */
+	unsigned int done;       /* bytes of the segment transferred */
+	unsigned int piece;      /* bytes transferred in one go */
+	unsigned int s;          /* counts segments */
+
+	p_ops->command(write ? C_PROGRAM_SETUP : C_READ_SETUP);
+	p_ops->address(iov[ 0 ].offset);
+
+	left = PAGE_SIZE - (iov[ 0 ].offset % PAGE_SIZE);
+	if (!write) {
+		p_ops->command(C_READ_EXECUTE);
+		if (p_ops->wait(TIMEOUT_READ_PAGE_US))
+			return -1;
+	}
+
+	for (s = 0; s < iovcnt; s++) {
+		for (done = 0; done < iov[ s ].length; done += piece) {
+
+			/* Move on to the next page when this one is
+			 * full, unless the run ends here.
+			 */
+			if (!left) {
+				p_ops->command(write ? C_PROGRAM_EXECUTE :
+					C_READ_EXECUTE);
+				if (p_ops->wait(write ? TIMEOUT_WRITE_PAGE_US :
+					TIMEOUT_READ_PAGE_US))
+					return -1;
+				left = PAGE_SIZE;
+			}
+
+			piece = iov[ s ].length - done;
+			if (piece > left)
+				piece = left;
+			p_ops->transfer(write, &iov[ s ].buffer[ done ], piece);
+			left -= piece;
+		}
+	}
+
+	/* Program the last page. */
+	if (write) {
+		p_ops->command(C_PROGRAM_EXECUTE);
+		if (p_ops->wait(TIMEOUT_WRITE_PAGE_US))
+			return -1;
+	}
+	return 0;
+
+} /* transfer_run() */
+
+
+/* vector_transfer()
+ *
+ * in:     p_ops  - how to issue commands
+ *         write  - true to program, false to read
+ *         iov    - segments
+ *         iovcnt - number of segments
+ * out:    data read into the segments' buffers, for a read
+ * return: -1 on error (specifically, device timeout) else 0.
+ *
+ * Transfers each run of contiguous segments in turn.
+ *
+ */
+
+int
+vector_transfer(const struct vector_ops *p_ops, bool write,
+	const struct nand_iovec *iov, unsigned int iovcnt) {
+
+	unsigned int run;  /* segments in the current run */
+
+	while (iovcnt) {
+
+		/* Skip leading empty segments, so every run the device
+		 * sees transfers at least one byte.
+		 */
+		if (!iov[ 0 ].length) {
+			iov++;
+			iovcnt--;
+			continue;
+		}
+
+		run = vector_run(iov, iovcnt);
+		if (transfer_run(p_ops, write, iov, run))
+			return -1;
+		iov += run;
+		iovcnt -= run;
+	}
+	return 0;
+
+} /* vector_transfer() */
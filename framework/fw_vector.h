@@ -0,0 +1,21 @@
+#ifndef _FW_VECTOR_H_
+#define _FW_VECTOR_H_
+
+struct nand_iovec;  /* from framework.h */
+
+/* How vector_transfer() issues a vectored read or write.  The jump
+ * table and exec_op frameworks each provide one.
+ */
+struct vector_ops {
+	void (*command)(unsigned char opcode);
+	void (*address)(unsigned long offset);
+	void (*transfer)(bool write, unsigned char *buffer,
+		unsigned int length);
+	int (*wait)(unsigned int timeout_us);  /* -1 on device timeout */
+};
+
+unsigned int vector_run(const struct nand_iovec *, unsigned int);
+int vector_transfer(const struct vector_ops *, bool,
+	const struct nand_iovec *, unsigned int);
+
+#endif
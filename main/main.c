@@ -1,13 +1,17 @@
 // Copyright (c) 2022 Provatek, LLC.
 
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/timerfd.h>
 #include <stdbool.h>
 #include <string.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <errno.h>
+#include <limits.h>
 
+#include "clock.h"
 #include "device_emu.h"
 #include "framework.h"
 #include "tester.h"
@@ -17,10 +21,28 @@
  */
 #define DETERMINISTIC "--deterministic"
 #define STOCHASTIC    "--stochastic"
+#define BENCHMARK     "--benchmark"
+#define SHARED_MEMORY "--shared-memory"
+#define IN_PROCESS    "--in-process"
+#define BYTE_WATCH    "--byte-watchpoints"
+#define STATS         "--stats"
+#define VIRTUAL_TIME  "--virtual-time"
+#define STATUS_PAGE   "--status-page"
+#define INTERRUPTS    "--interrupts"
+#define STRIPED       "--striped"
+#define GEOMETRY      "--geometry"
+#define IMAGE         "--image"
+#define PRIVATE_IMAGE "--private-image"
+#define SNAPSHOTS     "--snapshots"
+#define FORK_SERVER   "--fork-server"
+#define TRACE         "--trace"
+#define PAGE_CACHE    "--page-cache"
+#define COALESCE      "--coalesce-writes"
 
 typedef enum {
 	cl_deterministic,
 	cl_stochastic,
+	cl_benchmark,
 	cl_error
 } cl_t;
 
@@ -39,21 +61,321 @@ typedef enum {
  * variable in the tracee's memory.  ptrace(POKE_DATA) modifies an
  * entire unsigned long; if this variable were smaller the update
  * might overwrite part of a nearby variable.
+ *
+ * Only the first unsigned long holds the watched command, address,
+ * and data registers.  The rest hold the DMA registers, which the
+ * driver writes with ordinary stores and the device reads only when
+ * the driver issues a DMA command.
+ */
+volatile unsigned long ioregisters[ IOREG_WORDS ];
+
+
+/* usage()
+ *
+ * in:     progname - name of this program, from argv[0]
+ * out:    usage message to stderr
+ * return: -1, for main() to return
+ *
+ */
+
+static int
+usage(const char *progname) {
+
+	fprintf(stderr, "USAGE: %s [options]\n", progname);
+	fprintf(stderr,	"       %s [options] %s\n", progname, DETERMINISTIC);
+	fprintf(stderr,	"       %s [options] %s <positive number of tests>\n",
+		progname, STOCHASTIC);
+	fprintf(stderr,	"       %s [options] %s <table file>\n",
+		progname, BENCHMARK);
+	fprintf(stderr, "options:\n");
+	fprintf(stderr, "       %s  pass IO register accesses through "
+		"shared memory\n", SHARED_MEMORY);
+	fprintf(stderr, "       %s     run the device emulator in this "
+		"process, without ptrace()\n", IN_PROCESS);
+	fprintf(stderr, "       %s  watch each IO register separately\n",
+		BYTE_WATCH);
+	fprintf(stderr, "       %s            report statistics and latency "
+		"histograms at exit\n", STATS);
+	fprintf(stderr, "       %s     simulate time rather than waiting "
+		"on the device\n", VIRTUAL_TIME);
+	fprintf(stderr, "       %s      poll device status without "
+		"trapping\n", STATUS_PAGE);
+	fprintf(stderr, "       %s       wait for a ready interrupt rather "
+		"than polling\n", INTERRUPTS);
+	fprintf(stderr, "       %s          stripe pages across the DIB's "
+		"storage chips\n", STRIPED);
+	fprintf(stderr, "       %s <pages>\n"
+		"                    cache up to this many pages in the "
+		"framework\n", PAGE_CACHE);
+	fprintf(stderr, "       %s  stage small writes and program each "
+		"page once\n", COALESCE);
+	fprintf(stderr, "       %s <blocks>x<pages>x<bytes>\n"
+		"                    blocks per target, pages per block, "
+		"and bytes per page,\n"
+		"                    each a power of two (default %ux%ux%u)\n",
+		GEOMETRY, DEFAULT_NUM_BLOCKS, DEFAULT_NUM_PAGES,
+		DEFAULT_NUM_BYTES);
+	fprintf(stderr, "       %s <file>     keep device storage in an image "
+		"file\n", IMAGE);
+	fprintf(stderr, "       %s <file>\n"
+		"                    start device storage from an image "
+		"file, leaving it unchanged\n", PRIVATE_IMAGE);
+	fprintf(stderr, "       %s        rewind the device between "
+		"stochastic tests\n", SNAPSHOTS);
+	fprintf(stderr, "       %s      fork each stochastic test from "
+		"an initialized tracee\n", FORK_SERVER);
+	fprintf(stderr, "       %s <file>     record device emulator events "
+		"in a trace file\n", TRACE);
+	return -1;
+
+} /* usage() */
+
+
+/* driver_name()
+ *
+ * in:     progname - name of this program, from argv[0]
+ * out:    nothing
+ * return: the name of the driver this program tests: progname without
+ *         its directory or "test_" prefix.
+ *
+ */
+
+static const char *
+driver_name(const char *progname) {
+
+	const char *name;  /* progname without its directory */
+
+	name = (strrchr(progname, '/') ? strrchr(progname, '/') + 1 :
+		progname);
+	if (!strncmp(name, "test_", strlen("test_")))
+		name += strlen("test_");
+	return name;
+
+} /* driver_name() */
+
+
+/* parse_geometry()
+ *
+ * in:     arg - command-line argument of the form <blocks>x<pages>x<bytes>
+ * out:    device geometry set via geometry_init() side effect
+ * return: 0 on success, -1 if arg is malformed or describes a
+ *         geometry the device emulator can't emulate.
+ *
+ */
+
+static int
+parse_geometry(const char *arg) {
+
+	unsigned long dims[ 3 ];  /* blocks, pages, and bytes */
+	char *endptr;             /* strtoul()'s end-of-num pointer */
+	int d;                    /* indexes dims */
+
+	for (d = 0; d < 3; d++) {
+		errno = 0;
+		dims[ d ] = strtoul(arg, &endptr, 10);
+		if (errno || (endptr == arg) ||
+		    (*endptr != ((d < 2) ? 'x' : '\0')))
+			return -1;
+		arg = endptr + 1;
+	}
+	return geometry_init(dims[ 0 ], dims[ 1 ], dims[ 2 ]);
+
+} /* parse_geometry() */
+
+
+/* run_tests()
+ *
+ * in:     mode          - deterministic or stochastic
+ *         num_tests     - count of stochastic tests
+ *         p_ioregisters - address of the IO registers
+ *         striped       - stripe across the DIB's storage chips?
+ *         cache_pages   - pages for the framework to cache, 0 for none
+ *         coalesce      - have the framework coalesce small writes?
+ *         stats         - report latency and striped I/O statistics?
+ *         st_flags      - ST_* flags for st_stochastic()
+ *         bench         - configuration for st_benchmark()
+ * out:    test results to stdout
+ * return: 0 if all tests passed, otherwise -1
+ *
+ * Initializes the framework and driver and runs the tests.  In the
+ * usual configuration, this is the child tracee's job.
+ *
  */
-volatile unsigned long ioregisters = 0;
+
+static int
+run_tests(cl_t mode, long num_tests, volatile unsigned long *p_ioregisters,
+	bool striped, unsigned int cache_pages, bool coalesce, bool stats,
+	unsigned int st_flags, const struct st_bench *bench) {
+
+	struct nand_device *dib_old;    /* DIB before framework/driver init */
+	struct nand_device *dib_new;    /* DIB after framework/driver init */
+
+	/* Create an initial DIB and then initialize the framework and
+	 * whatever driver we've got configured in the makefiles.  For
+	 * some drivers, the driver and the framework simply return
+	 * the initial DIB unchanged.  Other drivers (the kilo
+	 * drivers, for example) add a new device to the DIB and
+	 * return the updated DIB.
+	 */
+	dib_old = st_dib_init(striped);
+	dib_new = init_framework(p_ioregisters, dib_old);
+
+	/* For drivers that update the DIB, verify that the new DIB is
+	 * correct.
+	 */
+	if ((dib_old != dib_new) &&           /* if DIB updated ... */
+	    (st_dib_test(dib_old, dib_new)))  /* ... verify DIB. */
+		return -1;
+
+	/* Optionally, have the framework stripe across the storage
+	 * chips of the first device in the DIB.
+	 */
+	if (striped) {
+		if (stripe_init(dib_new) < 0) {
+			puts("Fail - cannot stripe across the DIB's "
+				"storage chips.");
+			return -1;
+		}
+		puts("Striping across the DIB's storage chips.\n");
+	}
+
+	/* Optionally, have the framework cache pages. */
+	if (cache_pages) {
+		if (cache_init(cache_pages) < 0) {
+			puts("Fail - cannot allocate the page cache.");
+			return -1;
+		}
+		printf("Caching up to %u pages.\n\n", cache_pages);
+	}
+
+	/* Optionally, have the framework coalesce small writes. */
+	if (coalesce) {
+		if (coalesce_init() < 0) {
+			puts("Fail - cannot allocate write staging buffers.");
+			return -1;
+		}
+		puts("Coalescing small writes.\n");
+	}
+
+	if (stats)
+		framework_init_stats();
+
+	/* Run a small set of deterministic system tests. */
+	switch (mode) {
+
+	case cl_stochastic:
+		if (st_stochastic(num_tests, st_flags)) return -1;
+		break;
+
+	case cl_benchmark:
+		if (st_benchmark(bench)) return -1;
+		break;
+
+	case cl_deterministic:
+	default:
+		if (st_deterministic()) return -1;
+		if (coalesce && st_coalesce()) return -1;
+
+	} /* switch (mode) */
+
+	/* Leave no staged write behind for the device image. */
+	if (nand_flush()) {
+		puts("Fail - cannot flush staged writes.");
+		return -1;
+	}
+
+	if (stats)
+		framework_print_stats();
+	if (striped && stats)
+		stripe_print_stats();
+	if (cache_pages && stats)
+		cache_print_stats();
+	if (coalesce && stats)
+		coalesce_print_stats();
+
+	return 0;
+
+} /* run_tests() */
 
 
 int
 main(int argc, char * const argv[]) {
 	
 	pid_t child_pid; /* receives what fork() gives us. */
-	struct nand_device *dib_old;    /* DIB before framework/driver init */
-	struct nand_device *dib_new;    /* DIB after framework/driver init */
 	cl_t mode = cl_error;           /* test mode, default to error */
 	long num_tests = 0;             /* count of stochastic tests */
 	char *endptr;                   /* strtol()'s end-of-num pointer */
+	const char *progname = argv[0]; /* name of this program */
+	int a;                          /* index of current argument */
+	bool use_shm = false;           /* shared-memory register transport? */
+	bool in_process = false;        /* emulator in this process? */
+	bool byte_watch = false;        /* one watchpoint per register? */
+	bool stats = false;             /* report statistics? */
+	bool virtual_time = false;      /* simulate the passage of time? */
+	bool status_page = false;       /* poll status via shared page? */
+	struct gpio_status *status = NULL; /* shared status page */
+	bool interrupts = false;        /* ready interrupts? */
+	bool striped = false;           /* stripe across storage chips? */
+	unsigned long cache_pages = 0;  /* pages to cache, 0 for none */
+	bool coalesce = false;          /* coalesce small writes? */
+	int irq_fd = -1;                /* ready interrupt timer */
+	const char *image = NULL;       /* device storage image file */
+	bool private_image = false;     /* leave image file unchanged? */
+	const char *trace = NULL;       /* device event trace file */
+	struct st_bench bench;          /* st_benchmark() configuration */
+	struct device_counters *counters = NULL; /* shared trap counters */
+	unsigned int st_flags = 0;      /* ST_* flags for st_stochastic() */
+	int result;                     /* result of in-process tests */
+	struct ioregs_shm *shm = NULL;  /* shared-memory transport page */
+	volatile unsigned long *p_ioregisters = ioregisters; /* IO regs */
 	
-	/* Process command-line arguments and set test mode. */
+	/* Process options, which all precede the test mode. */
+	for (a = 1; (a < argc) && strcmp(argv[ a ], DETERMINISTIC) &&
+		     strcmp(argv[ a ], STOCHASTIC) &&
+		     strcmp(argv[ a ], BENCHMARK); a++) {
+		if (!strcmp(argv[ a ], SHARED_MEMORY))
+			use_shm = true;
+		else if (!strcmp(argv[ a ], IN_PROCESS))
+			in_process = true;
+		else if (!strcmp(argv[ a ], BYTE_WATCH))
+			byte_watch = true;
+		else if (!strcmp(argv[ a ], STATS))
+			stats = true;
+		else if (!strcmp(argv[ a ], VIRTUAL_TIME))
+			virtual_time = true;
+		else if (!strcmp(argv[ a ], STATUS_PAGE))
+			status_page = true;
+		else if (!strcmp(argv[ a ], INTERRUPTS))
+			interrupts = true;
+		else if (!strcmp(argv[ a ], STRIPED))
+			striped = true;
+		else if (!strcmp(argv[ a ], COALESCE))
+			coalesce = true;
+		else if (!strcmp(argv[ a ], SNAPSHOTS))
+			st_flags |= ST_SNAPSHOTS;
+		else if (!strcmp(argv[ a ], FORK_SERVER))
+			st_flags |= ST_FORK_SERVER;
+		else if (!strcmp(argv[ a ], GEOMETRY) && (a + 1 < argc) &&
+			 !parse_geometry(argv[ a + 1 ]))
+			a++;  /* skip the geometry argument */
+		else if ((!strcmp(argv[ a ], IMAGE) ||
+			  !strcmp(argv[ a ], PRIVATE_IMAGE)) && (a + 1 < argc)) {
+			private_image = !strcmp(argv[ a ], PRIVATE_IMAGE);
+			image = argv[ ++a ];
+		}
+		else if (!strcmp(argv[ a ], TRACE) && (a + 1 < argc))
+			trace = argv[ ++a ];
+		else if (!strcmp(argv[ a ], PAGE_CACHE) && (a + 1 < argc) &&
+			 (cache_pages = strtoul(argv[ a + 1 ], &endptr, 10)) &&
+			 (*endptr == '\0') && (cache_pages <= INT_MAX))
+			a++;  /* skip the page count */
+		else
+			return usage(progname);
+	}
+	argc -= (a - 1);  /* shift options away so the test mode */
+	argv += (a - 1);  /* arguments look as they always have */
+
+	/* Process remaining command-line arguments and set test mode. */
 	if (argc == 1) {
 		mode = cl_deterministic;
 	} else if ((argc == 2) && (!strcmp(argv[ 1 ], DETERMINISTIC))) {
@@ -70,59 +392,168 @@ main(int argc, char * const argv[]) {
 		num_tests = strtol(argv[2], &endptr, 10);
 		if (!errno && (*endptr == '\0') && (num_tests > 0))
 			mode = cl_stochastic;
+	} else if ((argc == 3) && (!strcmp(argv[ 1 ], BENCHMARK))) {
+		mode = cl_benchmark;
+		bench.driver = driver_name(progname);
+		bench.path = argv[ 2 ];
 	}
 	
-	if (mode == cl_error) {
-		fprintf(stderr, "USAGE: %s\n", argv[0]);
-		fprintf(stderr,	"       %s %s\n", argv[0], DETERMINISTIC);
-		fprintf(stderr,	"       %s %s <positive number of tests>\n",
-			argv[0], STOCHASTIC);
+	if ((mode == cl_error) || (use_shm + in_process + byte_watch > 1))
+		return usage(progname);
+
+	/* Ready interrupts fire on the real clock; in virtual time,
+	 * waiting is already free.
+	 */
+	if (interrupts && virtual_time)
+		return usage(progname);
+
+	/* Snapshots share the device's storage copy-on-write, which
+	 * an image file's mapping can't do.  The fork server's test
+	 * cases each begin by restoring a snapshot, and only stochastic
+	 * tests have test cases to fork.
+	 */
+	if (st_flags && image)
+		return usage(progname);
+	if ((st_flags & ST_FORK_SERVER) && (mode != cl_stochastic))
+		return usage(progname);
+	if (st_flags & ST_FORK_SERVER)
+		device_init_fork_server();
+	if (stats)
+		device_init_stats();
+
+	/* In virtual time, driver and device share a simulated clock
+	 * that jumps forward whenever the driver sleeps.  Set it up
+	 * before fork() so both processes see the same timeline.
+	 */
+	if (virtual_time)
+		clock_init_virtual();
+
+	/* Open the image before fork() so that a bad file name
+	 * stops us before any tests run.  The device emulator maps it
+	 * for the geometry chosen above when it initializes.
+	 */
+	if (image && device_init_image(image, private_image))
 		return -1;
-	}
-	
-	switch (child_pid = fork()) {
 
-	case -1: /* fork() failed. */
-		perror("Failed to fork");
+	/* Likewise create the trace file before fork(), so that it
+	 * has just one header and the tests' traps all go in it.
+	 */
+	if (trace && device_init_trace(trace))
 		return -1;
 
-	case 0: /* I am the child. */
+	/* With a status page, the device emulator publishes its
+	 * ready/busy deadline in a page that parent and child continue
+	 * to share after fork(), and the child's gpio_get() reads the
+	 * status pin from there instead of trapping.
+	 */
+	if (status_page) {
+		status = mmap(NULL, sizeof(struct gpio_status),
+			PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+			-1, 0);
+		if (status == MAP_FAILED) {
+			perror("Failed to map shared status page");
+			return -1;
+		}
+		device_init_status(status);
+	}
 
-		/* Create an initial DIB and then initialize the
-		 * framework and whatever driver we've got configured
-		 * in the makefiles.  For some drivers, the driver and
-		 * the framework simply return the initial DIB
-		 * unchanged.  Other drivers (the kilo drivers, for
-		 * example) add a new device to the DIB and return the
-		 * updated DIB.
-		 */
-		dib_old = st_dib_init();
-		dib_new = init_framework(&ioregisters, dib_old);
+	/* For benchmarks, the device emulator counts its traps in a
+	 * page that parent and child continue to share after fork(),
+	 * where the child's benchmark can read the count.
+	 */
+	if (mode == cl_benchmark) {
+		counters = mmap(NULL, sizeof(struct device_counters),
+			PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+			-1, 0);
+		if (counters == MAP_FAILED) {
+			perror("Failed to map shared trap counters");
+			return -1;
+		}
+		counters->emulator = getpid();
+		device_init_counters(counters);
+		bench.counters = counters;
+	}
 
-		/* For drivers that update the DIB, verify that the
-		 * new DIB is correct.
-		 */
-		if ((dib_old != dib_new) &&           /* if DIB updated ... */
-		    (st_dib_test(dib_old, dib_new)))  /* ... verify DIB. */
+	/* For ready interrupts, the device emulator arms a timer that
+	 * parent and child continue to share after fork() and the
+	 * child's driver sleeps until it expires.
+	 */
+	if (interrupts) {
+		irq_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+		if (irq_fd < 0) {
+			perror("Failed to create ready interrupt timer");
 			return -1;
+		}
+		device_init_irq(irq_fd);
+	}
+
+	/* In in-process mode there is no tracer.  The device emulator
+	 * services the driver's traps from a SIGTRAP handler in this
+	 * very process, so we skip fork() and run the tests here.
+	 */
+	if (in_process) {
+		device_init_in_process(ioregisters);
+		init_framework_in_process();
+		if (status_page)
+			gpio_init_status(status);
+		if (interrupts)
+			irq_init(irq_fd);
+		result = run_tests(mode, num_tests, ioregisters, striped,
+			cache_pages, coalesce, stats, st_flags, &bench);
+		device_sync_image();
+		if (stats)
+			device_print_stats();
+		return result;
+	}
 
-		/* Run a small set of deterministic system tests. */
-		switch (mode) {
-			
-		case cl_stochastic:
-			if (st_stochastic(num_tests)) return -1;
-			break;
-			
-		case cl_deterministic:
-		default:
-			if (st_deterministic()) return -1;
+	/* For the shared-memory transport, the IO registers live in a
+	 * page that parent and child continue to share after fork()
+	 * rather than in the ioregisters variable above.
+	 */
+	if (use_shm) {
+		shm = mmap(NULL, sizeof(struct ioregs_shm),
+			PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+			-1, 0);
+		if (shm == MAP_FAILED) {
+			perror("Failed to map shared IO registers");
+			return -1;
+		}
+		p_ioregisters = shm->ioregisters;
+	}
+	
+	switch (child_pid = fork()) {
 
-		} /* switch (mode) */
+	case -1: /* fork() failed. */
+		perror("Failed to fork");
+		return -1;
 
-		break;
+	case 0: /* I am the child. */
+		if (use_shm)
+			ioreg_init_shm(shm);
+		if (status_page) {
+			/* The driver may read the page but not write it. */
+			if (mprotect(status, sizeof(struct gpio_status),
+				PROT_READ)) {
+				perror("Failed to protect shared status page");
+				return -1;
+			}
+			gpio_init_status(status);
+		}
+		if (interrupts)
+			irq_init(irq_fd);
+		return run_tests(mode, num_tests, p_ioregisters, striped,
+			cache_pages, coalesce, stats, st_flags, &bench);
 
 	default: /* I am the parent; child_pid holds child pid. */
-		device_init(&ioregisters, child_pid);
+		if (use_shm)
+			device_init_shm(shm, child_pid);
+		else if (byte_watch)
+			device_init_registers(ioregisters, child_pid);
+		else
+			device_init(ioregisters, child_pid);
+		device_sync_image();
+		if (stats)
+			device_print_stats();
 	}
 
 	return 0;
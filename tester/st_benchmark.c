@@ -0,0 +1,459 @@
+/* Copyright (c) 2023 Timothy Jon Fraser Consulting LLC */
+
+#include <sys/types.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "device_emu.h"
+#include "framework.h"
+#include "st_data.h"
+#include "tester.h"
+
+/* The benchmark's fixed workloads all run in a region of
+ * BENCH_BLOCKS erase blocks at the start of the device, which the
+ * erase workload erases first.  The sequential workloads then write
+ * and read back SEQ_OPS runs of SEQ_PAGES pages from the start of the
+ * region, the random workload reads RANDOM_OPS single pages chosen
+ * from among them, the vectored workloads rewrite the start of them
+ * VECTOR_OPS times with writev_nand() and read that back with
+ * readv_nand(), VECTOR_SEGS records per call, and the partial-page
+ * workload writes the middle half of each of PARTIAL_OPS pages that
+ * follow them.  The region is the whole device if it has fewer
+ * blocks.  If the geometry makes the region too small to hold SEQ_OPS
+ * runs, the sequential workloads do as many as fit, shortening the
+ * runs if even one won't, and the partial-page writes wrap around to
+ * the start of the region.
+ */
+#define PAGE_SIZE    NUM_BYTES
+#define BLOCK_SIZE   (PAGE_SIZE * NUM_PAGES)
+#define ERASE_OPS    4
+#define ERASE_BLOCKS 4
+#define BENCH_BLOCKS (ERASE_OPS * ERASE_BLOCKS)
+#define REGION_SIZE  (((NUM_BLOCKS < BENCH_BLOCKS) ? NUM_BLOCKS : BENCH_BLOCKS) * \
+		      BLOCK_SIZE)
+#define SEQ_OPS      64
+#define SEQ_PAGES    4
+#define SEQ_SIZE     (seq_ops * seq_run)
+#define RANDOM_OPS   256
+#define PARTIAL_OPS  64
+#define VECTOR_OPS   16
+#define VECTOR_SEGS  16
+#define RECORD_SIZE  (PAGE_SIZE / 8)
+#define VECTOR_SPAN  (VECTOR_SEGS * RECORD_SIZE)
+#define RANDOM_SEED  1
+
+#define NS_PER_S 1000000000UL
+
+/* Where a workload's time and traps went. */
+struct sample {
+	unsigned long wall_ns;  /* elapsed real time */
+	unsigned long cpu_ns;   /* tracee plus device emulator CPU time */
+	unsigned long traps;    /* device emulator round trips */
+};
+
+static const struct st_bench *config;  /* from st_benchmark() */
+static FILE *table;                    /* where the results go */
+static unsigned long seq_run;          /* bytes per sequential run */
+static unsigned long seq_ops;          /* sequential runs that fit */
+static unsigned long vector_ops;       /* vectored calls that fit */
+
+
+/* cpu_clock()
+ *
+ * in:     id - a CPU-time clock
+ * out:    nothing
+ * return: id's time in nanoseconds, or 0 if it can't be read.
+ *
+ */
+
+static unsigned long
+cpu_clock(clockid_t id) {
+
+	struct timespec ts;
+
+	if (clock_gettime(id, &ts))
+		return 0;
+	return ts.tv_sec * NS_PER_S + ts.tv_nsec;
+
+} /* cpu_clock() */
+
+
+/* take_sample()
+ *
+ * in:     nothing
+ * out:    p_s - the clocks and trap count as of now
+ * return: nothing
+ *
+ * Charges the device emulator's CPU time to the workload, too, when
+ * it runs in another process.
+ *
+ */
+
+static void
+take_sample(struct sample *p_s) {
+
+	clockid_t emulator;  /* device emulator's CPU-time clock */
+
+	p_s->wall_ns = cpu_clock(CLOCK_MONOTONIC);
+	p_s->cpu_ns = cpu_clock(CLOCK_PROCESS_CPUTIME_ID);
+	if ((config->counters->emulator != getpid()) &&
+	    !clock_getcpuclockid(config->counters->emulator, &emulator))
+		p_s->cpu_ns += cpu_clock(emulator);
+	p_s->traps = config->counters->traps;
+
+} /* take_sample() */
+
+
+/* report()
+ *
+ * in:     workload - the workload's name
+ *         ops      - operations it completed
+ *         bytes    - bytes those operations moved or erased
+ *         p_start  - sample from before the first operation
+ *         result   - "ok", or why the workload stopped short
+ * out:    one row appended to the table
+ * return: nothing
+ *
+ */
+
+static void
+report(const char *workload, unsigned long ops, unsigned long bytes,
+	const struct sample *p_start, const char *result) {
+
+	struct sample end;     /* sample from after the last operation */
+	double seconds;        /* elapsed real time */
+
+	take_sample(&end);
+	seconds = (double)(end.wall_ns - p_start->wall_ns) / NS_PER_S;
+
+	fprintf(table, "%-12s %-13s %6lu %9lu %9.4f %9.4f %10.1f %10.4f "
+		"%11.1f %s\n", config->driver, workload, ops, bytes, seconds,
+		(seconds > 0) ? bytes / seconds / 1e6 : 0.0,
+		(seconds > 0) ? ops / seconds : 0.0,
+		bytes ? (double)(end.traps - p_start->traps) / bytes : 0.0,
+		bytes ? (double)(end.cpu_ns - p_start->cpu_ns) / bytes : 0.0,
+		result);
+	fflush(table);
+
+} /* report() */
+
+
+/* bench_erase()
+ *
+ * in:     nothing
+ * out:    the benchmark region erased, and a row in the table
+ * return: 0 on success, -1 on failure.
+ *
+ */
+
+static int
+bench_erase(void) {
+
+	struct sample start;  /* before the first operation */
+	unsigned long o;      /* counts operations */
+
+	take_sample(&start);
+	for (o = 0; o < ERASE_OPS; o++) {
+		if (erase_nand(o * ERASE_BLOCKS * BLOCK_SIZE,
+			ERASE_BLOCKS * BLOCK_SIZE)) {
+			report("erase", o, o * ERASE_BLOCKS * BLOCK_SIZE,
+				&start, "fail");
+			return -1;
+		}
+	}
+	report("erase", o, o * ERASE_BLOCKS * BLOCK_SIZE, &start, "ok");
+	return 0;
+
+} /* bench_erase() */
+
+
+/* bench_sequential()
+ *
+ * in:     data  - SEQ_SIZE bytes to write
+ *         write - write data if true, otherwise read it back
+ * out:    a row in the table
+ * return: 0 on success, -1 on failure.
+ *
+ */
+
+static int
+bench_sequential(unsigned char *data, int write) {
+
+	const char *workload = (write ? "seq_write" : "seq_read");
+	unsigned long run = seq_run;  /* bytes per operation */
+	unsigned char *buf;   /* read destination */
+	struct sample start;  /* before the first operation */
+	unsigned long o;      /* counts operations */
+	unsigned long addr;   /* each operation's start address */
+
+	if (!(buf = malloc(run))) {
+		printf("Benchmark failed to malloc() a read buffer.\n");
+		return -1;
+	}
+
+	take_sample(&start);
+	for (o = 0; o < seq_ops; o++) {
+		addr = o * run;
+		if (write ? write_nand(data + o * run, addr, run) :
+		    read_nand(buf, addr, run)) {
+			report(workload, o, o * run, &start, "fail");
+			free(buf);
+			return -1;
+		}
+		if (!write && memcmp(buf, data + o * run, run)) {
+			report(workload, o + 1, (o + 1) * run, &start,
+				"mismatch");
+			free(buf);
+			return -1;
+		}
+	}
+	report(workload, o, o * run, &start, "ok");
+	free(buf);
+	return 0;
+
+} /* bench_sequential() */
+
+
+/* bench_random()
+ *
+ * in:     data - the SEQ_SIZE bytes bench_sequential() wrote
+ * out:    a row in the table
+ * return: 0 on success, -1 on failure.
+ *
+ */
+
+static int
+bench_random(unsigned char *data) {
+
+	unsigned char *buf;   /* read destination */
+	struct sample start;  /* before the first operation */
+	unsigned long o;      /* counts operations */
+	unsigned long page;   /* page each operation reads */
+
+	if (!(buf = malloc(PAGE_SIZE))) {
+		printf("Benchmark failed to malloc() a read buffer.\n");
+		return -1;
+	}
+
+	srandom(RANDOM_SEED);
+	take_sample(&start);
+	for (o = 0; o < RANDOM_OPS; o++) {
+		page = random() % (SEQ_SIZE / PAGE_SIZE);
+		if (read_nand(buf, page * PAGE_SIZE, PAGE_SIZE)) {
+			report("random_read", o, o * PAGE_SIZE, &start, "fail");
+			free(buf);
+			return -1;
+		}
+		if (memcmp(buf, data + page * PAGE_SIZE, PAGE_SIZE)) {
+			report("random_read", o + 1, (o + 1) * PAGE_SIZE,
+				&start, "mismatch");
+			free(buf);
+			return -1;
+		}
+	}
+	report("random_read", o, o * PAGE_SIZE, &start, "ok");
+	free(buf);
+	return 0;
+
+} /* bench_random() */
+
+
+/* bench_gather()
+ *
+ * in:     data - the SEQ_SIZE bytes bench_sequential() wrote
+ * out:    a row in the table
+ * return: 0 on success, -1 on failure.
+ *
+ * Each writev_nand() call writes VECTOR_SEGS records to consecutive
+ * device addresses, gathering them from data in reverse order, so
+ * that the whole call is one run.
+ *
+ */
+
+static int
+bench_gather(unsigned char *data) {
+
+	struct nand_iovec iov[ VECTOR_SEGS ];  /* one call's records */
+	struct sample start;  /* before the first operation */
+	unsigned long o;      /* counts operations */
+	unsigned int r;       /* counts records */
+
+	take_sample(&start);
+	for (o = 0; o < vector_ops; o++) {
+		for (r = 0; r < VECTOR_SEGS; r++) {
+			iov[ r ].offset = o * VECTOR_SPAN + r * RECORD_SIZE;
+			iov[ r ].buffer = data + o * VECTOR_SPAN +
+				(VECTOR_SEGS - 1 - r) * RECORD_SIZE;
+			iov[ r ].length = RECORD_SIZE;
+		}
+		if (writev_nand(iov, VECTOR_SEGS)) {
+			report("gather_write", o, o * VECTOR_SPAN, &start,
+				"fail");
+			return -1;
+		}
+	}
+	report("gather_write", o, o * VECTOR_SPAN, &start, "ok");
+	return 0;
+
+} /* bench_gather() */
+
+
+/* bench_scatter()
+ *
+ * in:     data - what bench_gather() gathered its records from
+ * out:    a row in the table
+ * return: 0 on success, -1 on failure.
+ *
+ * Each readv_nand() call reads the records one bench_gather() call
+ * wrote back to where it gathered them from, skipping every third
+ * record, so that the call has runs of two records each.
+ *
+ */
+
+static int
+bench_scatter(unsigned char *data) {
+
+	struct nand_iovec iov[ VECTOR_SEGS ];  /* one call's records */
+	unsigned char *buf;   /* read destination */
+	struct sample start;  /* before the first operation */
+	unsigned long o;      /* counts operations */
+	unsigned long bytes = 0;  /* bytes read so far */
+	unsigned int r;       /* counts records */
+	unsigned int n;       /* records in this call */
+
+	if (!(buf = malloc((VECTOR_SPAN > 0) ? VECTOR_SPAN : 1))) {
+		printf("Benchmark failed to malloc() a read buffer.\n");
+		return -1;
+	}
+
+	take_sample(&start);
+	for (o = 0; o < vector_ops; o++) {
+		for (n = 0, r = 0; r < VECTOR_SEGS; r++) {
+			if (r % 3 == 2)
+				continue;
+			iov[ n ].offset = o * VECTOR_SPAN + r * RECORD_SIZE;
+			iov[ n ].buffer = buf + (VECTOR_SEGS - 1 - r) *
+				RECORD_SIZE;
+			iov[ n ].length = RECORD_SIZE;
+			n++;
+		}
+		if (readv_nand(iov, n)) {
+			report("scatter_read", o, bytes, &start, "fail");
+			free(buf);
+			return -1;
+		}
+		bytes += n * RECORD_SIZE;
+		for (r = 0; r < n; r++) {
+			if (memcmp(iov[ r ].buffer, data + o * VECTOR_SPAN +
+				(iov[ r ].buffer - buf), RECORD_SIZE)) {
+				report("scatter_read", o + 1, bytes, &start,
+					"mismatch");
+				free(buf);
+				return -1;
+			}
+		}
+	}
+	report("scatter_read", o, bytes, &start, "ok");
+	free(buf);
+	return 0;
+
+} /* bench_scatter() */
+
+
+/* bench_partial()
+ *
+ * in:     data - at least half a page of bytes to write
+ * out:    a row in the table
+ * return: 0 on success, -1 on failure.
+ *
+ */
+
+static int
+bench_partial(unsigned char *data) {
+
+	unsigned long size = PAGE_SIZE / 2;  /* bytes per operation */
+	struct sample start;  /* before the first operation */
+	unsigned long o;      /* counts operations */
+	unsigned long addr;   /* each operation's start address */
+
+	take_sample(&start);
+	for (o = 0; o < PARTIAL_OPS; o++) {
+		addr = (SEQ_SIZE + o * PAGE_SIZE + PAGE_SIZE / 4) % REGION_SIZE;
+		if (write_nand(data, addr, size)) {
+			report("partial_write", o, o * size, &start, "fail");
+			return -1;
+		}
+	}
+	/* Charge the workload for any writes the framework staged. */
+	if (nand_flush()) {
+		report("partial_write", o, o * size, &start, "fail");
+		return -1;
+	}
+	report("partial_write", o, o * size, &start, "ok");
+	return 0;
+
+} /* bench_partial() */
+
+
+/* st_benchmark()
+ *
+ * in:     in_config - driver name, table file, and trap counters
+ * out:    one row per workload appended to the table
+ * return: 0 if every workload completed and read back what it
+ *         should have, else -1.
+ *
+ * Runs the driver through fixed erase, sequential write, sequential
+ * read, random single-page read, vectored write, vectored read, and
+ * partial-page write workloads
+ * and appends a row of throughput and cost figures for each to the
+ * table file, headed by a comment line naming the columns if the
+ * file was empty.  Later workloads run even if an earlier one fails.
+ *
+ */
+
+int
+st_benchmark(const struct st_bench *in_config) {
+
+	unsigned char *data;  /* what the sequential workloads write */
+	int result = 0;       /* optimistically presume success */
+
+	config = in_config;
+	seq_run = ((REGION_SIZE < SEQ_PAGES * PAGE_SIZE) ? REGION_SIZE :
+		SEQ_PAGES * PAGE_SIZE);
+	seq_ops = ((REGION_SIZE / seq_run < SEQ_OPS) ?
+		REGION_SIZE / seq_run : SEQ_OPS);
+	vector_ops = ((VECTOR_SPAN > 0) ? SEQ_SIZE / VECTOR_SPAN : 0);
+	if (vector_ops > VECTOR_OPS)
+		vector_ops = VECTOR_OPS;
+	if (!(table = fopen(config->path, "a"))) {
+		perror("Failed to open benchmark table");
+		return -1;
+	}
+	if (!ftell(table))
+		fprintf(table, "#driver      workload         ops     bytes   "
+			"seconds      MB/s      ops/s traps/byte "
+			"cpu_ns/byte result\n");
+
+	if (!(data = malloc(SEQ_SIZE))) {
+		printf("Benchmark failed to malloc() its data.\n");
+		fclose(table);
+		return -1;
+	}
+	data_init(data, SEQ_SIZE);
+
+	result |= bench_erase();
+	result |= bench_sequential(data, 1);
+	result |= bench_sequential(data, 0);
+	result |= bench_random(data);
+	result |= bench_gather(data);
+	result |= bench_scatter(data);
+	result |= bench_partial(data);
+
+	free(data);
+	fclose(table);
+	return result;
+
+} /* st_benchmark() */
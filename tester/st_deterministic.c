@@ -10,6 +10,10 @@
 
 #define DATA_SIZE    300   /* how many bytes to write to/read from device */
 
+#define SMALL_SIZE   20    /* bytes in each of st_coalesce()'s writes */
+#define SMALL_SKIP   5     /* how far the second write starts past the first */
+#define SMALL_READ   64    /* bytes st_coalesce() reads back */
+
 static unsigned char data[DATA_SIZE];
 static unsigned char dest[DATA_SIZE];
 
@@ -91,3 +95,89 @@ st_deterministic(void) {
 	return 0;  /* All tests passed! */
 	
 } /* st_deterministic() */
+
+
+/* st_coalesce()
+ *
+ * in:     nothing
+ * out:    nothing
+ * return: 0 if all tests passed, else -1.
+ *
+ * Run a deterministic system test of write coalescing, after
+ * coalesce_init().  Makes two small writes to the same page, the
+ * second superseding the first while both are staged, then reads the
+ * page, which must flush the second write, and only the second, to
+ * the device.
+ *
+ */
+
+int
+st_coalesce(void) {
+
+	struct nand_coalesce_stats before;  /* counters before the test */
+	struct nand_coalesce_stats after;   /* counters after each step */
+	unsigned int tail;    /* index of the first byte past the second write */
+
+	printf("Test: stage a small write, supersede it with another to "
+	       "the same page,\nread the page, and confirm only the second "
+	       "write reached the device:\n\n");
+
+	puts("Erasing blocks...");
+	fflush(stdout);
+	if (erase_nand(STORAGE_ADDR, SMALL_READ)) {
+		printf("Failed to erase %u bytes from storage address %u.\n",
+		       SMALL_READ, STORAGE_ADDR);
+		return -1;
+	}
+	coalesce_get_stats(&before);
+
+	data_init(data, SMALL_SIZE);
+	puts("Writing data twice...");
+	fflush(stdout);
+	if (write_nand(data, STORAGE_ADDR, SMALL_SIZE) ||
+	    write_nand(data, STORAGE_ADDR + SMALL_SKIP, SMALL_SIZE)) {
+		printf("Failed to write %u bytes to storage address %u.\n",
+		       SMALL_SIZE, STORAGE_ADDR);
+		return -1;
+	}
+	coalesce_get_stats(&after);
+	if ((after.staged - before.staged != 2) ||
+	    (after.saved - before.saved != 1) ||
+	    (after.programs != before.programs)) {
+		puts("\nFail - the second write did not supersede the first.");
+		return -1;
+	}
+	puts("Pass - the second write superseded the first.\n");
+
+	puts("Reading data...");
+	fflush(stdout);
+	if (read_nand(dest, STORAGE_ADDR, SMALL_READ)) {
+		printf("Failed to read %u bytes from storage address %u.\n",
+		       SMALL_READ, STORAGE_ADDR);
+		return -1;
+	}
+	coalesce_get_stats(&after);
+	if (after.programs - before.programs != 1) {
+		puts("\nFail - the read did not flush the staged write.");
+		return -1;
+	}
+
+	puts("Data read from device (ideally the second write alone):");
+	data_print(dest, SMALL_READ);
+	if ((SMALL_SKIP != data_confirm_zeroes(dest, SMALL_SKIP)) ||
+	    (SMALL_SIZE != data_compare(data, &dest[ SMALL_SKIP ],
+		    SMALL_SIZE))) {
+		puts("\nFail - the device does not hold the second write.");
+		return -1;
+	}
+	tail = SMALL_SKIP + SMALL_SIZE;
+	if (SMALL_READ - tail != data_confirm_zeroes(&dest[ tail ],
+		SMALL_READ - tail)) {
+		puts("\nFail - the device holds more than the second write.");
+		return -1;
+	}
+	puts("\nPass - the read flushed only the second write.\n");
+
+	return 0;  /* All tests passed! */
+
+} /* st_coalesce() */
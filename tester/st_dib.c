@@ -1,40 +1,69 @@
 // Copyright (c) 2022 Provatek, LLC.
 
 #include <sys/types.h>
+#include <stdbool.h>
 #include <stdio.h>
 
 #include "device_emu.h"
 #include "framework.h"
 #include "tester.h"
 
-static struct nand_storage_chip init_storage = {
-	.controller = NULL,    /* must be set before test! */
-	.nblocks = NUM_BLOCKS,
-	.npages_per_block = NUM_PAGES,
-	.nbytes_per_page = NUM_BYTES,
-	.ref_count = 1
-};
+/* Room for one storage chip for each of the device's chip-enable
+ * targets.  The DIB lists them all only when the test stripes across
+ * them; otherwise it lists just the first, as it always has.
+ */
+static struct nand_storage_chip init_storage[ NUM_TARGETS ];
 
 static struct nand_controller_chip init_controller = {
-	.first_storage = &init_storage,
-	.last_storage = &init_storage,
-	.nstorage = 1,
-	.ref_count = 1,
+	.first_storage = &init_storage[ 0 ],
 	.exec_op = NULL
+	/* st_dib_init() sets last_storage, nstorage, and ref_count. */
 };
 
 static struct nand_device init_device = {
 	.device_makemodel = "Dummy device in original DIB",
 	.controller = &init_controller,
-	.next_device = NULL,
-	.ref_count = 2
+	.next_device = NULL
+	/* st_dib_init() sets ref_count. */
 };
 
 
+/* st_dib_init()
+ *
+ * in:     striped - will the framework stripe across the device's
+ *                   chip-enable targets?
+ * out:    nothing
+ * return: the initial DIB, describing one storage chip, or one for
+ *         each chip-enable target if striped.
+ *
+ */
+
 struct nand_device *
-st_dib_init(void) {
+st_dib_init(bool striped) {
+
+	unsigned int nchips = (striped ? NUM_TARGETS : 1);
+	unsigned int t;  /* indexes storage chips */
+
+	for (t = 0; t < nchips; t++) {
+		init_storage[ t ].nblocks = NUM_BLOCKS;
+		init_storage[ t ].npages_per_block = NUM_PAGES;
+		init_storage[ t ].nbytes_per_page = NUM_BYTES;
+		init_storage[ t ].ref_count = 1;
+		init_storage[ t ].next_storage = ((t + 1 < nchips) ?
+			&init_storage[ t + 1 ] : NULL);
+		init_storage[ t ].controller = NULL;
+	}
+
+	/* The first and last storage chips point back to the
+	 * controller.
+	 */
+	init_storage[ 0 ].controller = &init_controller;
+	init_storage[ nchips - 1 ].controller = &init_controller;
 
-	init_storage.controller= &init_controller;
+	init_controller.last_storage = &init_storage[ nchips - 1 ];
+	init_controller.nstorage = nchips;
+	init_controller.ref_count = nchips;
+	init_device.ref_count = nchips + 1;
 	return &init_device;
 
 } /* st_dib_init() */
@@ -11,7 +11,9 @@
  */
 
 #include <sys/types.h>
+#include <sys/mman.h>
 #include <assert.h>
+#include <stdlib.h>
 #include <stdio.h>
 
 #include "device_emu.h"
@@ -48,15 +50,67 @@
 #define BLOCK_START(o) (((o) / BLOCK_SIZE) * BLOCK_SIZE)
 #define BLOCK_END(o)   (BLOCK_START(o) + BLOCK_SIZE - 1)
 
+/* Likewise for the erase unit containing offset o.  The erase unit
+ * is a block unless the framework stripes across several chips; see
+ * set_mirror_erase_size().
+ */
+#define ERASE_SIZE     (erase_size ? erase_size : BLOCK_SIZE)
+#define ERASE_START(o) (((o) / ERASE_SIZE) * ERASE_SIZE)
+#define ERASE_END(o)   (ERASE_START(o) + ERASE_SIZE - 1)
+
 /* This module's functions accept offsets that are arbitrary unsigned
- * ints, but the mirror itself has a relatively small size.  This
+ * longs, but the mirror itself has a relatively small size.  This
  * macro wraps offsets to the size of the mirror.  Convention: don't
  * wrap until you actually need to index an array or print.  Wrapping
  * makes it hard to compare offsets with "<" and "<=".
  */
 #define WRAP(o) ((o) % MIRROR_SIZE)
 
-static unsigned char mirror[MIRROR_SIZE];
+/* The mirror is MIRROR_SIZE bytes, which depends on the geometry
+ * main.c chose at startup, so alloc_mirror() maps it on first use.
+ * That may be far more than the tests will touch, so it's mapped
+ * without reserving swap; only the pages the tests touch get backed.
+ */
+static unsigned char *mirror;
+
+static unsigned long erase_size;  /* bytes per erase unit, 0 for a block */
+
+
+/* alloc_mirror()
+ *
+ * in:     nothing
+ * out:    mirror allocated and zeroed by side-effect, if not already
+ * return: nothing
+ *
+ */
+
+static void
+alloc_mirror(void) {
+
+	if (!mirror) {
+		mirror = mmap(NULL, MIRROR_SIZE, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		assert(mirror != MAP_FAILED);
+	}
+
+} /* alloc_mirror() */
+
+
+/* set_mirror_erase_size()
+ *
+ * in:     size - bytes per erase unit, a multiple of BLOCK_SIZE
+ * out:    erase_size set by side-effect
+ * return: nothing
+ *
+ * Tells erase_mirror() how much the framework's erase_nand() erases
+ * at a time.
+ *
+ */
+
+void
+set_mirror_erase_size(unsigned long size) {
+	erase_size = size;
+} /* set_mirror_erase_size() */
 
 
 /* read_mirror()
@@ -71,10 +125,11 @@ static unsigned char mirror[MIRROR_SIZE];
  */
 
 void
-read_mirror(unsigned char *buffer, unsigned int offset, unsigned int size) {
+read_mirror(unsigned char *buffer, unsigned long offset, unsigned int size) {
 
 	unsigned int i;  /* index into both mirror and buffer */
 
+	alloc_mirror();
 	for (i = 0; i < size; i++) {
 		buffer[ i ] = mirror[ WRAP(offset + i) ];
 	}
@@ -103,9 +158,11 @@ read_mirror(unsigned char *buffer, unsigned int offset, unsigned int size) {
  */
 
 void
-write_mirror(unsigned char *buffer, unsigned int offset, unsigned int size) {
+write_mirror(unsigned char *buffer, unsigned long offset, unsigned int size) {
 
-	unsigned int i;  /* index into both mirror and buffer */
+	unsigned long i;  /* index into both mirror and buffer */
+
+	alloc_mirror();
 
 	/* Zero the first page preceeding the first actual data byte. */
 	for (i = PAGE_START(offset); i < offset; i++) {
@@ -134,8 +191,9 @@ write_mirror(unsigned char *buffer, unsigned int offset, unsigned int size) {
  * out:    mirror - erased by side-effect.
  * return: nothing
  *
- * Erases a contiguous series of complete blocks that contains the
- * byte range that starts at offset and ends at (offset + size).
+ * Erases a contiguous series of complete blocks (or erase units; see
+ * set_mirror_erase_size()) that contains the byte range that starts
+ * at offset and ends at (offset + size).
  *
  * Peculiar behavior: the NAND device emulator always erases whole
  * blocks.  If the erase does not begin precisely at the beginning of
@@ -149,11 +207,12 @@ write_mirror(unsigned char *buffer, unsigned int offset, unsigned int size) {
  */
 
 void
-erase_mirror(unsigned int offset, unsigned int size) {
+erase_mirror(unsigned long offset, unsigned long size) {
 
-	unsigned int m;  /* index into mirror */
+	unsigned long m;  /* index into mirror */
 
-	for (m = BLOCK_START(offset); m <= BLOCK_END(offset + size - 1); m++) {
+	alloc_mirror();
+	for (m = ERASE_START(offset); m <= ERASE_END(offset + size - 1); m++) {
 		mirror[ WRAP(m) ] = 0;
 	}
 	
@@ -180,16 +239,18 @@ erase_mirror(unsigned int offset, unsigned int size) {
 #define TEST_OFFSET (((2 * MIRROR_SIZE) - BLOCK_SIZE) + PAGE_SIZE + 7)
 #define NONZERO_CHAR 'x'   /* a byte value data_print() will print */
 
-static unsigned char data_written[ MIRROR_SIZE ];
-static unsigned char data_read[ MIRROR_SIZE ];
+static unsigned char *data_written;  /* MIRROR_SIZE bytes */
+static unsigned char *data_read;     /* MIRROR_SIZE bytes */
 
 static int
-test(unsigned int offset, unsigned int size) {
+test(unsigned long offset, unsigned long size) {
 
-	unsigned int i;
-	unsigned int true_start;  /* index of start of first page touched */
-	unsigned int true_end;    /* index of end of last page touched */
+	unsigned long i;
+	unsigned long true_start; /* index of start of first page touched */
+	unsigned long true_end;   /* index of end of last page touched */
 	
+	alloc_mirror();
+
 	/* Set entire mirror to non-zero value so that we can confirm
 	 * later zeroization works properly.
 	 */
@@ -200,12 +261,12 @@ test(unsigned int offset, unsigned int size) {
 	true_start = PAGE_START(offset);
 	true_end = PAGE_END(offset + size - 1);
 	
-	printf("Test: store and retrieve 0x%06x bytes "
-	       "to mirror index 0x%08x,\n"
-	       "      true start index 0x%08x "
-	       "block %03u page %03u offset %03u,\n"
-	       "        true end index 0x%08x "
-	       "block %03u page %03u offset %03u.\n",
+	printf("Test: store and retrieve 0x%06lx bytes "
+	       "to mirror index 0x%08lx,\n"
+	       "      true start index 0x%08lx "
+	       "block %03lu page %03lu offset %03lu,\n"
+	       "        true end index 0x%08lx "
+	       "block %03lu page %03lu offset %03lu.\n",
 	       size, offset,
 	       true_start,
 	       BLOCK(WRAP(true_start)), PAGE(true_start), BYTE(true_start),
@@ -220,7 +281,7 @@ test(unsigned int offset, unsigned int size) {
 	read_mirror(data_read, offset, size);
 
 	if (size != (i = data_compare(data_written, data_read, size))) {
-		printf("      Fail - buffers differ at index 0x%06x.\n", i);
+		printf("      Fail - buffers differ at index 0x%06lx.\n", i);
 		printf("written: 0x%02x%02x%02x%02x\n", data_written[0],
 			data_written[1], data_written[2], data_written[3]);
 		printf(" mirror: 0x%02x%02x%02x%02x\n", mirror[0], mirror[1],
@@ -235,7 +296,7 @@ test(unsigned int offset, unsigned int size) {
 
 		if (mirror[ WRAP(i) ] != 0) {
 			printf("      Fail - nonzero prefix data at index "
-				"0x%08x.\n", i);
+				"0x%08lx.\n", i);
 			return -1;
 		}
 	}
@@ -245,7 +306,7 @@ test(unsigned int offset, unsigned int size) {
 
 		if (mirror[ WRAP(i) ] != 0) {
 			printf("      Fail - nonzero postfix data at index "
-				"0x%08x.\n", i);
+				"0x%08lx.\n", i);
 			return -1;
 		}
 	}
@@ -256,12 +317,12 @@ test(unsigned int offset, unsigned int size) {
 	true_start = BLOCK_START(offset);
 	true_end   = BLOCK_END(offset + size - 1);
 	
-	printf("Test: erase a range of 0x%06x bytes "
-	       "starting at index 0x%08x,\n"
-	       "      true start index 0x%08x "
-	       "block %03u page %03u offset %03u,\n"
-	       "        true end index 0x%08x "
-	       "block %03u page %03u offset %03u.\n",
+	printf("Test: erase a range of 0x%06lx bytes "
+	       "starting at index 0x%08lx,\n"
+	       "      true start index 0x%08lx "
+	       "block %03lu page %03lu offset %03lu,\n"
+	       "        true end index 0x%08lx "
+	       "block %03lu page %03lu offset %03lu.\n",
 	       size, offset,
 	       true_start,
 	       BLOCK(WRAP(true_start)), PAGE(true_start), BYTE(true_start),
@@ -275,7 +336,7 @@ test(unsigned int offset, unsigned int size) {
 
 		if (mirror[ WRAP(i) ] != 0) {
 			printf("      Fail - nonzero erased data at index "
-				"0x%08x.\n", i);
+				"0x%08lx.\n", i);
 			return -1;
 		}
 	}
@@ -290,6 +351,10 @@ test(unsigned int offset, unsigned int size) {
 int
 main(int argv, char *argc[]) {
 
+	data_written = malloc(MIRROR_SIZE);
+	data_read = malloc(MIRROR_SIZE);
+	assert(data_written && data_read);
+
 	if (test(TEST_OFFSET, TEST_SIZE)) return -1;
 	if (test(0, MIRROR_SIZE)) return -1;
 	return 0;
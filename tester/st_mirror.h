@@ -3,9 +3,10 @@
 
 /* Copyright (c) 2023 Timothy Jon Fraser Consulting LLC */
 
-void read_mirror(unsigned char *, unsigned int, unsigned int);
-void write_mirror(unsigned char *, unsigned int, unsigned int);
-void erase_mirror(unsigned int, unsigned int);
+void read_mirror(unsigned char *, unsigned long, unsigned int);
+void write_mirror(unsigned char *, unsigned long, unsigned int);
+void erase_mirror(unsigned long, unsigned long);
+void set_mirror_erase_size(unsigned long);
 
 
 #endif
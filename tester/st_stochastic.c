@@ -1,7 +1,11 @@
 /* Copyright (c) 2023 Timothy Jon Fraser LLC */
 
+#include <sys/types.h>
+#include <sys/wait.h>
 #include <assert.h>
+#include <stdbool.h>
 #include <time.h>
+#include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
 
@@ -41,6 +45,19 @@
 #define OP_WRITE "Write"
 #define OP_ERASE "Erase"
 
+/* With snapshots, tests rewind the device to this snapshot of the
+ * freshly-erased arena rather than erase the arena through the
+ * driver.  A fork server's test cases all begin by restoring the
+ * device to the CHECKPOINT snapshot the fork server took.
+ */
+#define ERASED_ARENA 0
+#define CHECKPOINT   1
+
+/* Counts the operations the do_*() functions perform; odd ones go
+ * through the asynchronous interface.
+ */
+static unsigned long num_ops;
+
 
 static unsigned int
 random_size(void) {
@@ -55,10 +72,10 @@ random_size(void) {
 } /* random_size() */
 
 
-static unsigned int
+static unsigned long
 random_start(unsigned int size) {
 
-	unsigned int start;
+	unsigned long start;
 
 	/* Begin by considering a simple arena whose addresses run
 	 * from 0 to ARENA_SIZE-1.  Choose a random start address that
@@ -80,19 +97,19 @@ random_start(unsigned int size) {
 
 
 static void
-print_op(const char *op, unsigned int first_addr, unsigned int size) {
+print_op(const char *op, unsigned long first_addr, unsigned long size) {
 
 	first_addr = first_addr % DEVICE_SIZE;
-	unsigned int first_block = first_addr / BLOCK_SIZE;
-	unsigned int first_page  = (first_addr % BLOCK_SIZE) / PAGE_SIZE;
-	unsigned int first_byte  = first_addr % PAGE_SIZE;
-	unsigned int last_addr  = (first_addr + size - 1) % DEVICE_SIZE;
-	unsigned int last_block = last_addr / BLOCK_SIZE;
-	unsigned int last_page  = (last_addr % BLOCK_SIZE) / PAGE_SIZE;
-	unsigned int last_byte  = last_addr % PAGE_SIZE;
+	unsigned long first_block = first_addr / BLOCK_SIZE;
+	unsigned long first_page  = (first_addr % BLOCK_SIZE) / PAGE_SIZE;
+	unsigned long first_byte  = first_addr % PAGE_SIZE;
+	unsigned long last_addr  = (first_addr + size - 1) % DEVICE_SIZE;
+	unsigned long last_block = last_addr / BLOCK_SIZE;
+	unsigned long last_page  = (last_addr % BLOCK_SIZE) / PAGE_SIZE;
+	unsigned long last_byte  = last_addr % PAGE_SIZE;
 	
-	printf("\t%5s start 0x%06x (first block %3u page %3u byte %3u)\n"
-	       "\t       size 0x%06x  (last block %3u page %3u byte %3u)\n",
+	printf("\t%5s start 0x%06lx (first block %3lu page %3lu byte %3lu)\n"
+	       "\t       size 0x%06lx  (last block %3lu page %3lu byte %3lu)\n",
 	       op,
 	       first_addr, first_block, first_page, first_byte,
 	       size, last_block, last_page, last_byte);
@@ -100,24 +117,107 @@ print_op(const char *op, unsigned int first_addr, unsigned int size) {
 } /* print_op() */
 
 
+/* async()
+ *
+ * in:     nothing
+ * out:    num_ops incremented via side effect
+ * return: true if this operation goes through the asynchronous
+ *         interface, else false.
+ *
+ */
+
+static bool
+async(void) {
+
+	return num_ops++ % 2;
+
+} /* async() */
+
+
+/* submit()
+ *
+ * in:     op     - NAND_IO_READ, NAND_IO_WRITE, or NAND_IO_ERASE
+ *         buffer - data to write or buffer to read into, else NULL
+ *         start  - device address
+ *         size   - size in bytes
+ * out:    the operation submitted to the framework
+ * return: 0 on success, -1 on failure.
+ *
+ * Every other operation the do_*() functions perform goes through
+ * the asynchronous interface: they submit it to the framework first
+ * and update or read the mirror while it is pending, then finish()
+ * it.  The framework issues the operation's first page or block to
+ * the device on submission, so the mirror work overlaps the device's
+ * busy period.  The rest call read_nand(), write_nand(), and
+ * erase_nand() directly, so the tests still cover the synchronous
+ * paths.  Each operation completes before the next begins, so the
+ * mirror and device see them in the same order.
+ *
+ */
+
 static int
-do_erase(unsigned int start, unsigned int size) {
+submit(enum nand_io_op op, unsigned char *buffer, unsigned long start,
+	unsigned long size) {
 
-	print_op(OP_ERASE, start, size);
-	erase_mirror(start, size);
-	if (erase_nand(start, size)) {
-		printf("\tDevice timed out on erase operation.\n");
+	struct nand_io_request request = {
+		.op = op, .buffer = buffer, .offset = start, .size = size,
+	};
+
+	if (nand_io_submit(&request)) {
+		printf("\tTest failed to submit operation.\n");
 		return -1;
 	}
 	return 0;
 
+} /* submit() */
+
+
+/* finish()
+ *
+ * in:     op - "erase", "write", or "read", for the error message
+ * out:    nothing
+ * return: 0 if the submitted operation succeeded, else -1.
+ *
+ */
+
+static int
+finish(const char *op) {
+
+	struct nand_io_completion completion;
+
+	if (nand_io_wait(&completion) || completion.result) {
+		printf("\tDevice timed out on %s operation.\n", op);
+		return -1;
+	}
+	return 0;
+
+} /* finish() */
+
+
+static int
+do_erase(unsigned long start, unsigned long size) {
+
+	print_op(OP_ERASE, start, size);
+	if (!async()) {
+		erase_mirror(start, size);
+		if (erase_nand(start, size)) {
+			printf("\tDevice timed out on erase operation.\n");
+			return -1;
+		}
+		return 0;
+	}
+	if (submit(NAND_IO_ERASE, NULL, start, size))
+		return -1;
+	erase_mirror(start, size);
+	return finish("erase");
+
 } /* do_erase() */
 
 
 static int
-do_write(unsigned int start, unsigned int size) {
+do_write(unsigned long start, unsigned int size) {
 
-	int ret_val = 0;     /* optimistically presume success */
+	int ret_val;         /* the write's result */
 	unsigned char *buf;  /* buffer of data to write */
 
 	if (!(buf = malloc(size))) {
@@ -127,10 +227,18 @@ do_write(unsigned int start, unsigned int size) {
 
 	data_init(buf, size);
 	print_op(OP_WRITE, start, size);
-	write_mirror(buf, start, size);
-	if (write_nand(buf, start, size)) {
-		printf("\tDevice timed out on write operation.\n");
+	if (!async()) {
+		write_mirror(buf, start, size);
+		ret_val = 0;
+		if (write_nand(buf, start, size)) {
+			printf("\tDevice timed out on write operation.\n");
+			ret_val = -1;
+		}
+	} else if (submit(NAND_IO_WRITE, buf, start, size)) {
 		ret_val = -1;
+	} else {
+		write_mirror(buf, start, size);
+		ret_val = finish("write");
 	}
 	free(buf);
 	return ret_val;
@@ -139,7 +247,7 @@ do_write(unsigned int start, unsigned int size) {
 
 
 static int
-do_read_and_comparison(unsigned int start, unsigned int size) {
+do_read_and_comparison(unsigned long start, unsigned int size) {
 
 	int ret_val = 0;     /* optimistically presume success */
 	unsigned char *from_mirror;   /* data read from mirror */
@@ -159,11 +267,23 @@ do_read_and_comparison(unsigned int start, unsigned int size) {
 	}
 
 	print_op(OP_READ, start, size);
-	read_mirror(from_mirror, start, size);
-	if (read_nand(from_device, start, size)) {
-		printf("\tDevice timed out on read operation.\n");
-		ret_val = -1;
-		goto out_freeboth;
+	if (!async()) {
+		read_mirror(from_mirror, start, size);
+		if (read_nand(from_device, start, size)) {
+			printf("\tDevice timed out on read operation.\n");
+			ret_val = -1;
+			goto out_freeboth;
+		}
+	} else {
+		if (submit(NAND_IO_READ, from_device, start, size)) {
+			ret_val = -1;
+			goto out_freeboth;
+		}
+		read_mirror(from_mirror, start, size);
+		if (finish("read")) {
+			ret_val = -1;
+			goto out_freeboth;
+		}
 	}
 
 	/* Compare the data we read from the device to the presumably
@@ -175,7 +295,7 @@ do_read_and_comparison(unsigned int start, unsigned int size) {
 			printf("\tData read from device differs from "
 			       "data read from mirror\n"
 			       "\tat buffer index 0x%08x "
-			       "(device index 0x%08x).\n",
+			       "(device index 0x%08lx).\n",
 			       i, ((start + i) % DEVICE_SIZE));
 			printf("Read from device: 0x%02x\n"
 			       "Read from mirror: 0x%02x\n",
@@ -201,15 +321,30 @@ out_nofree:
 
 
 static int
-do_test(unsigned int arena_start, unsigned int arena_size) {
+do_test(unsigned long arena_start, unsigned int arena_size, int rewind) {
 
-	unsigned int rwe_start;  /* start address for operations */
+	unsigned long rwe_start; /* start address for operations */
 	unsigned int rwe_size;   /* size for operations in bytes */
 	unsigned int choice;     /* random number that chooses operation */
 	unsigned int o;          /* counts operations as we perform them */
 
-	/* Erase entire arena. */
-	if (do_erase(arena_start, arena_size)) return -1;
+	/* The seed alone must choose which operations go through the
+	 * asynchronous interface, so that a replay repeats them.
+	 */
+	num_ops = 0;
+
+	/* Erase entire arena, or rewind the device to the snapshot of
+	 * it erased.
+	 */
+	if (rewind) {
+		if (nand_flush())
+			return -1;
+		gpio_set(PN_RESTORE, ERASED_ARENA);
+		cache_invalidate_all();
+		erase_mirror(arena_start, arena_size);
+	} else if (do_erase(arena_start, arena_size)) {
+		return -1;
+	}
 
 	/* Perform a pseudorandom series of read, write, and erase
 	 * operations.
@@ -249,9 +384,100 @@ do_test(unsigned int arena_start, unsigned int arena_size) {
 } /* do_test() */
 
 
+/* run_test()
+ *
+ * in:     seed  - seeds the test's pseudorandom operations
+ *         flags - ST_SNAPSHOTS to rewind the device before the test
+ * out:    test results to stdout
+ * return: 0 if the test passed, else -1.
+ *
+ * Runs one stochastic test.  With snapshots, replays a failing test
+ * from the same snapshot to see whether the failure reproduces.
+ *
+ */
+
+static int
+run_test(unsigned int seed, unsigned int flags) {
+
+	int rewind = flags & ST_SNAPSHOTS;  /* restore, don't erase */
+
+	srandom(seed);   /* seed pseudorandom number generator */
+	if (!do_test(ARENA_START, ARENA_SIZE, rewind)) {
+		printf("\tTest result: pass.\n\n");
+		return 0;
+	}
+
+	printf("\tTest result: fail (seed %u).\n", seed);
+	if (rewind) {
+		printf("\tReplaying from snapshot:\n");
+		srandom(seed);
+		printf("\tReplay result: %s.\n",
+			do_test(ARENA_START, ARENA_SIZE, rewind) ?
+			"fail, reproduced" : "pass, not reproduced");
+	}
+	printf("\n");
+	return -1;
+
+} /* run_test() */
+
+
+/* fork_test()
+ *
+ * in:     seed  - seeds the test's pseudorandom operations
+ *         flags - as for run_test()
+ * out:    test results to stdout
+ * return: 0 if the test passed, else -1.
+ *
+ * Runs one stochastic test in a test case forked from this process,
+ * which serves as a fork server.  The test case inherits the
+ * framework, driver, and mirror as they are now and restores the
+ * device to the fork server's CHECKPOINT snapshot, so every test
+ * case starts from the same state without initializing anything.
+ * A test case that crashes fails without ending the tests.
+ *
+ */
+
+static int
+fork_test(unsigned int seed, unsigned int flags) {
+
+	pid_t pid;    /* the test case's */
+	int status;   /* the test case's exit status */
+
+	fflush(stdout);  /* or the test case would print it again */
+	switch (pid = fork()) {
+
+	case -1:
+		perror("Failed to fork test case");
+		return -1;
+
+	case 0: /* I am the test case. */
+		gpio_set(PN_RESTORE, CHECKPOINT);
+		cache_invalidate_all();
+		exit(run_test(seed, flags) ? EXIT_FAILURE : EXIT_SUCCESS);
+
+	default: /* I am the fork server. */
+		if (waitpid(pid, &status, 0) < 0) {
+			perror("Failed to wait for test case");
+			return -1;
+		}
+	}
+
+	if (WIFEXITED(status))
+		return (WEXITSTATUS(status) == EXIT_SUCCESS) ? 0 : -1;
+
+	printf("\tTest result: fail, crashed on signal %d (seed %u).\n\n",
+	       WTERMSIG(status), seed);
+	return -1;
+
+} /* fork_test() */
+
+
 /* st_stochastic()
  *
  * in:     num_tests - number of tests to run
+ *         flags     - ST_SNAPSHOTS to rewind the device between
+ *                     tests, ST_FORK_SERVER to run each test in its
+ *                     own process
  * out:    nothing
  * return: 0 if all tests passed, else -1.
  *
@@ -259,32 +485,64 @@ do_test(unsigned int arena_start, unsigned int arena_size) {
  * framework-driver-device system.  num_tests indicates how many
  * random tests to run.
  *
+ * Each test seeds the pseudorandom number generator afresh, so the
+ * seed alone determines its operations.  With snapshots, the tests
+ * erase the arena through the driver only once and rewind the device
+ * emulator to that state before every test.  Every test then begins
+ * from exactly the same state, so a failing test is replayed from it
+ * to see whether the failure reproduces.
+ *
  */
 
 int
-st_stochastic(long num_tests) {
+st_stochastic(long num_tests, unsigned int flags) {
 
 	long test;            /* number of the current test 1 ... num_tests */
 	time_t time_start;    /* number of seconds since Epoch at test start */
 	time_t duration;      /* number of seconds it took to run tests */
+	unsigned int seed;    /* seeds the current test */
 	int ret_val = 0;      /* optimistically presume all tests will pass */
+	int result;           /* of the current test */
 	
 	time_start = time(NULL);  /* record start time */
-	srandom(time_start);      /* seed pseudorandom number generator */
+
+	/* Striped framework erases erase more than a block at a time. */
+	set_mirror_erase_size(nand_erase_size());
+
+	/* Snapshots capture device storage, so no write may still be
+	 * staged in the framework when we take or restore one.
+	 */
+	if (flags & ST_SNAPSHOTS) {
+		printf("Snapshot of erased arena:\n");
+		if (do_erase(ARENA_START, ARENA_SIZE)) {
+			printf("At least one test failed.\n");
+			return -1;
+		}
+		if (nand_flush()) {
+			printf("At least one test failed.\n");
+			return -1;
+		}
+		gpio_set(PN_SNAPSHOT, ERASED_ARENA);
+		printf("\n");
+	}
+	if (flags & ST_FORK_SERVER) {
+		if (nand_flush()) {
+			printf("At least one test failed.\n");
+			return -1;
+		}
+		gpio_set(PN_SNAPSHOT, CHECKPOINT);
+	}
 	
 	for (test = 1; test <= num_tests; test++) {
 		
 		printf("Test %ld of %ld:\n", test, num_tests);
-		if (do_test(ARENA_START, ARENA_SIZE)) {
-
+		seed = time_start + test;
+		if (flags & ST_FORK_SERVER)
+			result = fork_test(seed, flags);
+		else
+			result = run_test(seed, flags);
+		if (result)
 			ret_val = -1;  /* Indicate that a test failed. */
-			printf("\tTest result: fail.\n\n");
-
-		} else {
-
-			printf("\tTest result: pass.\n\n");
-
-		}
 
 	}
 	
@@ -3,10 +3,25 @@
 
 // Copyright (c) 2022 Provatek, LLC.
 
+#include <stdbool.h>
+
+/* st_stochastic() flags */
+#define ST_SNAPSHOTS   0x1  /* rewind the device between tests */
+#define ST_FORK_SERVER 0x2  /* run each test in a forked test case */
+
+/* st_benchmark() configuration */
+struct st_bench {
+	const char *driver;  /* name for the table's driver column */
+	const char *path;    /* file to append the table to */
+	const struct device_counters *counters;  /* emulator's trap count */
+};
+
 int st_deterministic(void);
-int st_stochastic(long);
+int st_coalesce(void);
+int st_stochastic(long, unsigned int);
+int st_benchmark(const struct st_bench *);
 
-struct nand_device *st_dib_init(void);
+struct nand_device *st_dib_init(bool);
 int st_dib_test(struct nand_device *, struct nand_device *);
 
 #endif